@@ -0,0 +1,649 @@
+/*
+ * crun - OCI runtime written in C
+ *
+ * Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+ * crun is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * crun is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crun.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Long running helper that writes the uid_map and gid_map files for
+   rootless containers, as an alternative to newuidmap and newgidmap.
+   It must run as root.  crun uses it when the RUN_OCI_UIDMAP_HELPER
+   environment variable points to its socket.
+
+   Each request on the stream socket is:
+
+     "uid|gid PID LEN\n" followed by LEN bytes of mappings
+
+   and it is answered with "0\n" on success or "ERRNO MESSAGE\n".  As
+   for newuidmap and newgidmap, the target process must be owned by
+   the caller uid and gid, and the host ranges must be either the caller
+   own id or listed in /etc/subuid or /etc/subgid for the caller.
+
+   The PID is in the pid namespace of the caller.
+
+   Each connection is served by its own process, so that a slow client
+   does not delay the other ones, and each request must be completed
+   within REQUEST_TIMEOUT seconds.  At most MAX_CHILDREN connections are
+   served at the same time, the others wait in the listen queue, and at
+   most MAX_CHILDREN_PER_UID for each user: the connections above the
+   limit are refused with EAGAIN.  */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define error(status, errno_, fmt, ...) do{                             \
+    if (errno_)                                                         \
+      fprintf (stderr, "uidmap-helper: %s: " fmt "\n", strerror (errno_), ##__VA_ARGS__); \
+    else                                                                \
+      fprintf (stderr, "uidmap-helper: " fmt "\n", ##__VA_ARGS__);      \
+    if (status)                                                         \
+      exit (status);                                                    \
+  } while(0)
+
+#define REQUEST_TIMEOUT 5
+
+#define MAX_CHILDREN 64
+#define MAX_CHILDREN_PER_UID 4
+
+/* Maximum depth of nested pid namespaces.  */
+#define MAX_PID_NS_LEVEL 32
+
+#ifndef NS_GET_PARENT
+#  define NS_GET_PARENT _IO (0xb7, 0x2)
+#endif
+
+struct child_s
+{
+  pid_t pid;
+  uid_t uid;
+};
+
+static struct child_s children[MAX_CHILDREN];
+static size_t n_children;
+
+/* Same limit used by the kernel for the number of extents.  */
+#define MAX_EXTENTS 340
+#define MAX_MAP_SIZE 4096
+
+struct request_s
+{
+  bool gid;
+  pid_t pid;
+  size_t len;
+  char map[MAX_MAP_SIZE + 1];
+};
+
+static int
+open_unix_domain_socket (const char *path)
+{
+  struct sockaddr_un addr = {};
+  int ret, fd;
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    error (EXIT_FAILURE, errno, "socket");
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    error (EXIT_FAILURE, 0, "invalid path");
+  strcpy (addr.sun_path, path);
+  addr.sun_family = AF_UNIX;
+  ret = bind (fd, (struct sockaddr *) &addr, sizeof (addr));
+  if (ret < 0)
+    error (EXIT_FAILURE, errno, "bind");
+
+  /* Any user can ask for its own mappings.  */
+  ret = chmod (path, 0666);
+  if (ret < 0)
+    error (EXIT_FAILURE, errno, "chmod");
+
+  ret = listen (fd, 128);
+  if (ret < 0)
+    error (EXIT_FAILURE, errno, "listen");
+
+  return fd;
+}
+
+static int
+read_exact (int fd, char *buf, size_t len)
+{
+  while (len)
+    {
+      ssize_t r = read (fd, buf, len);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        return -1;
+      buf += r;
+      len -= r;
+    }
+  return 0;
+}
+
+/* Returns 1 on a new request, 0 on EOF and -1 on errors.  */
+static int
+read_request (int fd, struct request_s *req)
+{
+  char header[64];
+  char kind[4];
+  size_t i;
+
+  for (i = 0; i < sizeof (header) - 1; i++)
+    {
+      ssize_t r = read (fd, &header[i], 1);
+      if (r < 0 && errno == EINTR)
+        {
+          i--;
+          continue;
+        }
+      if (r == 0 && i == 0)
+        return 0;
+      if (r <= 0)
+        return -1;
+      if (header[i] == '\n')
+        break;
+    }
+  header[i] = '\0';
+
+  if (sscanf (header, "%3s %d %zu", kind, &req->pid, &req->len) != 3)
+    return -1;
+  if (strcmp (kind, "uid") != 0 && strcmp (kind, "gid") != 0)
+    return -1;
+  if (req->pid <= 0 || req->len == 0 || req->len > MAX_MAP_SIZE)
+    return -1;
+
+  req->gid = kind[0] == 'g';
+  if (read_exact (fd, req->map, req->len) < 0)
+    return -1;
+  req->map[req->len] = '\0';
+  return 1;
+}
+
+/* Check that [START, START + COUNT) is in a subordinate range of the
+   user NAME or UID in FILE.  */
+static bool
+in_subordinate_ranges (const char *file, const char *name, uid_t uid, unsigned long start, unsigned long count)
+{
+  char *line = NULL;
+  size_t n = 0;
+  bool found = false;
+  FILE *f;
+
+  f = fopen (file, "re");
+  if (f == NULL)
+    return false;
+
+  while (! found && getline (&line, &n, f) >= 0)
+    {
+      char *owner, *saveptr = NULL;
+      unsigned long sub_start, sub_count;
+      char *endptr;
+
+      owner = strtok_r (line, ":", &saveptr);
+      if (owner == NULL)
+        continue;
+
+      if (! (name && strcmp (owner, name) == 0))
+        {
+          unsigned long v = strtoul (owner, &endptr, 10);
+          if (*endptr != '\0' || v != uid)
+            continue;
+        }
+
+      if (sscanf (saveptr, "%lu:%lu", &sub_start, &sub_count) != 2)
+        continue;
+
+      if (start >= sub_start && count <= sub_count && start - sub_start <= sub_count - count)
+        found = true;
+    }
+
+  free (line);
+  fclose (f);
+  return found;
+}
+
+/* Validate the mappings for the caller.  *ONLY_OWN_ID is set when
+   nothing but the caller id is mapped.  */
+static int
+validate_map (struct request_s *req, struct ucred *cred, bool *only_own_id, const char **msg)
+{
+  struct passwd *pw = getpwuid (cred->uid);
+  const char *name = pw ? pw->pw_name : NULL;
+  unsigned long own = req->gid ? cred->gid : cred->uid;
+  char *copy, *line, *saveptr = NULL;
+  int extents = 0;
+  int ret = 0;
+
+  *only_own_id = true;
+
+  copy = strdup (req->map);
+  if (copy == NULL)
+    return ENOMEM;
+
+  for (line = strtok_r (copy, "\n", &saveptr); line; line = strtok_r (NULL, "\n", &saveptr))
+    {
+      unsigned long inside, outside, count;
+
+      if (++extents > MAX_EXTENTS || sscanf (line, "%lu %lu %lu", &inside, &outside, &count) != 3 || count == 0
+          || inside > UINT32_MAX || outside > UINT32_MAX || count > UINT32_MAX - inside
+          || count > UINT32_MAX - outside)
+        {
+          *msg = "invalid mapping";
+          ret = EINVAL;
+          break;
+        }
+
+      if (count == 1 && outside == own)
+        continue;
+
+      *only_own_id = false;
+      if (! in_subordinate_ranges (req->gid ? "/etc/subgid" : "/etc/subuid", name, cred->uid, outside, count))
+        {
+          *msg = "mapping not allowed";
+          ret = EPERM;
+          break;
+        }
+    }
+
+  free (copy);
+  return ret;
+}
+
+static int
+write_at (int dirfd, const char *name, const char *data, size_t len)
+{
+  ssize_t r;
+  int fd;
+
+  fd = openat (dirfd, name, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return errno;
+
+  r = write (fd, data, len);
+  if (r < 0 || (size_t) r != len)
+    {
+      int saved_errno = r < 0 ? errno : EIO;
+      close (fd);
+      return saved_errno;
+    }
+
+  close (fd);
+  return 0;
+}
+
+/* Read the NSpid line of the process in DIRFD: its pid in each pid
+   namespace, from the namespace of the helper to its own.  Returns the
+   number of pids or -1.  */
+static int
+read_nspid (int dirfd, pid_t *pids, int max)
+{
+  char *line = NULL;
+  size_t n = 0;
+  int ret = -1;
+  FILE *f;
+  int fd;
+
+  fd = openat (dirfd, "status", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  f = fdopen (fd, "re");
+  if (f == NULL)
+    {
+      close (fd);
+      return -1;
+    }
+
+  while (getline (&line, &n, f) >= 0)
+    {
+      char *it, *endptr;
+
+      if (strncmp (line, "NSpid:", 6) != 0)
+        continue;
+
+      ret = 0;
+      for (it = line + 6; ret < max; it = endptr)
+        {
+          long v = strtol (it, &endptr, 10);
+          if (endptr == it)
+            break;
+          pids[ret++] = v;
+        }
+      break;
+    }
+
+  free (line);
+  fclose (f);
+  return ret;
+}
+
+/* Check whether the pid namespace LEVELS levels above the one of the
+   process in DIRFD is the namespace NS.  */
+static bool
+pid_ns_ancestor_is (int dirfd, int levels, const struct stat *ns)
+{
+  struct stat st;
+  bool ret;
+  int fd;
+
+  fd = openat (dirfd, "ns/pid", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  while (levels-- > 0)
+    {
+      int parent = ioctl (fd, NS_GET_PARENT);
+      close (fd);
+      if (parent < 0)
+        return false;
+      fd = parent;
+    }
+
+  ret = fstat (fd, &st) == 0 && st.st_dev == ns->st_dev && st.st_ino == ns->st_ino;
+  close (fd);
+  return ret;
+}
+
+/* Open the /proc directory of the process that is REQ->pid in the pid
+   namespace of the caller.  The kernel translates the peer credentials
+   to the pid namespace of the helper, but not the pid in the request.  */
+static int
+open_target_process (struct request_s *req, struct ucred *cred, const char **msg)
+{
+  pid_t caller_pids[MAX_PID_NS_LEVEL];
+  pid_t pids[MAX_PID_NS_LEVEL];
+  char proc_path[64];
+  struct stat caller_ns;
+  struct dirent *de;
+  int callerfd, targetfd, procfd;
+  int depth, n;
+  DIR *d;
+
+  sprintf (proc_path, "/proc/%d", cred->pid);
+  callerfd = open (proc_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (callerfd < 0)
+    {
+      *msg = "cannot open the caller process";
+      return -errno;
+    }
+
+  depth = read_nspid (callerfd, caller_pids, MAX_PID_NS_LEVEL);
+  if (depth > 1)
+    {
+      int nsfd = openat (callerfd, "ns/pid", O_RDONLY | O_CLOEXEC);
+      if (nsfd < 0 || fstat (nsfd, &caller_ns) < 0)
+        depth = -1;
+      if (nsfd >= 0)
+        close (nsfd);
+    }
+  close (callerfd);
+
+  if (depth <= 0)
+    {
+      *msg = "cannot read the pid namespace of the caller";
+      return -ESRCH;
+    }
+
+  /* The caller is in the same pid namespace as the helper.  */
+  if (depth == 1)
+    {
+      sprintf (proc_path, "/proc/%d", req->pid);
+      targetfd = open (proc_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      if (targetfd < 0)
+        {
+          *msg = "cannot open the target process";
+          return -errno;
+        }
+      return targetfd;
+    }
+
+  d = opendir ("/proc");
+  if (d == NULL)
+    {
+      *msg = "cannot open /proc";
+      return -errno;
+    }
+
+  procfd = dirfd (d);
+  while ((de = readdir (d)))
+    {
+      if (de->d_name[0] < '1' || de->d_name[0] > '9')
+        continue;
+
+      targetfd = openat (procfd, de->d_name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      if (targetfd < 0)
+        continue;
+
+      /* The target is in the pid namespace of the caller, or in one of
+         its descendants.  */
+      n = read_nspid (targetfd, pids, MAX_PID_NS_LEVEL);
+      if (n >= depth && pids[depth - 1] == req->pid && pid_ns_ancestor_is (targetfd, n - depth, &caller_ns))
+        {
+          closedir (d);
+          return targetfd;
+        }
+      close (targetfd);
+    }
+
+  closedir (d);
+  *msg = "cannot find the target process in the caller pid namespace";
+  return -ESRCH;
+}
+
+static int
+handle_request (struct request_s *req, struct ucred *cred, const char **msg)
+{
+  bool only_own_id;
+  struct stat st;
+  int dirfd, ret;
+
+  /* Pin the process so that the checks and the write refer to the same
+     process even if the pid is reused.  */
+  dirfd = open_target_process (req, cred, msg);
+  if (dirfd < 0)
+    return -dirfd;
+
+  ret = fstat (dirfd, &st);
+  if (ret < 0 || st.st_uid != cred->uid || st.st_gid != cred->gid)
+    {
+      *msg = "the target process is not owned by the caller";
+      close (dirfd);
+      return EPERM;
+    }
+
+  ret = validate_map (req, cred, &only_own_id, msg);
+  if (ret == 0 && req->gid && only_own_id)
+    {
+      /* Same as newgidmap: do not allow dropping groups with setgroups
+         when only the caller gid is mapped.  */
+      ret = write_at (dirfd, "setgroups", "deny", 4);
+      if (ret)
+        *msg = "cannot write setgroups";
+    }
+
+  if (ret == 0)
+    {
+      ret = write_at (dirfd, req->gid ? "gid_map" : "uid_map", req->map, req->len);
+      if (ret)
+        *msg = "cannot write the mapping";
+    }
+
+  close (dirfd);
+  return ret;
+}
+
+static void
+handle_connection (int fd, struct ucred *cred)
+{
+  struct request_s req;
+  int ret;
+
+  for (;;)
+    {
+      const char *msg = "";
+      char reply[256];
+      int reply_len;
+
+      /* The default action of SIGALRM terminates the process serving a
+         client that does not complete its request in time.  */
+      alarm (REQUEST_TIMEOUT);
+
+      ret = read_request (fd, &req);
+      if (ret <= 0)
+        return;
+
+      ret = handle_request (&req, cred, &msg);
+      if (ret == 0)
+        reply_len = snprintf (reply, sizeof (reply), "0\n");
+      else
+        reply_len = snprintf (reply, sizeof (reply), "%d %s: %s\n", ret, msg, strerror (ret));
+
+      if (write (fd, reply, reply_len) != reply_len)
+        return;
+
+      alarm (0);
+    }
+}
+
+/* Reap the processes that served a connection.  If BLOCK is set, wait
+   for at least one of them.  */
+static void
+reap_children (bool block)
+{
+  for (;;)
+    {
+      size_t i;
+      pid_t pid;
+
+      pid = waitpid (-1, NULL, block ? 0 : WNOHANG);
+      if (pid < 0 && errno == EINTR)
+        continue;
+      if (pid <= 0)
+        return;
+
+      for (i = 0; i < n_children; i++)
+        if (children[i].pid == pid)
+          {
+            children[i] = children[--n_children];
+            break;
+          }
+      block = false;
+    }
+}
+
+static size_t
+count_children (uid_t uid)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < n_children; i++)
+    if (children[i].uid == uid)
+      n++;
+  return n;
+}
+
+int
+main (int argc, char **argv)
+{
+  pid_t pid;
+  int fd;
+
+  if (argc < 2)
+    error (EXIT_FAILURE, 0, "usage %s PATH", argv[0]);
+
+  if (geteuid () != 0)
+    error (EXIT_FAILURE, 0, "it must run as root");
+
+  signal (SIGPIPE, SIG_IGN);
+
+  unlink (argv[1]);
+
+  fd = open_unix_domain_socket (argv[1]);
+
+  while (1)
+    {
+      struct ucred cred;
+      socklen_t len = sizeof (cred);
+      int conn;
+
+      reap_children (false);
+
+      /* Leave the new connections in the listen queue until a process
+         is available.  */
+      while (n_children >= MAX_CHILDREN)
+        reap_children (true);
+
+      conn = accept4 (fd, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          error (EXIT_FAILURE, errno, "accept");
+        }
+
+      if (getsockopt (conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        {
+          error (0, errno, "getsockopt SO_PEERCRED");
+          close (conn);
+          continue;
+        }
+
+      if (count_children (cred.uid) >= MAX_CHILDREN_PER_UID)
+        {
+          char reply[64];
+          int reply_len;
+
+          reply_len = snprintf (reply, sizeof (reply), "%d too many connections: %s\n", EAGAIN, strerror (EAGAIN));
+          send (conn, reply, reply_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+          close (conn);
+          continue;
+        }
+
+      pid = fork ();
+      if (pid < 0)
+        error (0, errno, "fork");
+      else if (pid == 0)
+        {
+          close (fd);
+          handle_connection (conn, &cred);
+          _exit (EXIT_SUCCESS);
+        }
+      else
+        {
+          children[n_children].pid = pid;
+          children[n_children].uid = cred.uid;
+          n_children++;
+        }
+      close (conn);
+    }
+
+  return 0;
+}
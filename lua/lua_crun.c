@@ -26,6 +26,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <libcrun/container.h>
@@ -36,6 +41,9 @@
 static const char *LUA_CRUN_TAG_CTX = "crun-ctx";
 static const char *LUA_CRUN_TAG_CONT = "crun-container";
 static const char *LUA_CRUN_TAG_CONTS_ITER = "crun-containers-iterator";
+static const char *LUA_CRUN_TAG_LAZY_CONF = "crun-lazy-config";
+static const char *LUA_CRUN_TAG_STATUS_ITER = "crun-status-iterator";
+static const char *LUA_CRUN_TAG_YIELD_CALL = "crun-yield-call";
 
 #define luacrunL_optboolean(L, n, d) luaL_opt (S, lua_toboolean, n, d)
 
@@ -327,6 +335,82 @@ luacrun_container_finalizer (lua_State *S)
   return 0;
 }
 
+LUA_API int
+luacrun_new_lazy_config_from_string (lua_State *S)
+{
+  libcrun_error_t crun_err = NULL;
+  const char *def = luaL_checkstring (S, 1);
+  libcrun_lazy_config_t **config = lua_newuserdata (S, sizeof (libcrun_lazy_config_t *));
+  luaL_setmetatable (S, LUA_CRUN_TAG_LAZY_CONF);
+  *config = libcrun_lazy_config_load_from_memory (def, &crun_err);
+  if (*config == NULL)
+    {
+      lua_pushnil (S);
+      return luacrun_error (S, &crun_err) + 1;
+    }
+  return 1;
+}
+
+LUA_API int
+luacrun_new_lazy_config_from_file (lua_State *S)
+{
+  libcrun_error_t crun_err = NULL;
+  const char *path = luaL_checkstring (S, 1);
+  libcrun_lazy_config_t **config = lua_newuserdata (S, sizeof (libcrun_lazy_config_t *));
+  luaL_setmetatable (S, LUA_CRUN_TAG_LAZY_CONF);
+  *config = libcrun_lazy_config_load_from_file (path, &crun_err);
+  if (*config == NULL)
+    {
+      lua_pushnil (S);
+      return luacrun_error (S, &crun_err) + 1;
+    }
+  return 1;
+}
+
+/*Get the JSON string for a section, nil if the section is missing.*/
+LUA_API int
+luacrun_lazy_config_section (lua_State *S)
+{
+  libcrun_lazy_config_t **config = luaL_checkudata (S, 1, LUA_CRUN_TAG_LAZY_CONF);
+  const char *name = luaL_checkstring (S, 2);
+  const char *raw;
+  size_t len;
+
+  luaL_argcheck (S, *config != NULL, 1, "lazy config already released");
+  raw = libcrun_lazy_config_get_raw (*config, name, &len);
+  if (raw == NULL)
+    lua_pushnil (S);
+  else
+    lua_pushlstring (S, raw, len);
+  return 1;
+}
+
+LUA_API int
+luacrun_lazy_config_to_container (lua_State *S)
+{
+  libcrun_error_t crun_err = NULL;
+  libcrun_lazy_config_t **config = luaL_checkudata (S, 1, LUA_CRUN_TAG_LAZY_CONF);
+  luaL_argcheck (S, *config != NULL, 1, "lazy config already released");
+  libcrun_container_t **cont = lua_newuserdata (S, sizeof (libcrun_container_t *));
+  luaL_setmetatable (S, LUA_CRUN_TAG_CONT);
+  *cont = libcrun_lazy_config_to_container (*config, &crun_err);
+  if (*cont == NULL)
+    {
+      lua_pushnil (S);
+      return luacrun_error (S, &crun_err) + 1;
+    }
+  return 1;
+}
+
+LUA_API int
+luacrun_lazy_config_finalizer (lua_State *S)
+{
+  libcrun_lazy_config_t **config = luaL_checkudata (S, 1, LUA_CRUN_TAG_LAZY_CONF);
+  libcrun_lazy_config_free (*config);
+  *config = NULL;
+  return 0;
+}
+
 LUA_API int
 luacrun_set_verbosity (lua_State *S)
 {
@@ -689,6 +773,464 @@ luacrun_ctx_update_container (lua_State *S)
   return 1;
 }
 
+/* Status records for `iter_status`.  With the `prefetch` option all the
+   records are read when the iterator is created, otherwise each record
+   is read when the iterator reaches it.  */
+struct luacrun_status_record
+{
+  char *id;
+  libcrun_container_status_t status;
+  const char *state;
+  int running;
+};
+
+struct luacrun_ctx_status_iterator
+{
+  const char *state_root;
+  libcrun_container_list_t *list;
+  libcrun_container_list_t *curr;
+  struct luacrun_status_record *records;
+  size_t records_len;
+  size_t next;
+  lua_Integer counter;
+  bool reuse;
+};
+
+static int
+luacrun_read_status_record (const char *state_root, const char *id, struct luacrun_status_record *record)
+{
+  libcrun_error_t crun_err = NULL;
+  int ret;
+
+  memset (record, 0, sizeof (*record));
+
+  /* The container might have been deleted in the meanwhile.  */
+  ret = libcrun_read_container_status (&record->status, state_root, id, &crun_err);
+  if (ret < 0)
+    {
+      libcrun_error_release (&crun_err);
+      return -1;
+    }
+
+  ret = libcrun_get_container_state_string (id, &record->status, state_root, &record->state, &record->running,
+                                            &crun_err);
+  if (ret < 0)
+    {
+      libcrun_error_release (&crun_err);
+      libcrun_free_container_status (&record->status);
+      return -1;
+    }
+  return 0;
+}
+
+static void
+luacrun_set_string_field (lua_State *S, int tabidx, const char *name, const char *value)
+{
+  if (value)
+    lua_pushstring (S, value);
+  else
+    lua_pushnil (S);
+  lua_setfield (S, tabidx, name);
+}
+
+/* Fill the table at TABIDX with the same fields used by `status`, except
+   the annotations that require reading config.json.  [-0, +0, m] */
+static void
+luacrun_fill_status_table (lua_State *S, int tabidx, const char *id, struct luacrun_status_record *record)
+{
+  luaL_checkstack (S, 1, NULL);
+  luacrun_set_string_field (S, tabidx, "ociVersion", "1.0.0");
+  luacrun_set_string_field (S, tabidx, "id", id);
+  lua_pushinteger (S, record->running ? record->status.pid : 0);
+  lua_setfield (S, tabidx, "pid");
+  luacrun_set_string_field (S, tabidx, "status", record->state);
+  luacrun_set_string_field (S, tabidx, "bundle", record->status.bundle);
+  luacrun_set_string_field (S, tabidx, "rootfs", record->status.rootfs);
+  luacrun_set_string_field (S, tabidx, "created", record->status.created);
+  luacrun_set_string_field (S, tabidx, "systemd-scope", record->status.scope);
+  luacrun_set_string_field (S, tabidx, "owner", record->status.owner);
+}
+
+static void
+luacrun_free_status_iterator (struct luacrun_ctx_status_iterator *it)
+{
+  size_t i;
+
+  for (i = 0; i < it->records_len; i++)
+    {
+      free (it->records[i].id);
+      libcrun_free_container_status (&it->records[i].status);
+    }
+  free (it->records);
+  it->records = NULL;
+  it->records_len = 0;
+
+  libcrun_free_containers_list (it->list);
+  it->list = it->curr = NULL;
+}
+
+static int
+luacrun_ctx_status_iteratorf (lua_State *S)
+{
+  struct luacrun_ctx_status_iterator *it = luaL_checkudata (S, 1, LUA_CRUN_TAG_STATUS_ITER);
+  struct luacrun_status_record lazy_record;
+  struct luacrun_status_record *record = NULL;
+  const char *id = NULL;
+  int tabidx;
+
+  luaL_checkstack (S, 3, NULL);
+
+  if (it->records)
+    {
+      if (it->next < it->records_len)
+        {
+          record = &it->records[it->next++];
+          id = record->id;
+        }
+    }
+  else
+    {
+      while (it->curr != NULL && record == NULL)
+        {
+          id = it->curr->name;
+          it->curr = it->curr->next;
+          if (luacrun_read_status_record (it->state_root, id, &lazy_record) == 0)
+            record = &lazy_record;
+        }
+    }
+
+  if (record == NULL)
+    {
+      luacrun_free_status_iterator (it);
+      lua_pushnil (S);
+      return 1;
+    }
+
+  lua_pushinteger (S, ++(it->counter));
+  if (it->reuse)
+    lua_getiuservalue (S, 1, 1);
+  else
+    lua_createtable (S, 0, 9);
+  tabidx = lua_gettop (S);
+
+  luacrun_fill_status_table (S, tabidx, id, record);
+
+  if (record == &lazy_record)
+    libcrun_free_container_status (&lazy_record.status);
+
+  return 2;
+}
+
+static int
+luacrun_ctx_status_iterator_finalizer (lua_State *S)
+{
+  struct luacrun_ctx_status_iterator *it = luaL_checkudata (S, 1, LUA_CRUN_TAG_STATUS_ITER);
+  luacrun_free_status_iterator (it);
+  return 0;
+}
+
+static int
+luacrun_setup_ctx_status_iter_metatable (lua_State *S)
+{
+  luaL_checkstack (S, 2, NULL);
+  luaL_newmetatable (S, LUA_CRUN_TAG_STATUS_ITER);
+  lua_pushcfunction (S, &luacrun_ctx_status_iterator_finalizer);
+  lua_setfield (S, -2, "__gc");
+  lua_pop (S, 1);
+  return 0;
+}
+
+/* Iterate the status of all the containers. (ctx: userdata, opts: table | nil)
+
+The options are:
+- prefetch: read all the status files when the iterator is created.
+- reuse: fill the same table on each step, default true.  Copy the fields
+  that must survive the next step.
+*/
+LUA_API int
+luacrun_ctx_iter_status (lua_State *S)
+{
+  libcrun_error_t crun_err = NULL;
+  libcrun_context_t *ctx = luaL_checkudata (S, 1, LUA_CRUN_TAG_CTX);
+  bool prefetch = false;
+  bool reuse = true;
+
+  if (! lua_isnoneornil (S, 2))
+    {
+      luaL_checktype (S, 2, LUA_TTABLE);
+      lua_getfield (S, 2, "prefetch");
+      prefetch = lua_toboolean (S, -1);
+      lua_getfield (S, 2, "reuse");
+      if (! lua_isnil (S, -1))
+        reuse = lua_toboolean (S, -1);
+      lua_pop (S, 2);
+    }
+
+  luaL_checkstack (S, 5, NULL);
+  lua_pushcfunction (S, &luacrun_ctx_status_iteratorf);
+
+  struct luacrun_ctx_status_iterator *it = lua_newuserdatauv (S, sizeof (struct luacrun_ctx_status_iterator), 2);
+  memset (it, 0, sizeof (*it));
+  luaL_setmetatable (S, LUA_CRUN_TAG_STATUS_ITER);
+  int iteridx = lua_gettop (S);
+
+  lua_createtable (S, 0, 9);
+  lua_setiuservalue (S, iteridx, 1);
+  /* Keep the context, and its state_root, alive.  */
+  lua_pushvalue (S, 1);
+  lua_setiuservalue (S, iteridx, 2);
+
+  it->state_root = ctx->state_root;
+  it->reuse = reuse;
+
+  libcrun_container_list_t *containers = NULL;
+  int ret = libcrun_get_containers_list (&containers, ctx->state_root, &crun_err);
+  if (ret < 0 && crun_err != NULL)
+    luacrun_set_error (S, &crun_err);
+  it->list = it->curr = containers;
+
+  if (prefetch)
+    {
+      libcrun_container_list_t *l;
+      size_t n = 0;
+
+      for (l = containers; l; l = l->next)
+        n++;
+
+      it->records = xmalloc0 (sizeof (struct luacrun_status_record) * (n + 1));
+      for (l = containers; l; l = l->next)
+        {
+          if (luacrun_read_status_record (ctx->state_root, l->name, &it->records[it->records_len]) < 0)
+            continue;
+          it->records[it->records_len++].id = xstrdup (l->name);
+        }
+    }
+
+  lua_pushinteger (S, 0);
+  lua_pushnil (S);
+  return 4;
+}
+
+/* Coroutine-yielding variants of `run`, `create` and `delete`.
+
+When called from a coroutine, the operation runs in a child process and
+the coroutine yields the read end of a pipe.  The host resumes the
+coroutine once the fd is readable, then the call returns the same values
+as the blocking variant.  Outside of a coroutine, the blocking variant
+is used.  If the coroutine is collected without being resumed, its
+finalizer waits for the child to terminate.  */
+enum
+{
+  LUACRUN_YIELD_RUN,
+  LUACRUN_YIELD_CREATE,
+  LUACRUN_YIELD_DELETE,
+};
+
+struct luacrun_yield_call
+{
+  pid_t pid;
+  int fd;
+  int op;
+};
+
+struct luacrun_yield_result
+{
+  int ret;
+  bool has_error;
+  char msg[1024];
+};
+
+static int
+luacrun_yield_call_finalizer (lua_State *S)
+{
+  struct luacrun_yield_call *call = luaL_checkudata (S, 1, LUA_CRUN_TAG_YIELD_CALL);
+  /* The coroutine was collected before it was resumed: the child fails
+     to write the result once the pipe is closed, and it is reaped here
+     so that it is not left as a zombie.  */
+  if (call->fd >= 0)
+    close (call->fd);
+  if (call->pid > 0)
+    TEMP_FAILURE_RETRY (waitpid (call->pid, NULL, 0));
+  call->fd = -1;
+  call->pid = -1;
+  return 0;
+}
+
+static int
+luacrun_setup_yield_call_metatable (lua_State *S)
+{
+  luaL_checkstack (S, 2, NULL);
+  luaL_newmetatable (S, LUA_CRUN_TAG_YIELD_CALL);
+  lua_pushcfunction (S, &luacrun_yield_call_finalizer);
+  lua_setfield (S, -2, "__gc");
+  lua_pop (S, 1);
+  return 0;
+}
+
+static int
+luacrun_yield_continue (lua_State *S, int status arg_unused, lua_KContext kctx)
+{
+  struct luacrun_yield_call *call = luaL_checkudata (S, (int) kctx, LUA_CRUN_TAG_YIELD_CALL);
+  struct luacrun_yield_result result;
+  ssize_t r;
+
+  luaL_checkstack (S, 2, NULL);
+
+  r = TEMP_FAILURE_RETRY (read (call->fd, &result, sizeof (result)));
+  close (call->fd);
+  call->fd = -1;
+  TEMP_FAILURE_RETRY (waitpid (call->pid, NULL, 0));
+  call->pid = -1;
+
+  if (r != sizeof (result))
+    {
+      result.has_error = true;
+      result.ret = -1;
+      snprintf (result.msg, sizeof (result.msg), "crun: the helper process failed");
+    }
+  result.msg[sizeof (result.msg) - 1] = '\0';
+
+  if (call->op == LUACRUN_YIELD_DELETE)
+    {
+      lua_pushboolean (S, result.ret >= 0);
+      if (result.has_error)
+        {
+          lua_pushstring (S, result.msg);
+          return 2;
+        }
+      return 1;
+    }
+
+  if (result.ret < 0)
+    {
+      lua_pushnil (S);
+      lua_pushstring (S, result.msg);
+      return 2;
+    }
+  lua_pushinteger (S, result.ret);
+  return 1;
+}
+
+static int
+luacrun_yield_call (lua_State *S, int op)
+{
+  libcrun_context_t *ctx = luaL_checkudata (S, 1, LUA_CRUN_TAG_CTX);
+  libcrun_container_t **cont = NULL;
+  struct luacrun_yield_result result = {};
+  struct luacrun_yield_call *call;
+  libcrun_error_t crun_err = NULL;
+  unsigned int flags = 0;
+  const char *id = NULL;
+  bool force = false;
+  int fds[2];
+  pid_t pid;
+
+  switch (op)
+    {
+    case LUACRUN_YIELD_RUN:
+      cont = luaL_checkudata (S, 2, LUA_CRUN_TAG_CONT);
+      flags = luaL_opt (S, luacrun_build_run_flags, 3, 0);
+      break;
+
+    case LUACRUN_YIELD_CREATE:
+      cont = luaL_checkudata (S, 2, LUA_CRUN_TAG_CONT);
+      flags = luaL_opt (S, luacrun_build_run_flags, 3, LIBCRUN_RUN_OPTIONS_PREFORK);
+      break;
+
+    case LUACRUN_YIELD_DELETE:
+      id = luaL_checkstring (S, 2);
+      force = luaL_opt (S, lua_toboolean, 3, false);
+      break;
+    }
+
+  luaL_checkstack (S, 2, NULL);
+
+  call = lua_newuserdatauv (S, sizeof (struct luacrun_yield_call), 0);
+  call->pid = -1;
+  call->fd = -1;
+  call->op = op;
+  luaL_setmetatable (S, LUA_CRUN_TAG_YIELD_CALL);
+  int callidx = lua_gettop (S);
+
+  if (pipe2 (fds, O_CLOEXEC) < 0)
+    return luaL_error (S, "pipe: %s", strerror (errno));
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      int saved_errno = errno;
+      close (fds[0]);
+      close (fds[1]);
+      return luaL_error (S, "fork: %s", strerror (saved_errno));
+    }
+
+  if (pid == 0)
+    {
+      close (fds[0]);
+
+      switch (op)
+        {
+        case LUACRUN_YIELD_RUN:
+          result.ret = libcrun_container_run (ctx, *cont, flags, &crun_err);
+          break;
+
+        case LUACRUN_YIELD_CREATE:
+          result.ret = libcrun_container_create (ctx, *cont, flags, &crun_err);
+          break;
+
+        case LUACRUN_YIELD_DELETE:
+          result.ret = libcrun_container_delete (ctx, NULL, id, force, &crun_err);
+          break;
+        }
+
+      if (crun_err != NULL)
+        {
+          result.has_error = true;
+          if (crun_err->status == 0)
+            snprintf (result.msg, sizeof (result.msg), "crun: %s", crun_err->msg);
+          else
+            snprintf (result.msg, sizeof (result.msg), "crun: %s(%s)", crun_err->msg, strerror (crun_err->status));
+        }
+      else if (result.ret < 0)
+        snprintf (result.msg, sizeof (result.msg), "crun: the operation failed");
+
+      if (safe_write (fds[1], &result, sizeof (result)) < 0)
+        _exit (EXIT_FAILURE);
+      _exit (EXIT_SUCCESS);
+    }
+
+  close (fds[1]);
+  call->pid = pid;
+  call->fd = fds[0];
+
+  lua_pushinteger (S, call->fd);
+  return lua_yieldk (S, 1, (lua_KContext) callidx, luacrun_yield_continue);
+}
+
+LUA_API int
+luacrun_ctx_run_yielding (lua_State *S)
+{
+  if (! lua_isyieldable (S))
+    return luacrun_ctx_run (S);
+  return luacrun_yield_call (S, LUACRUN_YIELD_RUN);
+}
+
+LUA_API int
+luacrun_ctx_create_container_yielding (lua_State *S)
+{
+  if (! lua_isyieldable (S))
+    return luacrun_ctx_create_container (S);
+  return luacrun_yield_call (S, LUACRUN_YIELD_CREATE);
+}
+
+LUA_API int
+luacrun_ctx_delete_container_yielding (lua_State *S)
+{
+  if (! lua_isyieldable (S))
+    return luacrun_ctx_delete_container (S);
+  return luacrun_yield_call (S, LUACRUN_YIELD_DELETE);
+}
+
 #define luacrun_CtxStringAccessor(name, uval_idx)                      \
   LUA_API int luacrun_ctx_get_##name (lua_State *S)                    \
   {                                                                    \
@@ -767,6 +1309,10 @@ static const luaL_Reg luacrun_ctx_index[]
         { "start", &luacrun_ctx_start_container },
         { "status", &luacrun_ctx_status_container },
         { "iter_names", &luacrun_ctx_iter_containers },
+        { "iter_status", &luacrun_ctx_iter_status },
+        { "run_yielding", &luacrun_ctx_run_yielding },
+        { "create_yielding", &luacrun_ctx_create_container_yielding },
+        { "delete_yielding", &luacrun_ctx_delete_container_yielding },
         { "update", &luacrun_ctx_update_container },
         luacrun_RegAddCtxAccessor ("state_root", state_root),
         luacrun_RegAddCtxAccessor ("id", id),
@@ -807,11 +1353,27 @@ luacrun_setup_cont_metatable (lua_State *S)
   return 0;
 }
 
+LUA_API int
+luacrun_setup_lazy_config_metatable (lua_State *S)
+{
+  luaL_checkstack (S, 2, NULL);
+  luaL_newmetatable (S, LUA_CRUN_TAG_LAZY_CONF);
+  int mtab_idx = lua_gettop (S);
+  lua_pushcfunction (S, &luacrun_lazy_config_finalizer);
+  lua_setfield (S, mtab_idx, "__gc");
+  lua_pop (S, 1);
+  return 0;
+}
+
 static const luaL_Reg luacrun_library_reg[] = {
   { .name = "new_ctx", .func = &luacrun_new_ctx },
   { .name = "container_spec", .func = &luacrun_container_spec },
   { .name = "new_container_from_string", .func = &luacrun_new_container_from_string },
   { .name = "new_container_from_file", .func = &luacrun_new_container_from_file },
+  { .name = "new_lazy_config_from_string", .func = &luacrun_new_lazy_config_from_string },
+  { .name = "new_lazy_config_from_file", .func = &luacrun_new_lazy_config_from_file },
+  { .name = "lazy_config_section", .func = &luacrun_lazy_config_section },
+  { .name = "lazy_config_to_container", .func = &luacrun_lazy_config_to_container },
   { .name = "get_verbosity", .func = &luacrun_get_verbosity },
   { .name = "set_verbosity", .func = &luacrun_set_verbosity },
   { .name = "run", .func = &luacrun_ctx_run },
@@ -821,6 +1383,10 @@ static const luaL_Reg luacrun_library_reg[] = {
   { .name = "start_container", .func = &luacrun_ctx_start_container },
   { .name = "status_container", .func = &luacrun_ctx_status_container },
   { .name = "iter_container_names", .func = &luacrun_ctx_iter_containers },
+  { .name = "iter_container_status", .func = &luacrun_ctx_iter_status },
+  { .name = "run_yielding", .func = &luacrun_ctx_run_yielding },
+  { .name = "create_container_yielding", .func = &luacrun_ctx_create_container_yielding },
+  { .name = "delete_container_yielding", .func = &luacrun_ctx_delete_container_yielding },
   { .name = "update_container", .func = &luacrun_ctx_update_container },
   { NULL, NULL },
 };
@@ -836,9 +1402,14 @@ luaopen_luacrun (lua_State *S)
   lua_setfield (S, libtab_idx, "VERBOSITY_ERROR");
   lua_pushinteger (S, LIBCRUN_VERBOSITY_WARNING);
   lua_setfield (S, libtab_idx, "VERBOSITY_WARNING");
+  lua_pushinteger (S, LIBCRUN_VERBOSITY_DEBUG);
+  lua_setfield (S, libtab_idx, "VERBOSITY_DEBUG");
 
   luacrun_setup_ctx_metatable (S);
   luacrun_setup_cont_metatable (S);
+  luacrun_setup_lazy_config_metatable (S);
   luacrun_setup_ctx_iter_metatable (S);
+  luacrun_setup_ctx_status_iter_metatable (S);
+  luacrun_setup_yield_call_metatable (S);
   return 1;
 }
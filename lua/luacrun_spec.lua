@@ -96,6 +96,30 @@ insulate("luacrun", function()
         end)
     end)
 
+    describe("new_lazy_config_from_string", function()
+        it("returns the raw sections", function()
+            local spec = dkjson.decode(luacrun.container_spec())
+            spec.process.args = {'/bin/echo', "Hello World!"}
+            local config, err = luacrun.new_lazy_config_from_string(
+                                    dkjson.encode(spec))
+            assert(config, err)
+            local process = dkjson.decode(
+                                luacrun.lazy_config_section(config, "process"))
+            assert.are.same(spec.process.args, process.args)
+            assert.are.equals("table", type(dkjson.decode(
+                                  luacrun.lazy_config_section(config,
+                                                              "linux.namespaces"))))
+            assert.is_nil(luacrun.lazy_config_section(config, "missing"))
+        end)
+
+        it("can create a container object", function()
+            local config = luacrun.new_lazy_config_from_string(
+                               luacrun.container_spec())
+            local cont, err = luacrun.lazy_config_to_container(config)
+            assert(cont, err)
+        end)
+    end)
+
     describe("create_container", function()
         it("is same to ctx.create", function()
             local ctx = luacrun.new_ctx {id = "luacrun-test"}
@@ -188,6 +212,37 @@ insulate("luacrun", function()
             assert.is_true(ctx:systemd_cgroup())
         end)
 
+        describe("iter_status()", function ()
+            it("acts as empty iterator if no container", function ()
+                local touch = false
+                local ctx = luacrun.new_ctx {
+                    id = "luacrun-test-empty",
+                }
+
+                for i, status in ctx:iter_status {prefetch = true} do
+                    touch = true
+                end
+                assert.is_false(touch)
+            end)
+        end)
+
+        describe("delete_yielding()", function ()
+            it("yields a file descriptor in a coroutine", function ()
+                local temproot = mktestenv()
+                local ctx = luacrun.new_ctx {state_root = temproot, id = "luacrun-test"}
+                local co = coroutine.create(function ()
+                    return ctx:delete_yielding("luacrun-test-not-exists")
+                end)
+                local ok, fd = coroutine.resume(co)
+                assert(ok, fd)
+                assert.are.equals("number", type(fd))
+                local ok, stat, err = coroutine.resume(co)
+                assert(ok, stat)
+                assert.is_false(stat)
+                assert.are.equals("string", type(err))
+            end)
+        end)
+
         describe("iter_names()", function ()
             it("acts as empty iterator if no container", function ()
                 local touch = false
@@ -0,0 +1,90 @@
+# crun - OCI runtime written in C
+#
+# Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+# crun is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; either version 2.1 of the License, or
+# (at your option) any later version.
+#
+# crun is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with crun.  If not, see <http://www.gnu.org/licenses/>.
+
+"""asyncio wrappers for the python_crun module.
+
+The blocking python_crun functions release the GIL, so they run in the
+default executor without stopping the event loop.  libcrun is not
+thread safe and python_crun serializes the calls into it, only a
+foreground run is done in a helper process so that it does not keep the
+other calls waiting.  run() needs a detached context, a foreground run
+would keep an executor thread busy until the container exits; use
+create(), start() and wait() instead:
+
+    ctx = python_crun.make_context("test-container", detach=True)
+    await crun_async.create(ctx, ctr)
+    await crun_async.start(ctx, "test-container")
+    await crun_async.wait(ctx, "test-container")
+    await crun_async.delete(ctx, "test-container", False)
+"""
+
+import asyncio
+import functools
+import os
+import python_crun
+
+async def _call(fn, *args):
+    loop = asyncio.get_running_loop()
+    return await loop.run_in_executor(None, functools.partial(fn, *args))
+
+async def run(ctx, ctr):
+    if not python_crun.is_detached(ctx):
+        raise ValueError("crun_async.run needs a detached context, use create(), start() and wait()")
+    return await _call(python_crun.run, ctx, ctr)
+
+async def create(ctx, ctr):
+    return await _call(python_crun.create, ctx, ctr)
+
+async def start(ctx, id):
+    return await _call(python_crun.start, ctx, id)
+
+async def kill(ctx, id, signal):
+    return await _call(python_crun.kill, ctx, id, signal)
+
+async def delete(ctx, id, force):
+    return await _call(python_crun.delete, ctx, id, force)
+
+async def update(ctx, id, content):
+    return await _call(python_crun.update, ctx, id, content)
+
+async def status(ctx, id):
+    return await _call(python_crun.status, ctx, id)
+
+async def containers_status(ctx):
+    return await _call(python_crun.containers_status, ctx)
+
+async def wait(ctx, id):
+    """Wait for the init process of the container to exit.
+
+    The process is watched through a pidfd registered with the event
+    loop, no thread is blocked while waiting.
+    """
+    loop = asyncio.get_running_loop()
+    fd = await _call(python_crun.pidfd, ctx, id)
+    try:
+        exited = loop.create_future()
+
+        def on_exit():
+            if not exited.done():
+                exited.set_result(None)
+
+        loop.add_reader(fd, on_exit)
+        try:
+            await exited
+        finally:
+            loop.remove_reader(fd)
+    finally:
+        os.close(fd)
@@ -38,9 +38,164 @@ python_crun.run(ctx, ctr)
 #include <libcrun/status.h>
 #include <libcrun/utils.h>
 #include <libcrun/error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
 #define CONTEXT_OBJ_TAG "crun-context"
 #define CONTAINER_OBJ_TAG "crun-container"
+#define LAZY_CONFIG_OBJ_TAG "crun-lazy-config"
+
+/* libcrun is not thread safe, it changes process wide attributes such
+   as the umask.  The GIL is released while libcrun runs, so that other
+   Python threads can run, but only one thread at a time calls into
+   libcrun.  */
+static pthread_mutex_t libcrun_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define BEGIN_LIBCRUN_CALL \
+  Py_BEGIN_ALLOW_THREADS;  \
+  pthread_mutex_lock (&libcrun_lock)
+
+#define END_LIBCRUN_CALL                \
+  pthread_mutex_unlock (&libcrun_lock); \
+  Py_END_ALLOW_THREADS
+
+/* Arguments for the operations run in a helper process.  */
+struct helper_args_s
+{
+  libcrun_context_t *ctx;
+  libcrun_container_t *ctr;
+};
+
+typedef int (*helper_fn_t) (struct helper_args_s *args, libcrun_error_t *err);
+
+/* Sent by the helper process to its parent, followed by MSG_LEN bytes of
+   the error message.  */
+struct helper_result_s
+{
+  int ret;
+  int status;
+  size_t msg_len;
+};
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t r = write (fd, p, len);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        return -1;
+      p += r;
+      len -= r;
+    }
+  return 0;
+}
+
+static int
+read_all (int fd, void *buf, size_t len)
+{
+  char *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t r = read (fd, p, len);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        return -1;
+      p += r;
+      len -= r;
+    }
+  return 0;
+}
+
+/* Run FN in a child process.  It is used for the calls that wait for
+   the container to exit, so that they do not hold the libcrun lock for
+   the whole life of the container: the lock is taken only while
+   forking, so that the child does not copy the state of a call in
+   progress.  It must be called without the GIL.  */
+static int
+call_in_helper (helper_fn_t fn, struct helper_args_s *args, libcrun_error_t *err)
+{
+  struct helper_result_s result;
+  cleanup_free char *msg = NULL;
+  int read_ret;
+  int fds[2];
+  int status;
+  pid_t pid;
+  int ret;
+
+  ret = pipe2 (fds, O_CLOEXEC);
+  if (ret < 0)
+    return libcrun_make_error (err, errno, "pipe2");
+
+  pthread_mutex_lock (&libcrun_lock);
+  pid = fork ();
+  if (pid == 0)
+    {
+      libcrun_error_t child_err = NULL;
+
+      close (fds[0]);
+
+      memset (&result, 0, sizeof (result));
+      result.ret = fn (args, &child_err);
+      if (result.ret < 0 && child_err)
+        {
+          result.status = child_err->status;
+          result.msg_len = strlen (child_err->msg);
+        }
+
+      if (write_all (fds[1], &result, sizeof (result)) < 0
+          || (result.msg_len && write_all (fds[1], child_err->msg, result.msg_len) < 0))
+        _exit (EXIT_FAILURE);
+      _exit (EXIT_SUCCESS);
+    }
+  pthread_mutex_unlock (&libcrun_lock);
+
+  close (fds[1]);
+  if (pid < 0)
+    {
+      ret = libcrun_make_error (err, errno, "fork");
+      close (fds[0]);
+      return ret;
+    }
+
+  /* Read the result before waiting for the helper, it could not exit
+     while the error message does not fit in the pipe.  */
+  read_ret = read_all (fds[0], &result, sizeof (result));
+  if (read_ret == 0 && result.msg_len)
+    {
+      msg = xmalloc0 (result.msg_len + 1);
+      read_ret = read_all (fds[0], msg, result.msg_len);
+    }
+  close (fds[0]);
+
+  do
+    ret = waitpid (pid, &status, 0);
+  while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return libcrun_make_error (err, errno, "waitpid");
+
+  if (read_ret < 0 || ! WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+    return libcrun_make_error (err, 0, "the helper process failed");
+
+  if (result.ret < 0)
+    return libcrun_make_error (err, result.status, "%s", msg ? msg : "unknown error");
+
+  return result.ret;
+}
+
+static int
+helper_run (struct helper_args_s *args, libcrun_error_t *err)
+{
+  return libcrun_container_run (args->ctx, args->ctr, 0, err);
+}
 
 static PyObject *
 set_error (libcrun_error_t *err)
@@ -102,6 +257,250 @@ container_load_from_memory (PyObject *self arg_unused, PyObject *args)
   return PyCapsule_New (ctr, CONTAINER_OBJ_TAG, free_container);
 }
 
+static void
+free_lazy_config (PyObject *ptr)
+{
+  libcrun_lazy_config_t *config = PyCapsule_GetPointer (ptr, LAZY_CONFIG_OBJ_TAG);
+  libcrun_lazy_config_free (config);
+}
+
+static PyObject *
+lazy_config_load_from_file (PyObject *self arg_unused, PyObject *args)
+{
+  libcrun_error_t err;
+  const char *path;
+  libcrun_lazy_config_t *config;
+
+  if (!PyArg_ParseTuple (args, "s", &path))
+    return NULL;
+
+  config = libcrun_lazy_config_load_from_file (path, &err);
+  if (config == NULL)
+    return set_error (&err);
+
+  return PyCapsule_New (config, LAZY_CONFIG_OBJ_TAG, free_lazy_config);
+}
+
+static PyObject *
+lazy_config_load_from_memory (PyObject *self arg_unused, PyObject *args)
+{
+  libcrun_error_t err;
+  const char *def;
+  libcrun_lazy_config_t *config;
+
+  if (!PyArg_ParseTuple (args, "s", &def))
+    return NULL;
+
+  config = libcrun_lazy_config_load_from_memory (def, &err);
+  if (config == NULL)
+    return set_error (&err);
+
+  return PyCapsule_New (config, LAZY_CONFIG_OBJ_TAG, free_lazy_config);
+}
+
+static PyObject *
+lazy_config_section (PyObject *self arg_unused, PyObject *args)
+{
+  PyObject *config_obj = NULL;
+  libcrun_lazy_config_t *config;
+  const char *name;
+  const char *raw;
+  size_t len;
+
+  if (!PyArg_ParseTuple (args, "Os", &config_obj, &name))
+    return NULL;
+
+  config = PyCapsule_GetPointer (config_obj, LAZY_CONFIG_OBJ_TAG);
+  if (config == NULL)
+    return NULL;
+
+  raw = libcrun_lazy_config_get_raw (config, name, &len);
+  if (raw == NULL)
+    Py_RETURN_NONE;
+
+  return PyUnicode_FromStringAndSize (raw, len);
+}
+
+static PyObject *
+make_string_list (char **values, size_t len)
+{
+  PyObject *list = PyList_New (0);
+  size_t i;
+
+  if (list == NULL)
+    return NULL;
+
+  for (i = 0; i < len; i++)
+    {
+      PyObject *v = PyUnicode_FromString (values[i]);
+      if (v == NULL || PyList_Append (list, v) < 0)
+        {
+          Py_XDECREF (v);
+          Py_DECREF (list);
+          return NULL;
+        }
+      Py_DECREF (v);
+    }
+  return list;
+}
+
+static PyObject *
+lazy_config_process (PyObject *self arg_unused, PyObject *args)
+{
+  runtime_spec_schema_config_schema_process *process;
+  PyObject *config_obj = NULL;
+  libcrun_lazy_config_t *config;
+  libcrun_error_t err;
+  int ret;
+
+  if (!PyArg_ParseTuple (args, "O", &config_obj))
+    return NULL;
+
+  config = PyCapsule_GetPointer (config_obj, LAZY_CONFIG_OBJ_TAG);
+  if (config == NULL)
+    return NULL;
+
+  ret = libcrun_lazy_config_get_process (config, &process, &err);
+  if (ret < 0)
+    return set_error (&err);
+  if (ret == 0)
+    Py_RETURN_NONE;
+
+  return Py_BuildValue ("{s:N,s:N,s:z,s:O}",
+                        "args", make_string_list (process->args, process->args_len),
+                        "env", make_string_list (process->env, process->env_len),
+                        "cwd", process->cwd,
+                        "terminal", process->terminal ? Py_True : Py_False);
+}
+
+static PyObject *
+lazy_config_resources (PyObject *self arg_unused, PyObject *args)
+{
+  runtime_spec_schema_config_linux_resources *resources;
+  PyObject *config_obj = NULL;
+  libcrun_lazy_config_t *config;
+  libcrun_error_t err;
+  PyObject *ret_obj;
+  int ret;
+
+  if (!PyArg_ParseTuple (args, "O", &config_obj))
+    return NULL;
+
+  config = PyCapsule_GetPointer (config_obj, LAZY_CONFIG_OBJ_TAG);
+  if (config == NULL)
+    return NULL;
+
+  ret = libcrun_lazy_config_get_resources (config, &resources, &err);
+  if (ret < 0)
+    return set_error (&err);
+  if (ret == 0)
+    Py_RETURN_NONE;
+
+  /* Only the most common limits, lazy_section gives the full JSON.  */
+  ret_obj = PyDict_New ();
+  if (ret_obj == NULL)
+    return NULL;
+
+#define SET_LIMIT(NAME, VALUE)                                      \
+  do                                                                \
+    {                                                               \
+      PyObject *v = PyLong_FromLongLong (VALUE);                    \
+      if (v == NULL || PyDict_SetItemString (ret_obj, NAME, v) < 0) \
+        {                                                           \
+          Py_XDECREF (v);                                           \
+          Py_DECREF (ret_obj);                                      \
+          return NULL;                                              \
+        }                                                           \
+      Py_DECREF (v);                                                \
+  } while (0)
+
+  if (resources->memory && resources->memory->limit_present)
+    SET_LIMIT ("memory_limit", resources->memory->limit);
+  if (resources->pids && resources->pids->limit)
+    SET_LIMIT ("pids_limit", resources->pids->limit);
+  if (resources->cpu && resources->cpu->shares)
+    SET_LIMIT ("cpu_shares", resources->cpu->shares);
+  if (resources->cpu && resources->cpu->quota)
+    SET_LIMIT ("cpu_quota", resources->cpu->quota);
+  if (resources->cpu && resources->cpu->period)
+    SET_LIMIT ("cpu_period", resources->cpu->period);
+
+#undef SET_LIMIT
+
+  return ret_obj;
+}
+
+static PyObject *
+lazy_config_mounts (PyObject *self arg_unused, PyObject *args)
+{
+  runtime_spec_schema_defs_mount **mounts;
+  PyObject *config_obj = NULL;
+  libcrun_lazy_config_t *config;
+  libcrun_error_t err;
+  PyObject *list;
+  size_t i, len;
+  int ret;
+
+  if (!PyArg_ParseTuple (args, "O", &config_obj))
+    return NULL;
+
+  config = PyCapsule_GetPointer (config_obj, LAZY_CONFIG_OBJ_TAG);
+  if (config == NULL)
+    return NULL;
+
+  ret = libcrun_lazy_config_get_mounts (config, &mounts, &len, &err);
+  if (ret < 0)
+    return set_error (&err);
+  if (ret == 0)
+    Py_RETURN_NONE;
+
+  list = PyList_New (0);
+  if (list == NULL)
+    return NULL;
+
+  for (i = 0; i < len; i++)
+    {
+      PyObject *mount;
+
+      mount = Py_BuildValue ("{s:z,s:z,s:z,s:N}",
+                             "destination", mounts[i]->destination,
+                             "type", mounts[i]->type,
+                             "source", mounts[i]->source,
+                             "options", make_string_list (mounts[i]->options, mounts[i]->options_len));
+      if (mount == NULL || PyList_Append (list, mount) < 0)
+        {
+          Py_XDECREF (mount);
+          Py_DECREF (list);
+          return NULL;
+        }
+      Py_DECREF (mount);
+    }
+
+  return list;
+}
+
+static PyObject *
+lazy_config_to_container (PyObject *self arg_unused, PyObject *args)
+{
+  libcrun_error_t err;
+  PyObject *config_obj = NULL;
+  libcrun_lazy_config_t *config;
+  libcrun_container_t *ctr;
+
+  if (!PyArg_ParseTuple (args, "O", &config_obj))
+    return NULL;
+
+  config = PyCapsule_GetPointer (config_obj, LAZY_CONFIG_OBJ_TAG);
+  if (config == NULL)
+    return NULL;
+
+  ctr = libcrun_lazy_config_to_container (config, &err);
+  if (ctr == NULL)
+    return set_error (&err);
+
+  return PyCapsule_New (ctr, CONTAINER_OBJ_TAG, free_container);
+}
+
 static void
 free_context (void *ptr)
 {
@@ -141,9 +540,26 @@ make_context (PyObject *self arg_unused, PyObject *args, PyObject *kwargs)
   return PyCapsule_New (ctx, CONTEXT_OBJ_TAG, NULL);
 }
 
+static PyObject *
+context_is_detached (PyObject *self arg_unused, PyObject *args)
+{
+  PyObject *ctx_obj = NULL;
+  libcrun_context_t *ctx;
+
+  if (!PyArg_ParseTuple (args, "O", &ctx_obj))
+    return NULL;
+
+  ctx = PyCapsule_GetPointer (ctx_obj, CONTEXT_OBJ_TAG);
+  if (ctx == NULL)
+    return NULL;
+
+  return PyBool_FromLong (ctx->detach);
+}
+
 static PyObject *
 container_run (PyObject *self arg_unused, PyObject *args)
 {
+  struct helper_args_s helper_args = {};
   libcrun_error_t err;
   PyObject *ctx_obj = NULL;
   PyObject *ctr_obj = NULL;
@@ -162,9 +578,23 @@ container_run (PyObject *self arg_unused, PyObject *args)
   if (ctr == NULL)
     return NULL;
 
-  Py_BEGIN_ALLOW_THREADS;
-  ret = libcrun_container_run (ctx, ctr, 0, &err);
-  Py_END_ALLOW_THREADS;
+  if (ctx->detach)
+    {
+      BEGIN_LIBCRUN_CALL;
+      ret = libcrun_container_run (ctx, ctr, 0, &err);
+      END_LIBCRUN_CALL;
+    }
+  else
+    {
+      /* A foreground run waits for the container to exit, do not keep
+         the other calls waiting for it.  */
+      helper_args.ctx = ctx;
+      helper_args.ctr = ctr;
+
+      Py_BEGIN_ALLOW_THREADS;
+      ret = call_in_helper (helper_run, &helper_args, &err);
+      Py_END_ALLOW_THREADS;
+    }
   if (ret < 0)
     return set_error (&err);
 
@@ -192,9 +622,9 @@ container_create (PyObject *self arg_unused, PyObject *args)
   if (ctr == NULL)
     return NULL;
 
-  Py_BEGIN_ALLOW_THREADS;
+  BEGIN_LIBCRUN_CALL;
   ret = libcrun_container_create (ctx, ctr, LIBCRUN_CREATE_OPTIONS_PREFORK, &err);
-  Py_END_ALLOW_THREADS;
+  END_LIBCRUN_CALL;
   if (ret < 0)
     return set_error (&err);
 
@@ -218,9 +648,9 @@ container_delete (PyObject *self arg_unused, PyObject *args)
   if (ctx == NULL)
     return NULL;
 
-  Py_BEGIN_ALLOW_THREADS;
+  BEGIN_LIBCRUN_CALL;
   ret = libcrun_container_delete (ctx, NULL, id, force, &err);
-  Py_END_ALLOW_THREADS;
+  END_LIBCRUN_CALL;
   if (ret < 0)
     return set_error (&err);
 
@@ -244,9 +674,9 @@ container_kill (PyObject *self arg_unused, PyObject *args)
   if (ctx == NULL)
     return NULL;
 
-  Py_BEGIN_ALLOW_THREADS;
+  BEGIN_LIBCRUN_CALL;
   ret = libcrun_container_kill (ctx, id, signal, &err);
-  Py_END_ALLOW_THREADS;
+  END_LIBCRUN_CALL;
   if (ret < 0)
     return set_error (&err);
 
@@ -269,9 +699,9 @@ container_start (PyObject *self arg_unused, PyObject *args)
   if (ctx == NULL)
     return NULL;
 
-  Py_BEGIN_ALLOW_THREADS;
+  BEGIN_LIBCRUN_CALL;
   ret = libcrun_container_start (ctx, id, &err);
-  Py_END_ALLOW_THREADS;
+  END_LIBCRUN_CALL;
   if (ret < 0)
     return set_error (&err);
 
@@ -296,9 +726,9 @@ containers_list (PyObject *self arg_unused, PyObject *args)
   if (ctx == NULL)
     return NULL;
 
-  Py_BEGIN_ALLOW_THREADS;
+  BEGIN_LIBCRUN_CALL;
   ret = libcrun_get_containers_list (&containers, ctx->state_root, &err);
-  Py_END_ALLOW_THREADS;
+  END_LIBCRUN_CALL;
   if (ret < 0)
     return set_error (&err);
 
@@ -347,17 +777,214 @@ container_status (PyObject *self arg_unused, PyObject *args)
   memset (buffer, 0, 4096);
 
   memfile = fmemopen (buffer, 4095, "w");
-  Py_BEGIN_ALLOW_THREADS;
+  BEGIN_LIBCRUN_CALL;
   ret = libcrun_container_state (ctx, id, memfile, &err);
-  Py_END_ALLOW_THREADS;
+  END_LIBCRUN_CALL;
+  fclose (memfile);
   if (ret < 0)
     return set_error (&err);
 
-  fclose (memfile);
-
   return PyUnicode_FromString (buffer);
 }
 
+struct container_status_entry_s
+{
+  char *id;
+  pid_t pid;
+  const char *status;
+};
+
+static void
+free_container_status_entries (struct container_status_entry_s *entries, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    free (entries[i].id);
+  free (entries);
+}
+
+/* Read the status of all the containers while the GIL is released.  */
+static int
+read_containers_status (libcrun_context_t *ctx, struct container_status_entry_s **out, size_t *out_len,
+                        libcrun_error_t *err)
+{
+  libcrun_container_list_t *containers, *it;
+  struct container_status_entry_s *entries;
+  size_t n = 0;
+  int ret;
+
+  ret = libcrun_get_containers_list (&containers, ctx->state_root, err);
+  if (ret < 0)
+    return ret;
+
+  for (it = containers; it; it = it->next)
+    n++;
+
+  entries = xmalloc0 (sizeof (*entries) * (n + 1));
+
+  n = 0;
+  for (it = containers; it; it = it->next)
+    {
+      libcrun_container_status_t status;
+      const char *container_status = NULL;
+      libcrun_error_t tmp_err = NULL;
+      int running = 0;
+
+      /* The container might have been deleted in the meanwhile.  */
+      ret = libcrun_read_container_status (&status, ctx->state_root, it->name, &tmp_err);
+      if (ret < 0)
+        {
+          libcrun_error_release (&tmp_err);
+          continue;
+        }
+
+      ret = libcrun_get_container_state_string (it->name, &status, ctx->state_root, &container_status, &running,
+                                                &tmp_err);
+      if (ret < 0)
+        {
+          libcrun_error_release (&tmp_err);
+          libcrun_free_container_status (&status);
+          continue;
+        }
+
+      entries[n].id = xstrdup (it->name);
+      entries[n].pid = running ? status.pid : 0;
+      entries[n].status = container_status;
+      n++;
+
+      libcrun_free_container_status (&status);
+    }
+
+  libcrun_free_containers_list (containers);
+
+  *out = entries;
+  *out_len = n;
+  return 0;
+}
+
+static PyObject *
+containers_status (PyObject *self arg_unused, PyObject *args)
+{
+  libcrun_error_t err;
+  PyObject *ctx_obj = NULL;
+  libcrun_context_t *ctx;
+  struct container_status_entry_s *entries = NULL;
+  PyObject *retobj;
+  size_t i, len = 0;
+  int ret;
+
+  if (!PyArg_ParseTuple (args, "O", &ctx_obj))
+    return NULL;
+
+  ctx = PyCapsule_GetPointer (ctx_obj, CONTEXT_OBJ_TAG);
+  if (ctx == NULL)
+    return NULL;
+
+  BEGIN_LIBCRUN_CALL;
+  ret = read_containers_status (ctx, &entries, &len, &err);
+  END_LIBCRUN_CALL;
+  if (ret < 0)
+    return set_error (&err);
+
+  retobj = PyList_New (len);
+  if (retobj == NULL)
+    goto exit;
+
+  for (i = 0; i < len; i++)
+    {
+      /* There are only a few possible states, share the strings.  */
+      PyObject *item = Py_BuildValue ("(siN)", entries[i].id, (int) entries[i].pid,
+                                      PyUnicode_InternFromString (entries[i].status));
+      if (item == NULL)
+        {
+          Py_CLEAR (retobj);
+          goto exit;
+        }
+      PyList_SET_ITEM (retobj, i, item);
+    }
+
+exit:
+  free_container_status_entries (entries, len);
+  return retobj;
+}
+
+/* Open a pidfd for the init process of the container.  The pidfd becomes
+   readable when the process exits, so it can be watched by an event
+   loop.  */
+static int
+open_container_pidfd (libcrun_context_t *ctx, const char *id, libcrun_error_t *err)
+{
+  libcrun_container_status_t status;
+  int pidfd = -1;
+  int ret;
+
+  ret = libcrun_read_container_status (&status, ctx->state_root, id, err);
+  if (ret < 0)
+    return ret;
+
+  ret = libcrun_is_container_running (&status, err);
+  if (ret < 0)
+    goto exit;
+  if (ret == 0)
+    {
+      ret = libcrun_make_error (err, 0, "container `%s` is not running", id);
+      goto exit;
+    }
+
+#ifdef __NR_pidfd_open
+  pidfd = syscall (__NR_pidfd_open, status.pid, 0);
+#else
+  errno = ENOSYS;
+#endif
+  if (pidfd < 0)
+    {
+      ret = libcrun_make_error (err, errno, "pidfd_open");
+      goto exit;
+    }
+
+  /* Check again, the pid could have been reused before pidfd_open.  */
+  ret = libcrun_is_container_running (&status, err);
+  if (ret <= 0)
+    {
+      close (pidfd);
+      if (ret == 0)
+        ret = libcrun_make_error (err, 0, "container `%s` is not running", id);
+      goto exit;
+    }
+
+  ret = pidfd;
+
+exit:
+  libcrun_free_container_status (&status);
+  return ret;
+}
+
+static PyObject *
+container_pidfd (PyObject *self arg_unused, PyObject *args)
+{
+  libcrun_error_t err;
+  PyObject *ctx_obj = NULL;
+  libcrun_context_t *ctx;
+  char *id = NULL;
+  int ret;
+
+  if (!PyArg_ParseTuple (args, "Os", &ctx_obj, &id))
+    return NULL;
+
+  ctx = PyCapsule_GetPointer (ctx_obj, CONTEXT_OBJ_TAG);
+  if (ctx == NULL)
+    return NULL;
+
+  BEGIN_LIBCRUN_CALL;
+  ret = open_container_pidfd (ctx, id, &err);
+  END_LIBCRUN_CALL;
+  if (ret < 0)
+    return set_error (&err);
+
+  return PyLong_FromLong (ret);
+}
+
 static int
 load_json_file (yajl_val *out, const char *jsondata, struct parser_context *ctx arg_unused, libcrun_error_t *err)
 {
@@ -409,9 +1036,9 @@ container_update (PyObject *self arg_unused, PyObject *args)
       return NULL;
     }
 
-  Py_BEGIN_ALLOW_THREADS;
+  BEGIN_LIBCRUN_CALL;
   ret = libcrun_container_exec (ctx, id, process, &err);
-  Py_END_ALLOW_THREADS;
+  END_LIBCRUN_CALL;
 
   free_runtime_spec_schema_config_schema_process (process);
   if (ret < 0)
@@ -436,9 +1063,9 @@ container_spec (PyObject *self arg_unused, PyObject *args arg_unused)
     return NULL;
 
   memfile = fmemopen (buffer, 4095, "w");
-  Py_BEGIN_ALLOW_THREADS;
+  BEGIN_LIBCRUN_CALL;
   ret = libcrun_container_spec (geteuid () == 0, memfile, &err);
-  Py_END_ALLOW_THREADS;
+  END_LIBCRUN_CALL;
   if (ret < 0)
     return set_error (&err);
   buffer[ret] = '\0';
@@ -481,6 +1108,20 @@ static PyMethodDef CrunMethods[] = {
    "Load an OCI container from file."},
   {"load_from_memory", container_load_from_memory, METH_VARARGS,
    "Load an OCI container from memory."},
+  {"load_lazy_from_file", lazy_config_load_from_file, METH_VARARGS,
+   "Index an OCI configuration file without parsing it."},
+  {"load_lazy_from_memory", lazy_config_load_from_memory, METH_VARARGS,
+   "Index an OCI configuration without parsing it."},
+  {"lazy_section", lazy_config_section, METH_VARARGS,
+   "Get the JSON for a section of a lazy configuration."},
+  {"lazy_container", lazy_config_to_container, METH_VARARGS,
+   "Load an OCI container from a lazy configuration."},
+  {"lazy_process", lazy_config_process, METH_VARARGS,
+   "Parse the process section of a lazy configuration."},
+  {"lazy_resources", lazy_config_resources, METH_VARARGS,
+   "Parse the linux.resources section of a lazy configuration."},
+  {"lazy_mounts", lazy_config_mounts, METH_VARARGS,
+   "Parse the mounts section of a lazy configuration."},
   {"run", container_run, METH_VARARGS, "Run a container."},
   {"create", container_create, METH_VARARGS, "Create a container."},
   {"delete", container_delete, METH_VARARGS, "Delete a container."},
@@ -488,12 +1129,18 @@ static PyMethodDef CrunMethods[] = {
   {"list", containers_list, METH_VARARGS, "List the containers."},
   {"status", container_status, METH_VARARGS,
    "Get the status of a container."},
+  {"containers_status", containers_status, METH_VARARGS,
+   "Get the id, pid and state of all the containers."},
+  {"pidfd", container_pidfd, METH_VARARGS,
+   "Get a pidfd for the init process of a running container."},
   {"update", container_update, METH_VARARGS,
    "Update the constraints of a container."},
   {"spec", container_spec, METH_VARARGS,
    "Generate a new configuration file."},
   {"make_context", (PyCFunction) make_context, METH_VARARGS | METH_KEYWORDS,
    "Create a context object."},
+  {"is_detached", context_is_detached, METH_VARARGS,
+   "Check whether the containers of a context run detached."},
   {"set_verbosity", set_verbosity, METH_VARARGS, "Set the logging verbosity."},
   {"get_verbosity", get_verbosity, METH_VARARGS, "Get the logging verbosity."},
   {"spec", container_spec, METH_VARARGS,
@@ -519,5 +1166,6 @@ PyInit_python_crun (void)
     return ret;
   (void) PyModule_AddIntConstant (ret, "VERBOSITY_ERROR", LIBCRUN_VERBOSITY_ERROR);
   (void) PyModule_AddIntConstant (ret, "VERBOSITY_WARNING", LIBCRUN_VERBOSITY_WARNING);
+  (void) PyModule_AddIntConstant (ret, "VERBOSITY_DEBUG", LIBCRUN_VERBOSITY_DEBUG);
   return ret;
 }
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <regex.h>
 #if HAVE_CRIU && HAVE_DLOPEN
 #  include <criu/criu.h>
@@ -47,6 +48,9 @@ enum
   OPTION_PARENT_PATH,
   OPTION_PRE_DUMP,
   OPTION_MANAGE_CGROUPS_MODE,
+  OPTION_ITERATIVE,
+  OPTION_MAX_ITERATIONS,
+  OPTION_CONVERGE_PAGES,
 };
 
 static char doc[] = "OCI runtime";
@@ -64,6 +68,9 @@ static struct argp_option options[]
 #ifdef CRIU_PRE_DUMP_SUPPORT
         { "parent-path", OPTION_PARENT_PATH, "DIR", 0, "path for previous criu image files in pre-dump", 0 },
         { "pre-dump", OPTION_PRE_DUMP, 0, 0, "dump container's memory information only, leave the container running after this", 0 },
+        { "iterative", OPTION_ITERATIVE, 0, 0, "run pre-dumps until the dirty memory converges, then do the final dump", 0 },
+        { "max-iterations", OPTION_MAX_ITERATIONS, "N", 0, "maximum number of pre-dumps with --iterative (default 5)", 0 },
+        { "converge-pages", OPTION_CONVERGE_PAGES, "N", 0, "stop the pre-dumps once at most N pages were dirtied (default 1024)", 0 },
 #endif
         { "manage-cgroups-mode", OPTION_MANAGE_CGROUPS_MODE, "MODE", 0, "cgroups mode: 'soft' (default), 'ignore', 'full' and 'strict'", 0 },
         {
@@ -91,6 +98,20 @@ crun_parse_manage_cgroups_mode (char *param arg_unused)
 #endif
 }
 
+static unsigned long long
+parse_count (const char *arg, const char *option)
+{
+  unsigned long long v;
+  char *endptr;
+
+  errno = 0;
+  v = strtoull (arg, &endptr, 10);
+  if (errno != 0 || endptr == arg || *endptr != '\0' || *arg == '-' || v == 0)
+    libcrun_fail_with_error (0, "invalid value `%s` for `%s`", arg, option);
+
+  return v;
+}
+
 static error_t
 parse_opt (int key, char *arg, struct argp_state *state)
 {
@@ -115,6 +136,23 @@ parse_opt (int key, char *arg, struct argp_state *state)
       cr_options.pre_dump = true;
       break;
 
+    case OPTION_ITERATIVE:
+      cr_options.iterative = true;
+      break;
+
+    case OPTION_MAX_ITERATIONS:
+      {
+        unsigned long long v = parse_count (argp_mandatory_argument (arg, state), "--max-iterations");
+        if (v > UINT_MAX)
+          libcrun_fail_with_error (0, "invalid value `%s` for `--max-iterations`", arg);
+        cr_options.max_iterations = v;
+      }
+      break;
+
+    case OPTION_CONVERGE_PAGES:
+      cr_options.converge_pages = parse_count (argp_mandatory_argument (arg, state), "--converge-pages");
+      break;
+
     case OPTION_LEAVE_RUNNING:
       cr_options.leave_running = true;
       break;
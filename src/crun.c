@@ -47,6 +47,7 @@
 #include "unpause.h"
 #include "oci_features.h"
 #include "ps.h"
+#include "stats.h"
 #include "checkpoint.h"
 #include "restore.h"
 
@@ -116,6 +117,13 @@ init_libcrun_context (libcrun_context_t *con, const char *id, struct crun_global
         return ret;
     }
 
+  if (glob->option_sharded_state)
+    {
+      ret = libcrun_status_enable_sharded_layout (con->state_root, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+    }
+
   if (con->bundle == NULL)
     con->bundle = ".";
 
@@ -142,6 +150,7 @@ enum
   COMMAND_PS,
   COMMAND_CHECKPOINT,
   COMMAND_RESTORE,
+  COMMAND_STATS,
 };
 
 struct commands_s commands[] = { { COMMAND_CREATE, "create", crun_command_create },
@@ -154,6 +163,7 @@ struct commands_s commands[] = { { COMMAND_CREATE, "create", crun_command_create
                                  { COMMAND_SPEC, "spec", crun_command_spec },
                                  { COMMAND_START, "start", crun_command_start },
                                  { COMMAND_STATE, "state", crun_command_state },
+                                 { COMMAND_STATS, "stats", crun_command_stats },
                                  { COMMAND_UPDATE, "update", crun_command_update },
                                  { COMMAND_PAUSE, "pause", crun_command_pause },
                                  { COMMAND_UNPAUSE, "resume", crun_command_unpause },
@@ -184,6 +194,7 @@ static char doc[] = "\nCOMMANDS:\n"
                     "\tspec        - generate a configuration file\n"
                     "\tstart       - start a container\n"
                     "\tstate       - output the state of a container\n"
+                    "\tstats       - stream the resource usage of a container\n"
                     "\tpause       - pause all the processes in the container\n"
                     "\tresume      - unpause the processes in the container\n"
                     "\tupdate      - update container resource constraints\n";
@@ -210,7 +221,8 @@ enum
   OPTION_LOG,
   OPTION_LOG_FORMAT,
   OPTION_ROOT,
-  OPTION_ROOTLESS
+  OPTION_ROOTLESS,
+  OPTION_STATE_LAYOUT
 };
 
 const char *argp_program_bug_address = "https://github.com/containers/crun/issues";
@@ -222,6 +234,7 @@ static struct argp_option options[] = { { "debug", OPTION_DEBUG, 0, 0, "produce
                                         { "log-format", OPTION_LOG_FORMAT, "FORMAT", 0, NULL, 0 },
                                         { "root", OPTION_ROOT, "DIR", 0, NULL, 0 },
                                         { "rootless", OPTION_ROOT, "VALUE", 0, NULL, 0 },
+                                        { "state-layout", OPTION_STATE_LAYOUT, "LAYOUT", 0, NULL, 0 },
                                         { "version", OPTION_VERSION, 0, 0, NULL, 0 },
                                         // alias OPTION_VERSION_CAP with OPTION_VERSION
                                         { NULL, OPTION_VERSION_CAP, 0, OPTION_ALIAS, NULL, 0 },
@@ -311,6 +324,14 @@ parse_opt (int key, char *arg, struct argp_state *state)
       arguments.root = argp_mandatory_argument (arg, state);
       break;
 
+    case OPTION_STATE_LAYOUT:
+      tmp = argp_mandatory_argument (arg, state);
+      if (strcmp (tmp, "sharded") == 0)
+        arguments.option_sharded_state = true;
+      else
+        libcrun_fail_with_error (0, "unknown state layout specified");
+      break;
+
     case OPTION_ROOTLESS:
       /* Ignored.  So that a runc command line won't fail.  */
       break;
@@ -396,7 +417,7 @@ main (int argc, char **argv)
     libcrun_fail_with_error (0, "unknown command %s", argv[first_argument]);
 
   if (arguments.debug)
-    libcrun_set_verbosity (LIBCRUN_VERBOSITY_WARNING);
+    libcrun_set_verbosity (LIBCRUN_VERBOSITY_DEBUG);
 
   ret = command->handler (&arguments, argc - first_argument, argv + first_argument, &err);
   if (ret && err)
@@ -45,6 +45,7 @@ struct delete_options_s
 {
   int regex;
   bool force;
+  bool all;
 };
 
 static struct delete_options_s delete_options;
@@ -52,11 +53,12 @@ static struct delete_options_s delete_options;
 static struct argp_option options[]
     = { { "force", 'f', 0, 0, "delete the container even if it is still running", 0 },
         { "regex", 'r', 0, 0, "the specified CONTAINER is a regular expression (delete multiple containers)", 0 },
+        { "all", 'a', 0, 0, "delete all the containers and the caches in the state root", 0 },
         {
             0,
         } };
 
-static char args_doc[] = "delete CONTAINER";
+static char args_doc[] = "delete [CONTAINER]";
 
 static error_t
 parse_opt (int key, char *arg arg_unused, struct argp_state *state arg_unused)
@@ -71,7 +73,13 @@ parse_opt (int key, char *arg arg_unused, struct argp_state *state arg_unused)
       delete_options.regex = true;
       break;
 
+    case 'a':
+      delete_options.all = true;
+      break;
+
     case ARGP_KEY_NO_ARGS:
+      if (delete_options.all)
+        break;
       libcrun_fail_with_error (0, "please specify a ID for the container");
 
     default:
@@ -93,6 +101,33 @@ crun_command_delete (struct crun_global_arguments *global_args, int argc, char *
   };
 
   argp_parse (&run_argp, argc, argv, ARGP_IN_ORDER, &first_arg, &delete_options);
+
+  if (delete_options.all)
+    {
+      libcrun_container_list_t *list, *it;
+
+      crun_assert_n_args (argc - first_arg, 0, 0);
+
+      ret = init_libcrun_context (&crun_context, NULL, global_args, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      ret = libcrun_get_containers_list (&list, crun_context.state_root, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      for (it = list; it; it = it->next)
+        {
+          ret = libcrun_container_delete (&crun_context, NULL, it->name, delete_options.force, err);
+          if (UNLIKELY (ret < 0))
+            libcrun_error_write_warning_and_release (stderr, &err);
+        }
+
+      libcrun_free_containers_list (list);
+
+      return libcrun_container_purge_caches (&crun_context, err);
+    }
+
   crun_assert_n_args (argc - first_arg, 1, 1);
 
   ret = init_libcrun_context (&crun_context, argv[first_arg], global_args, err);
@@ -0,0 +1,964 @@
+/*
+ * crun - OCI runtime written in C
+ *
+ * Copyright (C) 2017, 2018, 2019 Giuseppe Scrivano <giuseppe@scrivano.org>
+ * crun is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * crun is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crun.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <config.h>
+#include "container.h"
+#include "cgroup.h"
+#include "cgroup-utils.h"
+#include "status.h"
+#include "utils.h"
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+/* Initial size of the buffer used to read the cgroup files.  It is
+   grown when a file does not fit, so after the first reads no more
+   memory is allocated.  */
+#define STATS_BUFFER_SIZE 4096
+
+#define STATS_JSON_SIZE 2048
+
+enum
+{
+  STATS_FILE_CPU = 0,
+  STATS_FILE_MEMORY,
+  STATS_FILE_MEMORY_EVENTS,
+  STATS_FILE_IO,
+  STATS_FILE_PIDS,
+  STATS_FILES,
+};
+
+static const char *stats_files[STATS_FILES] = {
+  "cpu.stat",
+  "memory.stat",
+  "memory.events",
+  "io.stat",
+  "pids.current",
+};
+
+struct libcrun_stats_reader_s
+{
+  int fds[STATS_FILES];
+  char *id;
+  char *buffer;
+  size_t buffer_size;
+  char json[STATS_JSON_SIZE];
+};
+
+struct stats_key_s
+{
+  const char *name;
+  size_t offset;
+};
+
+#define STATS_KEY(name, field)                          \
+  {                                                     \
+    name, offsetof (libcrun_container_stats_t, field) \
+  }
+
+static const struct stats_key_s cpu_stat_keys[] = {
+  STATS_KEY ("usage_usec", cpu_usage_usec),
+  STATS_KEY ("user_usec", cpu_user_usec),
+  STATS_KEY ("system_usec", cpu_system_usec),
+  STATS_KEY ("nr_periods", cpu_nr_periods),
+  STATS_KEY ("nr_throttled", cpu_nr_throttled),
+  STATS_KEY ("throttled_usec", cpu_throttled_usec),
+  { NULL, 0 },
+};
+
+static const struct stats_key_s memory_stat_keys[] = {
+  STATS_KEY ("anon", memory_anon),
+  STATS_KEY ("file", memory_file),
+  STATS_KEY ("kernel_stack", memory_kernel_stack),
+  STATS_KEY ("sock", memory_sock),
+  STATS_KEY ("shmem", memory_shmem),
+  STATS_KEY ("pgfault", memory_pgfault),
+  STATS_KEY ("pgmajfault", memory_pgmajfault),
+  { NULL, 0 },
+};
+
+static const struct stats_key_s memory_events_keys[] = {
+  STATS_KEY ("low", memory_events_low),
+  STATS_KEY ("high", memory_events_high),
+  STATS_KEY ("max", memory_events_max),
+  STATS_KEY ("oom", memory_events_oom),
+  STATS_KEY ("oom_kill", memory_events_oom_kill),
+  { NULL, 0 },
+};
+
+static const struct stats_key_s io_stat_keys[] = {
+  STATS_KEY ("rbytes", io_rbytes),
+  STATS_KEY ("wbytes", io_wbytes),
+  STATS_KEY ("rios", io_rios),
+  STATS_KEY ("wios", io_wios),
+  { NULL, 0 },
+};
+
+static inline uint64_t *
+stats_field (libcrun_container_stats_t *stats, size_t offset)
+{
+  return (uint64_t *) ((char *) stats + offset);
+}
+
+/* Parse an unsigned decimal number, stopping at the first non digit.  */
+static inline const char *
+parse_stats_value (const char *it, const char *end, uint64_t *value)
+{
+  uint64_t v = 0;
+
+  while (it < end && *it >= '0' && *it <= '9')
+    v = v * 10 + (*it++ - '0');
+
+  *value = v;
+  return it;
+}
+
+static const struct stats_key_s *
+find_stats_key (const struct stats_key_s *keys, const char *name, size_t len)
+{
+  for (; keys->name; keys++)
+    if (strncmp (keys->name, name, len) == 0 && keys->name[len] == '\0')
+      return keys;
+  return NULL;
+}
+
+/* Parse the flat keyed format used by cpu.stat, memory.stat and
+   memory.events: one "KEY VALUE" pair per line.  */
+static void
+parse_flat_keyed (const char *buffer, size_t len, const struct stats_key_s *keys, libcrun_container_stats_t *stats)
+{
+  const char *it = buffer, *end = buffer + len;
+
+  while (it < end)
+    {
+      const struct stats_key_s *key;
+      const char *name = it;
+      uint64_t value;
+
+      while (it < end && *it != ' ' && *it != '\n')
+        it++;
+
+      key = find_stats_key (keys, name, it - name);
+      if (key && it < end && *it == ' ')
+        {
+          it = parse_stats_value (it + 1, end, &value);
+          *stats_field (stats, key->offset) = value;
+        }
+
+      while (it < end && *it++ != '\n')
+        ;
+    }
+}
+
+/* Parse the nested keyed format used by io.stat: one line per device
+   "MAJ:MIN KEY=VALUE...".  The values are summed over the devices.  */
+static void
+parse_nested_keyed (const char *buffer, size_t len, const struct stats_key_s *keys, libcrun_container_stats_t *stats)
+{
+  const char *it = buffer, *end = buffer + len;
+
+  while (it < end)
+    {
+      /* Skip the device.  */
+      while (it < end && *it != ' ' && *it != '\n')
+        it++;
+
+      while (it < end && *it == ' ')
+        {
+          const struct stats_key_s *key;
+          const char *name = ++it;
+          uint64_t value;
+
+          while (it < end && *it != '=' && *it != ' ' && *it != '\n')
+            it++;
+
+          if (it == end || *it != '=')
+            continue;
+
+          key = find_stats_key (keys, name, it - name);
+          it = parse_stats_value (it + 1, end, &value);
+          if (key)
+            *stats_field (stats, key->offset) += value;
+
+          while (it < end && *it != ' ' && *it != '\n')
+            it++;
+        }
+
+      if (it < end)
+        it++;
+    }
+}
+
+static int
+read_stats_file (libcrun_stats_reader_t *reader, int index, size_t *len, libcrun_error_t *err)
+{
+  for (;;)
+    {
+      ssize_t ret;
+
+      ret = TEMP_FAILURE_RETRY (pread (reader->fds[index], reader->buffer, reader->buffer_size, 0));
+      if (UNLIKELY (ret < 0))
+        return crun_make_error (err, errno, "read `%s`", stats_files[index]);
+
+      if ((size_t) ret < reader->buffer_size)
+        {
+          *len = ret;
+          return 0;
+        }
+
+      /* The file might have been truncated, try again with a bigger buffer.  */
+      reader->buffer_size *= 2;
+      reader->buffer = xrealloc (reader->buffer, reader->buffer_size);
+    }
+}
+
+static char *
+escape_json_id (const char *id)
+{
+  char *ret = xmalloc (strlen (id) * 6 + 1);
+  char *out = ret;
+  const unsigned char *it;
+
+  for (it = (const unsigned char *) id; *it; it++)
+    {
+      if (*it == '"' || *it == '\\')
+        {
+          *out++ = '\\';
+          *out++ = *it;
+        }
+      else if (*it < 0x20)
+        out += sprintf (out, "\\u%04x", *it);
+      else
+        *out++ = *it;
+    }
+  *out = '\0';
+  return ret;
+}
+
+/* Escape a label value for the Prometheus text format, where only the
+   backslash, the double quote and the line feed are escaped.  */
+static char *
+escape_prometheus_label (const char *value)
+{
+  char *ret = xmalloc (strlen (value) * 2 + 1);
+  char *out = ret;
+  const char *it;
+
+  for (it = value; *it; it++)
+    {
+      if (*it == '"' || *it == '\\')
+        {
+          *out++ = '\\';
+          *out++ = *it;
+        }
+      else if (*it == '\n')
+        {
+          *out++ = '\\';
+          *out++ = 'n';
+        }
+      else
+        *out++ = *it;
+    }
+  *out = '\0';
+  return ret;
+}
+
+void
+libcrun_stats_reader_free (libcrun_stats_reader_t *reader)
+{
+  size_t i;
+
+  if (reader == NULL)
+    return;
+
+  for (i = 0; i < STATS_FILES; i++)
+    if (reader->fds[i] >= 0)
+      close (reader->fds[i]);
+
+  free (reader->id);
+  free (reader->buffer);
+  free (reader);
+}
+
+int
+libcrun_container_stats_open (libcrun_context_t *context, const char *id, libcrun_stats_reader_t **out,
+                              libcrun_error_t *err)
+{
+  cleanup_cgroup_status struct libcrun_cgroup_status *cgroup_status = NULL;
+  cleanup_container_status libcrun_container_status_t status = {};
+  cleanup_close int dirfd = -1;
+  libcrun_stats_reader_t *reader;
+  size_t i;
+  int ret;
+
+  ret = libcrun_read_container_status (&status, context->state_root, id, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  if (status.cgroup_path == NULL || status.cgroup_path[0] == '\0')
+    return crun_make_error (err, 0, "the container is not using cgroups");
+
+  cgroup_status = libcrun_cgroup_make_status (&status);
+
+  dirfd = libcrun_get_cgroup_dirfd (cgroup_status, NULL, err);
+  if (UNLIKELY (dirfd < 0))
+    return dirfd;
+
+  reader = xmalloc0 (sizeof (*reader));
+  reader->id = escape_json_id (id);
+  reader->buffer_size = STATS_BUFFER_SIZE;
+  reader->buffer = xmalloc (reader->buffer_size);
+
+  /* A controller might not be enabled for the cgroup, its files are
+     then skipped.  */
+  for (i = 0; i < STATS_FILES; i++)
+    {
+      reader->fds[i] = openat (dirfd, stats_files[i], O_RDONLY | O_CLOEXEC);
+      if (UNLIKELY (reader->fds[i] < 0 && errno != ENOENT))
+        {
+          ret = crun_make_error (err, errno, "open `%s`", stats_files[i]);
+          libcrun_stats_reader_free (reader);
+          return ret;
+        }
+    }
+
+  *out = reader;
+  return 0;
+}
+
+int
+libcrun_stats_reader_read (libcrun_stats_reader_t *reader, libcrun_container_stats_t *stats, libcrun_error_t *err)
+{
+  struct timespec now;
+  size_t len;
+  int ret;
+
+  memset (stats, 0, sizeof (*stats));
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  stats->timestamp_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+  if (reader->fds[STATS_FILE_CPU] >= 0)
+    {
+      ret = read_stats_file (reader, STATS_FILE_CPU, &len, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+      parse_flat_keyed (reader->buffer, len, cpu_stat_keys, stats);
+      stats->valid |= LIBCRUN_STATS_CPU;
+    }
+
+  if (reader->fds[STATS_FILE_MEMORY] >= 0)
+    {
+      ret = read_stats_file (reader, STATS_FILE_MEMORY, &len, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+      parse_flat_keyed (reader->buffer, len, memory_stat_keys, stats);
+      stats->valid |= LIBCRUN_STATS_MEMORY;
+    }
+
+  if (reader->fds[STATS_FILE_MEMORY_EVENTS] >= 0)
+    {
+      ret = read_stats_file (reader, STATS_FILE_MEMORY_EVENTS, &len, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+      parse_flat_keyed (reader->buffer, len, memory_events_keys, stats);
+      stats->valid |= LIBCRUN_STATS_MEMORY_EVENTS;
+    }
+
+  if (reader->fds[STATS_FILE_IO] >= 0)
+    {
+      ret = read_stats_file (reader, STATS_FILE_IO, &len, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+      parse_nested_keyed (reader->buffer, len, io_stat_keys, stats);
+      stats->valid |= LIBCRUN_STATS_IO;
+    }
+
+  if (reader->fds[STATS_FILE_PIDS] >= 0)
+    {
+      ret = read_stats_file (reader, STATS_FILE_PIDS, &len, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+      parse_stats_value (reader->buffer, reader->buffer + len, &stats->pids_current);
+      stats->valid |= LIBCRUN_STATS_PIDS;
+    }
+
+  return 0;
+}
+
+static size_t
+append_json_section (char *out, size_t size, const char *name, const struct stats_key_s *keys,
+                     const libcrun_container_stats_t *stats)
+{
+  size_t i, len;
+
+  len = snprintf (out, size, ",\"%s\":{", name);
+  for (i = 0; keys[i].name && len < size; i++)
+    len += snprintf (out + len, size - len, "%s\"%s\":%" PRIu64, i ? "," : "", keys[i].name,
+                     *stats_field ((libcrun_container_stats_t *) stats, keys[i].offset));
+  if (len < size)
+    len += snprintf (out + len, size - len, "}");
+  return len;
+}
+
+int
+libcrun_stats_reader_format_json (libcrun_stats_reader_t *reader, const libcrun_container_stats_t *stats,
+                                  const char **json, size_t *json_len, libcrun_error_t *err)
+{
+  static const struct stats_key_s pids_keys[] = {
+    STATS_KEY ("current", pids_current),
+    { NULL, 0 },
+  };
+  static const struct
+  {
+    uint32_t flag;
+    const char *name;
+    const struct stats_key_s *keys;
+  } sections[] = {
+    { LIBCRUN_STATS_CPU, "cpu", cpu_stat_keys },
+    { LIBCRUN_STATS_MEMORY, "memory", memory_stat_keys },
+    { LIBCRUN_STATS_MEMORY_EVENTS, "memory_events", memory_events_keys },
+    { LIBCRUN_STATS_IO, "io", io_stat_keys },
+    { LIBCRUN_STATS_PIDS, "pids", pids_keys },
+  };
+  const size_t size = sizeof (reader->json);
+  size_t i, len;
+
+  len = snprintf (reader->json, size, "{\"id\":\"%s\",\"timestamp\":%" PRIu64, reader->id, stats->timestamp_ns);
+
+  for (i = 0; i < sizeof (sections) / sizeof (sections[0]) && len < size; i++)
+    if (stats->valid & sections[i].flag)
+      len += append_json_section (reader->json + len, size - len, sections[i].name, sections[i].keys, stats);
+
+  if (len < size)
+    len += snprintf (reader->json + len, size - len, "}");
+
+  if (UNLIKELY (len >= size))
+    return crun_make_error (err, 0, "stats for `%s` do not fit in the output buffer", reader->id);
+
+  *json = reader->json;
+  *json_len = len;
+  return 0;
+}
+
+/* Containers are split in chunks of this size between the threads, so
+   that small tables are read inline without spawning any thread.  */
+#define STATS_TABLE_CHUNK 64
+
+/* Containers that could not be opened, e.g. because they are stopped,
+   are retried only once every STATS_TABLE_RETRY scrapes.  */
+#define STATS_TABLE_RETRY 16
+
+#define STATS_TABLE_MAX_THREADS 64
+
+struct stats_table_entry_s
+{
+  char *name;
+  /* The name escaped as a Prometheus label value.  */
+  char *label;
+  libcrun_stats_reader_t *reader;
+  libcrun_container_stats_t stats;
+  unsigned int retry;
+  bool seen;
+  bool valid;
+};
+
+struct libcrun_stats_table_s
+{
+  libcrun_context_t *context;
+  unsigned int threads;
+
+  struct stats_table_entry_s *entries;
+  size_t n_entries;
+  size_t allocated;
+
+  /* Next chunk to read, shared by the threads.  */
+  size_t next_chunk;
+
+  /* The worker threads are started on the first scrape that needs them
+     and are kept for the lifetime of the table.  A scrape bumps
+     GENERATION to wake them up and waits until BUSY is back to 0.  */
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  pthread_t workers[STATS_TABLE_MAX_THREADS];
+  size_t n_workers;
+  bool workers_started;
+  bool shutdown;
+  uint64_t generation;
+  size_t busy;
+
+  char *out;
+  size_t out_size;
+  size_t out_len;
+};
+
+static int
+compare_stats_table_entry (const void *a, const void *b)
+{
+  const struct stats_table_entry_s *ea = a;
+  const struct stats_table_entry_s *eb = b;
+
+  return strcmp (ea->name, eb->name);
+}
+
+static void
+stats_table_entry_close (struct stats_table_entry_s *entry)
+{
+  libcrun_stats_reader_free (entry->reader);
+  entry->reader = NULL;
+  entry->valid = false;
+  entry->retry = STATS_TABLE_RETRY;
+}
+
+static void
+stats_table_entry_open (libcrun_stats_table_t *table, struct stats_table_entry_s *entry)
+{
+  libcrun_error_t tmp_err = NULL;
+  int ret;
+
+  ret = libcrun_container_stats_open (table->context, entry->name, &entry->reader, &tmp_err);
+  if (UNLIKELY (ret < 0))
+    {
+      crun_error_release (&tmp_err);
+      stats_table_entry_close (entry);
+    }
+}
+
+int
+libcrun_stats_table_new (libcrun_context_t *context, unsigned int threads, libcrun_stats_table_t **out,
+                         libcrun_error_t *err arg_unused)
+{
+  libcrun_stats_table_t *table;
+
+  table = xmalloc0 (sizeof (*table));
+  table->context = context;
+  table->threads = threads == 0 ? 1 : (threads > STATS_TABLE_MAX_THREADS ? STATS_TABLE_MAX_THREADS : threads);
+  pthread_mutex_init (&table->lock, NULL);
+  pthread_cond_init (&table->work_cond, NULL);
+  pthread_cond_init (&table->done_cond, NULL);
+
+  *out = table;
+  return 0;
+}
+
+void
+libcrun_stats_table_free (libcrun_stats_table_t *table)
+{
+  size_t i;
+
+  if (table == NULL)
+    return;
+
+  pthread_mutex_lock (&table->lock);
+  table->shutdown = true;
+  pthread_cond_broadcast (&table->work_cond);
+  pthread_mutex_unlock (&table->lock);
+
+  for (i = 0; i < table->n_workers; i++)
+    pthread_join (table->workers[i], NULL);
+
+  pthread_cond_destroy (&table->done_cond);
+  pthread_cond_destroy (&table->work_cond);
+  pthread_mutex_destroy (&table->lock);
+
+  for (i = 0; i < table->n_entries; i++)
+    {
+      libcrun_stats_reader_free (table->entries[i].reader);
+      free (table->entries[i].name);
+      free (table->entries[i].label);
+    }
+  free (table->entries);
+  free (table->out);
+  free (table);
+}
+
+size_t
+libcrun_stats_table_size (libcrun_stats_table_t *table)
+{
+  size_t i, ret = 0;
+
+  for (i = 0; i < table->n_entries; i++)
+    if (table->entries[i].reader)
+      ret++;
+  return ret;
+}
+
+/* Synchronize the table with the containers in the state root.  Known
+   containers keep their open files, new ones are opened and the ones
+   that were deleted are dropped.  The entries are kept sorted by name. */
+static int
+stats_table_refresh (libcrun_stats_table_t *table, libcrun_error_t *err)
+{
+  libcrun_container_list_t *list = NULL, *it;
+  size_t i, j, n_old = table->n_entries;
+  bool added;
+  int ret;
+
+  ret = libcrun_get_containers_list (&list, table->context->state_root, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  for (i = 0; i < n_old; i++)
+    table->entries[i].seen = false;
+
+  for (it = list; it; it = it->next)
+    {
+      struct stats_table_entry_s key = {
+        .name = it->name,
+      };
+      struct stats_table_entry_s *found;
+
+      found = bsearch (&key, table->entries, n_old, sizeof (*table->entries), compare_stats_table_entry);
+      if (found)
+        {
+          found->seen = true;
+          continue;
+        }
+
+      if (table->n_entries == table->allocated)
+        {
+          table->allocated = table->allocated ? table->allocated * 2 : 64;
+          table->entries = xrealloc (table->entries, table->allocated * sizeof (*table->entries));
+        }
+      memset (&table->entries[table->n_entries], 0, sizeof (*table->entries));
+      table->entries[table->n_entries].name = xstrdup (it->name);
+      table->entries[table->n_entries].label = escape_prometheus_label (it->name);
+      table->entries[table->n_entries].seen = true;
+      stats_table_entry_open (table, &table->entries[table->n_entries]);
+      table->n_entries++;
+    }
+
+  libcrun_free_containers_list (list);
+
+  /* The new entries were appended at the end.  */
+  added = table->n_entries > n_old;
+
+  for (i = 0, j = 0; i < table->n_entries; i++)
+    {
+      struct stats_table_entry_s *entry = &table->entries[i];
+
+      if (! entry->seen)
+        {
+          libcrun_stats_reader_free (entry->reader);
+          free (entry->name);
+          free (entry->label);
+          continue;
+        }
+
+      if (entry->reader == NULL && i < n_old && --entry->retry == 0)
+        stats_table_entry_open (table, entry);
+
+      if (i != j)
+        table->entries[j] = *entry;
+      j++;
+    }
+  table->n_entries = j;
+
+  /* Dropping entries keeps the order, the appended ones must be sorted
+     even if as many entries were dropped.  */
+  if (added)
+    qsort (table->entries, table->n_entries, sizeof (*table->entries), compare_stats_table_entry);
+
+  return 0;
+}
+
+static void
+stats_table_read_entry (struct stats_table_entry_s *entry)
+{
+  libcrun_error_t tmp_err = NULL;
+  int ret;
+
+  entry->valid = false;
+  if (entry->reader == NULL)
+    return;
+
+  ret = libcrun_stats_reader_read (entry->reader, &entry->stats, &tmp_err);
+  if (UNLIKELY (ret < 0))
+    {
+      /* The container exited, its files are closed and it is
+         retried later in case the id was reused.  */
+      crun_error_release (&tmp_err);
+      stats_table_entry_close (entry);
+      return;
+    }
+  entry->valid = true;
+}
+
+static void
+stats_table_read_chunks (libcrun_stats_table_t *table)
+{
+  for (;;)
+    {
+      size_t chunk, i, end;
+
+      chunk = __atomic_fetch_add (&table->next_chunk, 1, __ATOMIC_RELAXED);
+      i = chunk * STATS_TABLE_CHUNK;
+      if (i >= table->n_entries)
+        break;
+
+      end = i + STATS_TABLE_CHUNK;
+      if (end > table->n_entries)
+        end = table->n_entries;
+
+      for (; i < end; i++)
+        stats_table_read_entry (&table->entries[i]);
+    }
+}
+
+static void *
+stats_table_worker (void *arg)
+{
+  libcrun_stats_table_t *table = arg;
+  uint64_t generation = 0;
+
+  pthread_mutex_lock (&table->lock);
+  for (;;)
+    {
+      while (! table->shutdown && table->generation == generation)
+        pthread_cond_wait (&table->work_cond, &table->lock);
+      if (table->shutdown)
+        break;
+      generation = table->generation;
+      pthread_mutex_unlock (&table->lock);
+
+      stats_table_read_chunks (table);
+
+      pthread_mutex_lock (&table->lock);
+      if (--table->busy == 0)
+        pthread_cond_signal (&table->done_cond);
+    }
+  pthread_mutex_unlock (&table->lock);
+  return NULL;
+}
+
+/* Read every container, using up to table->threads threads.  Each
+   reader owns its buffer so they can be used concurrently.  Tables of a
+   single chunk are read inline.  */
+static void
+stats_table_read (libcrun_stats_table_t *table)
+{
+  size_t n_chunks, i;
+
+  n_chunks = (table->n_entries + STATS_TABLE_CHUNK - 1) / STATS_TABLE_CHUNK;
+
+  table->next_chunk = 0;
+
+  if (n_chunks <= 1 || table->threads == 1)
+    {
+      stats_table_read_chunks (table);
+      return;
+    }
+
+  /* The calling thread is one of the workers.  If a thread cannot be
+     created, the scrape just uses fewer of them.  */
+  if (! table->workers_started)
+    {
+      table->workers_started = true;
+      for (i = 1; i < table->threads; i++)
+        {
+          if (pthread_create (&table->workers[table->n_workers], NULL, stats_table_worker, table) != 0)
+            break;
+          table->n_workers++;
+        }
+    }
+
+  pthread_mutex_lock (&table->lock);
+  table->busy = table->n_workers;
+  table->generation++;
+  pthread_cond_broadcast (&table->work_cond);
+  pthread_mutex_unlock (&table->lock);
+
+  stats_table_read_chunks (table);
+
+  pthread_mutex_lock (&table->lock);
+  while (table->busy > 0)
+    pthread_cond_wait (&table->done_cond, &table->lock);
+  pthread_mutex_unlock (&table->lock);
+}
+
+static void
+stats_table_append (libcrun_stats_table_t *table, const char *data, size_t len)
+{
+  if (table->out_len + len + 1 > table->out_size)
+    {
+      while (table->out_len + len + 1 > table->out_size)
+        table->out_size = table->out_size ? table->out_size * 2 : 65536;
+      table->out = xrealloc (table->out, table->out_size);
+    }
+  memcpy (table->out + table->out_len, data, len);
+  table->out_len += len;
+  table->out[table->out_len] = '\0';
+}
+
+static void
+stats_table_appendf (libcrun_stats_table_t *table, const char *fmt, ...)
+{
+  va_list ap;
+  int len;
+
+  for (;;)
+    {
+      size_t available = table->out_size - table->out_len;
+
+      va_start (ap, fmt);
+      len = vsnprintf (table->out + table->out_len, available, fmt, ap);
+      va_end (ap);
+
+      if (UNLIKELY (len < 0))
+        return;
+
+      if ((size_t) len < available)
+        {
+          table->out_len += len;
+          return;
+        }
+
+      table->out_size = table->out_size ? table->out_size * 2 : 65536;
+      table->out = xrealloc (table->out, table->out_size);
+    }
+}
+
+static int
+stats_table_format_json (libcrun_stats_table_t *table, libcrun_error_t *err)
+{
+  struct timespec now;
+  bool first = true;
+  size_t i;
+  int ret;
+
+  clock_gettime (CLOCK_REALTIME, &now);
+
+  stats_table_appendf (table, "{\"timestamp\":%" PRIu64 ",\"containers\":[",
+                       (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec);
+
+  for (i = 0; i < table->n_entries; i++)
+    {
+      struct stats_table_entry_s *entry = &table->entries[i];
+      const char *json;
+      size_t len;
+
+      if (! entry->valid)
+        continue;
+
+      ret = libcrun_stats_reader_format_json (entry->reader, &entry->stats, &json, &len, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      if (! first)
+        stats_table_append (table, ",", 1);
+      stats_table_append (table, json, len);
+      first = false;
+    }
+
+  stats_table_append (table, "]}\n", 3);
+  return 0;
+}
+
+static void
+stats_table_format_prometheus (libcrun_stats_table_t *table)
+{
+  static const struct
+  {
+    const char *name;
+    const char *type;
+    uint32_t flag;
+    size_t offset;
+  } metrics[] = {
+    { "cpu_usage_usec", "counter", LIBCRUN_STATS_CPU, offsetof (libcrun_container_stats_t, cpu_usage_usec) },
+    { "cpu_user_usec", "counter", LIBCRUN_STATS_CPU, offsetof (libcrun_container_stats_t, cpu_user_usec) },
+    { "cpu_system_usec", "counter", LIBCRUN_STATS_CPU, offsetof (libcrun_container_stats_t, cpu_system_usec) },
+    { "cpu_nr_periods", "counter", LIBCRUN_STATS_CPU, offsetof (libcrun_container_stats_t, cpu_nr_periods) },
+    { "cpu_nr_throttled", "counter", LIBCRUN_STATS_CPU, offsetof (libcrun_container_stats_t, cpu_nr_throttled) },
+    { "cpu_throttled_usec", "counter", LIBCRUN_STATS_CPU, offsetof (libcrun_container_stats_t, cpu_throttled_usec) },
+    { "memory_anon_bytes", "gauge", LIBCRUN_STATS_MEMORY, offsetof (libcrun_container_stats_t, memory_anon) },
+    { "memory_file_bytes", "gauge", LIBCRUN_STATS_MEMORY, offsetof (libcrun_container_stats_t, memory_file) },
+    { "memory_kernel_stack_bytes", "gauge", LIBCRUN_STATS_MEMORY, offsetof (libcrun_container_stats_t, memory_kernel_stack) },
+    { "memory_sock_bytes", "gauge", LIBCRUN_STATS_MEMORY, offsetof (libcrun_container_stats_t, memory_sock) },
+    { "memory_shmem_bytes", "gauge", LIBCRUN_STATS_MEMORY, offsetof (libcrun_container_stats_t, memory_shmem) },
+    { "memory_pgfault", "counter", LIBCRUN_STATS_MEMORY, offsetof (libcrun_container_stats_t, memory_pgfault) },
+    { "memory_pgmajfault", "counter", LIBCRUN_STATS_MEMORY, offsetof (libcrun_container_stats_t, memory_pgmajfault) },
+    { "memory_events_low", "counter", LIBCRUN_STATS_MEMORY_EVENTS, offsetof (libcrun_container_stats_t, memory_events_low) },
+    { "memory_events_high", "counter", LIBCRUN_STATS_MEMORY_EVENTS, offsetof (libcrun_container_stats_t, memory_events_high) },
+    { "memory_events_max", "counter", LIBCRUN_STATS_MEMORY_EVENTS, offsetof (libcrun_container_stats_t, memory_events_max) },
+    { "memory_events_oom", "counter", LIBCRUN_STATS_MEMORY_EVENTS, offsetof (libcrun_container_stats_t, memory_events_oom) },
+    { "memory_events_oom_kill", "counter", LIBCRUN_STATS_MEMORY_EVENTS, offsetof (libcrun_container_stats_t, memory_events_oom_kill) },
+    { "io_read_bytes", "counter", LIBCRUN_STATS_IO, offsetof (libcrun_container_stats_t, io_rbytes) },
+    { "io_write_bytes", "counter", LIBCRUN_STATS_IO, offsetof (libcrun_container_stats_t, io_wbytes) },
+    { "io_read_ios", "counter", LIBCRUN_STATS_IO, offsetof (libcrun_container_stats_t, io_rios) },
+    { "io_write_ios", "counter", LIBCRUN_STATS_IO, offsetof (libcrun_container_stats_t, io_wios) },
+    { "pids_current", "gauge", LIBCRUN_STATS_PIDS, offsetof (libcrun_container_stats_t, pids_current) },
+  };
+  size_t i, m;
+
+  for (m = 0; m < sizeof (metrics) / sizeof (metrics[0]); m++)
+    {
+      stats_table_appendf (table, "# TYPE crun_container_%s %s\n", metrics[m].name, metrics[m].type);
+
+      for (i = 0; i < table->n_entries; i++)
+        {
+          struct stats_table_entry_s *entry = &table->entries[i];
+
+          if (! entry->valid || ! (entry->stats.valid & metrics[m].flag))
+            continue;
+
+          stats_table_appendf (table, "crun_container_%s{id=\"%s\"} %" PRIu64 "\n", metrics[m].name,
+                               entry->label, *stats_field (&entry->stats, metrics[m].offset));
+        }
+    }
+}
+
+int
+libcrun_stats_table_scrape (libcrun_stats_table_t *table, int format, const char **out, size_t *len,
+                            libcrun_error_t *err)
+{
+  int ret;
+
+  ret = stats_table_refresh (table, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  stats_table_read (table);
+
+  table->out_len = 0;
+  switch (format)
+    {
+    case LIBCRUN_STATS_FORMAT_JSON:
+      ret = stats_table_format_json (table, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+      break;
+
+    case LIBCRUN_STATS_FORMAT_PROMETHEUS:
+      stats_table_format_prometheus (table);
+      break;
+
+    default:
+      return crun_make_error (err, EINVAL, "unknown stats format `%d`", format);
+    }
+
+  *out = table->out;
+  *len = table->out_len;
+  return 0;
+}
@@ -467,12 +467,23 @@ systemd_job_removed (sd_bus_message *m, void *userdata, sd_bus_error *error arg_
   return 0;
 }
 
+static int64_t
+systemd_elapsed_us (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* The match is bound to SLOT, that must be released before DATA goes
+   out of scope since the bus connection is reused.  */
 static int
-systemd_check_job_status_setup (sd_bus *bus, struct systemd_job_removed_s *data, libcrun_error_t *err)
+systemd_check_job_status_setup (sd_bus *bus, sd_bus_slot **slot, struct systemd_job_removed_s *data, libcrun_error_t *err)
 {
   int ret;
 
-  ret = sd_bus_match_signal_async (bus, NULL, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+  ret = sd_bus_match_signal_async (bus, slot, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
                                    "org.freedesktop.systemd1.Manager", "JobRemoved", systemd_job_removed, NULL, data);
   if (UNLIKELY (ret < 0))
     return crun_make_error (err, -ret, "sd-bus match signal");
@@ -751,23 +762,59 @@ append_systemd_annotation (sd_bus_message *m, const char *name, size_t name_len,
   return crun_make_error (err, errno, "unknown type for `%s`", name);
 }
 
+/* The connection to systemd is kept open for the lifetime of the
+   thread, so that batch operations and the language bindings do not
+   pay for a new connection and authentication on every call.  It is a
+   private connection, not the sd-bus default one that other users in
+   the same process could share.  An sd-bus connection cannot be used
+   after fork(): when the pid changes the inherited connection is just
+   forgotten, as unreferencing it could flush the parent messages, and
+   a new one is opened.  */
+static __thread sd_bus *cached_bus;
+static __thread pid_t cached_bus_pid;
+
 static int
 open_sd_bus_connection (sd_bus **bus, libcrun_error_t *err)
 {
+  struct timespec start;
+  pid_t pid = getpid ();
   int rootless;
   int sd_err = 0;
 
+  if (cached_bus && cached_bus_pid != pid)
+    cached_bus = NULL;
+
+  if (cached_bus)
+    {
+      if (sd_bus_is_open (cached_bus) > 0)
+        {
+          *bus = sd_bus_ref (cached_bus);
+          return 0;
+        }
+
+      /* The connection was closed, e.g. systemd was restarted.  */
+      sd_bus_unref (cached_bus);
+      cached_bus = NULL;
+    }
+
   rootless = is_rootless (err);
   if (UNLIKELY (rootless < 0))
     return rootless;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
   if (rootless)
-    sd_err = sd_bus_default_user (bus);
+    sd_err = sd_bus_open_user (bus);
   if (! rootless || sd_err < 0)
-    sd_err = sd_bus_default_system (bus);
+    sd_err = sd_bus_open_system (bus);
   if (sd_err < 0)
     return crun_make_error (err, -sd_err, "cannot open sd-bus");
 
+  libcrun_debug ("systemd: connected to the %s bus in %" PRId64 " us", rootless ? "user" : "system",
+                 systemd_elapsed_us (&start));
+
+  cached_bus = sd_bus_ref (*bus);
+  cached_bus_pid = pid;
   return 0;
 }
 
@@ -961,12 +1008,15 @@ append_resources (sd_bus_message *m,
   return 0;
 }
 
+/* Queue a ResetFailedUnit call without waiting for its reply.  systemd
+   handles the messages from a connection in order, so it is processed
+   before any call sent after it.  It fails if the unit does not exist,
+   that is fine and the error is not even sent back.  */
 static int
 reset_failed_unit (sd_bus *bus, const char *unit)
 {
   int sd_err;
-  sd_bus_error error = SD_BUS_ERROR_NULL;
-  sd_bus_message *m = NULL, *reply = NULL;
+  sd_bus_message *m = NULL;
 
   sd_err = sd_bus_message_new_method_call (bus, &m, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
                                            "org.freedesktop.systemd1.Manager", "ResetFailedUnit");
@@ -977,7 +1027,11 @@ reset_failed_unit (sd_bus *bus, const char *unit)
   if (UNLIKELY (sd_err < 0))
     goto exit;
 
-  sd_err = sd_bus_call (bus, m, 0, &error, &reply);
+  sd_err = sd_bus_message_set_expect_reply (m, 0);
+  if (UNLIKELY (sd_err < 0))
+    goto exit;
+
+  sd_err = sd_bus_send (bus, m, NULL);
   if (UNLIKELY (sd_err < 0))
     goto exit;
 
@@ -986,9 +1040,6 @@ reset_failed_unit (sd_bus *bus, const char *unit)
 exit:
   if (m)
     sd_bus_message_unref (m);
-  if (reply)
-    sd_bus_message_unref (reply);
-  sd_bus_error_free (&error);
 
   return sd_err;
 }
@@ -1001,12 +1052,15 @@ enter_systemd_cgroup_scope (runtime_spec_schema_config_linux_resources *resource
                             pid_t pid, libcrun_error_t *err)
 {
   sd_bus *bus = NULL;
+  sd_bus_slot *slot = NULL;
   sd_bus_message *m = NULL;
   sd_bus_message *reply = NULL;
   int sd_err, ret = 0;
   sd_bus_error error = SD_BUS_ERROR_NULL;
   const char *object = NULL;
   struct systemd_job_removed_s job_data = {};
+  struct timespec start;
+  int64_t call_us;
   int i;
   const char *boolean_opts[10];
 
@@ -1029,10 +1083,15 @@ enter_systemd_cgroup_scope (runtime_spec_schema_config_linux_resources *resource
   if (UNLIKELY (ret < 0))
     goto exit;
 
-  ret = systemd_check_job_status_setup (bus, &job_data, err);
+  ret = systemd_check_job_status_setup (bus, &slot, &job_data, err);
   if (UNLIKELY (ret < 0))
     goto exit;
 
+  /* A failed unit with the same name left by a previous container would
+     make StartTransientUnit fail.  Reset it before the call instead of
+     retrying, the two messages are pipelined on the connection.  */
+  reset_failed_unit (bus, scope);
+
   sd_err = sd_bus_message_new_method_call (bus, &m, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
                                            "org.freedesktop.systemd1.Manager", "StartTransientUnit");
   if (UNLIKELY (sd_err < 0))
@@ -1135,27 +1194,17 @@ enter_systemd_cgroup_scope (runtime_spec_schema_config_linux_resources *resource
       goto exit;
     }
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
   sd_err = sd_bus_call (bus, m, 0, &error, &reply);
   if (UNLIKELY (sd_err < 0))
     {
-      if (reset_failed_unit (bus, scope) == 0)
-        {
-          sd_bus_error_free (&error);
-          if (reply)
-            sd_bus_message_unref (reply);
-
-          error = SD_BUS_ERROR_NULL;
-          reply = NULL;
-
-          sd_err = sd_bus_call (bus, m, 0, &error, &reply);
-        }
-      if (sd_err < 0)
-        {
-          ret = crun_make_error (err, sd_bus_error_get_errno (&error), "sd-bus call: %s", error.message ?: error.name);
-          goto exit;
-        }
+      ret = crun_make_error (err, sd_bus_error_get_errno (&error), "sd-bus call: %s", error.message ?: error.name);
+      goto exit;
     }
 
+  call_us = systemd_elapsed_us (&start);
+
   sd_err = sd_bus_message_read (reply, "o", &object);
   if (UNLIKELY (sd_err < 0))
     {
@@ -1165,7 +1214,12 @@ enter_systemd_cgroup_scope (runtime_spec_schema_config_linux_resources *resource
 
   ret = systemd_check_job_status (bus, &job_data, object, "creating", err);
 
+  libcrun_debug ("systemd: StartTransientUnit `%s` took %" PRId64 " us, job completed after %" PRId64 " us", scope,
+                 call_us, systemd_elapsed_us (&start));
+
 exit:
+  if (slot)
+    sd_bus_slot_unref (slot);
   if (bus)
     sd_bus_unref (bus);
   if (m)
@@ -1181,6 +1235,7 @@ libcrun_destroy_systemd_cgroup_scope (struct libcrun_cgroup_status *cgroup_statu
                                       libcrun_error_t *err)
 {
   sd_bus *bus = NULL;
+  sd_bus_slot *slot = NULL;
   sd_bus_message *m = NULL;
   sd_bus_message *reply = NULL;
   int ret = 0;
@@ -1188,12 +1243,13 @@ libcrun_destroy_systemd_cgroup_scope (struct libcrun_cgroup_status *cgroup_statu
   const char *object;
   const char *scope = cgroup_status->scope;
   struct systemd_job_removed_s job_data = {};
+  struct timespec start;
 
   ret = open_sd_bus_connection (&bus, err);
   if (UNLIKELY (ret < 0))
     goto exit;
 
-  ret = systemd_check_job_status_setup (bus, &job_data, err);
+  ret = systemd_check_job_status_setup (bus, &slot, &job_data, err);
   if (UNLIKELY (ret < 0))
     goto exit;
 
@@ -1212,6 +1268,8 @@ libcrun_destroy_systemd_cgroup_scope (struct libcrun_cgroup_status *cgroup_statu
       goto exit;
     }
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
   ret = sd_bus_call (bus, m, 0, &error, &reply);
   if (UNLIKELY (ret < 0))
     {
@@ -1228,10 +1286,15 @@ libcrun_destroy_systemd_cgroup_scope (struct libcrun_cgroup_status *cgroup_statu
 
   ret = systemd_check_job_status (bus, &job_data, object, "removing", err);
 
+  libcrun_debug ("systemd: StopUnit `%s` completed after %" PRId64 " us", scope, systemd_elapsed_us (&start));
+
   /* In case of a failed unit, call reset-failed so systemd can remove it. */
   reset_failed_unit (bus, scope);
+  sd_bus_flush (bus);
 
 exit:
+  if (slot)
+    sd_bus_slot_unref (slot);
   if (bus)
     sd_bus_unref (bus);
   if (m)
@@ -1356,11 +1419,11 @@ libcrun_update_resources_systemd (struct libcrun_cgroup_status *cgroup_status,
                                   runtime_spec_schema_config_linux_resources *resources,
                                   libcrun_error_t *err)
 {
-  struct systemd_job_removed_s job_data = {};
   sd_bus_error error = SD_BUS_ERROR_NULL;
   sd_bus_message *reply = NULL;
   sd_bus_message *m = NULL;
   sd_bus *bus = NULL;
+  struct timespec start;
   int sd_err, ret;
   int cgroup_mode;
 
@@ -1372,10 +1435,6 @@ libcrun_update_resources_systemd (struct libcrun_cgroup_status *cgroup_status,
   if (UNLIKELY (ret < 0))
     return ret;
 
-  ret = systemd_check_job_status_setup (bus, &job_data, err);
-  if (UNLIKELY (ret < 0))
-    goto exit;
-
   sd_err = sd_bus_message_new_method_call (bus, &m, "org.freedesktop.systemd1",
                                            "/org/freedesktop/systemd1",
                                            "org.freedesktop.systemd1.Manager",
@@ -1411,6 +1470,8 @@ libcrun_update_resources_systemd (struct libcrun_cgroup_status *cgroup_status,
       goto exit;
     }
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
   sd_err = sd_bus_call (bus, m, 0, &error, &reply);
   if (UNLIKELY (sd_err < 0))
     {
@@ -1418,6 +1479,9 @@ libcrun_update_resources_systemd (struct libcrun_cgroup_status *cgroup_status,
       goto exit;
     }
 
+  libcrun_debug ("systemd: SetUnitProperties `%s` took %" PRId64 " us", cgroup_status->scope,
+                 systemd_elapsed_us (&start));
+
   if (cgroup_mode != CGROUP_MODE_UNIFIED)
     {
       ret = setup_rt_runtime (resources, cgroup_status->path, err);
@@ -38,6 +38,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <sys/syscall.h>
 
 struct symlink_s
 {
@@ -237,76 +238,190 @@ libcrun_get_cgroup_mode (libcrun_error_t *err)
   return cgroup_mode;
 }
 
+/* Size of the buffer used both for reading cgroup.procs and for listing
+   the sub-cgroups.  It is allocated once for the whole walk.  */
+#define PIDS_BUFFER_SIZE (64 * 1024)
+
+struct linux_dirent64
+{
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static inline void
+append_pid (pid_t pid, pid_t **pids, size_t *n_pids, size_t *allocated)
+{
+  /* Always keep space for the terminator.  */
+  if (*n_pids + 2 > *allocated)
+    {
+      *allocated = *allocated < 64 ? 64 : *allocated * 2;
+      *pids = xrealloc (*pids, sizeof (pid_t) * *allocated);
+    }
+  (*pids)[(*n_pids)++] = pid;
+}
+
+/* Read the pids from FD in chunks of SIZE bytes.  A number can span two
+   chunks, so the parser state is kept across reads.  */
 static int
-read_pids_cgroup (int dfd, bool recurse, pid_t **pids, size_t *n_pids, size_t *allocated, libcrun_error_t *err)
+read_pids_from_fd (int fd, char *buffer, size_t size, pid_t **pids, size_t *n_pids, size_t *allocated,
+                   libcrun_error_t *err)
 {
-  __attribute__ ((unused)) cleanup_close int clean_dfd = dfd;
-  cleanup_close int tasksfd = -1;
-  cleanup_free char *buffer = NULL;
-  char *saveptr = NULL;
-  size_t n_new_pids;
-  size_t len;
-  char *it;
-  int ret;
+  pid_t value = 0;
+  ssize_t i, len;
 
-  tasksfd = openat (dfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
-  if (tasksfd < 0)
-    return crun_make_error (err, errno, "open `cgroup.procs`");
+  for (;;)
+    {
+      len = TEMP_FAILURE_RETRY (read (fd, buffer, size));
+      /* The cgroup was removed after it was opened.  */
+      if (UNLIKELY (len < 0 && errno == ENODEV))
+        len = 0;
+      if (UNLIKELY (len < 0))
+        return crun_make_error (err, errno, "read `cgroup.procs`");
+      if (len == 0)
+        break;
+
+      for (i = 0; i < len; i++)
+        {
+          char c = buffer[i];
 
-  ret = read_all_fd (tasksfd, "cgroup.procs", &buffer, &len, err);
-  if (UNLIKELY (ret < 0))
-    return ret;
+          if (c >= '0' && c <= '9')
+            value = value * 10 + (c - '0');
+          else
+            {
+              if (value > 0)
+                append_pid (value, pids, n_pids, allocated);
+              value = 0;
+            }
+        }
+    }
+  if (value > 0)
+    append_pid (value, pids, n_pids, allocated);
 
-  if (len == 0)
-    return 0;
+  return 0;
+}
 
-  for (n_new_pids = 0, it = buffer; it; it = strchr (it + 1, '\n'))
-    n_new_pids++;
+struct pids_walk_s
+{
+  char **stack;
+  size_t n_stack;
+  size_t allocated;
+};
 
-  if (*allocated < *n_pids + n_new_pids + 1)
+static void
+pids_walk_push (struct pids_walk_s *walk, char *path)
+{
+  if (walk->n_stack == walk->allocated)
     {
-      *allocated = *n_pids + n_new_pids + 1;
-      *pids = xrealloc (*pids, sizeof (pid_t) * *allocated);
+      walk->allocated = walk->allocated ? walk->allocated * 2 : 16;
+      walk->stack = xrealloc (walk->stack, sizeof (char *) * walk->allocated);
     }
+  walk->stack[walk->n_stack++] = path;
+}
 
-  for (it = strtok_r (buffer, "\n", &saveptr); it; it = strtok_r (NULL, "\n", &saveptr))
-    {
-      pid_t pid = strtoul (it, NULL, 10);
+static void
+cleanup_pids_walkp (struct pids_walk_s *walk)
+{
+  size_t i;
 
-      if (pid > 0)
-        (*pids)[(*n_pids)++] = pid;
-    }
-  (*pids)[*n_pids] = 0;
+  for (i = 0; i < walk->n_stack; i++)
+    free (walk->stack[i]);
+  free (walk->stack);
+}
+#define cleanup_pids_walk __attribute__ ((cleanup (cleanup_pids_walkp)))
 
-  if (recurse)
+/* Push all the sub-cgroups of CGROUPFD, found at PATH relative to the
+   root of the walk.  */
+static int
+push_sub_cgroups (struct pids_walk_s *walk, int cgroupfd, const char *path, char *buffer, size_t size,
+                  libcrun_error_t *err)
+{
+  for (;;)
     {
-      cleanup_dir DIR *dir = NULL;
-      struct dirent *de;
+      long nread, pos;
 
-      dir = fdopendir (dfd);
-      if (UNLIKELY (dir == NULL))
-        return crun_make_error (err, errno, "open cgroup sub-directory");
-      /* Now dir owns the dfd descriptor.  */
-      clean_dfd = -1;
+      nread = syscall (SYS_getdents64, cgroupfd, buffer, size);
+      if (UNLIKELY (nread < 0))
+        return crun_make_error (err, errno, "getdents64 `%s`", path);
+      if (nread == 0)
+        return 0;
 
-      for (de = readdir (dir); de; de = readdir (dir))
+      for (pos = 0; pos < nread;)
         {
-          int nfd;
+          struct linux_dirent64 *de = (struct linux_dirent64 *) (buffer + pos);
+          const char *name = de->d_name;
+          char *child;
 
-          if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
-            continue;
+          pos += de->d_reclen;
 
           if (de->d_type != DT_DIR)
             continue;
+          if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
 
-          nfd = openat (dirfd (dir), de->d_name, O_DIRECTORY | O_CLOEXEC);
-          if (UNLIKELY (nfd < 0))
-            return crun_make_error (err, errno, "open cgroup directory `%s`", de->d_name);
-          ret = read_pids_cgroup (nfd, recurse, pids, n_pids, allocated, err);
-          if (UNLIKELY (ret < 0))
-            return ret;
+          xasprintf (&child, "%s/%s", path, name);
+          pids_walk_push (walk, child);
+        }
+    }
+}
+
+/* Read the pids in the cgroup DFD and, if RECURSE is set, in all its
+   sub-cgroups.  The tree is walked iteratively and the sub-cgroups are
+   opened relative to DFD, so only a couple of fds are open at any time.
+   It takes ownership of DFD.  */
+static int
+read_pids_cgroup (int dfd, bool recurse, pid_t **pids, size_t *n_pids, size_t *allocated, libcrun_error_t *err)
+{
+  cleanup_close int root_dfd = dfd;
+  cleanup_free char *buffer = NULL;
+  cleanup_pids_walk struct pids_walk_s walk = {};
+  int ret;
+
+  buffer = xmalloc (PIDS_BUFFER_SIZE);
+
+  pids_walk_push (&walk, xstrdup ("."));
+
+  while (walk.n_stack > 0)
+    {
+      cleanup_free char *path = walk.stack[--walk.n_stack];
+      cleanup_close int cgroupfd = -1;
+      cleanup_close int procsfd = -1;
+
+      cgroupfd = openat (root_dfd, path, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+      if (UNLIKELY (cgroupfd < 0))
+        {
+          /* The sub-cgroup was removed while walking the tree.  */
+          if (errno == ENOENT && strcmp (path, ".") != 0)
+            continue;
+          return crun_make_error (err, errno, "open cgroup directory `%s`", path);
+        }
+
+      procsfd = openat (cgroupfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+      if (UNLIKELY (procsfd < 0))
+        {
+          /* The cgroup is being removed, it has no processes.  */
+          if (errno == ENOENT || errno == ENODEV)
+            continue;
+          return crun_make_error (err, errno, "open `cgroup.procs`");
         }
+
+      ret = read_pids_from_fd (procsfd, buffer, PIDS_BUFFER_SIZE, pids, n_pids, allocated, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      if (! recurse)
+        break;
+
+      ret = push_sub_cgroups (&walk, cgroupfd, path, buffer, PIDS_BUFFER_SIZE, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
     }
+
+  if (*pids)
+    (*pids)[*n_pids] = 0;
+
   return 0;
 }
 
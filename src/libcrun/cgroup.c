@@ -41,6 +41,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <sys/inotify.h>
 
 static int
 libcrun_cgroup_enter_disabled (struct libcrun_cgroup_args *args arg_unused, struct libcrun_cgroup_status *out, libcrun_error_t *err arg_unused)
@@ -552,6 +553,226 @@ libcrun_cgroup_has_oom (struct libcrun_cgroup_status *status, libcrun_error_t *e
   return 0;
 }
 
+static const char *memory_events_names[] = { "low", "high", "max", "oom", "oom_kill" };
+
+struct libcrun_cgroup_events_watch_s
+{
+  int inotify_fd;
+  int memory_events_fd;
+  int cgroup_events_fd;
+  uint64_t memory_events[sizeof (memory_events_names) / sizeof (memory_events_names[0])];
+  int populated;
+};
+
+void
+libcrun_cgroup_events_watch_free (struct libcrun_cgroup_events_watch_s *watch)
+{
+  if (watch == NULL)
+    return;
+
+  if (watch->inotify_fd >= 0)
+    close (watch->inotify_fd);
+  if (watch->memory_events_fd >= 0)
+    close (watch->memory_events_fd);
+  if (watch->cgroup_events_fd >= 0)
+    close (watch->cgroup_events_fd);
+  free (watch);
+}
+
+static int
+add_cgroup_events_watch (int inotify_fd, const char *cgroup_path, const char *name, int *fd, libcrun_error_t *err)
+{
+  cleanup_free char *path = NULL;
+  int ret;
+
+  ret = append_paths (&path, err, CGROUP_ROOT, cgroup_path, name, NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  *fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (UNLIKELY (*fd < 0))
+    {
+      /* The memory controller might not be enabled.  */
+      if (errno == ENOENT)
+        return 0;
+      return crun_make_error (err, errno, "open `%s`", path);
+    }
+
+  /* The kernel generates a modify event every time the file changes.  */
+  ret = inotify_add_watch (inotify_fd, path, IN_MODIFY);
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "inotify_add_watch `%s`", path);
+
+  return 0;
+}
+
+/* Parse a "KEY VALUE" line from a cgroup events file.  */
+static bool
+parse_cgroup_events_line (const char *line, const char *name, uint64_t *value)
+{
+  size_t len = strlen (name);
+
+  if (strncmp (line, name, len) != 0 || line[len] != ' ')
+    return false;
+
+  *value = strtoull (line + len + 1, NULL, 10);
+  return true;
+}
+
+static char *
+next_line (char *it)
+{
+  it = strchr (it, '\n');
+  return (it && it[1]) ? it + 1 : NULL;
+}
+
+static int
+read_cgroup_events (int fd, char *buffer, size_t size, libcrun_error_t *err)
+{
+  ssize_t ret;
+
+  ret = TEMP_FAILURE_RETRY (pread (fd, buffer, size - 1, 0));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "read cgroup events");
+
+  buffer[ret] = '\0';
+  return 0;
+}
+
+static int
+refresh_cgroup_events (struct libcrun_cgroup_events_watch_s *watch, libcrun_cgroup_event_cb cb, void *arg,
+                       libcrun_error_t *err)
+{
+  char buffer[512];
+  char *it;
+  int ret;
+
+  if (watch->memory_events_fd >= 0)
+    {
+      ret = read_cgroup_events (watch->memory_events_fd, buffer, sizeof (buffer), err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      for (it = buffer; it && *it; it = next_line (it))
+        {
+          size_t i;
+
+          for (i = 0; i < sizeof (memory_events_names) / sizeof (memory_events_names[0]); i++)
+            {
+              uint64_t value;
+
+              if (! parse_cgroup_events_line (it, memory_events_names[i], &value))
+                continue;
+
+              if (value > watch->memory_events[i] && cb)
+                cb (memory_events_names[i], value, arg);
+              watch->memory_events[i] = value;
+              break;
+            }
+        }
+    }
+
+  if (watch->cgroup_events_fd >= 0)
+    {
+      ret = read_cgroup_events (watch->cgroup_events_fd, buffer, sizeof (buffer), err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      for (it = buffer; it && *it; it = next_line (it))
+        {
+          uint64_t value;
+
+          if (! parse_cgroup_events_line (it, "populated", &value))
+            continue;
+
+          if ((int) value != watch->populated && cb)
+            cb ("populated", value, arg);
+          watch->populated = (int) value;
+          break;
+        }
+    }
+
+  return 0;
+}
+
+int
+libcrun_cgroup_events_watch_open (struct libcrun_cgroup_status *status, struct libcrun_cgroup_events_watch_s **out,
+                                  libcrun_error_t *err)
+{
+  struct libcrun_cgroup_events_watch_s *watch;
+  int cgroup_mode;
+  int ret;
+
+  *out = NULL;
+
+  if (status == NULL || is_empty_string (status->path))
+    return 0;
+
+  cgroup_mode = libcrun_get_cgroup_mode (err);
+  if (UNLIKELY (cgroup_mode < 0))
+    return cgroup_mode;
+
+  /* Only cgroup v2 notifies changes to the events files.  */
+  if (cgroup_mode != CGROUP_MODE_UNIFIED)
+    return 0;
+
+  watch = xmalloc0 (sizeof (*watch));
+  watch->memory_events_fd = -1;
+  watch->cgroup_events_fd = -1;
+  watch->populated = 1;
+
+  watch->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (UNLIKELY (watch->inotify_fd < 0))
+    {
+      ret = crun_make_error (err, errno, "inotify_init1");
+      goto fail;
+    }
+
+  ret = add_cgroup_events_watch (watch->inotify_fd, status->path, "memory.events", &watch->memory_events_fd, err);
+  if (UNLIKELY (ret < 0))
+    goto fail;
+
+  ret = add_cgroup_events_watch (watch->inotify_fd, status->path, "cgroup.events", &watch->cgroup_events_fd, err);
+  if (UNLIKELY (ret < 0))
+    goto fail;
+
+  /* Record the initial values, only the changes are notified.  */
+  ret = refresh_cgroup_events (watch, NULL, NULL, err);
+  if (UNLIKELY (ret < 0))
+    goto fail;
+
+  *out = watch;
+  return 0;
+
+fail:
+  libcrun_cgroup_events_watch_free (watch);
+  return ret;
+}
+
+int
+libcrun_cgroup_events_watch_get_fd (struct libcrun_cgroup_events_watch_s *watch)
+{
+  return watch ? watch->inotify_fd : -1;
+}
+
+int
+libcrun_cgroup_events_watch_process (struct libcrun_cgroup_events_watch_s *watch, libcrun_cgroup_event_cb cb,
+                                     void *arg, libcrun_error_t *err)
+{
+  char buffer[sizeof (struct inotify_event) * 16];
+  ssize_t ret;
+
+  /* Drain the pending notifications, the files are read only once.  */
+  do
+    ret = read (watch->inotify_fd, buffer, sizeof (buffer));
+  while (ret > 0 || (ret < 0 && errno == EINTR));
+
+  if (UNLIKELY (ret < 0 && errno != EAGAIN))
+    return crun_make_error (err, errno, "read from inotify");
+
+  return refresh_cgroup_events (watch, cb, arg, err);
+}
+
 int
 libcrun_cgroup_get_status (struct libcrun_cgroup_status *cgroup_status,
                            libcrun_container_status_t *status,
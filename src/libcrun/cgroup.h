@@ -86,6 +86,30 @@ int libcrun_cgroup_killall (struct libcrun_cgroup_status *cgroup_status, int sig
 
 int libcrun_cgroup_has_oom (struct libcrun_cgroup_status *status, libcrun_error_t *err);
 
+/* Watch memory.events and cgroup.events for changes.  CB is called with
+   the name of each memory.events counter that increased, or with
+   "populated" when the cgroup becomes empty or populated.  */
+struct libcrun_cgroup_events_watch_s;
+
+typedef void (*libcrun_cgroup_event_cb) (const char *event, uint64_t value, void *arg);
+
+int libcrun_cgroup_events_watch_open (struct libcrun_cgroup_status *status,
+                                      struct libcrun_cgroup_events_watch_s **watch, libcrun_error_t *err);
+
+int libcrun_cgroup_events_watch_get_fd (struct libcrun_cgroup_events_watch_s *watch);
+
+int libcrun_cgroup_events_watch_process (struct libcrun_cgroup_events_watch_s *watch, libcrun_cgroup_event_cb cb,
+                                         void *arg, libcrun_error_t *err);
+
+void libcrun_cgroup_events_watch_free (struct libcrun_cgroup_events_watch_s *watch);
+
+static inline void
+cgroup_events_watch_freep (struct libcrun_cgroup_events_watch_s **p)
+{
+  libcrun_cgroup_events_watch_free (*p);
+}
+#define cleanup_cgroup_events_watch __attribute__ ((cleanup (cgroup_events_watch_freep)))
+
 int libcrun_cgroup_read_pids (struct libcrun_cgroup_status *status, bool recurse, pid_t **pids, libcrun_error_t *err);
 
 int libcrun_update_cgroup_resources (struct libcrun_cgroup_status *status,
@@ -43,11 +43,13 @@
 #include "linux.h"
 #include "terminal.h"
 #include "io_priority.h"
+#include "userns-cache.h"
 #include "cgroup.h"
 #include "cgroup-utils.h"
 #include <sys/prctl.h>
 #include <sys/signalfd.h>
 #include <sys/epoll.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 #ifdef HAVE_CAP
 #  include <sys/capability.h>
@@ -520,8 +522,45 @@ sync_socket_send_sync (int fd, bool flush_errors, libcrun_error_t *err)
   return 0;
 }
 
+/* Configuration files parsed by this process.  */
+static size_t config_parsed_files;
+static size_t config_parsed_bytes;
+
+void
+libcrun_get_config_parse_stats (size_t *parsed_files, size_t *parsed_bytes)
+{
+  if (parsed_files)
+    *parsed_files = config_parsed_files;
+  if (parsed_bytes)
+    *parsed_bytes = config_parsed_bytes;
+}
+
+static runtime_spec_schema_config_schema *
+parse_config (const char *json, size_t len, const char *path, libcrun_error_t *err)
+{
+  runtime_spec_schema_config_schema *container_def;
+  cleanup_free char *oci_error = NULL;
+
+  container_def = runtime_spec_schema_config_schema_parse_data (json, NULL, &oci_error);
+  if (container_def == NULL)
+    {
+      if (path)
+        crun_make_error (err, 0, "load `%s`: %s", path, oci_error);
+      else
+        crun_make_error (err, 0, "load: `%s`", oci_error);
+      return NULL;
+    }
+
+  config_parsed_files++;
+  config_parsed_bytes += len;
+  libcrun_debug ("parsed %zu bytes of configuration from `%s` (%zu bytes in %zu files so far)", len,
+                 path ? path : "memory", config_parsed_bytes, config_parsed_files);
+
+  return container_def;
+}
+
 static libcrun_container_t *
-make_container (runtime_spec_schema_config_schema *container_def, const char *path, const char *config)
+make_container (runtime_spec_schema_config_schema *container_def, const char *path, char *config, size_t config_len)
 {
   libcrun_container_t *container = xmalloc0 (sizeof (*container));
   container->container_def = container_def;
@@ -531,8 +570,10 @@ make_container (runtime_spec_schema_config_schema *container_def, const char *pa
 
   if (path)
     container->config_file = xstrdup (path);
-  if (config)
-    container->config_file_content = xstrdup (config);
+
+  /* Take ownership of the buffer.  */
+  container->config_file_content = config;
+  container->config_file_content_len = config_len;
 
   return container;
 }
@@ -541,28 +582,46 @@ libcrun_container_t *
 libcrun_container_load_from_memory (const char *json, libcrun_error_t *err)
 {
   runtime_spec_schema_config_schema *container_def;
-  cleanup_free char *oci_error = NULL;
-  container_def = runtime_spec_schema_config_schema_parse_data (json, NULL, &oci_error);
+  size_t len = strlen (json);
+
+  container_def = parse_config (json, len, NULL, err);
   if (container_def == NULL)
-    {
-      crun_make_error (err, 0, "load: `%s`", oci_error);
-      return NULL;
-    }
-  return make_container (container_def, NULL, json);
+    return NULL;
+
+  return make_container (container_def, NULL, xstrdup (json), len);
 }
 
 libcrun_container_t *
 libcrun_container_load_from_file (const char *path, libcrun_error_t *err)
 {
   runtime_spec_schema_config_schema *container_def;
-  cleanup_free char *oci_error = NULL;
-  container_def = runtime_spec_schema_config_schema_parse_file (path, NULL, &oci_error);
-  if (container_def == NULL)
+  libcrun_container_t *container;
+  cleanup_free char *buffer = NULL;
+  cleanup_close int fd = -1;
+  size_t len;
+  int ret;
+
+  /* Read the file only once: the same buffer is parsed and later
+     used for the copy in the state directory.  */
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (UNLIKELY (fd < 0))
     {
-      crun_make_error (err, 0, "load `%s`: %s", path, oci_error);
+      crun_make_error (err, errno, "load `%s`: open", path);
       return NULL;
     }
-  return make_container (container_def, path, NULL);
+
+  ret = read_all_fd (fd, path, &buffer, &len, err);
+  if (UNLIKELY (ret < 0))
+    return NULL;
+
+  container_def = parse_config (buffer, len, path, err);
+  if (container_def == NULL)
+    return NULL;
+
+  container = make_container (container_def, path, buffer, len);
+  buffer = NULL;
+
+  return container;
 }
 
 void
@@ -1578,15 +1637,139 @@ read_container_config_from_state (libcrun_container_t **container, const char *s
   return 0;
 }
 
+static bool
+has_new_pid_namespace (runtime_spec_schema_config_schema *def)
+{
+  size_t i;
+
+  if (def->linux == NULL || def->linux->namespaces == NULL)
+    return false;
+
+  for (i = 0; i < def->linux->namespaces_len; i++)
+    {
+      if (strcmp (def->linux->namespaces[i]->type, "pid") == 0 && def->linux->namespaces[i]->path == NULL)
+        return true;
+    }
+  return false;
+}
+
+/* Pre-parsed summary of the configuration, written to the state
+   directory next to config.json at create time.  It holds what `delete`
+   needs, so that it does not parse config.json.  It is used only if it
+   was written by the same crun version and config.json did not change
+   since, otherwise config.json is parsed as before.  */
+#define CONFIG_SUMMARY_FILE "config.summary"
+#define CONFIG_SUMMARY_MAGIC 0x6372756e
+#define CONFIG_SUMMARY_FORMAT 1
+
+enum
+{
+  CONFIG_SUMMARY_POSTSTOP_HOOKS = (1 << 0),
+  CONFIG_SUMMARY_NEW_PID_NS = (1 << 1),
+};
+
+struct config_summary_s
+{
+  uint32_t magic;
+  uint32_t format;
+  char version[32];
+  uint64_t config_ino;
+  uint64_t config_size;
+  int64_t config_mtime_sec;
+  int64_t config_mtime_nsec;
+  uint32_t flags;
+};
+
+static void
+fill_config_summary (struct config_summary_s *summary, const struct stat *st)
+{
+  memset (summary, 0, sizeof (*summary));
+  summary->magic = CONFIG_SUMMARY_MAGIC;
+  summary->format = CONFIG_SUMMARY_FORMAT;
+  strncpy (summary->version, PACKAGE_VERSION, sizeof (summary->version) - 1);
+  summary->config_ino = st->st_ino;
+  summary->config_size = st->st_size;
+  summary->config_mtime_sec = st->st_mtim.tv_sec;
+  summary->config_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int
+write_config_summary (const char *dir, runtime_spec_schema_config_schema *def, libcrun_error_t *err)
+{
+  struct config_summary_s summary;
+  cleanup_close int dfd = -1;
+  struct stat st;
+  int ret;
+
+  dfd = open (dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+  if (UNLIKELY (dfd < 0))
+    return crun_make_error (err, errno, "open `%s`", dir);
+
+  ret = fstatat (dfd, "config.json", &st, 0);
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "stat `%s/config.json`", dir);
+
+  fill_config_summary (&summary, &st);
+  if (def->hooks && def->hooks->poststop_len)
+    summary.flags |= CONFIG_SUMMARY_POSTSTOP_HOOKS;
+  if (has_new_pid_namespace (def))
+    summary.flags |= CONFIG_SUMMARY_NEW_PID_NS;
+
+  return write_file_at (dfd, CONFIG_SUMMARY_FILE, &summary, sizeof (summary), err);
+}
+
+/* Read the summary of the configuration of the container ID.  Returns 1
+   if it is valid, 0 if config.json must be parsed instead.  */
+static int
+read_config_summary (const char *state_root, const char *id, struct config_summary_s *summary)
+{
+  struct config_summary_s expected;
+  cleanup_free char *dir = NULL;
+  cleanup_close int dfd = -1;
+  cleanup_close int fd = -1;
+  struct stat st;
+  ssize_t r;
+
+  dir = libcrun_get_state_directory (state_root, id);
+  if (UNLIKELY (dir == NULL))
+    return 0;
+
+  dfd = open (dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+  if (UNLIKELY (dfd < 0))
+    return 0;
+
+  fd = openat (dfd, CONFIG_SUMMARY_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  r = TEMP_FAILURE_RETRY (read (fd, summary, sizeof (*summary)));
+  if (r != sizeof (*summary))
+    return 0;
+
+  if (fstatat (dfd, "config.json", &st, 0) < 0)
+    return 0;
+
+  /* Everything but the flags must match the current config.json.  */
+  fill_config_summary (&expected, &st);
+  expected.flags = summary->flags;
+  return memcmp (&expected, summary, sizeof (expected)) == 0 ? 1 : 0;
+}
+
 static int
 run_poststop_hooks (libcrun_context_t *context, libcrun_container_t *container, runtime_spec_schema_config_schema *def,
                     libcrun_container_status_t *status, const char *state_root, const char *id, libcrun_error_t *err)
 {
   cleanup_container libcrun_container_t *container_cleanup = NULL;
+  struct config_summary_s summary;
   int ret;
 
   if (def == NULL)
     {
+      /* Do not parse the configuration only to find out there are no hooks.  */
+      if (container == NULL && read_config_summary (state_root, id, &summary) > 0
+          && ! (summary.flags & CONFIG_SUMMARY_POSTSTOP_HOOKS))
+        return 0;
+
       if (container == NULL)
         {
           ret = read_container_config_from_state (&container_cleanup, state_root, id, err);
@@ -1623,22 +1806,6 @@ run_poststop_hooks (libcrun_context_t *context, libcrun_container_t *container,
   return 0;
 }
 
-static bool
-has_new_pid_namespace (runtime_spec_schema_config_schema *def)
-{
-  size_t i;
-
-  if (def->linux == NULL || def->linux->namespaces == NULL)
-    return false;
-
-  for (i = 0; i < def->linux->namespaces_len; i++)
-    {
-      if (strcmp (def->linux->namespaces[i]->type, "pid") == 0 && def->linux->namespaces[i]->path == NULL)
-        return true;
-    }
-  return false;
-}
-
 static int
 container_delete_internal (libcrun_context_t *context, runtime_spec_schema_config_schema *def,
                            const char *id, bool force, bool killall, libcrun_error_t *err)
@@ -1647,8 +1814,20 @@ container_delete_internal (libcrun_context_t *context, runtime_spec_schema_confi
   cleanup_container_status libcrun_container_status_t status = {};
   cleanup_container libcrun_container_t *container = NULL;
   const char *state_root = context->state_root;
+  struct config_summary_s summary;
+  cleanup_close int lockfd = -1;
   int ret;
 
+  /* Serialize with other commands on the same container.  If the state
+     directory does not exist, the code below reports it.  */
+  lockfd = libcrun_status_lock_container (state_root, id, err);
+  if (UNLIKELY (lockfd < 0))
+    {
+      if (crun_error_get_errno (err) != ENOENT)
+        return lockfd;
+      crun_error_release (err);
+    }
+
   ret = libcrun_read_container_status (&status, state_root, id, err);
   if (UNLIKELY (ret < 0))
     {
@@ -1686,19 +1865,26 @@ container_delete_internal (libcrun_context_t *context, runtime_spec_schema_confi
 
   if (killall && force)
     {
-      if (def == NULL)
+      bool new_pid_ns;
+
+      if (def)
+        new_pid_ns = has_new_pid_namespace (def);
+      else if (read_config_summary (state_root, id, &summary) > 0)
+        new_pid_ns = summary.flags & CONFIG_SUMMARY_NEW_PID_NS;
+      else
         {
           ret = read_container_config_from_state (&container, state_root, id, err);
           if (UNLIKELY (ret < 0))
             return ret;
 
           def = container->container_def;
+          new_pid_ns = has_new_pid_namespace (def);
         }
 
       /* If the container has a pid namespace, it is enough to kill the first
          process (pid=1 in the namespace).
       */
-      if (has_new_pid_namespace (def))
+      if (new_pid_ns)
         {
           ret = libcrun_kill_linux (&status, SIGKILL, err);
           if (UNLIKELY (ret < 0))
@@ -1749,6 +1935,22 @@ libcrun_container_delete (libcrun_context_t *context, runtime_spec_schema_config
   return container_delete_internal (context, def, id, force, true, err);
 }
 
+/* Drop the caches kept under the state root: the user namespaces
+   stored with run.oci.userns_cache=1 and the devices template used with
+   run.oci.devices_template=1.  Containers that are still using them are
+   not affected.  */
+int
+libcrun_container_purge_caches (libcrun_context_t *context, libcrun_error_t *err)
+{
+  int ret;
+
+  ret = libcrun_userns_cache_purge (context->state_root, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  return libcrun_purge_devices_template (context->state_root, err);
+}
+
 int
 libcrun_container_kill (libcrun_context_t *context, const char *id, const char *signal, libcrun_error_t *err)
 {
@@ -1922,8 +2124,92 @@ struct wait_for_process_args
   int *container_ready_fd;
   int seccomp_notify_fd;
   const char *seccomp_notify_plugins;
+  libcrun_container_t *container;
+  struct libcrun_cgroup_status *cgroup_status;
+};
+
+struct cgroup_events_receiver_s
+{
+  const char *id;
+  int fd;
 };
 
+/* Deliver a cgroup event either to the log or, as a JSON line, to the
+   socket configured with run.oci.cgroup_events.  A failure to deliver
+   the event must not affect the container.  */
+static void
+notify_cgroup_event (const char *event, uint64_t value, void *arg)
+{
+  struct cgroup_events_receiver_s *receiver = arg;
+  const unsigned char *buf = NULL;
+  yajl_gen gen = NULL;
+  size_t len;
+
+  if (receiver->fd < 0)
+    {
+      libcrun_log_event ("container `%s`: cgroup event `%s` (%" PRIu64 ")", receiver->id, event, value);
+      return;
+    }
+
+  gen = yajl_gen_alloc (NULL);
+  if (gen == NULL)
+    return;
+
+  yajl_gen_map_open (gen);
+  yajl_gen_string (gen, YAJL_STR ("id"), strlen ("id"));
+  yajl_gen_string (gen, YAJL_STR (receiver->id), strlen (receiver->id));
+  yajl_gen_string (gen, YAJL_STR ("event"), strlen ("event"));
+  yajl_gen_string (gen, YAJL_STR (event), strlen (event));
+  yajl_gen_string (gen, YAJL_STR ("value"), strlen ("value"));
+  yajl_gen_integer (gen, value);
+  yajl_gen_map_close (gen);
+
+  if (yajl_gen_get_buf (gen, &buf, &len) == yajl_gen_status_ok)
+    {
+      TEMP_FAILURE_RETRY (write (receiver->fd, buf, len));
+      TEMP_FAILURE_RETRY (write (receiver->fd, "\n", 1));
+    }
+
+  yajl_gen_free (gen);
+}
+
+static int
+setup_cgroup_events_watch (struct wait_for_process_args *args, struct libcrun_cgroup_events_watch_s **watch,
+                           struct cgroup_events_receiver_s *receiver, libcrun_error_t *err)
+{
+  const char *annotation;
+  int ret;
+
+  if (args->container == NULL || args->cgroup_status == NULL)
+    return 0;
+
+  annotation = find_annotation (args->container, "run.oci.cgroup_events");
+  if (annotation == NULL)
+    return 0;
+
+  if (strcmp (annotation, "log") != 0)
+    {
+      if (annotation[0] != '/')
+        return crun_make_error (err, 0, "the cgroup events receiver `%s` is not an absolute path", annotation);
+
+      receiver->fd = open_unix_domain_client_socket (annotation, 0, err);
+      if (UNLIKELY (receiver->fd < 0))
+        return crun_error_wrap (err, "open cgroup events receiver");
+    }
+
+  ret = libcrun_cgroup_events_watch_open (args->cgroup_status, watch, err);
+  if (UNLIKELY (ret < 0))
+    {
+      close_and_reset (&receiver->fd);
+      return ret;
+    }
+
+  if (*watch == NULL)
+    libcrun_warning ("cgroup events are supported only on cgroup v2");
+
+  return 0;
+}
+
 static int
 wait_for_process (struct wait_for_process_args *args, libcrun_error_t *err)
 {
@@ -1936,6 +2222,10 @@ wait_for_process (struct wait_for_process_args *args, libcrun_error_t *err)
   int levelfds_len = 0;
   int fds_len = 0;
   cleanup_seccomp_notify_context struct seccomp_notify_context_s *seccomp_notify_ctx = NULL;
+  cleanup_cgroup_events_watch struct libcrun_cgroup_events_watch_s *events_watch = NULL;
+  cleanup_close int events_receiver_fd = -1;
+  struct cgroup_events_receiver_s events_receiver = { .fd = -1 };
+  int events_fd = -1;
 
   container_exit_code = 0;
 
@@ -2013,6 +2303,16 @@ wait_for_process (struct wait_for_process_args *args, libcrun_error_t *err)
       fds[fds_len++] = args->seccomp_notify_fd;
     }
 
+  ret = setup_cgroup_events_watch (args, &events_watch, &events_receiver, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+  events_receiver.id = args->context->id;
+  events_receiver_fd = events_receiver.fd;
+
+  events_fd = libcrun_cgroup_events_watch_get_fd (events_watch);
+  if (events_fd >= 0)
+    fds[fds_len++] = events_fd;
+
   fds[fds_len++] = signalfd;
   if (args->notify_socket >= 0)
     fds[fds_len++] = args->notify_socket;
@@ -2069,6 +2369,17 @@ wait_for_process (struct wait_for_process_args *args, libcrun_error_t *err)
               if (UNLIKELY (ret < 0))
                 return crun_error_wrap (err, "set terminal fd blocking");
             }
+          else if (events[i].data.fd == events_fd)
+            {
+              ret = libcrun_cgroup_events_watch_process (events_watch, notify_cgroup_event, &events_receiver, err);
+              if (UNLIKELY (ret < 0))
+                {
+                  /* The cgroup might be gone already, stop watching it.  */
+                  crun_error_release (err);
+                  epoll_ctl (epollfd, EPOLL_CTL_DEL, events_fd, NULL);
+                  events_fd = -1;
+                }
+            }
           else if (events[i].data.fd == args->notify_socket)
             {
               ret = handle_notify_socket (args->notify_socket, err);
@@ -2620,6 +2931,8 @@ libcrun_container_run_internal (libcrun_container_t *container, libcrun_context_
       .container_ready_fd = container_ready_fd,
       .seccomp_notify_fd = seccomp_notify_fd,
       .seccomp_notify_plugins = seccomp_notify_plugins,
+      .container = container,
+      .cgroup_status = cgroup_status,
     };
     ret = wait_for_process (&args, err);
   }
@@ -2665,8 +2978,6 @@ libcrun_copy_config_file (const char *id, const char *state_root, libcrun_contai
   int ret;
   cleanup_free char *dest_path = NULL;
   cleanup_free char *dir = NULL;
-  cleanup_free char *buffer = NULL;
-  size_t len;
 
   dir = libcrun_get_state_directory (state_root, id);
   if (UNLIKELY (dir == NULL))
@@ -2676,25 +2987,19 @@ libcrun_copy_config_file (const char *id, const char *state_root, libcrun_contai
   if (UNLIKELY (ret < 0))
     return ret;
 
-  if (container->config_file == NULL && container->config_file_content == NULL)
+  if (container->config_file_content == NULL)
     return crun_make_error (err, 0, "config file not specified");
 
-  if (container->config_file == NULL)
-    {
-      ret = write_file (dest_path, container->config_file_content, strlen (container->config_file_content), err);
-      if (UNLIKELY (ret < 0))
-        return ret;
-    }
-  else
-    {
-      ret = read_all_file (container->config_file, &buffer, &len, err);
-      if (UNLIKELY (ret < 0))
-        return ret;
+  /* Write the buffer that was parsed, without reading the file again:
+     the file could have been modified in the meanwhile.  */
+  ret = write_file (dest_path, container->config_file_content, container->config_file_content_len, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
 
-      ret = write_file (dest_path, buffer, len, err);
-      if (UNLIKELY (ret < 0))
-        return ret;
-    }
+  /* The summary is only an optimization, config.json is the reference.  */
+  ret = write_config_summary (dir, container->container_def, err);
+  if (UNLIKELY (ret < 0))
+    crun_error_release (err);
 
   return 0;
 }
@@ -4247,6 +4552,116 @@ libcrun_container_read_pids (libcrun_context_t *context, const char *id, bool re
   return libcrun_cgroup_read_pids (cgroup_status, recurse, pids, err);
 }
 
+static inline const char *
+parse_stat_u64 (const char *it, const char *end, uint64_t *value)
+{
+  uint64_t v = 0;
+
+  while (it < end && *it >= '0' && *it <= '9')
+    v = v * 10 + (*it++ - '0');
+
+  *value = v;
+  return it;
+}
+
+int
+libcrun_read_process_stat (pid_t pid, char *buffer, size_t size, libcrun_process_stat_t *st, libcrun_error_t *err)
+{
+  cleanup_close int fd = -1;
+  const char *it, *end, *comm, *comm_end;
+  char path[64];
+  uint64_t value;
+  size_t comm_len;
+  ssize_t len;
+  int field;
+
+  memset (st, 0, sizeof (*st));
+
+  sprintf (path, "/proc/%d/stat", pid);
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (UNLIKELY (fd < 0))
+    {
+      if (errno == ENOENT || errno == ESRCH)
+        return 0;
+      return crun_make_error (err, errno, "open `%s`", path);
+    }
+
+  len = TEMP_FAILURE_RETRY (read (fd, buffer, size));
+  if (UNLIKELY (len < 0))
+    {
+      if (errno == ESRCH)
+        return 0;
+      return crun_make_error (err, errno, "read `%s`", path);
+    }
+
+  end = buffer + len;
+
+  /* The command name can contain any character, so look for the last ')'.  */
+  comm = memchr (buffer, '(', len);
+  comm_end = memrchr (buffer, ')', len);
+  if (UNLIKELY (comm == NULL || comm_end == NULL || comm_end < comm))
+    return crun_make_error (err, 0, "invalid content for `%s`", path);
+
+  comm++;
+  comm_len = comm_end - comm;
+  if (comm_len >= sizeof (st->comm))
+    comm_len = sizeof (st->comm) - 1;
+  memcpy (st->comm, comm, comm_len);
+  st->comm[comm_len] = '\0';
+
+  st->pid = pid;
+
+  for (it = comm_end + 1, field = 3; it < end && field <= 24; field++)
+    {
+      while (it < end && *it == ' ')
+        it++;
+      if (it == end)
+        break;
+
+      switch (field)
+        {
+        case 3:
+          st->state = *it;
+          break;
+
+        case 4:
+          parse_stat_u64 (it, end, &value);
+          st->ppid = (pid_t) value;
+          break;
+
+        case 14:
+          parse_stat_u64 (it, end, &st->utime);
+          break;
+
+        case 15:
+          parse_stat_u64 (it, end, &st->stime);
+          break;
+
+        case 20:
+          parse_stat_u64 (it, end, &st->num_threads);
+          break;
+
+        case 22:
+          parse_stat_u64 (it, end, &st->starttime);
+          break;
+
+        case 23:
+          parse_stat_u64 (it, end, &st->vsize);
+          break;
+
+        case 24:
+          parse_stat_u64 (it, end, &st->rss);
+          break;
+        }
+
+      while (it < end && *it != ' ' && *it != '\n')
+        it++;
+    }
+
+  return 1;
+}
+
 int
 libcrun_write_json_containers_list (libcrun_context_t *context, FILE *out, libcrun_error_t *err)
 {
@@ -91,6 +91,9 @@ struct libcrun_container_s
   void *private_data;
   void (*cleanup_private_data) (void *private_data);
   struct libcrun_context_s *context;
+
+  /* Length of config_file_content.  */
+  size_t config_file_content_len;
 };
 
 struct libcrun_container_status_s;
@@ -187,6 +190,10 @@ struct libcrun_checkpoint_restore_s
   char *parent_path;
   bool pre_dump;
   int manage_cgroups_mode;
+  bool lazy_pages;
+  bool iterative;
+  unsigned int max_iterations;
+  uint64_t converge_pages;
 };
 typedef struct libcrun_checkpoint_restore_s libcrun_checkpoint_restore_t;
 
@@ -196,12 +203,47 @@ LIBCRUN_PUBLIC libcrun_container_t *libcrun_container_load_from_memory (const ch
 
 LIBCRUN_PUBLIC void libcrun_container_free (libcrun_container_t *);
 
+/* Number of configuration files parsed by this process and their total size.  */
+LIBCRUN_PUBLIC void libcrun_get_config_parse_stats (size_t *parsed_files, size_t *parsed_bytes);
+
+/* A configuration whose sections are parsed only when requested.  */
+typedef struct libcrun_lazy_config_s libcrun_lazy_config_t;
+
+LIBCRUN_PUBLIC libcrun_lazy_config_t *libcrun_lazy_config_load_from_file (const char *path, libcrun_error_t *err);
+
+LIBCRUN_PUBLIC libcrun_lazy_config_t *libcrun_lazy_config_load_from_memory (const char *json, libcrun_error_t *err);
+
+LIBCRUN_PUBLIC void libcrun_lazy_config_free (libcrun_lazy_config_t *config);
+
+/* Raw JSON for a top level key, or for a member of "linux" as "linux.NAME".
+   Returns NULL if the key is not present.  */
+LIBCRUN_PUBLIC const char *libcrun_lazy_config_get_raw (libcrun_lazy_config_t *config, const char *name, size_t *len);
+
+/* The getters return 1 and the object owned by CONFIG, or 0 if the
+   section is missing.  */
+LIBCRUN_PUBLIC int libcrun_lazy_config_get_process (libcrun_lazy_config_t *config,
+                                                    runtime_spec_schema_config_schema_process **out,
+                                                    libcrun_error_t *err);
+
+LIBCRUN_PUBLIC int libcrun_lazy_config_get_resources (libcrun_lazy_config_t *config,
+                                                      runtime_spec_schema_config_linux_resources **out,
+                                                      libcrun_error_t *err);
+
+LIBCRUN_PUBLIC int libcrun_lazy_config_get_mounts (libcrun_lazy_config_t *config, runtime_spec_schema_defs_mount ***out,
+                                                   size_t *len, libcrun_error_t *err);
+
+/* Parse the whole configuration.  The container is owned by the caller.  */
+LIBCRUN_PUBLIC libcrun_container_t *libcrun_lazy_config_to_container (libcrun_lazy_config_t *config,
+                                                                      libcrun_error_t *err);
+
 LIBCRUN_PUBLIC int libcrun_container_run (libcrun_context_t *context, libcrun_container_t *container,
                                           unsigned int options, libcrun_error_t *error);
 
 LIBCRUN_PUBLIC int libcrun_container_delete (libcrun_context_t *context, runtime_spec_schema_config_schema *def,
                                              const char *id, bool force, libcrun_error_t *err);
 
+LIBCRUN_PUBLIC int libcrun_container_purge_caches (libcrun_context_t *context, libcrun_error_t *err);
+
 LIBCRUN_PUBLIC int libcrun_container_kill (libcrun_context_t *context, const char *id, const char *signal,
                                            libcrun_error_t *err);
 
@@ -287,8 +329,126 @@ LIBCRUN_PUBLIC int libcrun_container_restore (libcrun_context_t *context, const
 
 LIBCRUN_PUBLIC int libcrun_container_read_pids (libcrun_context_t *context, const char *id, bool recurse, pid_t **pids, libcrun_error_t *err);
 
+/* Fields from /proc/PID/stat.  Times are in clock ticks, rss in pages.  */
+struct libcrun_process_stat_s
+{
+  pid_t pid;
+  pid_t ppid;
+  char state;
+  char comm[64];
+  uint64_t utime;
+  uint64_t stime;
+  uint64_t num_threads;
+  uint64_t starttime;
+  uint64_t vsize;
+  uint64_t rss;
+};
+typedef struct libcrun_process_stat_s libcrun_process_stat_t;
+
+/* Read the stat of PID using BUFFER of SIZE bytes, that can be reused
+   across calls.  Returns 1 on success and 0 if the process exited.  */
+LIBCRUN_PUBLIC int libcrun_read_process_stat (pid_t pid, char *buffer, size_t size, libcrun_process_stat_t *st,
+                                              libcrun_error_t *err);
+
 LIBCRUN_PUBLIC int libcrun_write_json_containers_list (libcrun_context_t *context, FILE *out, libcrun_error_t *err);
 
+/* Resource usage of a container, read from its cgroup v2 files.  VALID
+   has a LIBCRUN_STATS_* bit set for each file that could be read.  */
+enum
+{
+  LIBCRUN_STATS_CPU = (1 << 0),
+  LIBCRUN_STATS_MEMORY = (1 << 1),
+  LIBCRUN_STATS_MEMORY_EVENTS = (1 << 2),
+  LIBCRUN_STATS_IO = (1 << 3),
+  LIBCRUN_STATS_PIDS = (1 << 4),
+};
+
+struct libcrun_container_stats_s
+{
+  uint32_t valid;
+  uint64_t timestamp_ns;
+
+  /* cpu.stat */
+  uint64_t cpu_usage_usec;
+  uint64_t cpu_user_usec;
+  uint64_t cpu_system_usec;
+  uint64_t cpu_nr_periods;
+  uint64_t cpu_nr_throttled;
+  uint64_t cpu_throttled_usec;
+
+  /* memory.stat */
+  uint64_t memory_anon;
+  uint64_t memory_file;
+  uint64_t memory_kernel_stack;
+  uint64_t memory_sock;
+  uint64_t memory_shmem;
+  uint64_t memory_pgfault;
+  uint64_t memory_pgmajfault;
+
+  /* memory.events */
+  uint64_t memory_events_low;
+  uint64_t memory_events_high;
+  uint64_t memory_events_max;
+  uint64_t memory_events_oom;
+  uint64_t memory_events_oom_kill;
+
+  /* io.stat, summed over all the devices */
+  uint64_t io_rbytes;
+  uint64_t io_wbytes;
+  uint64_t io_rios;
+  uint64_t io_wios;
+
+  /* pids.current */
+  uint64_t pids_current;
+};
+typedef struct libcrun_container_stats_s libcrun_container_stats_t;
+
+typedef struct libcrun_stats_reader_s libcrun_stats_reader_t;
+
+/* Open the cgroup files of the container ID.  The files are kept open,
+   so that libcrun_stats_reader_read can be called at an interval without
+   opening them again and without allocating memory.  */
+LIBCRUN_PUBLIC int libcrun_container_stats_open (libcrun_context_t *context, const char *id,
+                                                 libcrun_stats_reader_t **reader, libcrun_error_t *err);
+
+/* Fails with ENODEV once the cgroup of the container was removed.  */
+LIBCRUN_PUBLIC int libcrun_stats_reader_read (libcrun_stats_reader_t *reader, libcrun_container_stats_t *stats,
+                                              libcrun_error_t *err);
+
+/* Format STATS as a single line JSON object.  The returned string is
+   owned by READER and valid until the next call.  */
+LIBCRUN_PUBLIC int libcrun_stats_reader_format_json (libcrun_stats_reader_t *reader,
+                                                     const libcrun_container_stats_t *stats,
+                                                     const char **json, size_t *len, libcrun_error_t *err);
+
+LIBCRUN_PUBLIC void libcrun_stats_reader_free (libcrun_stats_reader_t *reader);
+
+enum
+{
+  LIBCRUN_STATS_FORMAT_JSON = 0,
+  LIBCRUN_STATS_FORMAT_PROMETHEUS,
+};
+
+typedef struct libcrun_stats_table_s libcrun_stats_table_t;
+
+/* Create a table to read the stats of all the containers in the state
+   root of CONTEXT, which must outlive the table.  The cgroup files of
+   each container are opened once and kept open between scrapes.  Up to
+   THREADS threads are used to read them.  */
+LIBCRUN_PUBLIC int libcrun_stats_table_new (libcrun_context_t *context, unsigned int threads,
+                                            libcrun_stats_table_t **table, libcrun_error_t *err);
+
+/* Refresh the list of containers, read all of them and format the
+   result as a single batch in FORMAT.  The returned string is owned by
+   TABLE and valid until the next call.  */
+LIBCRUN_PUBLIC int libcrun_stats_table_scrape (libcrun_stats_table_t *table, int format, const char **out,
+                                               size_t *len, libcrun_error_t *err);
+
+/* Number of containers currently tracked with open cgroup files.  */
+LIBCRUN_PUBLIC size_t libcrun_stats_table_size (libcrun_stats_table_t *table);
+
+LIBCRUN_PUBLIC void libcrun_stats_table_free (libcrun_stats_table_t *table);
+
 // Not part of the public API, just a method in container.c we need to access from linux.c
 void get_root_in_the_userns (runtime_spec_schema_config_schema *def, uid_t host_uid, gid_t host_gid,
                              uid_t *uid, gid_t *gid);
@@ -27,7 +27,9 @@
 #  include <sched.h>
 #  include <sys/stat.h>
 #  include <sys/mount.h>
+#  include <sys/wait.h>
 #  include <fcntl.h>
+#  include <time.h>
 
 #  include "container.h"
 #  include "linux.h"
@@ -40,8 +42,13 @@
 
 #  define CRIU_CHECKPOINT_LOG_FILE "dump.log"
 #  define CRIU_RESTORE_LOG_FILE "restore.log"
+#  define CRIU_LAZY_PAGES_LOG_FILE "lazy-pages.log"
+#  define CRIU_LAZY_PAGES_SOCKET "lazy-pages.socket"
 #  define DESCRIPTORS_FILENAME "descriptors.json"
 
+#  define CRIU_DEFAULT_MAX_ITERATIONS 5
+#  define CRIU_DEFAULT_CONVERGE_PAGES 1024
+
 #  define CRIU_EXT_NETNS "extRootNetNS"
 #  define CRIU_EXT_PIDNS "extRootPidNS"
 
@@ -82,6 +89,7 @@ struct libcriu_wrapper_s
   void (*criu_set_notify_cb) (int (*cb) (char *action, criu_notify_arg_t na));
   void (*criu_set_orphan_pts_master) (bool orphan_pts_master);
   void (*criu_set_images_dir_fd) (int fd);
+  void (*criu_set_lazy_pages) (bool enable);
   int (*criu_set_parent_images) (const char *path);
   void (*criu_set_pid) (int pid);
   int (*criu_set_root) (const char *root);
@@ -156,6 +164,8 @@ load_wrapper (struct libcriu_wrapper_s **wrapper_out, libcrun_error_t *err)
   LOAD_CRIU_FUNCTION (criu_set_file_locks, false);
   LOAD_CRIU_FUNCTION (criu_set_freeze_cgroup, false);
   LOAD_CRIU_FUNCTION (criu_set_images_dir_fd, false);
+  /* Only needed, and checked, with --lazy-pages.  */
+  LOAD_CRIU_FUNCTION (criu_set_lazy_pages, true);
   LOAD_CRIU_FUNCTION (criu_set_leave_running, false);
   LOAD_CRIU_FUNCTION (criu_set_log_file, false);
   LOAD_CRIU_FUNCTION (criu_set_log_level, false);
@@ -382,9 +392,9 @@ checkpoint_cgroup_v1_mount (runtime_spec_schema_config_schema *def, libcrun_erro
   return 0;
 }
 
-int
-libcrun_container_checkpoint_linux_criu (libcrun_container_status_t *status, libcrun_container_t *container,
-                                         libcrun_checkpoint_restore_t *cr_options, libcrun_error_t *err)
+static int
+checkpoint_criu (libcrun_container_status_t *status, libcrun_container_t *container,
+                 libcrun_checkpoint_restore_t *cr_options, libcrun_error_t *err)
 {
   runtime_spec_schema_config_schema *def = container->container_def;
   cleanup_wrapper struct libcriu_wrapper_s *wrapper = NULL;
@@ -650,6 +660,249 @@ libcrun_container_checkpoint_linux_criu (libcrun_container_status_t *status, lib
   return 0;
 }
 
+#  ifdef CRIU_PRE_DUMP_SUPPORT
+
+/* Count the memory pages written by a dump, looking at the size of
+   the pages-*.img files in the images directory.  For a pre-dump with
+   a parent, these are only the pages dirtied since the parent.  */
+static int
+count_dumped_pages (const char *image_path, uint64_t *pages, libcrun_error_t *err)
+{
+  cleanup_dir DIR *dir = NULL;
+  struct dirent *de;
+  uint64_t total = 0;
+  long page_size;
+
+  dir = opendir (image_path);
+  if (UNLIKELY (dir == NULL))
+    return crun_make_error (err, errno, "opendir `%s`", image_path);
+
+  while ((de = readdir (dir)))
+    {
+      struct stat st;
+      size_t len;
+      int ret;
+
+      if (! has_prefix (de->d_name, "pages-"))
+        continue;
+
+      len = strlen (de->d_name);
+      if (len < 4 || strcmp (de->d_name + len - 4, ".img") != 0)
+        continue;
+
+      ret = fstatat (dirfd (dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW);
+      if (UNLIKELY (ret < 0))
+        return crun_make_error (err, errno, "stat `%s/%s`", image_path, de->d_name);
+
+      total += st.st_size;
+    }
+
+  page_size = sysconf (_SC_PAGESIZE);
+  *pages = total / (page_size > 0 ? page_size : 4096);
+  return 0;
+}
+
+/* Run pre-dumps until the number of pages dirtied since the previous
+   round is at most cr_options->converge_pages, stops decreasing, or
+   cr_options->max_iterations rounds were done.  Each round is stored
+   in a pre-dump-N directory under the images directory and uses the
+   previous one as its parent.  The final dump goes to the images
+   directory itself, so that only the pages dirtied during the last
+   round are copied while the container is frozen.  */
+static int
+checkpoint_criu_iterative (libcrun_container_status_t *status, libcrun_container_t *container,
+                           libcrun_checkpoint_restore_t *cr_options, libcrun_error_t *err)
+{
+  libcrun_checkpoint_restore_t round_options;
+  cleanup_free char *parent_path = NULL;
+  uint64_t previous_pages = UINT64_MAX;
+  unsigned int max_iterations;
+  uint64_t converge_pages;
+  unsigned int i;
+  int ret;
+
+  if (UNLIKELY (cr_options->image_path == NULL))
+    return crun_make_error (err, 0, "image path not set");
+
+  if (cr_options->pre_dump)
+    return crun_make_error (err, 0, "`--iterative` cannot be used together with `--pre-dump`");
+
+  max_iterations = cr_options->max_iterations ? cr_options->max_iterations : CRIU_DEFAULT_MAX_ITERATIONS;
+  converge_pages = cr_options->converge_pages ? cr_options->converge_pages : CRIU_DEFAULT_CONVERGE_PAGES;
+
+  ret = mkdir (cr_options->image_path, 0700);
+  if (UNLIKELY ((ret == -1) && (errno != EEXIST)))
+    return crun_make_error (err, errno, "error creating checkpoint directory `%s`", cr_options->image_path);
+
+  /* A relative user-specified parent is relative to the images directory,
+     while the rounds are stored one level below it.  */
+  if (cr_options->parent_path)
+    {
+      if (cr_options->parent_path[0] == '/')
+        parent_path = xstrdup (cr_options->parent_path);
+      else
+        xasprintf (&parent_path, "../%s", cr_options->parent_path);
+    }
+
+  for (i = 1; i <= max_iterations; i++)
+    {
+      cleanup_free char *round_image_path = NULL;
+      cleanup_free char *round_name = NULL;
+      uint64_t pages = 0;
+
+      xasprintf (&round_name, "pre-dump-%u", i);
+
+      ret = append_paths (&round_image_path, err, cr_options->image_path, round_name, NULL);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      round_options = *cr_options;
+      round_options.image_path = round_image_path;
+      round_options.pre_dump = true;
+      round_options.parent_path = parent_path;
+
+      ret = checkpoint_criu (status, container, &round_options, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      ret = count_dumped_pages (round_image_path, &pages, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      libcrun_debug ("CRIU pre-dump round %u: %llu pages", i, (unsigned long long) pages);
+
+      free (parent_path);
+      xasprintf (&parent_path, "../%s", round_name);
+
+      if (pages <= converge_pages || pages >= previous_pages)
+        break;
+
+      previous_pages = pages;
+    }
+
+  /* The final dump is in the images directory itself, so the parent
+     is a direct subdirectory: drop the leading "../".  */
+  round_options = *cr_options;
+  round_options.parent_path = parent_path + 3;
+  return checkpoint_criu (status, container, &round_options, err);
+}
+#  endif
+
+int
+libcrun_container_checkpoint_linux_criu (libcrun_container_status_t *status, libcrun_container_t *container,
+                                         libcrun_checkpoint_restore_t *cr_options, libcrun_error_t *err)
+{
+  if (cr_options->iterative)
+    {
+#  ifdef CRIU_PRE_DUMP_SUPPORT
+      return checkpoint_criu_iterative (status, container, cr_options, err);
+#  else
+      return crun_make_error (err, 0, "iterative checkpoint requires CRIU pre-dump support");
+#  endif
+    }
+
+  return checkpoint_criu (status, container, cr_options, err);
+}
+
+/* Start `criu lazy-pages`.  It serves the memory pages from the images
+   directory to the restored processes, which fault them in on demand
+   through userfaultfd.  The daemon and the restore talk through a unix
+   socket created in the work directory; wait for it before returning so
+   that the restore does not race with the daemon start.  The daemon exits
+   on its own once all the pages were transferred.  It is started with a
+   double fork so that it is not left as a zombie of a long-lived caller;
+   the daemon sends its PID back before the exec.  */
+static int
+start_lazy_pages_daemon (libcrun_checkpoint_restore_t *cr_options, pid_t *daemon_pid, libcrun_error_t *err)
+{
+  cleanup_free char *socket_path = NULL;
+  cleanup_close int pipe_r = -1;
+  cleanup_close int pipe_w = -1;
+  char *args[] = { "criu", "lazy-pages", "--images-dir", cr_options->image_path, "--work-dir", cr_options->work_path,
+                   "--log-file", CRIU_LAZY_PAGES_LOG_FILE, NULL };
+  int i, ret, fds[2];
+  pid_t pid, server_pid;
+
+  ret = append_paths (&socket_path, err, cr_options->work_path, CRIU_LAZY_PAGES_SOCKET, NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  /* A stale socket from a previous restore would be mistaken for the new one.  */
+  ret = unlink (socket_path);
+  if (UNLIKELY (ret < 0 && errno != ENOENT))
+    return crun_make_error (err, errno, "unlink `%s`", socket_path);
+
+  ret = pipe2 (fds, O_CLOEXEC);
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "pipe");
+  pipe_r = fds[0];
+  pipe_w = fds[1];
+
+  pid = fork ();
+  if (UNLIKELY (pid < 0))
+    return crun_make_error (err, errno, "fork");
+
+  if (pid == 0)
+    {
+      libcrun_error_t tmp_err = NULL;
+      int null_fd;
+
+      /* Do not let the daemon be killed together with crun.  */
+      setsid ();
+
+      server_pid = fork ();
+      if (server_pid != 0)
+        _exit (server_pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+      null_fd = open ("/dev/null", O_RDWR | O_CLOEXEC);
+      if (UNLIKELY (null_fd < 0))
+        _exit (EXIT_FAILURE);
+      if (UNLIKELY (dup2 (null_fd, 0) < 0 || dup2 (null_fd, 1) < 0 || dup2 (null_fd, 2) < 0))
+        _exit (EXIT_FAILURE);
+
+      server_pid = getpid ();
+      TEMP_FAILURE_RETRY (write (pipe_w, &server_pid, sizeof (server_pid)));
+
+      /* Do not leak the container and crun descriptors to the daemon.  */
+      ret = mark_or_close_fds_ge_than (3, true, &tmp_err);
+      if (UNLIKELY (ret < 0))
+        _exit (EXIT_FAILURE);
+
+      execvp (args[0], args);
+      _exit (EXIT_FAILURE);
+    }
+
+  close_and_reset (&pipe_w);
+
+  ret = TEMP_FAILURE_RETRY (waitpid (pid, NULL, 0));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "waitpid");
+
+  ret = TEMP_FAILURE_RETRY (read (pipe_r, &server_pid, sizeof (server_pid)));
+  if (UNLIKELY (ret != sizeof (server_pid)))
+    return crun_make_error (err, 0, "could not start the CRIU lazy-pages daemon");
+
+  for (i = 0; i < 500; i++)
+    {
+      if (access (socket_path, F_OK) == 0)
+        {
+          *daemon_pid = server_pid;
+          return 0;
+        }
+
+      /* The daemon is not our child anymore, check that it is still alive.  */
+      if (kill (server_pid, 0) < 0 && errno == ESRCH)
+        return crun_make_error (err, 0, "CRIU lazy-pages daemon exited.  Please check CRIU logfile %s/%s",
+                                cr_options->work_path, CRIU_LAZY_PAGES_LOG_FILE);
+
+      usleep (10000);
+    }
+
+  kill (server_pid, SIGKILL);
+  return crun_make_error (err, 0, "timeout waiting for the CRIU lazy-pages daemon.  Please check CRIU logfile %s/%s",
+                          cr_options->work_path, CRIU_LAZY_PAGES_LOG_FILE);
+}
+
 static int
 prepare_restore_mounts (runtime_spec_schema_config_schema *def, char *root, libcrun_error_t *err)
 {
@@ -737,6 +990,8 @@ libcrun_container_restore_linux_criu (libcrun_container_status_t *status, libcru
   cleanup_free char *root = NULL;
   cleanup_free char *bundle_cleanup = NULL;
   cleanup_close int work_fd = -1;
+  struct timespec restore_start, restore_end;
+  pid_t lazy_pages_pid = -1;
   int ret_out;
   size_t i;
   int ret;
@@ -964,7 +1219,27 @@ libcrun_container_restore_linux_criu (libcrun_container_status_t *status, libcru
 
   libcriu_wrapper->criu_set_log_level (4);
   libcriu_wrapper->criu_set_log_file (CRIU_RESTORE_LOG_FILE);
+
+  /* With lazy pages, the memory is not copied before the processes are
+   * resumed but faulted in on demand from the lazy-pages daemon. */
+  if (cr_options->lazy_pages)
+    {
+      if (libcriu_wrapper->criu_set_lazy_pages == NULL)
+        {
+          ret = crun_make_error (err, 0, "lazy pages are not supported by the installed `libcriu.so.2`");
+          goto out_umount;
+        }
+
+      ret = start_lazy_pages_daemon (cr_options, &lazy_pages_pid, err);
+      if (UNLIKELY (ret < 0))
+        goto out_umount;
+
+      libcriu_wrapper->criu_set_lazy_pages (true);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &restore_start);
   ret = libcriu_wrapper->criu_restore_child ();
+  clock_gettime (CLOCK_MONOTONIC, &restore_end);
 
   /* criu_restore() returns the PID of the process of the restored process
    * tree. This PID will not be the same as status->pid if the container is
@@ -972,12 +1247,20 @@ libcrun_container_restore_linux_criu (libcrun_container_status_t *status, libcru
 
   if (UNLIKELY (ret <= 0))
     {
+      if (lazy_pages_pid > 0)
+        kill (lazy_pages_pid, SIGKILL);
       ret = crun_make_error (err, 0,
                              "CRIU restoring failed %d.  Please check CRIU logfile `%s/%s`",
                              ret, cr_options->work_path, CRIU_RESTORE_LOG_FILE);
       goto out_umount;
     }
 
+  /* CRIU resumes the restored processes before returning, this is the time
+   * until they run their first instruction. */
+  libcrun_debug ("CRIU restore%s: processes resumed after %lld us", cr_options->lazy_pages ? " (lazy pages)" : "",
+                 (restore_end.tv_sec - restore_start.tv_sec) * 1000000LL
+                     + (restore_end.tv_nsec - restore_start.tv_nsec) / 1000);
+
   /* Update the status struct with the newly allocated PID. This will
    * be necessary later when moving the process into its cgroup. */
   status->pid = ret;
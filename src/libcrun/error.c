@@ -45,6 +45,26 @@ static int log_format;
 static bool log_also_to_stderr;
 static int output_verbosity = LIBCRUN_VERBOSITY_ERROR;
 
+/* Messages for a log file are collected here and written in batches.
+   Only the process that opened the log file uses the buffer, forked
+   processes write directly to the file since they might never reach
+   a flush point.  */
+#define LOG_BUFFER_SIZE 32768
+
+struct log_buffer_s
+{
+  char data[LOG_BUFFER_SIZE];
+  size_t used;
+  size_t entries;
+  size_t dropped;
+  FILE *stream;
+  pid_t owner;
+};
+
+static struct log_buffer_s log_buffer = {
+  .owner = -1,
+};
+
 int
 libcrun_make_error (libcrun_error_t *err, int status, const char *msg, ...)
 {
@@ -127,6 +147,8 @@ crun_error_write_warning_and_release (FILE *out, libcrun_error_t **err)
   if (err == NULL || *err == NULL)
     return;
 
+  libcrun_flush_log ();
+
   ref = **err;
   if (ref->status)
     fprintf (out, "%s: %s\n", ref->msg, strerror (ref->status));
@@ -201,6 +223,25 @@ get_log_type (const char *log, const char **data)
   return -1;
 }
 
+static void
+init_log_buffer (FILE *stream)
+{
+  static bool registered;
+
+  libcrun_flush_log ();
+
+  log_buffer.stream = stream;
+  log_buffer.owner = getpid ();
+  log_buffer.used = 0;
+  log_buffer.entries = 0;
+
+  if (! registered)
+    {
+      atexit (libcrun_flush_log);
+      registered = true;
+    }
+}
+
 int
 libcrun_init_logging (crun_output_handler *new_output_handler, void **new_output_handler_arg, const char *id,
                       const char *log, libcrun_error_t *err)
@@ -227,6 +268,11 @@ libcrun_init_logging (crun_output_handler *new_output_handler, void **new_output
             return crun_make_error (err, errno, "open log file `%s`", log);
           if (output_verbosity >= LIBCRUN_VERBOSITY_WARNING)
             setlinebuf (*new_output_handler_arg);
+          if (! isatty (fileno (*new_output_handler_arg)))
+            {
+              *new_output_handler = log_write_to_buffer;
+              init_log_buffer (*new_output_handler_arg);
+            }
           break;
 
         case LOG_TYPE_SYSLOG:
@@ -270,6 +316,109 @@ log_write_to_stream (int errno_, const char *msg, bool warning, void *arg)
     fprintf (stream, "%s%s%s%s\n", color_begin, timestamp, msg, color_end);
 }
 
+static char *make_json_error (const char *msg, int errno_, int verbosity);
+
+/* Write the messages that could not be written earlier as a single
+   entry, so that the gap in the log is visible.  */
+static int
+write_dropped_log_entries (int fd)
+{
+  cleanup_free char *json = NULL;
+  char msg[64];
+  int len;
+
+  len = snprintf (msg, sizeof (msg), "%zu log messages dropped", log_buffer.dropped);
+  if (log_format == LOG_FORMAT_JSON)
+    {
+      json = make_json_error (msg, 0, LIBCRUN_VERBOSITY_WARNING);
+      if (json == NULL)
+        return -1;
+      if (safe_write (fd, json, strlen (json)) < 0 || safe_write (fd, "\n", 1) < 0)
+        return -1;
+      return 0;
+    }
+
+  msg[len++] = '\n';
+  if (safe_write (fd, msg, len) < 0)
+    return -1;
+  return 0;
+}
+
+void
+libcrun_flush_log (void)
+{
+  int fd;
+
+  if (log_buffer.stream == NULL || log_buffer.owner != getpid ())
+    return;
+
+  /* Other writers use the stream directly, write what they left first.  */
+  fflush (log_buffer.stream);
+
+  if (log_buffer.used == 0)
+    return;
+
+  fd = fileno (log_buffer.stream);
+
+  if (log_buffer.dropped && write_dropped_log_entries (fd) == 0)
+    log_buffer.dropped = 0;
+
+  if (safe_write (fd, log_buffer.data, log_buffer.used) < 0)
+    log_buffer.dropped += log_buffer.entries;
+
+  log_buffer.used = 0;
+  log_buffer.entries = 0;
+}
+
+size_t
+libcrun_get_log_dropped (void)
+{
+  return log_buffer.dropped;
+}
+
+void
+log_write_to_buffer (int errno_, const char *msg, bool warning, void *arg)
+{
+  const char *error_msg = errno_ ? strerror (errno_) : NULL;
+  size_t msg_len = strlen (msg);
+  size_t len;
+  char *it;
+
+  if (log_buffer.stream != arg || log_buffer.owner != getpid ())
+    {
+      log_write_to_stream (errno_, msg, warning, arg);
+      return;
+    }
+
+  len = msg_len + 1 + (error_msg ? strlen (error_msg) + 2 : 0);
+  if (len > LOG_BUFFER_SIZE - log_buffer.used)
+    libcrun_flush_log ();
+
+  if (len > LOG_BUFFER_SIZE)
+    {
+      log_write_to_stream (errno_, msg, warning, arg);
+      fflush (arg);
+      return;
+    }
+
+  it = log_buffer.data + log_buffer.used;
+  it = mempcpy (it, msg, msg_len);
+  if (error_msg)
+    {
+      it = mempcpy (it, ": ", 2);
+      it = mempcpy (it, error_msg, strlen (error_msg));
+    }
+  *it = '\n';
+
+  log_buffer.used += len;
+  log_buffer.entries++;
+
+  /* Errors are usually followed by the exit of the process, do not
+     keep them around.  */
+  if (! warning)
+    libcrun_flush_log ();
+}
+
 void
 log_write_to_stderr (int errno_, const char *msg, bool warning, void *arg arg_unused)
 {
@@ -323,10 +472,26 @@ crun_set_output_handler (crun_output_handler handler, void *arg, bool log_to_std
   log_also_to_stderr = log_to_stderr;
 }
 
+static const char *
+get_log_level_name (int verbosity)
+{
+  switch (verbosity)
+    {
+    case LIBCRUN_VERBOSITY_DEBUG:
+      return "debug";
+
+    case LIBCRUN_VERBOSITY_WARNING:
+      return "warning";
+
+    default:
+      return "error";
+    }
+}
+
 static char *
-make_json_error (const char *msg, int errno_, bool warning)
+make_json_error (const char *msg, int errno_, int verbosity)
 {
-  const char *level = warning ? "warning" : "error";
+  const char *level = get_log_level_name (verbosity);
   const unsigned char *buf = NULL;
   yajl_gen gen = NULL;
   char *ret = NULL;
@@ -372,15 +537,13 @@ make_json_error (const char *msg, int errno_, bool warning)
 }
 
 static void
-write_log (int errno_, bool warning, const char *msg, va_list args_list)
+write_log_unconditionally (int errno_, int verbosity, const char *msg, va_list args_list)
 {
+  bool warning = verbosity > LIBCRUN_VERBOSITY_ERROR;
   int ret;
   cleanup_free char *output = NULL;
   cleanup_free char *json = NULL;
 
-  if (warning && output_verbosity < LIBCRUN_VERBOSITY_WARNING)
-    return;
-
   ret = vasprintf (&output, msg, args_list);
   if (UNLIKELY (ret < 0))
     OOM ();
@@ -395,7 +558,7 @@ write_log (int errno_, bool warning, const char *msg, va_list args_list)
       break;
 
     case LOG_FORMAT_JSON:
-      json = make_json_error (output, errno_, warning);
+      json = make_json_error (output, errno_, verbosity);
       if (json)
         output_handler (0, json, warning, output_handler_arg);
       else
@@ -404,12 +567,41 @@ write_log (int errno_, bool warning, const char *msg, va_list args_list)
     }
 }
 
+static void
+write_log (int errno_, int verbosity, const char *msg, va_list args_list)
+{
+  if (output_verbosity < verbosity)
+    return;
+
+  write_log_unconditionally (errno_, verbosity, msg, args_list);
+}
+
+/* Write an event the user explicitly asked for to the log, as a warning
+   but whatever the verbosity is.  */
+void
+libcrun_log_event (const char *msg, ...)
+{
+  va_list args_list;
+  va_start (args_list, msg);
+  write_log_unconditionally (0, LIBCRUN_VERBOSITY_WARNING, msg, args_list);
+  va_end (args_list);
+}
+
 void
 libcrun_warning (const char *msg, ...)
 {
   va_list args_list;
   va_start (args_list, msg);
-  write_log (0, true, msg, args_list);
+  write_log (0, LIBCRUN_VERBOSITY_WARNING, msg, args_list);
+  va_end (args_list);
+}
+
+void
+libcrun_debug (const char *msg, ...)
+{
+  va_list args_list;
+  va_start (args_list, msg);
+  write_log (0, LIBCRUN_VERBOSITY_DEBUG, msg, args_list);
   va_end (args_list);
 }
 
@@ -419,7 +611,7 @@ libcrun_error (int errno_, const char *msg, ...)
   va_list args_list;
   va_start (args_list, msg);
 
-  write_log (errno_, false, msg, args_list);
+  write_log (errno_, LIBCRUN_VERBOSITY_ERROR, msg, args_list);
   va_end (args_list);
 }
 
@@ -428,7 +620,7 @@ libcrun_fail_with_error (int errno_, const char *msg, ...)
 {
   va_list args_list;
   va_start (args_list, msg);
-  write_log (errno_, false, msg, args_list);
+  write_log (errno_, LIBCRUN_VERBOSITY_ERROR, msg, args_list);
   va_end (args_list);
   exit (EXIT_FAILURE);
 }
@@ -67,6 +67,8 @@ void log_write_to_stream (int errno_, const char *msg, bool warning, void *arg);
 
 void log_write_to_stderr (int errno_, const char *msg, bool warning, void *arg);
 
+void log_write_to_buffer (int errno_, const char *msg, bool warning, void *arg);
+
 int crun_error_wrap (libcrun_error_t *err, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 
 int crun_error_get_errno (libcrun_error_t *err);
@@ -79,6 +81,10 @@ LIBCRUN_PUBLIC void libcrun_warning (const char *msg, ...) __attribute__ ((forma
 
 LIBCRUN_PUBLIC void libcrun_error (int errno_, const char *msg, ...) __attribute__ ((format (printf, 2, 3)));
 
+LIBCRUN_PUBLIC void libcrun_debug (const char *msg, ...) __attribute__ ((format (printf, 1, 2)));
+
+void libcrun_log_event (const char *msg, ...) __attribute__ ((format (printf, 1, 2)));
+
 LIBCRUN_PUBLIC int libcrun_make_error (libcrun_error_t *err, int status, const char *msg, ...) __attribute__ ((format (printf, 3, 4)));
 
 #define crun_make_error libcrun_make_error
@@ -94,12 +100,19 @@ LIBCRUN_PUBLIC int libcrun_init_logging (crun_output_handler *output_handler, vo
 
 LIBCRUN_PUBLIC int libcrun_error_release (libcrun_error_t *err);
 
+/* Write the messages collected for the log file.  */
+LIBCRUN_PUBLIC void libcrun_flush_log (void);
+
+/* Number of log messages that could not be written.  */
+LIBCRUN_PUBLIC size_t libcrun_get_log_dropped (void);
+
 int yajl_error_to_crun_error (int yajl_status, libcrun_error_t *err);
 
 enum
 {
   LIBCRUN_VERBOSITY_ERROR,
   LIBCRUN_VERBOSITY_WARNING,
+  LIBCRUN_VERBOSITY_DEBUG,
 };
 
 LIBCRUN_PUBLIC void libcrun_set_verbosity (int verbosity);
@@ -23,6 +23,14 @@
 #include "../utils.h"
 #include "handler-utils.h"
 
+static bool
+is_wasm_entrypoint (const char *entrypoint_executable)
+{
+  return has_suffix (entrypoint_executable, ".wat") > 0
+         || has_suffix (entrypoint_executable, ".wasm") > 0
+         || has_suffix (entrypoint_executable, ".cwasm") > 0;
+}
+
 int
 wasm_can_handle_container (libcrun_container_t *container, libcrun_error_t *err arg_unused)
 {
@@ -45,7 +53,7 @@ wasm_can_handle_container (libcrun_container_t *container, libcrun_error_t *err
       */
       if (strcmp (annotation, "wasm-smart") == 0)
         {
-          return ((has_suffix (entrypoint_executable, ".wat") > 0) || (has_suffix (entrypoint_executable, ".wasm") > 0)) ? 1 : 0;
+          return is_wasm_entrypoint (entrypoint_executable) ? 1 : 0;
         }
       return strcmp (annotation, "wasm") == 0 ? 1 : 0;
     }
@@ -61,7 +69,7 @@ wasm_can_handle_container (libcrun_container_t *container, libcrun_error_t *err
       */
       if (strcmp (annotation, "compat-smart") == 0)
         {
-          return ((has_suffix (entrypoint_executable, ".wat") > 0) || (has_suffix (entrypoint_executable, ".wasm") > 0)) ? 1 : 0;
+          return is_wasm_entrypoint (entrypoint_executable) ? 1 : 0;
         }
 
       return strcmp (annotation, "compat") == 0 ? 1 : 0;
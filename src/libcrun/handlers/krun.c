@@ -30,6 +30,7 @@
 #include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <time.h>
 #include <ocispec/runtime_spec_schema_config_schema.h>
 
 #ifdef HAVE_DLOPEN
@@ -43,15 +44,157 @@
 /* libkrun has a hard-limit of 8 vCPUs per microVM. */
 #define LIBKRUN_MAX_VCPUS 8
 
+/* Maximum number of warm contexts kept by a process.  */
+#define LIBKRUN_POOL_MAX 16
+
+/* A context already created and sized, ready to be claimed by a container
+   with the same vCPUs and RAM.  */
+struct krun_pooled_ctx
+{
+  int32_t ctx_id;
+  uint32_t num_vcpus;
+  uint32_t ram_mib;
+};
+
 struct krun_config
 {
   void *handle;
   void *handle_sev;
   bool sev;
+
+  /* Context claimed for the container being created, or -1.  */
+  int32_t claimed_ctx_id;
+  uint32_t claimed_num_vcpus;
+  uint32_t claimed_ram_mib;
+
+  /* Set once a second container is created by this process.  Only then
+     the pool is filled, so that the crun command line, which creates a
+     single container per process, never prepares contexts it cannot use.  */
+  bool long_lived;
+
+  struct krun_pooled_ctx pool[LIBKRUN_POOL_MAX];
+  size_t pool_len;
 };
 
+/* The configuration, and with it the pool, is shared by all the containers
+   created by the same process.  The container process is forked from it,
+   so it inherits the claimed context already sized.  */
+static struct krun_config *libkrun_config;
+
 /* libkrun handler.  */
 #if HAVE_DLOPEN && HAVE_LIBKRUN
+
+static long long
+libkrun_elapsed_us (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void
+libkrun_get_vm_size (runtime_spec_schema_config_schema *def, uint32_t *num_vcpus, uint32_t *ram_mib)
+{
+  cpu_set_t set;
+
+  /* If sched_getaffinity fails, default to 1 vcpu.  */
+  *num_vcpus = 1;
+  /* If no memory limit is specified, default to 2G.  */
+  *ram_mib = 2 * 1024;
+
+  if (def && def->linux && def->linux->resources && def->linux->resources->memory
+      && def->linux->resources->memory->limit_present)
+    *ram_mib = def->linux->resources->memory->limit / (1024 * 1024);
+
+  CPU_ZERO (&set);
+  if (sched_getaffinity (getpid (), sizeof (set), &set) == 0)
+    *num_vcpus = MIN (CPU_COUNT (&set), LIBKRUN_MAX_VCPUS);
+}
+
+/* Create a new context and configure its size.  This is the part of the
+   VM setup that does not depend on the container and that the pool
+   performs ahead of time.  */
+static int32_t
+libkrun_create_sized_ctx (void *handle, uint32_t num_vcpus, uint32_t ram_mib)
+{
+  int32_t (*krun_create_ctx) ();
+  int32_t (*krun_free_ctx) (uint32_t ctx_id);
+  int32_t (*krun_set_vm_config) (uint32_t ctx_id, uint8_t num_vcpus, uint32_t ram_mib);
+  int32_t ctx_id, ret;
+
+  krun_create_ctx = dlsym (handle, "krun_create_ctx");
+  krun_free_ctx = dlsym (handle, "krun_free_ctx");
+  krun_set_vm_config = dlsym (handle, "krun_set_vm_config");
+  if (krun_create_ctx == NULL || krun_set_vm_config == NULL)
+    return -ENOSYS;
+
+  ctx_id = krun_create_ctx ();
+  if (UNLIKELY (ctx_id < 0))
+    return ctx_id;
+
+  ret = krun_set_vm_config (ctx_id, num_vcpus, ram_mib);
+  if (UNLIKELY (ret < 0))
+    {
+      if (krun_free_ctx)
+        krun_free_ctx (ctx_id);
+      return ret;
+    }
+
+  return ctx_id;
+}
+
+/* Take a warm context of the requested size from the pool, if any.  */
+static int32_t
+libkrun_pool_claim (struct krun_config *kconf, uint32_t num_vcpus, uint32_t ram_mib)
+{
+  size_t i;
+
+  for (i = 0; i < kconf->pool_len; i++)
+    {
+      int32_t ctx_id;
+
+      if (kconf->pool[i].num_vcpus != num_vcpus || kconf->pool[i].ram_mib != ram_mib)
+        continue;
+
+      ctx_id = kconf->pool[i].ctx_id;
+      kconf->pool[i] = kconf->pool[--kconf->pool_len];
+      return ctx_id;
+    }
+  return -1;
+}
+
+/* Make sure there are at least TARGET warm contexts of the given size.  */
+static void
+libkrun_pool_fill (struct krun_config *kconf, uint32_t num_vcpus, uint32_t ram_mib, size_t target)
+{
+  size_t i, available = 0;
+
+  for (i = 0; i < kconf->pool_len; i++)
+    if (kconf->pool[i].num_vcpus == num_vcpus && kconf->pool[i].ram_mib == ram_mib)
+      available++;
+
+  while (available < target && kconf->pool_len < LIBKRUN_POOL_MAX)
+    {
+      struct timespec start;
+      int32_t ctx_id;
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      ctx_id = libkrun_create_sized_ctx (kconf->handle, num_vcpus, ram_mib);
+      if (UNLIKELY (ctx_id < 0))
+        return;
+
+      libcrun_debug ("krun: prepared warm context %d (%u vCPUs, %u MiB) in %lld us",
+                     ctx_id, num_vcpus, ram_mib, libkrun_elapsed_us (&start));
+
+      kconf->pool[kconf->pool_len].ctx_id = ctx_id;
+      kconf->pool[kconf->pool_len].num_vcpus = num_vcpus;
+      kconf->pool[kconf->pool_len].ram_mib = ram_mib;
+      kconf->pool_len++;
+      available++;
+    }
+}
+
 static int
 libkrun_exec (void *cookie, libcrun_container_t *container, const char *pathname, char *const argv[])
 {
@@ -59,7 +202,6 @@ libkrun_exec (void *cookie, libcrun_container_t *container, const char *pathname
   int32_t (*krun_set_log_level) (uint32_t level);
   int32_t (*krun_create_ctx) ();
   int (*krun_start_enter) (uint32_t ctx_id);
-  int32_t (*krun_set_vm_config) (uint32_t ctx_id, uint8_t num_vcpus, uint32_t ram_mib);
   int32_t (*krun_set_root) (uint32_t ctx_id, const char *root_path);
   int32_t (*krun_set_root_disk) (uint32_t ctx_id, const char *disk_path);
   int32_t (*krun_set_workdir) (uint32_t ctx_id, const char *workdir_path);
@@ -69,7 +211,6 @@ libkrun_exec (void *cookie, libcrun_container_t *container, const char *pathname
   void *handle;
   uint32_t num_vcpus, ram_mib;
   int32_t ctx_id, ret;
-  cpu_set_t set;
   char *const envp[] = { 0 };
 
   if (access ("/krun-sev.json", F_OK) == 0)
@@ -97,12 +238,12 @@ libkrun_exec (void *cookie, libcrun_container_t *container, const char *pathname
   /* Set log level to "error" */
   krun_set_log_level (1);
 
-  ctx_id = krun_create_ctx ();
-  if (UNLIKELY (ctx_id < 0))
-    error (EXIT_FAILURE, -ctx_id, "could not create krun context");
-
   if (kconf->sev)
     {
+      ctx_id = krun_create_ctx ();
+      if (UNLIKELY (ctx_id < 0))
+        error (EXIT_FAILURE, -ctx_id, "could not create krun context");
+
       krun_set_root_disk = dlsym (handle, "krun_set_root_disk");
       krun_set_tee_config_file = dlsym (handle, "krun_set_tee_config_file");
       if (krun_set_root_disk == NULL || krun_set_tee_config_file == NULL)
@@ -118,30 +259,25 @@ libkrun_exec (void *cookie, libcrun_container_t *container, const char *pathname
     }
   else
     {
-      /* If sched_getaffinity fails, default to 1 vcpu.  */
-      num_vcpus = 1;
-      /* If no memory limit is specified, default to 2G.  */
-      ram_mib = 2 * 1024;
-
-      if (def && def->linux && def->linux->resources && def->linux->resources->memory
-          && def->linux->resources->memory->limit_present)
-        ram_mib = def->linux->resources->memory->limit / (1024 * 1024);
+      libkrun_get_vm_size (def, &num_vcpus, &ram_mib);
 
-      CPU_ZERO (&set);
-      if (sched_getaffinity (getpid (), sizeof (set), &set) == 0)
-        num_vcpus = MIN (CPU_COUNT (&set), LIBKRUN_MAX_VCPUS);
-
-      krun_set_vm_config = dlsym (handle, "krun_set_vm_config");
       krun_set_root = dlsym (handle, "krun_set_root");
       krun_set_workdir = dlsym (handle, "krun_set_workdir");
       krun_set_exec = dlsym (handle, "krun_set_exec");
-      if (krun_set_vm_config == NULL || krun_set_root == NULL
-          || krun_set_exec == NULL)
+      if (krun_set_root == NULL || krun_set_exec == NULL)
         error (EXIT_FAILURE, 0, "could not find symbol in `libkrun.so`");
 
-      ret = krun_set_vm_config (ctx_id, num_vcpus, ram_mib);
-      if (UNLIKELY (ret < 0))
-        error (EXIT_FAILURE, -ret, "could not set krun vm configuration");
+      /* Use the context claimed from the pool only if the container ended
+         up with the same size it was claimed for.  */
+      if (kconf->claimed_ctx_id >= 0 && kconf->claimed_num_vcpus == num_vcpus
+          && kconf->claimed_ram_mib == ram_mib)
+        ctx_id = kconf->claimed_ctx_id;
+      else
+        {
+          ctx_id = libkrun_create_sized_ctx (handle, num_vcpus, ram_mib);
+          if (UNLIKELY (ctx_id < 0))
+            error (EXIT_FAILURE, -ctx_id, "could not create krun context");
+        }
 
       ret = krun_set_root (ctx_id, "/");
       if (UNLIKELY (ret < 0))
@@ -259,10 +395,28 @@ static int
 libkrun_load (void **cookie, libcrun_error_t *err)
 {
   struct krun_config *kconf;
-  void *handle;
   const char *libkrun_so = "libkrun.so.1";
   const char *libkrun_sev_so = "libkrun-sev.so.1";
 
+  /* Already loaded by a previous container in this process.  */
+  if (libkrun_config)
+    {
+      /* The context claimed by the previous container is owned by its
+         process now, release the copy here.  */
+      if (libkrun_config->claimed_ctx_id >= 0)
+        {
+          int32_t (*krun_free_ctx) (uint32_t ctx_id);
+
+          krun_free_ctx = dlsym (libkrun_config->handle, "krun_free_ctx");
+          if (krun_free_ctx)
+            krun_free_ctx (libkrun_config->claimed_ctx_id);
+        }
+      libkrun_config->claimed_ctx_id = -1;
+      libkrun_config->long_lived = true;
+      *cookie = libkrun_config;
+      return 0;
+    }
+
   kconf = malloc (sizeof (struct krun_config));
   if (kconf == NULL)
     return crun_make_error (err, 0, "could not allocate memory for krun_config");
@@ -277,23 +431,21 @@ libkrun_load (void **cookie, libcrun_error_t *err)
     }
 
   kconf->sev = false;
+  kconf->claimed_ctx_id = -1;
+  kconf->long_lived = false;
+  kconf->pool_len = 0;
 
+  libkrun_config = kconf;
   *cookie = kconf;
 
   return 0;
 }
 
 static int
-libkrun_unload (void *cookie, libcrun_error_t *err)
+libkrun_unload (void *cookie arg_unused, libcrun_error_t *err arg_unused)
 {
-  int r;
-
-  if (cookie)
-    {
-      r = dlclose (cookie);
-      if (UNLIKELY (r < 0))
-        return crun_make_error (err, 0, "could not unload handle: `%s`", dlerror ());
-    }
+  /* The libraries and the warm contexts are kept for the next container
+     created by this process.  */
   return 0;
 }
 
@@ -318,8 +470,55 @@ make_oci_spec_dev (const char *type, dev_t device, bool allow, const char *acces
   return dev;
 }
 
+/* Claim a warm context for the container, and refill the pool for its size
+   when the `run.oci.krun.pool_size` annotation is set and the process is
+   long-lived.  The time needed to prepare a context and the time to claim
+   one are reported at the debug level, so that the pool can be sized
+   accordingly.  */
+static void
+libkrun_claim_ctx (struct krun_config *kconf, runtime_spec_schema_config_schema *def)
+{
+  const char *annotation;
+  uint32_t num_vcpus, ram_mib;
+  struct timespec start;
+  size_t pool_size = 0;
+
+  /* `crun update` passes only the resources, there is no VM to start.  */
+  if (kconf->handle == NULL || def->process == NULL)
+    return;
+
+  annotation = find_annotation_map (def->annotations, "run.oci.krun.pool_size");
+  if (annotation)
+    {
+      unsigned long v;
+      char *endptr;
+
+      errno = 0;
+      v = strtoul (annotation, &endptr, 10);
+      if (errno == 0 && *annotation != '\0' && *endptr == '\0')
+        pool_size = MIN (v, LIBKRUN_POOL_MAX);
+      else
+        libcrun_warning ("invalid value for `run.oci.krun.pool_size`: `%s`", annotation);
+    }
+
+  libkrun_get_vm_size (def, &num_vcpus, &ram_mib);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  kconf->claimed_ctx_id = libkrun_pool_claim (kconf, num_vcpus, ram_mib);
+  kconf->claimed_num_vcpus = num_vcpus;
+  kconf->claimed_ram_mib = ram_mib;
+  if (kconf->claimed_ctx_id >= 0)
+    libcrun_debug ("krun: claimed warm context %d (%u vCPUs, %u MiB) in %lld us",
+                   kconf->claimed_ctx_id, num_vcpus, ram_mib, libkrun_elapsed_us (&start));
+  else if (pool_size > 0)
+    libcrun_debug ("krun: no warm context available (%u vCPUs, %u MiB)", num_vcpus, ram_mib);
+
+  if (pool_size > 0 && kconf->long_lived)
+    libkrun_pool_fill (kconf, num_vcpus, ram_mib, pool_size);
+}
+
 static int
-libkrun_modify_oci_configuration (void *cookie arg_unused, libcrun_context_t *context arg_unused,
+libkrun_modify_oci_configuration (void *cookie, libcrun_context_t *context arg_unused,
                                   runtime_spec_schema_config_schema *def,
                                   libcrun_error_t *err)
 {
@@ -329,6 +528,8 @@ libkrun_modify_oci_configuration (void *cookie arg_unused, libcrun_context_t *co
   size_t len;
   int ret;
 
+  libkrun_claim_ctx ((struct krun_config *) cookie, def);
+
   if (def->linux == NULL || def->linux->resources == NULL
       || def->linux->resources->devices == NULL)
     return 0;
@@ -44,126 +44,104 @@
 #endif
 
 #if HAVE_DLOPEN && HAVE_WASMTIME
-static int
-libwasmtime_exec (void *cookie, libcrun_container_t *container arg_unused,
-                  const char *pathname, char *const argv[])
+
+/* Everything needed from `libwasmtime.so`.  The library is loaded and
+   the symbols resolved only once per process.  The engine and the linker
+   are never created in the process that loads the handler: each
+   container process creates its own, right before the module is
+   compiled, so neither crun nor a long-lived process using the bindings
+   pays for them.  */
+struct libwasmtime_s
 {
-  size_t args_size = 0;
-  char *const *arg;
-  wasm_byte_vec_t error_message;
-  wasm_byte_vec_t wasm_bytes;
+  void *handle;
+
+  wasm_engine_t *engine;
+  wasmtime_linker_t *linker;
+
   wasm_engine_t *(*wasm_engine_new) ();
-  wasmtime_error_t *(*wasmtime_wat2wasm) (const char *wat, size_t wat_len, wasm_byte_vec_t *out);
   void (*wasm_engine_delete) (wasm_engine_t *);
   void (*wasm_byte_vec_delete) (wasm_byte_vec_t *);
   void (*wasm_byte_vec_new_uninitialized) (wasm_byte_vec_t *, size_t);
+  wasmtime_error_t *(*wasmtime_wat2wasm) (const char *wat, size_t wat_len, wasm_byte_vec_t *out);
   wasi_config_t *(*wasi_config_new) (const char *);
-  wasmtime_store_t *(*wasmtime_store_new) (wasm_engine_t *engine, void *data, void (*finalizer) (void *));
-  wasmtime_context_t *(*wasmtime_store_context) (wasmtime_store_t *store);
-  wasmtime_linker_t *(*wasmtime_linker_new) (wasm_engine_t *engine);
-  wasmtime_error_t *(*wasmtime_linker_define_wasi) (wasmtime_linker_t *linker);
-  wasmtime_error_t *(*wasmtime_module_new) (
-      wasm_engine_t *engine,
-      const uint8_t *wasm,
-      size_t wasm_len,
-      wasmtime_module_t **ret);
-  void (*wasi_config_inherit_argv) (wasi_config_t *config);
   void (*wasi_config_inherit_env) (wasi_config_t *config);
   void (*wasi_config_set_argv) (wasi_config_t *config, int argc, const char *argv[]);
   void (*wasi_config_inherit_stdin) (wasi_config_t *config);
   void (*wasi_config_inherit_stdout) (wasi_config_t *config);
   void (*wasi_config_inherit_stderr) (wasi_config_t *config);
+  bool (*wasi_config_preopen_dir) (wasi_config_t *config, const char *path, const char *guest_path);
+  wasmtime_store_t *(*wasmtime_store_new) (wasm_engine_t *engine, void *data, void (*finalizer) (void *));
+  wasmtime_context_t *(*wasmtime_store_context) (wasmtime_store_t *store);
+  void (*wasmtime_store_delete) (wasmtime_store_t *store);
   wasmtime_error_t *(*wasmtime_context_set_wasi) (wasmtime_context_t *context, wasi_config_t *wasi);
-  wasmtime_error_t *(*wasmtime_linker_module) (
-      wasmtime_linker_t *linker,
-      wasmtime_context_t *store,
-      const char *name,
-      size_t name_len,
-      const wasmtime_module_t *module);
-  wasmtime_error_t *(*wasmtime_linker_get_default) (
-      const wasmtime_linker_t *linker,
-      wasmtime_context_t *store,
-      const char *name,
-      size_t name_len,
-      wasmtime_func_t *func);
-  wasmtime_error_t *(*wasmtime_func_call) (
-      wasmtime_context_t *store,
-      const wasmtime_func_t *func,
-      const wasmtime_val_t *args,
-      size_t nargs,
-      wasmtime_val_t *results,
-      size_t nresults,
-      wasm_trap_t **trap);
+  wasmtime_linker_t *(*wasmtime_linker_new) (wasm_engine_t *engine);
+  void (*wasmtime_linker_delete) (wasmtime_linker_t *linker);
+  wasmtime_error_t *(*wasmtime_linker_define_wasi) (wasmtime_linker_t *linker);
+  wasmtime_error_t *(*wasmtime_linker_instantiate) (const wasmtime_linker_t *linker, wasmtime_context_t *store,
+                                                    const wasmtime_module_t *module, wasmtime_instance_t *instance,
+                                                    wasm_trap_t **trap);
+  bool (*wasmtime_instance_export_get) (wasmtime_context_t *store, const wasmtime_instance_t *instance,
+                                        const char *name, size_t name_len, wasmtime_extern_t *item);
+  wasmtime_error_t *(*wasmtime_module_new) (wasm_engine_t *engine, const uint8_t *wasm, size_t wasm_len,
+                                            wasmtime_module_t **ret);
+  wasmtime_error_t *(*wasmtime_module_deserialize_file) (wasm_engine_t *engine, const char *path,
+                                                         wasmtime_module_t **ret);
   void (*wasmtime_module_delete) (wasmtime_module_t *m);
-  void (*wasmtime_store_delete) (wasmtime_store_t *store);
+  wasmtime_error_t *(*wasmtime_func_call) (wasmtime_context_t *store, const wasmtime_func_t *func,
+                                           const wasmtime_val_t *args, size_t nargs, wasmtime_val_t *results,
+                                           size_t nresults, wasm_trap_t **trap);
   void (*wasmtime_error_message) (const wasmtime_error_t *error, wasm_name_t *message);
   void (*wasmtime_error_delete) (wasmtime_error_t *error);
-  bool (*wasi_config_preopen_dir) (wasi_config_t *config, const char *path, const char *guest_path);
+};
 
-  wasmtime_wat2wasm = dlsym (cookie, "wasmtime_wat2wasm");
-  wasm_engine_new = dlsym (cookie, "wasm_engine_new");
-  wasm_engine_delete = dlsym (cookie, "wasm_engine_delete");
-  wasm_byte_vec_delete = dlsym (cookie, "wasm_byte_vec_delete");
-  wasm_byte_vec_new_uninitialized = dlsym (cookie, "wasm_byte_vec_new_uninitialized");
-  wasi_config_new = dlsym (cookie, "wasi_config_new");
-  wasi_config_set_argv = dlsym (cookie, "wasi_config_set_argv");
-  wasmtime_store_new = dlsym (cookie, "wasmtime_store_new");
-  wasmtime_store_context = dlsym (cookie, "wasmtime_store_context");
-  wasmtime_linker_new = dlsym (cookie, "wasmtime_linker_new");
-  wasmtime_linker_define_wasi = dlsym (cookie, "wasmtime_linker_define_wasi");
-  wasmtime_module_new = dlsym (cookie, "wasmtime_module_new");
-  wasi_config_inherit_argv = dlsym (cookie, "wasi_config_inherit_argv");
-  wasi_config_inherit_stdout = dlsym (cookie, "wasi_config_inherit_stdout");
-  wasi_config_inherit_stdin = dlsym (cookie, "wasi_config_inherit_stdin");
-  wasi_config_inherit_stderr = dlsym (cookie, "wasi_config_inherit_stderr");
-  wasi_config_inherit_env = dlsym (cookie, "wasi_config_inherit_env");
-  wasmtime_context_set_wasi = dlsym (cookie, "wasmtime_context_set_wasi");
-  wasmtime_linker_module = dlsym (cookie, "wasmtime_linker_module");
-  wasmtime_linker_get_default = dlsym (cookie, "wasmtime_linker_get_default");
-  wasmtime_func_call = dlsym (cookie, "wasmtime_func_call");
-  wasmtime_module_delete = dlsym (cookie, "wasmtime_module_delete");
-  wasmtime_store_delete = dlsym (cookie, "wasmtime_store_delete");
-  wasmtime_error_delete = dlsym (cookie, "wasmtime_error_delete");
-  wasmtime_error_message = dlsym (cookie, "wasmtime_error_message");
-  wasi_config_preopen_dir = dlsym (cookie, "wasi_config_preopen_dir");
-
-  if (wasm_engine_new == NULL || wasm_engine_delete == NULL || wasm_byte_vec_delete == NULL
-      || wasm_byte_vec_new_uninitialized == NULL || wasi_config_new == NULL || wasmtime_store_new == NULL
-      || wasmtime_store_context == NULL || wasmtime_linker_new == NULL || wasmtime_linker_define_wasi == NULL
-      || wasmtime_module_new == NULL || wasi_config_inherit_argv == NULL || wasi_config_inherit_stdout == NULL
-      || wasi_config_inherit_stdin == NULL || wasi_config_inherit_stderr == NULL
-      || wasi_config_inherit_env == NULL || wasmtime_context_set_wasi == NULL
-      || wasmtime_linker_module == NULL || wasmtime_linker_get_default == NULL || wasmtime_func_call == NULL
-      || wasmtime_module_delete == NULL || wasmtime_store_delete == NULL || wasi_config_set_argv == NULL
-      || wasmtime_error_delete == NULL || wasmtime_error_message == NULL || wasi_config_preopen_dir == NULL
-      || wasmtime_wat2wasm == NULL)
-    error (EXIT_FAILURE, 0, "could not find symbol in `libwasmtime.so`");
-
-  // Set up wasmtime context
-  wasm_engine_t *engine = wasm_engine_new ();
-  assert (engine != NULL);
-  wasmtime_store_t *store = wasmtime_store_new (engine, NULL, NULL);
-  assert (store != NULL);
-  wasmtime_context_t *context = wasmtime_store_context (store);
+static struct libwasmtime_s *libwasmtime;
 
-  // Link with wasi functions defined
-  wasmtime_linker_t *linker = wasmtime_linker_new (engine);
-  wasmtime_error_t *err = wasmtime_linker_define_wasi (linker);
-  if (err != NULL)
+static void __attribute__ ((noreturn))
+libwasmtime_fail (struct libwasmtime_s *lib, wasmtime_error_t *werr, const char *what)
+{
+  wasm_byte_vec_t error_message;
+
+  if (werr == NULL)
+    error (EXIT_FAILURE, 0, "%s", what);
+
+  lib->wasmtime_error_message (werr, &error_message);
+  lib->wasmtime_error_delete (werr);
+  error (EXIT_FAILURE, 0, "%s: %.*s", what, (int) error_message.size, error_message.data);
+}
+
+/* Compile the module at PATHNAME.  A `.cwasm` file is an artifact already
+   compiled for this engine, e.g. by `wasmtime compile` from a module
+   pre-initialized with wizer.  It is mapped directly from the file and its
+   linear memory is initialized copy-on-write from the mapping, so the
+   cold start is reduced to the instantiation.  */
+static wasmtime_module_t *
+libwasmtime_load_module (struct libwasmtime_s *lib, const char *pathname)
+{
+  wasmtime_module_t *module = NULL;
+  wasm_byte_vec_t wasm_bytes;
+  wasmtime_error_t *werr;
+  wasm_byte_vec_t wasm;
+  size_t file_size;
+  FILE *file;
+
+  if (has_suffix (pathname, ".cwasm") > 0)
     {
-      wasmtime_error_message (err, &error_message);
-      wasmtime_error_delete (err);
-      error (EXIT_FAILURE, 0, "failed to link wasi: %.*s", (int) error_message.size, error_message.data);
+      if (lib->wasmtime_module_deserialize_file == NULL)
+        error (EXIT_FAILURE, 0, "precompiled modules are not supported by `libwasmtime.so`");
+
+      werr = lib->wasmtime_module_deserialize_file (lib->engine, pathname, &module);
+      if (module == NULL)
+        libwasmtime_fail (lib, werr, "failed to load precompiled module");
+      return module;
     }
 
-  wasm_byte_vec_t wasm;
   // Load and parse container entrypoint
-  FILE *file = fopen (pathname, "rbe");
+  file = fopen (pathname, "rbe");
   if (! file)
     error (EXIT_FAILURE, 0, "error loading entrypoint");
   fseek (file, 0L, SEEK_END);
-  size_t file_size = ftell (file);
-  wasm_byte_vec_new_uninitialized (&wasm, file_size);
+  file_size = ftell (file);
+  lib->wasm_byte_vec_new_uninitialized (&wasm, file_size);
   fseek (file, 0L, SEEK_SET);
   if (fread (wasm.data, file_size, 1, file) != 1)
     error (EXIT_FAILURE, 0, "error load");
@@ -174,81 +152,119 @@ libwasmtime_exec (void *cookie, libcrun_container_t *container arg_unused,
   // binary format.
   if (has_suffix (pathname, "wat") > 0)
     {
-      wasmtime_error_t *err = wasmtime_wat2wasm ((char *) &wasm_bytes, file_size, &wasm);
-      if (err != NULL)
-        {
-          wasmtime_error_message (err, &error_message);
-          wasmtime_error_delete (err);
-          error (EXIT_FAILURE, 0, "failed while compiling wat to wasm binary : %.*s", (int) error_message.size, error_message.data);
-        }
+      werr = lib->wasmtime_wat2wasm (wasm.data, file_size, &wasm_bytes);
+      if (werr != NULL)
+        libwasmtime_fail (lib, werr, "failed while compiling wat to wasm binary");
+      lib->wasm_byte_vec_delete (&wasm);
       wasm = wasm_bytes;
     }
 
   // Compile wasm modules
-  wasmtime_module_t *module = NULL;
-  err = wasmtime_module_new (engine, (uint8_t *) wasm.data, wasm.size, &module);
-  if (! module)
+  werr = lib->wasmtime_module_new (lib->engine, (uint8_t *) wasm.data, wasm.size, &module);
+  if (module == NULL)
+    libwasmtime_fail (lib, werr, "failed to compile module");
+  lib->wasm_byte_vec_delete (&wasm);
+
+  return module;
+}
+
+/* Create the engine and the WASI linker, if not already done.  */
+static int
+libwasmtime_prepare (struct libwasmtime_s *lib, libcrun_error_t *err)
+{
+  wasm_byte_vec_t error_message;
+  wasmtime_error_t *werr;
+  int ret;
+
+  if (lib->linker)
+    return 0;
+
+  if (lib->engine == NULL)
+    {
+      lib->engine = lib->wasm_engine_new ();
+      if (lib->engine == NULL)
+        return crun_make_error (err, 0, "could not create the wasmtime engine");
+    }
+
+  // Link with wasi functions defined
+  lib->linker = lib->wasmtime_linker_new (lib->engine);
+  werr = lib->wasmtime_linker_define_wasi (lib->linker);
+  if (werr != NULL)
     {
-      wasmtime_error_message (err, &error_message);
-      wasmtime_error_delete (err);
-      error (EXIT_FAILURE, 0, "failed to compile module: %.*s", (int) error_message.size, error_message.data);
+      lib->wasmtime_error_message (werr, &error_message);
+      lib->wasmtime_error_delete (werr);
+      ret = crun_make_error (err, 0, "failed to link wasi: %.*s", (int) error_message.size, error_message.data);
+      lib->wasm_byte_vec_delete (&error_message);
+      lib->wasmtime_linker_delete (lib->linker);
+      lib->linker = NULL;
+      return ret;
     }
-  wasm_byte_vec_delete (&wasm);
+
+  return 0;
+}
+
+static int
+libwasmtime_exec (void *cookie, libcrun_container_t *container arg_unused,
+                  const char *pathname, char *const argv[])
+{
+  struct libwasmtime_s *lib = (struct libwasmtime_s *) cookie;
+  wasmtime_instance_t instance;
+  wasmtime_context_t *context;
+  wasmtime_module_t *module;
+  wasi_config_t *wasi_config;
+  wasmtime_store_t *store;
+  wasm_trap_t *trap = NULL;
+  wasmtime_extern_t start;
+  wasmtime_error_t *werr;
+  size_t args_size = 0;
+  libcrun_error_t tmp_err = NULL;
+  char *const *arg;
+
+  if (libwasmtime_prepare (lib, &tmp_err) < 0)
+    error (EXIT_FAILURE, tmp_err->status, "%s", tmp_err->msg);
+
+  module = libwasmtime_load_module (lib, pathname);
+
+  // Only the store is per container, the engine and the linker are shared
+  store = lib->wasmtime_store_new (lib->engine, NULL, NULL);
+  assert (store != NULL);
+  context = lib->wasmtime_store_context (store);
 
   // Init WASI program
-  wasi_config_t *wasi_config = wasi_config_new ("crun_wasi_program");
+  wasi_config = lib->wasi_config_new ("crun_wasi_program");
   assert (wasi_config);
 
   // Calculate argc for `wasi_config_set_argv`
   for (arg = argv; *arg != NULL; ++arg)
     args_size++;
 
-  wasi_config_set_argv (wasi_config, args_size, (const char **) argv);
-  wasi_config_inherit_env (wasi_config);
-  wasi_config_inherit_stdin (wasi_config);
-  wasi_config_inherit_stdout (wasi_config);
-  wasi_config_inherit_stderr (wasi_config);
-  wasi_config_preopen_dir (wasi_config, ".", ".");
-  wasm_trap_t *trap = NULL;
-  err = wasmtime_context_set_wasi (context, wasi_config);
-  if (err != NULL)
-    {
-      wasmtime_error_message (err, &error_message);
-      wasmtime_error_delete (err);
-      error (EXIT_FAILURE, 0, "failed to instantiate WASI: %.*s", (int) error_message.size, error_message.data);
-    }
+  lib->wasi_config_set_argv (wasi_config, args_size, (const char **) argv);
+  lib->wasi_config_inherit_env (wasi_config);
+  lib->wasi_config_inherit_stdin (wasi_config);
+  lib->wasi_config_inherit_stdout (wasi_config);
+  lib->wasi_config_inherit_stderr (wasi_config);
+  lib->wasi_config_preopen_dir (wasi_config, ".", ".");
+  werr = lib->wasmtime_context_set_wasi (context, wasi_config);
+  if (werr != NULL)
+    libwasmtime_fail (lib, werr, "failed to instantiate WASI");
 
-  // Init module
-  err = wasmtime_linker_module (linker, context, "", 0, module);
-  if (err != NULL)
-    {
-      wasmtime_error_message (err, &error_message);
-      wasmtime_error_delete (err);
-      error (EXIT_FAILURE, 0, "failed to instantiate module: %.*s", (int) error_message.size, error_message.data);
-    }
+  // Instantiate the module without defining it in the shared linker
+  werr = lib->wasmtime_linker_instantiate (lib->linker, context, module, &instance, &trap);
+  if (werr != NULL || trap != NULL)
+    libwasmtime_fail (lib, werr, "failed to instantiate module");
 
-  // Actually run our .wasm
-  wasmtime_func_t func;
-  err = wasmtime_linker_get_default (linker, context, "", 0, &func);
-  if (err != NULL)
-    {
-      wasmtime_error_message (err, &error_message);
-      wasmtime_error_delete (err);
-      error (EXIT_FAILURE, 0, "failed to locate default export for module %.*s", (int) error_message.size, error_message.data);
-    }
+  if (! lib->wasmtime_instance_export_get (context, &instance, "_start", strlen ("_start"), &start)
+      || start.kind != WASMTIME_EXTERN_FUNC)
+    error (EXIT_FAILURE, 0, "failed to locate `_start` export for module");
 
-  err = wasmtime_func_call (context, &func, NULL, 0, NULL, 0, &trap);
-  if (err != NULL || trap != NULL)
-    {
-      wasmtime_error_message (err, &error_message);
-      wasmtime_error_delete (err);
-      error (EXIT_FAILURE, 0, "error calling default export: %.*s", (int) error_message.size, error_message.data);
-    }
+  // Actually run our .wasm
+  werr = lib->wasmtime_func_call (context, &start.of.func, NULL, 0, NULL, 0, &trap);
+  if (werr != NULL || trap != NULL)
+    libwasmtime_fail (lib, werr, "error calling default export");
 
   // Clean everything
-  wasmtime_module_delete (module);
-  wasmtime_store_delete (store);
-  wasm_engine_delete (engine);
+  lib->wasmtime_module_delete (module);
+  lib->wasmtime_store_delete (store);
 
   exit (EXIT_SUCCESS);
 }
@@ -256,27 +272,80 @@ libwasmtime_exec (void *cookie, libcrun_container_t *container arg_unused,
 static int
 libwasmtime_load (void **cookie, libcrun_error_t *err)
 {
-  void *handle;
+  cleanup_free struct libwasmtime_s *lib = NULL;
+  int ret;
 
-  handle = dlopen ("libwasmtime.so", RTLD_NOW);
-  if (handle == NULL)
+  /* Already loaded by a previous container in this process.  */
+  if (libwasmtime)
+    {
+      *cookie = libwasmtime;
+      return 0;
+    }
+
+  lib = xmalloc0 (sizeof (*lib));
+
+  lib->handle = dlopen ("libwasmtime.so", RTLD_NOW);
+  if (lib->handle == NULL)
     return crun_make_error (err, 0, "could not load `libwasmtime.so`: %s", dlerror ());
-  *cookie = handle;
+
+#  define LOAD_WASMTIME_FUNCTION(X, ALLOW_NULL)                                                     \
+    do                                                                                              \
+      {                                                                                             \
+        lib->X = dlsym (lib->handle, #X);                                                           \
+        if (! ALLOW_NULL && lib->X == NULL)                                                         \
+          {                                                                                         \
+            ret = crun_make_error (err, 0, "could not find symbol `%s` in `libwasmtime.so`", #X); \
+            goto fail;                                                                              \
+          }                                                                                         \
+    } while (0)
+
+  LOAD_WASMTIME_FUNCTION (wasm_engine_new, false);
+  LOAD_WASMTIME_FUNCTION (wasm_engine_delete, false);
+  LOAD_WASMTIME_FUNCTION (wasm_byte_vec_delete, false);
+  LOAD_WASMTIME_FUNCTION (wasm_byte_vec_new_uninitialized, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_wat2wasm, false);
+  LOAD_WASMTIME_FUNCTION (wasi_config_new, false);
+  LOAD_WASMTIME_FUNCTION (wasi_config_inherit_env, false);
+  LOAD_WASMTIME_FUNCTION (wasi_config_set_argv, false);
+  LOAD_WASMTIME_FUNCTION (wasi_config_inherit_stdin, false);
+  LOAD_WASMTIME_FUNCTION (wasi_config_inherit_stdout, false);
+  LOAD_WASMTIME_FUNCTION (wasi_config_inherit_stderr, false);
+  LOAD_WASMTIME_FUNCTION (wasi_config_preopen_dir, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_store_new, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_store_context, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_store_delete, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_context_set_wasi, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_linker_new, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_linker_delete, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_linker_define_wasi, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_linker_instantiate, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_instance_export_get, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_module_new, false);
+  /* Only needed for precompiled `.cwasm` modules.  */
+  LOAD_WASMTIME_FUNCTION (wasmtime_module_deserialize_file, true);
+  LOAD_WASMTIME_FUNCTION (wasmtime_module_delete, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_func_call, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_error_message, false);
+  LOAD_WASMTIME_FUNCTION (wasmtime_error_delete, false);
+
+#  undef LOAD_WASMTIME_FUNCTION
+
+  libwasmtime = lib;
+  *cookie = lib;
+  lib = NULL;
 
   return 0;
+
+fail:
+  dlclose (lib->handle);
+  return ret;
 }
 
 static int
-libwasmtime_unload (void *cookie, libcrun_error_t *err)
+libwasmtime_unload (void *cookie arg_unused, libcrun_error_t *err arg_unused)
 {
-  int r;
-
-  if (cookie)
-    {
-      r = dlclose (cookie);
-      if (UNLIKELY (r < 0))
-        return crun_make_error (err, 0, "could not unload handle: %s", dlerror ());
-    }
+  /* The library, and the engine and the linker if they were prepared,
+     are kept for the next container created by this process.  */
   return 0;
 }
 
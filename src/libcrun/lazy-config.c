@@ -0,0 +1,413 @@
+/*
+ * crun - OCI runtime written in C
+ *
+ * Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+ * crun is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * crun is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crun.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <config.h>
+#include "container.h"
+#include "utils.h"
+#include <string.h>
+
+/* A lazy configuration scans the JSON document once and only records
+   where each top level key, and each member of "linux", is found.
+   Sections are converted to libocispec objects the first time they
+   are requested, so that callers that look only at a few sections do
+   not pay for the whole tree.  */
+
+struct lazy_config_section_s
+{
+  char *name;
+  size_t offset;
+  size_t len;
+};
+
+struct libcrun_lazy_config_s
+{
+  char *json;
+  size_t json_len;
+
+  struct lazy_config_section_s *sections;
+  size_t sections_len;
+
+  runtime_spec_schema_config_schema_process *process;
+  runtime_spec_schema_config_linux_resources *resources;
+  runtime_spec_schema_defs_mount **mounts;
+  size_t mounts_len;
+  bool mounts_loaded;
+};
+
+static const char *
+skip_whitespace (const char *it, const char *end)
+{
+  while (it < end && (*it == ' ' || *it == '\t' || *it == '\n' || *it == '\r'))
+    it++;
+  return it;
+}
+
+/* Returns a pointer after the end of the string starting at IT, or NULL
+   if the string is not terminated.  */
+static const char *
+skip_string (const char *it, const char *end)
+{
+  for (it++; it < end; it++)
+    {
+      if (*it == '\\')
+        it++;
+      else if (*it == '"')
+        return it + 1;
+    }
+  return NULL;
+}
+
+/* Returns a pointer after the end of the value starting at IT, or NULL
+   if the document is truncated.  The value is not validated, that is
+   left to the parser when the section is materialized.  */
+static const char *
+skip_value (const char *it, const char *end)
+{
+  size_t depth = 0;
+
+  while (it < end)
+    {
+      switch (*it)
+        {
+        case '"':
+          it = skip_string (it, end);
+          if (it == NULL)
+            return NULL;
+          if (depth == 0)
+            return it;
+          continue;
+
+        case '{':
+        case '[':
+          depth++;
+          break;
+
+        case '}':
+        case ']':
+          if (depth == 0)
+            return it;
+          if (--depth == 0)
+            return it + 1;
+          break;
+
+        case ',':
+          if (depth == 0)
+            return it;
+          break;
+
+        default:
+          break;
+        }
+      it++;
+    }
+  return depth == 0 ? it : NULL;
+}
+
+static void
+add_section (struct libcrun_lazy_config_s *config, const char *prefix, const char *key, size_t key_len,
+             const char *value, const char *value_end)
+{
+  struct lazy_config_section_s *section;
+  size_t prefix_len = prefix ? strlen (prefix) : 0;
+
+  config->sections = xrealloc (config->sections, sizeof (*config->sections) * (config->sections_len + 1));
+  section = &config->sections[config->sections_len++];
+
+  section->name = xmalloc (prefix_len + key_len + 1);
+  if (prefix_len)
+    memcpy (section->name, prefix, prefix_len);
+  memcpy (section->name + prefix_len, key, key_len);
+  section->name[prefix_len + key_len] = '\0';
+
+  section->offset = value - config->json;
+  section->len = value_end - value;
+}
+
+/* Record the members of the object starting at IT.  When PREFIX is NULL,
+   the object is the root and the members of "linux" are recorded too.  */
+static int
+index_object (struct libcrun_lazy_config_s *config, const char *it, const char *end, const char *prefix,
+              libcrun_error_t *err)
+{
+  it = skip_whitespace (it, end);
+  if (it == end || *it != '{')
+    return crun_make_error (err, 0, "invalid config: expected an object");
+
+  it = skip_whitespace (it + 1, end);
+  if (it < end && *it == '}')
+    return 0;
+
+  while (it < end)
+    {
+      const char *key, *key_end, *value, *value_end;
+      int ret;
+
+      if (*it != '"')
+        return crun_make_error (err, 0, "invalid config: expected a key at offset %zu", (size_t) (it - config->json));
+
+      key = it + 1;
+      key_end = skip_string (it, end);
+      if (key_end == NULL)
+        return crun_make_error (err, 0, "invalid config: unterminated string");
+
+      it = skip_whitespace (key_end, end);
+      if (it == end || *it != ':')
+        return crun_make_error (err, 0, "invalid config: expected `:` at offset %zu", (size_t) (it - config->json));
+
+      value = skip_whitespace (it + 1, end);
+      value_end = skip_value (value, end);
+      if (value_end == NULL || value_end == value)
+        return crun_make_error (err, 0, "invalid config: truncated value");
+
+      add_section (config, prefix, key, key_end - 1 - key, value, value_end);
+
+      if (prefix == NULL && key_end - 1 - key == 5 && memcmp (key, "linux", 5) == 0 && *value == '{')
+        {
+          ret = index_object (config, value, value_end, "linux.", err);
+          if (UNLIKELY (ret < 0))
+            return ret;
+        }
+
+      it = skip_whitespace (value_end, end);
+      if (it < end && *it == '}')
+        return 0;
+      if (it == end || *it != ',')
+        return crun_make_error (err, 0, "invalid config: expected `,` at offset %zu", (size_t) (it - config->json));
+      it = skip_whitespace (it + 1, end);
+    }
+
+  return crun_make_error (err, 0, "invalid config: truncated object");
+}
+
+libcrun_lazy_config_t *
+libcrun_lazy_config_load_from_memory (const char *json, libcrun_error_t *err)
+{
+  libcrun_lazy_config_t *config;
+  int ret;
+
+  config = xmalloc0 (sizeof (*config));
+  config->json_len = strlen (json);
+  config->json = xmalloc (config->json_len + 1);
+  memcpy (config->json, json, config->json_len + 1);
+
+  ret = index_object (config, config->json, config->json + config->json_len, NULL, err);
+  if (UNLIKELY (ret < 0))
+    {
+      libcrun_lazy_config_free (config);
+      return NULL;
+    }
+  return config;
+}
+
+libcrun_lazy_config_t *
+libcrun_lazy_config_load_from_file (const char *path, libcrun_error_t *err)
+{
+  cleanup_free char *content = NULL;
+  size_t len;
+  int ret;
+
+  ret = read_all_file (path, &content, &len, err);
+  if (UNLIKELY (ret < 0))
+    return NULL;
+
+  return libcrun_lazy_config_load_from_memory (content, err);
+}
+
+void
+libcrun_lazy_config_free (libcrun_lazy_config_t *config)
+{
+  size_t i;
+
+  if (config == NULL)
+    return;
+
+  for (i = 0; i < config->sections_len; i++)
+    free (config->sections[i].name);
+  free (config->sections);
+
+  if (config->process)
+    free_runtime_spec_schema_config_schema_process (config->process);
+  if (config->resources)
+    free_runtime_spec_schema_config_linux_resources (config->resources);
+  for (i = 0; i < config->mounts_len; i++)
+    free_runtime_spec_schema_defs_mount (config->mounts[i]);
+  free (config->mounts);
+
+  free (config->json);
+  free (config);
+}
+
+const char *
+libcrun_lazy_config_get_raw (libcrun_lazy_config_t *config, const char *name, size_t *len)
+{
+  size_t i;
+
+  for (i = 0; i < config->sections_len; i++)
+    if (strcmp (config->sections[i].name, name) == 0)
+      {
+        *len = config->sections[i].len;
+        return config->json + config->sections[i].offset;
+      }
+  return NULL;
+}
+
+/* Parse the section NAME in a yajl tree.  Returns 0 if the section is
+   not present.  */
+static int
+parse_section (libcrun_lazy_config_t *config, const char *name, yajl_val *tree, libcrun_error_t *err)
+{
+  struct parser_context ctx = { 0, stderr };
+  cleanup_free char *buffer = NULL;
+  const char *raw;
+  size_t len;
+  int ret;
+
+  raw = libcrun_lazy_config_get_raw (config, name, &len);
+  if (raw == NULL)
+    return 0;
+
+  buffer = xmalloc (len + 1);
+  memcpy (buffer, raw, len);
+  buffer[len] = '\0';
+
+  ret = parse_json_file (tree, buffer, &ctx, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  return 1;
+}
+
+int
+libcrun_lazy_config_get_process (libcrun_lazy_config_t *config, runtime_spec_schema_config_schema_process **out,
+                                 libcrun_error_t *err)
+{
+  struct parser_context ctx = { 0, stderr };
+  parser_error parser_err = NULL;
+  yajl_val tree = NULL;
+  int ret;
+
+  if (config->process == NULL)
+    {
+      ret = parse_section (config, "process", &tree, err);
+      if (ret <= 0)
+        return ret;
+
+      config->process = make_runtime_spec_schema_config_schema_process (tree, &ctx, &parser_err);
+      yajl_tree_free (tree);
+      if (UNLIKELY (config->process == NULL))
+        {
+          ret = crun_make_error (err, 0, "cannot parse `process`: %s", parser_err);
+          free (parser_err);
+          return ret;
+        }
+      free (parser_err);
+    }
+
+  *out = config->process;
+  return 1;
+}
+
+int
+libcrun_lazy_config_get_resources (libcrun_lazy_config_t *config, runtime_spec_schema_config_linux_resources **out,
+                                   libcrun_error_t *err)
+{
+  struct parser_context ctx = { 0, stderr };
+  parser_error parser_err = NULL;
+  yajl_val tree = NULL;
+  int ret;
+
+  if (config->resources == NULL)
+    {
+      ret = parse_section (config, "linux.resources", &tree, err);
+      if (ret <= 0)
+        return ret;
+
+      config->resources = make_runtime_spec_schema_config_linux_resources (tree, &ctx, &parser_err);
+      yajl_tree_free (tree);
+      if (UNLIKELY (config->resources == NULL))
+        {
+          ret = crun_make_error (err, 0, "cannot parse `linux.resources`: %s", parser_err);
+          free (parser_err);
+          return ret;
+        }
+      free (parser_err);
+    }
+
+  *out = config->resources;
+  return 1;
+}
+
+int
+libcrun_lazy_config_get_mounts (libcrun_lazy_config_t *config, runtime_spec_schema_defs_mount ***out, size_t *len,
+                                libcrun_error_t *err)
+{
+  struct parser_context ctx = { 0, stderr };
+  yajl_val tree = NULL;
+  size_t i;
+  int ret;
+
+  if (! config->mounts_loaded)
+    {
+      ret = parse_section (config, "mounts", &tree, err);
+      if (ret <= 0)
+        return ret;
+
+      if (! YAJL_IS_ARRAY (tree))
+        {
+          yajl_tree_free (tree);
+          return crun_make_error (err, 0, "invalid `mounts`: expected an array");
+        }
+
+      config->mounts = xmalloc0 (sizeof (*config->mounts) * (tree->u.array.len + 1));
+      for (i = 0; i < tree->u.array.len; i++)
+        {
+          parser_error parser_err = NULL;
+
+          config->mounts[i] = make_runtime_spec_schema_defs_mount (tree->u.array.values[i], &ctx, &parser_err);
+          if (UNLIKELY (config->mounts[i] == NULL))
+            {
+              ret = crun_make_error (err, 0, "cannot parse mount %zu: %s", i, parser_err);
+              free (parser_err);
+              yajl_tree_free (tree);
+              for (i = 0; i < config->mounts_len; i++)
+                free_runtime_spec_schema_defs_mount (config->mounts[i]);
+              free (config->mounts);
+              config->mounts = NULL;
+              config->mounts_len = 0;
+              return ret;
+            }
+          free (parser_err);
+          config->mounts_len++;
+        }
+      yajl_tree_free (tree);
+      config->mounts_loaded = true;
+    }
+
+  *out = config->mounts;
+  *len = config->mounts_len;
+  return 1;
+}
+
+libcrun_container_t *
+libcrun_lazy_config_to_container (libcrun_lazy_config_t *config, libcrun_error_t *err)
+{
+  return libcrun_container_load_from_memory (config->json, err);
+}
@@ -52,13 +52,17 @@
 #include "scheduler.h"
 #include "intelrdt.h"
 #include "io_priority.h"
+#include "userns-cache.h"
 
 #include <sys/socket.h>
 #include <libgen.h>
 #include <sys/wait.h>
 #include <sys/vfs.h>
+#include <sys/statvfs.h>
+#include <sys/file.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <time.h>
 #include <sys/personality.h>
 #include <net/if.h>
 #include <sys/xattr.h>
@@ -144,6 +148,19 @@ struct private_data_s
   /* Used to save stdin, stdout, stderr during checkpointing to descriptors.json
    * and needed during restore. */
   char *external_descriptors;
+
+  /* User namespaces created or found in the cache for the idmapped
+     mounts, so that mounts with the same mappings share them.  */
+  struct idmap_userns_s *idmap_userns;
+  size_t idmap_userns_len;
+  size_t userns_cache_hits;
+  size_t userns_cache_misses;
+};
+
+struct idmap_userns_s
+{
+  userns_cache_key_t key;
+  int fd;
 };
 
 struct linux_namespace_s
@@ -157,6 +174,7 @@ static void
 cleanup_private_data (void *private_data)
 {
   struct private_data_s *p = private_data;
+  size_t i;
 
   if (p->rootfsfd >= 0)
     TEMP_FAILURE_RETRY (close (p->rootfsfd));
@@ -165,6 +183,10 @@ cleanup_private_data (void *private_data)
   if (p->dev_fds)
     cleanup_close_mapp (&(p->dev_fds));
 
+  for (i = 0; i < p->idmap_userns_len; i++)
+    TEMP_FAILURE_RETRY (close (p->idmap_userns[i].fd));
+  free (p->idmap_userns);
+
   free (p->host_notify_socket_path);
   free (p->container_notify_socket_path);
   free (p->external_descriptors);
@@ -621,18 +643,62 @@ has_same_mappings (runtime_spec_schema_config_schema *def, runtime_spec_schema_d
   return true;
 }
 
-static pid_t
-maybe_create_userns_for_idmapped_mount (runtime_spec_schema_config_schema *def,
-                                        runtime_spec_schema_defs_mount *mnt,
-                                        const char *options, pid_t *pid_out,
-                                        libcrun_error_t *err)
+static int
+format_idmapped_mount_mappings (runtime_spec_schema_config_schema *def,
+                                runtime_spec_schema_defs_mount *mnt,
+                                const char *options,
+                                char **uid_map, size_t *uid_map_len,
+                                char **gid_map, size_t *gid_map_len,
+                                libcrun_error_t *err)
+{
+  cleanup_free char *dup_options = NULL;
+  char *option, *saveptr = NULL;
+
+  if (mnt->uid_mappings_len)
+    {
+      *uid_map = format_mount_mappings (mnt->uid_mappings, mnt->uid_mappings_len, uid_map_len);
+      *gid_map = format_mount_mappings (mnt->gid_mappings, mnt->gid_mappings_len, gid_map_len);
+      return 0;
+    }
+
+  if (! options)
+    return crun_make_error (err, 0, "internal error: no mappings found");
+
+  dup_options = xstrdup (options);
+
+  /* If there are no OCI mappings specified, then parse the annotation.  */
+  for (option = strtok_r (dup_options, ";", &saveptr); option; option = strtok_r (NULL, ";", &saveptr))
+    {
+      bool is_uids = false;
+      char **out;
+      size_t *len;
+      int ret;
+
+      if (has_prefix (option, "uids="))
+        is_uids = true;
+      else if (! has_prefix (option, "gids="))
+        return crun_make_error (err, 0, "invalid option `%s` specified", option);
+
+      out = is_uids ? uid_map : gid_map;
+      len = is_uids ? uid_map_len : gid_map_len;
+      if (*out)
+        return crun_make_error (err, 0, "mappings specified multiple times in `%s`", options);
+
+      ret = parse_idmapped_mount_option (def, is_uids, option + 5 /* strlen ("uids="), strlen ("gids=")*/, out, len, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+    }
+  return 0;
+}
+
+static int
+create_userns_for_idmapped_mount (const char *uid_map, size_t uid_map_len,
+                                  const char *gid_map, size_t gid_map_len,
+                                  pid_t *pid_out, libcrun_error_t *err)
 {
   cleanup_pid pid_t pid = -1;
   char proc_file[64];
-  bool need_new_userns = mnt->uid_mappings_len ? ! has_same_mappings (def, mnt) : options != NULL;
-
-  if (! need_new_userns)
-    return 0;
+  int ret;
 
   pid = syscall_clone (CLONE_NEWUSER | SIGCHLD, NULL);
   if (UNLIKELY (pid < 0))
@@ -646,66 +712,156 @@ maybe_create_userns_for_idmapped_mount (runtime_spec_schema_config_schema *def,
       _exit (EXIT_SUCCESS);
     }
 
-  if (mnt->uid_mappings_len)
+  if (uid_map)
     {
-      cleanup_free char *uid_map = NULL;
-      cleanup_free char *gid_map = NULL;
-      size_t written = 0;
-      int ret;
-
-      uid_map = format_mount_mappings (mnt->uid_mappings, mnt->uid_mappings_len, &written);
       sprintf (proc_file, "/proc/%d/uid_map", pid);
-      ret = write_file (proc_file, uid_map, written, err);
+      ret = write_file (proc_file, uid_map, uid_map_len, err);
       if (UNLIKELY (ret < 0))
         return ret;
+    }
 
-      gid_map = format_mount_mappings (mnt->gid_mappings, mnt->gid_mappings_len, &written);
+  if (gid_map)
+    {
       sprintf (proc_file, "/proc/%d/gid_map", pid);
-      ret = write_file (proc_file, gid_map, written, err);
+      ret = write_file (proc_file, gid_map, gid_map_len, err);
       if (UNLIKELY (ret < 0))
         return ret;
     }
-  else
+
+  *pid_out = pid;
+  pid = -1;
+  return 0;
+}
+
+#define USERNS_CACHE_DEFAULT_MAX_ENTRIES 64
+
+/* Returns the maximum number of user namespaces to keep in the
+   persistent cache, or 0 if the cache is not enabled.  */
+static size_t
+get_userns_cache_max_entries (libcrun_container_t *container)
+{
+  const char *annotation;
+  char *endptr = NULL;
+  unsigned long value;
+
+  annotation = find_annotation (container, "run.oci.userns_cache");
+  if (annotation == NULL || strcmp (annotation, "1") != 0)
+    return 0;
+
+  annotation = find_annotation (container, "run.oci.userns_cache.max_entries");
+  if (annotation == NULL)
+    return USERNS_CACHE_DEFAULT_MAX_ENTRIES;
+
+  errno = 0;
+  value = strtoul (annotation, &endptr, 10);
+  if (errno || endptr == annotation || *endptr != '\0' || value == 0)
     {
-      cleanup_free char *dup_options = NULL;
-      char *option, *saveptr = NULL;
+      libcrun_warning ("invalid value `%s` for `run.oci.userns_cache.max_entries`, using %d", annotation,
+                       USERNS_CACHE_DEFAULT_MAX_ENTRIES);
+      return USERNS_CACHE_DEFAULT_MAX_ENTRIES;
+    }
+  return value;
+}
 
-      if (! options)
-        return crun_make_error (err, 0, "internal error: no mappings found");
+static int
+dup_userns_fd (int fd, int *out_fd, libcrun_error_t *err)
+{
+  *out_fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+  if (UNLIKELY (*out_fd < 0))
+    return crun_make_error (err, errno, "dup user namespace fd");
+  return 0;
+}
 
-      dup_options = xstrdup (options);
+/* Get a user namespace with the mappings requested for the idmapped
+   mount MNT.  Mounts with the same mappings share the same user
+   namespace, and when run.oci.userns_cache=1 is set, the user namespace
+   is also looked up and stored in the cache under the state root so
+   that other containers can reuse it.  */
+static int
+get_userns_for_idmapped_mount (libcrun_container_t *container, runtime_spec_schema_defs_mount *mnt,
+                               const char *options, int *out_fd, libcrun_error_t *err)
+{
+  struct private_data_s *private_data = get_private_data (container);
+  cleanup_free char *uid_map = NULL;
+  cleanup_free char *gid_map = NULL;
+  size_t uid_map_len = 0, gid_map_len = 0;
+  cleanup_close int fd = -1;
+  struct idmap_userns_s *entry;
+  const char *state_root = NULL;
+  userns_cache_key_t key;
+  size_t max_entries;
+  size_t i;
+  int ret;
 
-      /* If there are no OCI mappings specified, then parse the annotation.  */
-      for (option = strtok_r (dup_options, ";", &saveptr); option; option = strtok_r (NULL, ";", &saveptr))
+  ret = format_idmapped_mount_mappings (container->container_def, mnt, options, &uid_map, &uid_map_len, &gid_map,
+                                        &gid_map_len, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  libcrun_userns_cache_key (uid_map, uid_map_len, gid_map, gid_map_len, key);
+
+  for (i = 0; i < private_data->idmap_userns_len; i++)
+    if (strcmp (private_data->idmap_userns[i].key, key) == 0)
+      {
+        private_data->userns_cache_hits++;
+        return dup_userns_fd (private_data->idmap_userns[i].fd, out_fd, err);
+      }
+
+  max_entries = get_userns_cache_max_entries (container);
+  if (max_entries > 0 && container->context && geteuid () == 0)
+    state_root = container->context->state_root;
+
+  if (max_entries > 0 && state_root)
+    {
+      libcrun_error_t tmp_err = NULL;
+
+      ret = libcrun_userns_cache_lookup (state_root, key, &fd, &tmp_err);
+      if (UNLIKELY (ret < 0))
         {
-          cleanup_free char *mappings = NULL;
-          bool is_uids = false;
-          size_t len = 0;
-          int ret;
+          libcrun_debug ("userns cache lookup failed: %s", tmp_err->msg);
+          crun_error_release (&tmp_err);
+        }
+    }
 
-          if (has_prefix (option, "uids="))
-            {
-              is_uids = true;
-              sprintf (proc_file, "/proc/%d/uid_map", pid);
-            }
-          else if (has_prefix (option, "gids="))
-            sprintf (proc_file, "/proc/%d/gid_map", pid);
-          else
-            return crun_make_error (err, 0, "invalid option `%s` specified", option);
+  if (fd >= 0)
+    private_data->userns_cache_hits++;
+  else
+    {
+      cleanup_pid pid_t pid = -1;
+      char proc_path[64];
 
-          ret = parse_idmapped_mount_option (def, is_uids, option + 5 /* strlen ("uids="), strlen ("gids=")*/, &mappings, &len, err);
-          if (UNLIKELY (ret < 0))
-            return ret;
+      ret = create_userns_for_idmapped_mount (uid_map, uid_map_len, gid_map, gid_map_len, &pid, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
 
-          ret = write_file (proc_file, mappings, len, err);
+      sprintf (proc_path, "/proc/%d/ns/user", pid);
+      fd = open (proc_path, O_RDONLY | O_CLOEXEC);
+      if (UNLIKELY (fd < 0))
+        return crun_make_error (err, errno, "open `%s`", proc_path);
+
+      if (max_entries > 0 && state_root)
+        {
+          libcrun_error_t tmp_err = NULL;
+
+          ret = libcrun_userns_cache_store (state_root, key, pid, max_entries, &tmp_err);
           if (UNLIKELY (ret < 0))
-            return ret;
+            {
+              libcrun_debug ("userns cache store failed: %s", tmp_err->msg);
+              crun_error_release (&tmp_err);
+            }
         }
+
+      private_data->userns_cache_misses++;
     }
 
-  *pid_out = pid;
-  pid = -1;
-  return 0;
+  private_data->idmap_userns = xrealloc (private_data->idmap_userns,
+                                         sizeof (struct idmap_userns_s) * (private_data->idmap_userns_len + 1));
+  entry = &private_data->idmap_userns[private_data->idmap_userns_len++];
+  memcpy (entry->key, key, sizeof (key));
+  entry->fd = fd;
+  fd = -1;
+
+  return dup_userns_fd (entry->fd, out_fd, err);
 }
 
 int
@@ -1120,6 +1276,8 @@ do_mount (libcrun_container_t *container, const char *source, int targetfd,
   else
     label_how = LABEL_NONE;
 
+  safe_openat_cache_invalidate (targetfd);
+
   if (targetfd >= 0)
     {
       get_proc_self_fd_path (target_buffer, targetfd);
@@ -1289,6 +1447,7 @@ try_umount (int targetfd, const char *target)
       get_proc_self_fd_path (target_buffer, targetfd);
       real_target = target_buffer;
     }
+  safe_openat_cache_invalidate (targetfd);
   umount2 (real_target, MNT_DETACH);
 }
 
@@ -1582,6 +1741,9 @@ struct device_s needed_devs[] = { { "/dev/null", "c", 1, 3, 0666, 0, 0 },
                                   { "/dev/urandom", "c", 1, 9, 0666, 0, 0 },
                                   {} };
 
+/* Number of entries in needed_devs, without the terminator.  */
+#define N_NEEDED_DEVS (sizeof (needed_devs) / sizeof (needed_devs[0]) - 1)
+
 /* Check if the specified path is a direct child of /dev.  If it is
  return a pointer to the basename.  */
 static const char *
@@ -1794,8 +1956,12 @@ create_missing_devs (libcrun_container_t *container, bool binds, libcrun_error_t
 
   for (it = needed_devs; it->path; it++)
     {
+      /* The default devices can be already prepared by prepare_and_send_dev_mounts.  */
+      size_t index = def->linux->devices_len + (it - needed_devs);
+      int srcfd = (dev_fds && index < dev_fds->nfds) ? dev_fds->fds[index] : -1;
+
       /* make sure the parent directory exists only on the first iteration.  */
-      ret = libcrun_create_dev (container, devfd, -1, it, binds, it == needed_devs, err);
+      ret = libcrun_create_dev (container, devfd, srcfd, it, binds, it == needed_devs, err);
       if (UNLIKELY (ret < 0))
         return ret;
     }
@@ -2058,6 +2224,21 @@ get_force_cgroup_v1_annotation (libcrun_container_t *container)
   return find_annotation (container, "run.oci.systemd.force_cgroup_v1");
 }
 
+/* Maximum number of processes used to copy the content of a tmpcopyup
+   mount.  */
+#define TMPCOPYUP_MAX_WORKERS 4
+
+static unsigned int
+get_tmpcopyup_workers ()
+{
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+  if (cpus < 1)
+    return 1;
+
+  return cpus < TMPCOPYUP_MAX_WORKERS ? cpus : TMPCOPYUP_MAX_WORKERS;
+}
+
 static int
 do_mounts (libcrun_container_t *container, int rootfsfd, const char *rootfs, const char *unified_cgroup_path, libcrun_error_t *err)
 {
@@ -2067,6 +2248,10 @@ do_mounts (libcrun_container_t *container, int rootfsfd, const char *rootfs, con
   size_t rootfs_len = get_private_data (container)->rootfs_len;
   const char *systemd_cgroup_v1 = get_force_cgroup_v1_annotation (container);
   cleanup_close_map struct libcrun_fd_map *mount_fds = NULL;
+  struct copy_recursive_stats_s copy_stats = {
+    0,
+  };
+  size_t copied_mounts = 0;
 
   mount_fds = get_private_data (container)->mount_fds;
   get_private_data (container)->mount_fds = NULL;
@@ -2217,6 +2402,7 @@ do_mounts (libcrun_container_t *container, int rootfsfd, const char *rootfs, con
         {
           cleanup_close int mfd = get_and_reset (&(mount_fds->fds[i]));
 
+          safe_openat_cache_invalidate (targetfd);
           ret = fs_move_mount_to (mfd, targetfd, NULL);
           if (LIKELY (ret == 0))
             {
@@ -2269,9 +2455,11 @@ do_mounts (libcrun_container_t *container, int rootfsfd, const char *rootfs, con
           /* take ownership for the fd.  */
           tmpfd = get_and_reset (&copy_from_fd);
 
-          ret = copy_recursive_fd_to_fd (tmpfd, destfd, target, target, err);
+          ret = copy_recursive_fd_to_fd (tmpfd, destfd, target, target, get_tmpcopyup_workers (), &copy_stats, err);
           if (UNLIKELY (ret < 0))
             return ret;
+
+          copied_mounts++;
         }
 
       if (rec_clear || rec_set)
@@ -2288,6 +2476,11 @@ do_mounts (libcrun_container_t *container, int rootfsfd, const char *rootfs, con
             return ret;
         }
     }
+
+  if (copied_mounts)
+    libcrun_debug ("tmpcopyup: copied %" PRIu64 " files and %" PRIu64 " bytes for %zu mounts", copy_stats.files,
+                   copy_stats.bytes, copied_mounts);
+
   return 0;
 }
 
@@ -2519,6 +2712,7 @@ do_finalize_notify_socket (libcrun_container_t *container, libcrun_error_t *err)
 
   if (notify_socket_tree_fd >= 0)
     {
+      safe_openat_cache_invalidate (-1);
       ret = syscall_move_mount (notify_socket_tree_fd, "", AT_FDCWD, container_notify_socket_path_dir,
                                 MOVE_MOUNT_F_EMPTY_PATH);
       if (ret >= 0)
@@ -2585,6 +2779,7 @@ libcrun_set_mounts (struct container_entrypoint_s *entrypoint_args, libcrun_cont
   runtime_spec_schema_config_schema *def = container->container_def;
   cleanup_free char *unified_cgroup_path = NULL;
   cleanup_close int rootfsfd_cleanup = -1;
+  cleanup_safe_openat_cache bool resolve_cache = false;
   unsigned long rootfs_propagation = 0;
   int rootfsfd = -1;
   int cgroup_mode;
@@ -2665,6 +2860,10 @@ libcrun_set_mounts (struct container_entrypoint_s *entrypoint_args, libcrun_cont
   if (UNLIKELY (ret < 0))
     return ret;
 
+  /* Cache the directories resolved under the rootfs while the mounts are created.  */
+  safe_openat_cache_begin (rootfsfd);
+  resolve_cache = true;
+
   ret = do_mounts (container, rootfsfd, rootfs, unified_cgroup_path, err);
   if (UNLIKELY (ret < 0))
     return ret;
@@ -2690,6 +2889,9 @@ libcrun_set_mounts (struct container_entrypoint_s *entrypoint_args, libcrun_cont
   /* Notify the callback after all the mounts are ready but before making them read-only.  */
   if (cb)
     {
+      /* The callback can change the mounts.  */
+      safe_openat_cache_invalidate (-1);
+
       ret = cb (cb_data, err);
       if (UNLIKELY (ret < 0))
         return ret;
@@ -2713,6 +2915,9 @@ libcrun_set_mounts (struct container_entrypoint_s *entrypoint_args, libcrun_cont
   if (UNLIKELY (ret < 0))
     return ret;
 
+  safe_openat_cache_end ();
+  resolve_cache = false;
+
   ret = finalize_mounts (container, err);
   if (UNLIKELY (ret < 0))
     return ret;
@@ -2880,15 +3085,133 @@ uidgidmap_helper (char *helper, pid_t pid, char *map_file, libcrun_error_t *err)
   return run_process (args, err) ? -1 : 0;
 }
 
+/* Time given to the uid map helper for each read and write on the
+   socket, before falling back to newuidmap and newgidmap.  */
+#define UIDGIDMAP_HELPER_TIMEOUT 2
+
+/* Connection to the helper set with RUN_OCI_UIDMAP_HELPER, used in place
+   of newuidmap and newgidmap.  It is opened on the first request and
+   used for both the uid and the gid mappings.  After a failure the
+   connection is in an unknown state, so it is closed and the helper is
+   not used anymore.  */
+struct uidgidmap_socket_s
+{
+  const char *path;
+  int fd;
+  bool used;
+};
+
+static void
+cleanup_uidgidmap_socketp (struct uidgidmap_socket_s *helper)
+{
+  if (helper->fd >= 0)
+    TEMP_FAILURE_RETRY (close (helper->fd));
+}
+#define cleanup_uidgidmap_socket __attribute__ ((cleanup (cleanup_uidgidmap_socketp)))
+
+static void
+uidgidmap_socket_disable (struct uidgidmap_socket_s *helper)
+{
+  cleanup_uidgidmap_socketp (helper);
+  helper->fd = -1;
+  helper->path = NULL;
+}
+
+static int
+uidgidmap_socket (struct uidgidmap_socket_s *helper, const char *kind, pid_t pid, const char *map, size_t map_len,
+                  libcrun_error_t *err)
+{
+  char header[64];
+  char reply[256];
+  size_t reply_len = 0;
+  int header_len;
+  char *endptr;
+  long status;
+  int ret;
+
+  if (helper->fd < 0)
+    {
+      struct timeval timeout = {
+        .tv_sec = UIDGIDMAP_HELPER_TIMEOUT,
+      };
+
+      helper->fd = open_unix_domain_client_socket (helper->path, 0, err);
+      if (UNLIKELY (helper->fd < 0))
+        return helper->fd;
+
+      ret = setsockopt (helper->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+      if (LIKELY (ret == 0))
+        ret = setsockopt (helper->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+      if (UNLIKELY (ret < 0))
+        return crun_make_error (err, errno, "setsockopt `%s`", helper->path);
+    }
+
+  header_len = snprintf (header, sizeof (header), "%s %d %zu\n", kind, pid, map_len);
+
+  ret = safe_write (helper->fd, header, header_len);
+  if (ret >= 0)
+    ret = safe_write (helper->fd, map, map_len);
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "write to `%s`", helper->path);
+
+  while (reply_len == 0 || reply[reply_len - 1] != '\n')
+    {
+      ssize_t r;
+
+      if (UNLIKELY (reply_len == sizeof (reply) - 1))
+        return crun_make_error (err, 0, "invalid reply from `%s`", helper->path);
+
+      r = TEMP_FAILURE_RETRY (read (helper->fd, reply + reply_len, sizeof (reply) - 1 - reply_len));
+      if (UNLIKELY (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+        return crun_make_error (err, ETIMEDOUT, "timeout waiting for `%s`", helper->path);
+      if (UNLIKELY (r < 0))
+        return crun_make_error (err, errno, "read from `%s`", helper->path);
+      if (UNLIKELY (r == 0))
+        return crun_make_error (err, 0, "`%s` closed the connection", helper->path);
+      reply_len += r;
+    }
+  reply[reply_len - 1] = '\0';
+
+  errno = 0;
+  status = strtol (reply, &endptr, 10);
+  if (UNLIKELY (errno != 0 || endptr == reply))
+    return crun_make_error (err, 0, "invalid reply from `%s`", helper->path);
+  if (status != 0)
+    return crun_make_error (err, (int) status, "set %s mapping with `%s`:%s", kind, helper->path, endptr);
+
+  helper->used = true;
+  return 0;
+}
+
 static int
-newgidmap (pid_t pid, char *map_file, libcrun_error_t *err)
+newgidmap (pid_t pid, char *map_file, size_t map_len, struct uidgidmap_socket_s *helper, libcrun_error_t *err)
 {
+  if (helper->path)
+    {
+      int ret = uidgidmap_socket (helper, "gid", pid, map_file, map_len, err);
+      if (LIKELY (ret == 0))
+        return ret;
+
+      libcrun_debug ("cannot use the uid map helper, falling back to `newgidmap`: %s", (*err)->msg);
+      crun_error_release (err);
+      uidgidmap_socket_disable (helper);
+    }
   return uidgidmap_helper ("newgidmap", pid, map_file, err);
 }
 
 static int
-newuidmap (pid_t pid, char *map_file, libcrun_error_t *err)
+newuidmap (pid_t pid, char *map_file, size_t map_len, struct uidgidmap_socket_s *helper, libcrun_error_t *err)
 {
+  if (helper->path)
+    {
+      int ret = uidgidmap_socket (helper, "uid", pid, map_file, map_len, err);
+      if (LIKELY (ret == 0))
+        return ret;
+
+      libcrun_debug ("cannot use the uid map helper, falling back to `newuidmap`: %s", (*err)->msg);
+      crun_error_release (err);
+      uidgidmap_socket_disable (helper);
+    }
   return uidgidmap_helper ("newuidmap", pid, map_file, err);
 }
 
@@ -3006,10 +3329,24 @@ libcrun_set_usernamespace (libcrun_container_t *container, pid_t pid, libcrun_er
   size_t uid_map_len = 0, gid_map_len = 0;
   int ret = 0;
   runtime_spec_schema_config_schema *def = container->container_def;
+  cleanup_uidgidmap_socket struct uidgidmap_socket_s helper = {
+    .path = NULL,
+    .fd = -1,
+  };
+  struct timespec start, end;
 
   if ((get_private_data (container)->unshare_flags & CLONE_NEWUSER) == 0)
     return 0;
 
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  if (container->host_uid)
+    {
+      helper.path = getenv ("RUN_OCI_UIDMAP_HELPER");
+      if (helper.path && helper.path[0] == '\0')
+        helper.path = NULL;
+    }
+
   if (def->linux->uid_mappings_len)
     uid_map = format_mount_mappings (def->linux->uid_mappings, def->linux->uid_mappings_len, &uid_map_len);
   else
@@ -3029,7 +3366,7 @@ libcrun_set_usernamespace (libcrun_container_t *container, pid_t pid, libcrun_er
     }
 
   if (container->host_uid)
-    ret = newgidmap (pid, gid_map, err);
+    ret = newgidmap (pid, gid_map, gid_map_len, &helper, err);
   if (container->host_uid == 0 || ret < 0)
     {
       if (ret < 0)
@@ -3060,7 +3397,7 @@ libcrun_set_usernamespace (libcrun_container_t *container, pid_t pid, libcrun_er
     return ret;
 
   if (container->host_uid)
-    ret = newuidmap (pid, uid_map, err);
+    ret = newuidmap (pid, uid_map, uid_map_len, &helper, err);
   if (container->host_uid == 0 || ret < 0)
     {
       if (ret < 0)
@@ -3090,9 +3427,15 @@ libcrun_set_usernamespace (libcrun_container_t *container, pid_t pid, libcrun_er
           ret = write_file (uid_map_file, single_mapping, single_mapping_len, err);
         }
     }
+
   if (UNLIKELY (ret < 0))
     return ret;
 
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  libcrun_debug ("user namespace mappings written in %lld us%s",
+                 (long long) ((end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000),
+                 helper.used ? " with the uid map helper" : "");
+
   return 0;
 }
 
@@ -3940,6 +4283,13 @@ root_mapped_in_container_p (runtime_spec_schema_defs_id_mapping **mappings, size
   return false;
 }
 
+/* The map holds the devices in the configuration followed by needed_devs.  */
+static size_t
+get_devices_fd_map_size (runtime_spec_schema_config_schema *def)
+{
+  return def->linux ? def->linux->devices_len + N_NEEDED_DEVS : 0;
+}
+
 static struct libcrun_fd_map *
 get_devices_fd_map (libcrun_container_t *container)
 {
@@ -3947,10 +4297,7 @@ get_devices_fd_map (libcrun_container_t *container)
 
   if (dev_fds == NULL)
     {
-      runtime_spec_schema_config_schema *def = container->container_def;
-      size_t len = def->linux ? def->linux->devices_len : 0;
-
-      dev_fds = make_libcrun_fd_map (len);
+      dev_fds = make_libcrun_fd_map (get_devices_fd_map_size (container->container_def));
       get_private_data (container)->dev_fds = dev_fds;
     }
   return dev_fds;
@@ -4013,10 +4360,10 @@ get_idmapped_option (runtime_spec_schema_defs_mount *mnt, bool *recursive)
 }
 
 static int
-maybe_get_idmapped_mount (runtime_spec_schema_config_schema *def, runtime_spec_schema_defs_mount *mnt, pid_t pid, int *out_fd, libcrun_error_t *err)
+maybe_get_idmapped_mount (libcrun_container_t *container, runtime_spec_schema_defs_mount *mnt, pid_t pid, int *out_fd, libcrun_error_t *err)
 {
+  runtime_spec_schema_config_schema *def = container->container_def;
   cleanup_close int newfs_fd = -1;
-  cleanup_pid pid_t created_pid = -1;
   struct mount_attr_s attr = {
     0,
   };
@@ -4054,16 +4401,19 @@ maybe_get_idmapped_mount (runtime_spec_schema_config_schema *def, runtime_spec_s
         }
     }
 
-  ret = maybe_create_userns_for_idmapped_mount (def, mnt, options, &created_pid, err);
-  if (UNLIKELY (ret < 0))
-    return ret;
-  if (created_pid > 0)
-    pid = created_pid;
-
-  sprintf (proc_path, "/proc/%d/ns/user", pid);
-  fd = open (proc_path, O_RDONLY | O_CLOEXEC);
-  if (UNLIKELY (fd < 0))
-    return crun_make_error (err, errno, "open `%s`", proc_path);
+  if (mnt->uid_mappings_len ? ! has_same_mappings (def, mnt) : options != NULL)
+    {
+      ret = get_userns_for_idmapped_mount (container, mnt, options, &fd, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+    }
+  else
+    {
+      sprintf (proc_path, "/proc/%d/ns/user", pid);
+      fd = open (proc_path, O_RDONLY | O_CLOEXEC);
+      if (UNLIKELY (fd < 0))
+        return crun_make_error (err, errno, "open `%s`", proc_path);
+    }
 
   if (is_bind_mount (mnt, &recursive_bind_mount))
     {
@@ -4161,9 +4511,15 @@ precreate_device (libcrun_container_t *container, int devs_dirfd, size_t i, libc
   return get_bind_mount (devs_dirfd, name, false, false, err);
 }
 
+/* Maximum number of FDs sent with a single SCM_RIGHTS message.  */
+#define MAX_FDS_PER_MESSAGE 64
+
 static int
 send_mounts (int sync_socket_host, struct libcrun_fd_map *fds, size_t how_many, size_t total, libcrun_error_t *err)
 {
+  size_t indexes[MAX_FDS_PER_MESSAGE];
+  int batch[MAX_FDS_PER_MESSAGE];
+  size_t n = 0;
   size_t i;
   int ret;
 
@@ -4173,16 +4529,51 @@ send_mounts (int sync_socket_host, struct libcrun_fd_map *fds, size_t how_many,
 
   for (i = 0; i < total; i++)
     {
-      if (fds->fds[i] >= 0)
+      if (fds->fds[i] < 0)
+        continue;
+
+      indexes[n] = i;
+      batch[n] = fds->fds[i];
+      n++;
+
+      /* The receiver expects full batches followed by the remainder.  */
+      if (n == MAX_FDS_PER_MESSAGE)
         {
-          ret = send_fd_to_socket_with_payload (sync_socket_host, fds->fds[i], (char *) &i, sizeof (i), err);
+          ret = send_fds_to_socket_with_payload (sync_socket_host, batch, n, (char *) indexes, n * sizeof (size_t), err);
           if (UNLIKELY (ret < 0))
             return ret;
+          n = 0;
         }
     }
+
+  if (n > 0)
+    return send_fds_to_socket_with_payload (sync_socket_host, batch, n, (char *) indexes, n * sizeof (size_t), err);
+
   return 0;
 }
 
+static void
+report_userns_cache_stats (libcrun_container_t *container)
+{
+  struct private_data_s *private_data = get_private_data (container);
+  libcrun_error_t tmp_err = NULL;
+  int ret;
+
+  if (private_data->userns_cache_hits + private_data->userns_cache_misses == 0)
+    return;
+
+  libcrun_debug ("idmapped mounts user namespaces: %zu reused, %zu created", private_data->userns_cache_hits,
+                 private_data->userns_cache_misses);
+
+  if (container->context == NULL || geteuid () > 0 || get_userns_cache_max_entries (container) == 0)
+    return;
+
+  ret = libcrun_userns_cache_update_stats (container->context->state_root, private_data->userns_cache_hits,
+                                           private_data->userns_cache_misses, &tmp_err);
+  if (UNLIKELY (ret < 0))
+    crun_error_release (&tmp_err);
+}
+
 static int
 prepare_and_send_mount_mounts (libcrun_container_t *container, pid_t pid, int sync_socket_host, libcrun_error_t *err)
 {
@@ -4216,7 +4607,7 @@ prepare_and_send_mount_mounts (libcrun_container_t *container, pid_t pid, int sy
 
       mount_fds->fds[i] = -1;
 
-      ret = maybe_get_idmapped_mount (def, def->mounts[i], pid, &(mount_fds->fds[i]), err);
+      ret = maybe_get_idmapped_mount (container, def->mounts[i], pid, &(mount_fds->fds[i]), err);
       if (UNLIKELY (ret < 0))
         return ret;
 
@@ -4231,9 +4622,216 @@ prepare_and_send_mount_mounts (libcrun_container_t *container, pid_t pid, int sy
         how_many++;
     }
 
+  report_userns_cache_stats (container);
+
   return send_mounts (sync_socket_host, mount_fds, how_many, def->mounts_len, err);
 }
 
+/* Directory under the state root where the device nodes shared by
+   the containers are created.  */
+#define DEVICES_TEMPLATE_DIR ".cache/devs"
+
+/* Lock serializing the changes to the template.  It is kept outside of
+   DEVICES_TEMPLATE_DIR so that the same file is locked before and after
+   the tmpfs is mounted there.  */
+#define DEVICES_TEMPLATE_LOCK ".cache/devs.lock"
+
+static bool
+use_devices_template (libcrun_container_t *container)
+{
+  const char *annotation;
+
+  /* The template is shared, so it cannot carry the SELinux label of a
+     single container.  */
+  if (container->container_def->linux && container->container_def->linux->mount_label)
+    return false;
+
+  annotation = find_annotation (container, "run.oci.devices_template");
+  return annotation && strcmp (annotation, "1") == 0;
+}
+
+/* Open the devices template, mounting a tmpfs on it the first time
+   since the state root is usually on a nodev file system.  On success
+   *LOCKFD holds the lock on the template, which must be kept until the
+   nodes needed by the container are created.  */
+static int
+open_devices_template (libcrun_container_t *container, int *lockfd, libcrun_error_t *err)
+{
+  cleanup_free char *state_dir = NULL;
+  cleanup_free char *lock_path = NULL;
+  cleanup_free char *path = NULL;
+  cleanup_close int lfd = -1;
+  struct statvfs st;
+  int fd;
+  int ret;
+
+  state_dir = libcrun_get_state_directory (container->context->state_root, NULL);
+  if (state_dir == NULL)
+    return crun_make_error (err, 0, "cannot get the state directory");
+
+  ret = append_paths (&path, err, state_dir, DEVICES_TEMPLATE_DIR, NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  ret = append_paths (&lock_path, err, state_dir, DEVICES_TEMPLATE_LOCK, NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  ret = crun_ensure_directory (path, 0700, true, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  lfd = open (lock_path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (UNLIKELY (lfd < 0))
+    return crun_make_error (err, errno, "open `%s`", lock_path);
+
+  ret = TEMP_FAILURE_RETRY (flock (lfd, LOCK_EX));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "flock `%s`", lock_path);
+
+  fd = open (path, O_DIRECTORY | O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (UNLIKELY (fd < 0))
+    return crun_make_error (err, errno, "open `%s`", path);
+
+  ret = fstatvfs (fd, &st);
+  if (UNLIKELY (ret < 0))
+    {
+      ret = crun_make_error (err, errno, "statvfs `%s`", path);
+      TEMP_FAILURE_RETRY (close (fd));
+      return ret;
+    }
+
+  if (st.f_flag & ST_NODEV)
+    {
+      TEMP_FAILURE_RETRY (close (fd));
+
+      ret = mount ("tmpfs", path, "tmpfs", MS_NOSUID | MS_NOEXEC, "mode=0700");
+      if (UNLIKELY (ret < 0))
+        return crun_make_error (err, errno, "mount tmpfs on `%s`", path);
+
+      ret = mount (NULL, path, NULL, MS_PRIVATE, NULL);
+      if (UNLIKELY (ret < 0))
+        return crun_make_error (err, errno, "make `%s` private", path);
+
+      fd = open (path, O_DIRECTORY | O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+      if (UNLIKELY (fd < 0))
+        return crun_make_error (err, errno, "open `%s`", path);
+    }
+
+  *lockfd = lfd;
+  lfd = -1;
+  return fd;
+}
+
+int
+libcrun_purge_devices_template (const char *state_root, libcrun_error_t *err)
+{
+  cleanup_free char *state_dir = NULL;
+  cleanup_free char *lock_path = NULL;
+  cleanup_free char *path = NULL;
+  cleanup_close int lockfd = -1;
+  cleanup_dir DIR *dir = NULL;
+  struct dirent *de;
+  int ret;
+
+  state_dir = libcrun_get_state_directory (state_root, NULL);
+  if (state_dir == NULL)
+    return crun_make_error (err, 0, "cannot get the state directory");
+
+  ret = append_paths (&path, err, state_dir, DEVICES_TEMPLATE_DIR, NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  ret = append_paths (&lock_path, err, state_dir, DEVICES_TEMPLATE_LOCK, NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  lockfd = open (lock_path, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+  if (lockfd < 0)
+    {
+      if (errno == ENOENT)
+        return 0;
+      return crun_make_error (err, errno, "open `%s`", lock_path);
+    }
+
+  ret = TEMP_FAILURE_RETRY (flock (lockfd, LOCK_EX));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "flock `%s`", lock_path);
+
+  /* The containers use clones of the nodes, so they are not affected.  */
+  ret = umount2 (path, MNT_DETACH);
+  if (UNLIKELY (ret < 0 && errno != EINVAL && errno != ENOENT))
+    return crun_make_error (err, errno, "umount `%s`", path);
+
+  /* Without the tmpfs the nodes were created directly in the directory.  */
+  dir = opendir (path);
+  if (dir == NULL)
+    {
+      if (errno == ENOENT)
+        return 0;
+      return crun_make_error (err, errno, "opendir `%s`", path);
+    }
+
+  while ((de = readdir (dir)))
+    {
+      if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
+        continue;
+
+      ret = unlinkat (dirfd (dir), de->d_name, 0);
+      if (UNLIKELY (ret < 0 && errno != ENOENT))
+        return crun_make_error (err, errno, "unlink `%s/%s`", path, de->d_name);
+    }
+
+  ret = rmdir (path);
+  if (UNLIKELY (ret < 0 && errno != ENOENT))
+    return crun_make_error (err, errno, "rmdir `%s`", path);
+
+  return 0;
+}
+
+/* Get a detached bind mount for the I-th device in the configuration,
+   creating the node in the template if it is not already there.  Nodes
+   are named after all their attributes, so containers that request the
+   same device with the same owner share it.  */
+static int
+get_device_from_template (libcrun_container_t *container, int templatefd, size_t i, libcrun_error_t *err)
+{
+  runtime_spec_schema_config_schema *def = container->container_def;
+  runtime_spec_schema_defs_linux_device *device = def->linux->devices[i];
+  uid_t uid;
+  gid_t gid;
+  char name[128];
+  mode_t type;
+  dev_t dev;
+  int ret;
+
+  type = (device->type[0] == 'b') ? S_IFBLK : ((device->type[0] == 'p') ? S_IFIFO : S_IFCHR);
+  dev = makedev (device->major, device->minor);
+
+  uid = get_id_in_user_namespace (device->uid, true, def);
+  gid = get_id_in_user_namespace (device->gid, false, def);
+
+  snprintf (name, sizeof (name), "%c-%lld-%lld-%o-%d-%d", device->type[0], (long long) device->major,
+            (long long) device->minor, (unsigned int) device->file_mode, uid, gid);
+
+  ret = mknodat (templatefd, name, device->file_mode | type, dev);
+  if (UNLIKELY (ret < 0 && errno != EEXIST))
+    return crun_make_error (err, errno, "mknod `%s`", device->path);
+
+  if (ret == 0)
+    {
+      ret = fchownat (templatefd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+      if (UNLIKELY (ret < 0))
+        {
+          ret = crun_make_error (err, errno, "chown `%s`", device->path);
+          unlinkat (templatefd, name, 0);
+          return ret;
+        }
+    }
+
+  return get_bind_mount (templatefd, name, false, false, err);
+}
+
 static int
 prepare_and_send_dev_mounts (libcrun_container_t *container, int sync_socket_host, libcrun_error_t *err)
 {
@@ -4248,20 +4846,68 @@ prepare_and_send_dev_mounts (libcrun_container_t *container, int sync_socket_hos
   const char *context_type = NULL;
   const char *label = NULL;
   size_t how_many = 0;
+  size_t total;
   size_t i;
   int ret;
 
-  if (def->linux == NULL || def->linux->devices_len == 0)
+  if (def->linux == NULL)
     return 0;
 
-  dev_fds = make_libcrun_fd_map (def->linux->devices_len);
+  total = get_devices_fd_map_size (def);
+  dev_fds = make_libcrun_fd_map (total);
 
   if (! has_userns || is_empty_string (container->context->id) || geteuid () > 0)
-    return send_mounts (sync_socket_host, dev_fds, how_many, def->linux->devices_len, err);
+    return send_mounts (sync_socket_host, dev_fds, how_many, total, err);
+
+  /* The default devices are bind mounted from the host, so prepare them
+     here and let the container only move them in place.  */
+  for (i = 0; i < N_NEEDED_DEVS; i++)
+    {
+      ret = get_bind_mount (-1, needed_devs[i].path, false, false, err);
+      if (UNLIKELY (ret < 0))
+        {
+          crun_error_release (err);
+          continue;
+        }
+
+      dev_fds->fds[def->linux->devices_len + i] = ret;
+      how_many++;
+    }
+
+  if (def->linux->devices_len == 0)
+    return send_mounts (sync_socket_host, dev_fds, how_many, total, err);
+
+  if (use_devices_template (container))
+    {
+      cleanup_close int templatefd = -1;
+      cleanup_close int lockfd = -1;
+
+      templatefd = open_devices_template (container, &lockfd, err);
+      if (LIKELY (templatefd >= 0))
+        {
+          for (i = 0; i < def->linux->devices_len; i++)
+            {
+              ret = get_device_from_template (container, templatefd, i, err);
+              if (UNLIKELY (ret < 0))
+                {
+                  crun_error_release (err);
+                  continue;
+                }
+
+              dev_fds->fds[i] = ret;
+              how_many++;
+            }
+
+          return send_mounts (sync_socket_host, dev_fds, how_many, total, err);
+        }
+
+      libcrun_debug ("cannot use the devices template: %s", (*err)->msg);
+      crun_error_release (err);
+    }
 
   state_dir = libcrun_get_state_directory (container->context->state_root, container->context->id);
   if (state_dir == NULL)
-    return send_mounts (sync_socket_host, dev_fds, how_many, def->linux->devices_len, err);
+    return send_mounts (sync_socket_host, dev_fds, how_many, total, err);
 
   ret = append_paths (&devs_path, err, state_dir, "devs", NULL);
   if (UNLIKELY (ret < 0))
@@ -4337,7 +4983,7 @@ prepare_and_send_dev_mounts (libcrun_container_t *container, int sync_socket_hos
         how_many++;
     }
 
-  ret = send_mounts (sync_socket_host, dev_fds, how_many, def->linux->devices_len, err);
+  ret = send_mounts (sync_socket_host, dev_fds, how_many, total, err);
 restore_mountns:
   {
     int setns_ret;
@@ -4372,7 +5018,7 @@ prepare_and_send_mounts (libcrun_container_t *container, pid_t pid, int sync_soc
 static int
 receive_mounts (struct libcrun_fd_map *fds, int sync_socket_container, libcrun_error_t *err)
 {
-  size_t i, how_many = 0;
+  size_t i, received, how_many = 0;
   int ret;
 
   if (fds->nfds == 0)
@@ -4382,20 +5028,34 @@ receive_mounts (struct libcrun_fd_map *fds, int sync_socket_container, libcrun_e
   if (UNLIKELY (ret < 0))
     return crun_make_error (err, errno, "read from sync socket");
 
-  for (i = 0; i < how_many; i++)
+  for (received = 0; received < how_many;)
     {
-      size_t index;
+      size_t n = how_many - received < MAX_FDS_PER_MESSAGE ? how_many - received : MAX_FDS_PER_MESSAGE;
+      size_t indexes[MAX_FDS_PER_MESSAGE];
+      int batch[MAX_FDS_PER_MESSAGE];
 
-      ret = receive_fd_from_socket_with_payload (sync_socket_container, (char *) &index, sizeof (index), err);
+      ret = receive_fds_from_socket_with_payload (sync_socket_container, batch, n, (char *) indexes,
+                                                  n * sizeof (size_t), err);
       if (UNLIKELY (ret < 0))
         return ret;
-      if (index >= fds->nfds)
-        return crun_make_error (err, 0, "invalid mount data received");
 
-      if (fds->fds[index] >= 0)
-        TEMP_FAILURE_RETRY (close (fds->fds[index]));
+      for (i = 0; i < n; i++)
+        if (indexes[i] >= fds->nfds)
+          {
+            for (i = 0; i < n; i++)
+              TEMP_FAILURE_RETRY (close (batch[i]));
+            return crun_make_error (err, 0, "invalid mount data received");
+          }
+
+      for (i = 0; i < n; i++)
+        {
+          if (fds->fds[indexes[i]] >= 0)
+            TEMP_FAILURE_RETRY (close (fds->fds[indexes[i]]));
+
+          fds->fds[indexes[i]] = batch[i];
+        }
 
-      fds->fds[index] = ret;
+      received += n;
     }
 
   return 0;
@@ -4703,6 +5363,10 @@ libcrun_run_linux_container (libcrun_container_t *container, container_entrypoin
   if (UNLIKELY (ret < 0))
     return ret;
 
+  /* The container processes write directly to the log, flush what was
+     collected so far to keep the messages in order.  */
+  libcrun_flush_log ();
+
   get_private_data (container)->unshare_flags = init_status.all_namespaces;
 #if CLONE_NEWCGROUP
   /* cgroup will be unshared later.  Once the process is in the correct cgroup.  */
@@ -5223,6 +5887,8 @@ libcrun_join_process (libcrun_context_t *context,
   struct _clone3_args clone3_args;
   bool need_move_to_cgroup;
 
+  libcrun_flush_log ();
+
   if (! detach)
     {
       ret = prctl (PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
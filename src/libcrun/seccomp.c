@@ -37,6 +37,8 @@
 #include <sys/utsname.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
 
 #if HAVE_STDATOMIC_H
 #  include <stdatomic.h>
@@ -468,6 +470,28 @@ open_rundir_dirfd (const char *state_root, libcrun_error_t *err)
   return dirfd;
 }
 
+/* Path of the container seccomp.bpf file, relative to the run directory.
+   With the sharded layout, the state directory is not a direct child of
+   the run directory.  */
+static int
+get_seccomp_bpf_path (const char *state_root, const char *id, char **out, libcrun_error_t *err)
+{
+  cleanup_free char *rundir = NULL;
+  cleanup_free char *dir = NULL;
+  size_t len;
+
+  rundir = libcrun_get_state_directory (state_root, NULL);
+  dir = libcrun_get_state_directory (state_root, id);
+  if (UNLIKELY (rundir == NULL || dir == NULL))
+    return crun_make_error (err, 0, "cannot get state directory");
+
+  len = strlen (rundir);
+  if (UNLIKELY (strncmp (dir, rundir, len) != 0 || dir[len] != '/'))
+    return crun_make_error (err, 0, "invalid state directory `%s`", dir);
+
+  return append_paths (out, err, dir + len + 1, "seccomp.bpf", NULL);
+}
+
 struct cache_entry
 {
   seccomp_checksum_t checksum;
@@ -568,6 +592,57 @@ evict_cache (int root_dfd, libcrun_error_t *err)
   return 0;
 }
 
+static bool
+cache_needs_eviction (int root_dfd)
+{
+  struct stat st;
+  off_t max_size;
+  int ret;
+
+  ret = TEMP_FAILURE_RETRY (fstat (root_dfd, &st));
+  if (UNLIKELY (ret < 0))
+    return false;
+
+  max_size = get_cache_dir_inode_max_size (st.st_size);
+
+  ret = TEMP_FAILURE_RETRY (fstatat (root_dfd, SECCOMP_CACHE_DIR, &st, 0));
+  if (UNLIKELY (ret < 0))
+    return false;
+
+  return st.st_size > max_size;
+}
+
+/* Run evict_cache if the cache grew too large.  Only one eviction runs
+   at a time: if another process holds the lock, it is already evicting
+   the entries and the caller does not wait for it.  The eviction does
+   not need to be synchronized with the users of the cache: files that
+   are in use are skipped, and a lookup racing with the unlink only
+   misses the cache.  */
+static void
+maybe_evict_cache (int root_dfd)
+{
+  libcrun_error_t tmp_err = NULL;
+  cleanup_close int lockfd = -1;
+  int ret;
+
+  if (! cache_needs_eviction (root_dfd))
+    return;
+
+  lockfd = TEMP_FAILURE_RETRY (openat (root_dfd, SECCOMP_CACHE_DIR, O_DIRECTORY | O_RDONLY | O_CLOEXEC));
+  if (UNLIKELY (lockfd < 0))
+    return;
+
+  if (flock (lockfd, LOCK_EX | LOCK_NB) < 0)
+    return;
+
+  ret = evict_cache (root_dfd, &tmp_err);
+  if (UNLIKELY (ret < 0))
+    {
+      libcrun_debug ("cannot evict the seccomp cache: %s", tmp_err->msg);
+      crun_error_release (&tmp_err);
+    }
+}
+
 static int
 store_seccomp_cache (struct libcrun_seccomp_gen_ctx_s *ctx, libcrun_error_t *err)
 {
@@ -588,7 +663,7 @@ store_seccomp_cache (struct libcrun_seccomp_gen_ctx_s *ctx, libcrun_error_t *err
     return dirfd;
 
   /* relative path to dirfd.  */
-  ret = append_paths (&src_path, err, container->context->id, "seccomp.bpf", NULL);
+  ret = get_seccomp_bpf_path (container->context->state_root, container->context->id, &src_path, err);
   if (UNLIKELY (ret < 0))
     return ret;
 
@@ -600,9 +675,7 @@ store_seccomp_cache (struct libcrun_seccomp_gen_ctx_s *ctx, libcrun_error_t *err
   if (UNLIKELY (ret < 0))
     return ret;
 
-  ret = evict_cache (dirfd, err);
-  if (UNLIKELY (ret < 0))
-    return ret;
+  maybe_evict_cache (dirfd);
 
   ret = linkat (dirfd, src_path, dirfd, dest_path, 0);
   if (UNLIKELY (ret < 0 && errno != EEXIST))
@@ -873,7 +946,7 @@ libcrun_open_seccomp_bpf (struct libcrun_seccomp_gen_ctx_s *ctx, int *fd, libcru
     return dirfd;
 
   /* relative path to dirfd.  */
-  ret = append_paths (&dest_path, err, container->context->id, "seccomp.bpf", NULL);
+  ret = get_seccomp_bpf_path (container->context->state_root, container->context->id, &dest_path, err);
   if (UNLIKELY (ret < 0))
     return ret;
 
@@ -21,11 +21,16 @@
 #include "status.h"
 #include "utils.h"
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <yajl/yajl_tree.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <signal.h>
@@ -69,18 +74,127 @@ get_run_directory (const char *state_root)
   return root;
 }
 
+/* With the sharded layout, the state directory of a container is
+   ROOT/.shards/XX/ID where XX is computed from a hash of ID.  The layout
+   is used once the .shards directory exists.  Containers created before
+   the migration can still live in ROOT/ID.  */
+#define STATE_SHARDS_DIR ".shards"
+#define STATE_SHARDS 256
+#define STATE_SHARDS_MAX_THREADS 8
+
+static unsigned int
+get_state_shard (const char *id)
+{
+  uint32_t hash = 2166136261U;
+
+  /* FNV-1a.  */
+  for (; *id; id++)
+    {
+      hash ^= (unsigned char) *id;
+      hash *= 16777619U;
+    }
+  return (hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24)) & (STATE_SHARDS - 1);
+}
+
+/* The state roots known to use the sharded layout.  A root is never
+   moved back to the flat layout, so a positive result is valid for the
+   life of the process.  */
+struct sharded_root_s
+{
+  struct sharded_root_s *next;
+  char *root;
+};
+
+static struct sharded_root_s *sharded_roots;
+static pthread_mutex_t sharded_roots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+is_sharded_layout (const char *root)
+{
+  cleanup_free char *path = NULL;
+  struct sharded_root_s *it;
+  libcrun_error_t err = NULL;
+  bool found = false;
+  int ret;
+
+  pthread_mutex_lock (&sharded_roots_lock);
+  for (it = sharded_roots; it && ! found; it = it->next)
+    found = strcmp (it->root, root) == 0;
+  pthread_mutex_unlock (&sharded_roots_lock);
+  if (found)
+    return true;
+
+  ret = append_paths (&path, &err, root, STATE_SHARDS_DIR, NULL);
+  if (UNLIKELY (ret < 0))
+    {
+      crun_error_release (&err);
+      return false;
+    }
+  if (faccessat (AT_FDCWD, path, F_OK, AT_EACCESS) < 0)
+    return false;
+
+  it = xmalloc (sizeof (*it));
+  it->root = xstrdup (root);
+  pthread_mutex_lock (&sharded_roots_lock);
+  it->next = sharded_roots;
+  sharded_roots = it;
+  pthread_mutex_unlock (&sharded_roots_lock);
+  return true;
+}
+
+#ifndef RENAME_NOREPLACE
+#  define RENAME_NOREPLACE (1 << 0)
+#endif
+
+/* Rename OLDPATH to NEWPATH, failing with EEXIST if NEWPATH exists.  A
+   plain rename would replace an empty directory.  */
+static int
+rename_noreplace (int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+  int ret = -1;
+
+#ifdef __NR_renameat2
+  ret = (int) syscall (__NR_renameat2, olddirfd, oldpath, newdirfd, newpath, RENAME_NOREPLACE);
+  if (ret == 0 || (errno != ENOSYS && errno != EINVAL))
+    return ret;
+#endif
+  /* Not supported by the kernel or the file system.  */
+  return renameat (olddirfd, oldpath, newdirfd, newpath);
+}
+
 char *
 libcrun_get_state_directory (const char *state_root, const char *id)
 {
   int ret;
-  char *path;
-  libcrun_error_t *err = NULL;
+  char *path = NULL;
+  char shard[16];
+  libcrun_error_t err = NULL;
   cleanup_free char *root = get_run_directory (state_root);
 
-  ret = append_paths (&path, err, root, id, NULL);
+  ret = append_paths (&path, &err, root, id, NULL);
   if (UNLIKELY (ret < 0))
     {
-      crun_error_release (err);
+      crun_error_release (&err);
+      return NULL;
+    }
+
+  /* A container in the flat layout, or not migrated yet.  Checking it
+     first avoids looking for ROOT/.shards for the existing containers
+     of a flat root.  */
+  if (id == NULL || faccessat (AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+    return path;
+
+  if (! is_sharded_layout (root))
+    return path;
+
+  free (path);
+  path = NULL;
+
+  sprintf (shard, "%02x", get_state_shard (id));
+  ret = append_paths (&path, &err, root, STATE_SHARDS_DIR, shard, id, NULL);
+  if (UNLIKELY (ret < 0))
+    {
+      crun_error_release (&err);
       return NULL;
     }
 
@@ -90,21 +204,143 @@ libcrun_get_state_directory (const char *state_root, const char *id)
 static char *
 get_state_directory_status_file (const char *state_root, const char *id)
 {
-  cleanup_free char *root = get_run_directory (state_root);
-  libcrun_error_t *err = NULL;
+  cleanup_free char *dir = libcrun_get_state_directory (state_root, id);
+  libcrun_error_t err = NULL;
   char *path = NULL;
   int ret;
 
-  ret = append_paths (&path, err, root, id, "status", NULL);
+  if (UNLIKELY (dir == NULL))
+    return NULL;
+
+  ret = append_paths (&path, &err, dir, "status", NULL);
   if (UNLIKELY (ret < 0))
     {
-      crun_error_release (err);
+      crun_error_release (&err);
       return NULL;
     }
 
   return path;
 }
 
+/* Move every container in the flat ROOT directory to its shard.  Only
+   directories with a status file are moved, the others could be still
+   in use by a `crun create`.  A container is moved while holding the
+   lock taken by libcrun_status_lock_container, and the ones locked by
+   another process are skipped.  They are found anyway in ROOT and they
+   are deleted from there.  */
+static int
+migrate_to_sharded_layout (const char *root, libcrun_error_t *err)
+{
+  cleanup_close int shardsfd = -1;
+  cleanup_dir DIR *dir = NULL;
+  struct dirent *de;
+
+  dir = opendir (root);
+  if (UNLIKELY (dir == NULL))
+    return crun_make_error (err, errno, "cannot opendir `%s`", root);
+
+  shardsfd = openat (dirfd (dir), STATE_SHARDS_DIR, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+  if (UNLIKELY (shardsfd < 0))
+    return crun_make_error (err, errno, "cannot open `%s/%s`", root, STATE_SHARDS_DIR);
+
+  for (de = readdir (dir); de; de = readdir (dir))
+    {
+      char status_file[NAME_MAX + 8];
+      cleanup_close int lockfd = -1;
+      char shard[16];
+      struct stat st;
+      int ret;
+
+      if (de->d_name[0] == '.')
+        continue;
+
+      sprintf (status_file, "%s/status", de->d_name);
+      if (faccessat (dirfd (dir), status_file, F_OK, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+
+      lockfd = TEMP_FAILURE_RETRY (openat (dirfd (dir), de->d_name, O_DIRECTORY | O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
+      if (lockfd < 0)
+        continue;
+
+      /* The container is being deleted.  */
+      if (TEMP_FAILURE_RETRY (flock (lockfd, LOCK_EX | LOCK_NB)) < 0)
+        continue;
+
+      /* Deleted before the lock was taken.  */
+      if (TEMP_FAILURE_RETRY (fstat (lockfd, &st)) < 0 || st.st_nlink == 0)
+        continue;
+
+      sprintf (shard, "%02x/%s", get_state_shard (de->d_name), de->d_name);
+      ret = rename_noreplace (dirfd (dir), de->d_name, shardsfd, shard);
+      /* Another process migrated or deleted the container.  */
+      if (UNLIKELY (ret < 0 && errno != ENOENT && errno != EEXIST))
+        return crun_make_error (err, errno, "cannot move `%s/%s` to `%s/%s/%s`", root, de->d_name, root,
+                                STATE_SHARDS_DIR, shard);
+    }
+
+  return 0;
+}
+
+int
+libcrun_status_enable_sharded_layout (const char *state_root, libcrun_error_t *err)
+{
+  cleanup_free char *root = get_run_directory (state_root);
+  cleanup_free char *shards_dir = NULL;
+  cleanup_free char *tmp_dir = NULL;
+  cleanup_close int tmpfd = -1;
+  unsigned int i;
+  int ret;
+
+  if (is_sharded_layout (root))
+    return 0;
+
+  ret = append_paths (&shards_dir, err, root, STATE_SHARDS_DIR, NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  /* Create all the shards first, so that the layout is used only when
+     it is complete.  */
+  xasprintf (&tmp_dir, "%s.tmp-%d", shards_dir, (int) getpid ());
+  if (UNLIKELY (mkdir (tmp_dir, 0700) < 0 && errno != EEXIST))
+    return crun_make_error (err, errno, "mkdir `%s`", tmp_dir);
+
+  tmpfd = TEMP_FAILURE_RETRY (open (tmp_dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC));
+  if (UNLIKELY (tmpfd < 0))
+    return crun_make_error (err, errno, "open `%s`", tmp_dir);
+
+  for (i = 0; i < STATE_SHARDS; i++)
+    {
+      char shard[16];
+
+      sprintf (shard, "%02x", i);
+      if (UNLIKELY (mkdirat (tmpfd, shard, 0700) < 0 && errno != EEXIST))
+        return crun_make_error (err, errno, "mkdir `%s/%s`", tmp_dir, shard);
+    }
+
+  ret = rename (tmp_dir, shards_dir);
+  if (UNLIKELY (ret < 0))
+    {
+      int saved_errno = errno;
+
+      /* Another process enabled the layout at the same time.  */
+      if (saved_errno == EEXIST || saved_errno == ENOTEMPTY)
+        {
+          for (i = 0; i < STATE_SHARDS; i++)
+            {
+              char shard[16];
+
+              sprintf (shard, "%02x", i);
+              unlinkat (tmpfd, shard, AT_REMOVEDIR);
+            }
+          rmdir (tmp_dir);
+        }
+      else
+        return crun_make_error (err, saved_errno, "rename `%s` to `%s`", tmp_dir, shards_dir);
+    }
+
+  return migrate_to_sharded_layout (root, err);
+}
+
 static int
 read_pid_stat (pid_t pid, struct pid_stat *st, libcrun_error_t *err)
 {
@@ -188,8 +424,9 @@ libcrun_write_container_status (const char *state_root, const char *id, libcrun_
 
   status->process_start_time = st.starttime;
 
-  xasprintf (&file_tmp, "%s.tmp", file);
-  fd_write = open (file_tmp, O_CREAT | O_WRONLY | O_CLOEXEC, 0700);
+  /* Each writer uses its own temporary file, the last rename wins.  */
+  xasprintf (&file_tmp, "%s.tmp-XXXXXX", file);
+  fd_write = mkostemp (file_tmp, O_CLOEXEC);
   if (UNLIKELY (fd_write < 0))
     return crun_make_error (err, errno, "cannot open status file");
 
@@ -331,12 +568,15 @@ libcrun_write_container_status (const char *state_root, const char *id, libcrun_
 exit:
   if (gen)
     yajl_gen_free (gen);
+  if (ret < 0)
+    unlink (file_tmp);
 
   return ret;
 
 yajl_error:
   if (gen)
     yajl_gen_free (gen);
+  unlink (file_tmp);
 
   return yajl_error_to_crun_error (r, err);
 }
@@ -449,17 +689,59 @@ libcrun_status_check_directories (const char *state_root, const char *id, libcru
   if (UNLIKELY (dir == NULL))
     return crun_make_error (err, 0, "cannot get state directory");
 
-  ret = crun_path_exists (dir, err);
+  /* mkdir is atomic: when the same id is created concurrently, only one
+     of the callers succeeds.  */
+  if (UNLIKELY (mkdir (dir, 0700) < 0))
+    {
+      if (errno == EEXIST)
+        return crun_make_error (err, 0, "container `%s` already exists", id);
+      return crun_make_error (err, errno, "cannot create state directory for `%s`", id);
+    }
+
+  return 0;
+}
+
+int
+libcrun_status_lock_container (const char *state_root, const char *id, libcrun_error_t *err)
+{
+  cleanup_free char *dir = NULL;
+  cleanup_close int fd = -1;
+  struct stat st;
+  int ret;
+
+  dir = libcrun_get_state_directory (state_root, id);
+  if (UNLIKELY (dir == NULL))
+    return crun_make_error (err, 0, "cannot get state directory");
+
+  fd = TEMP_FAILURE_RETRY (open (dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC));
+  if (UNLIKELY (fd < 0 && errno == ENOENT))
+    {
+      /* The directory could have been moved to its shard in the meanwhile.  */
+      free (dir);
+      dir = libcrun_get_state_directory (state_root, id);
+      if (UNLIKELY (dir == NULL))
+        return crun_make_error (err, 0, "cannot get state directory");
+
+      fd = TEMP_FAILURE_RETRY (open (dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC));
+    }
+  if (UNLIKELY (fd < 0))
+    return crun_make_error (err, errno, "cannot open state directory `%s`", dir);
+
+  ret = TEMP_FAILURE_RETRY (flock (fd, LOCK_EX));
   if (UNLIKELY (ret < 0))
-    return ret;
+    return crun_make_error (err, errno, "flock `%s`", dir);
 
-  if (ret)
-    return crun_make_error (err, 0, "container `%s` already exists", id);
+  ret = TEMP_FAILURE_RETRY (fstat (fd, &st));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "fstat `%s`", dir);
 
-  if (UNLIKELY (mkdir (dir, 0700) < 0))
-    return crun_make_error (err, 0, "cannot create state directory for `%s`", id);
+  /* The container was deleted while waiting for the lock.  */
+  if (st.st_nlink == 0)
+    return crun_make_error (err, ENOENT, "container `%s` does not exist", id);
 
-  return 0;
+  ret = fd;
+  fd = -1;
+  return ret;
 }
 
 static int
@@ -524,19 +806,26 @@ int
 libcrun_container_delete_status (const char *state_root, const char *id, libcrun_error_t *err)
 {
   int ret;
-  cleanup_close int rundir_dfd = -1;
+  cleanup_close int parent_dfd = -1;
   cleanup_close int dfd = -1;
   cleanup_free char *dir = NULL;
+  char *sep;
 
-  dir = get_run_directory (state_root);
+  dir = libcrun_get_state_directory (state_root, id);
   if (UNLIKELY (dir == NULL))
     return crun_make_error (err, 0, "cannot get state directory");
 
-  rundir_dfd = TEMP_FAILURE_RETRY (open (dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC));
-  if (UNLIKELY (rundir_dfd < 0))
+  /* DIR is either the run directory or a shard, followed by ID.  */
+  sep = strrchr (dir, '/');
+  if (UNLIKELY (sep == NULL))
+    return crun_make_error (err, 0, "invalid state directory `%s`", dir);
+  *sep = '\0';
+
+  parent_dfd = TEMP_FAILURE_RETRY (open (dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC));
+  if (UNLIKELY (parent_dfd < 0))
     return crun_make_error (err, errno, "cannot open run directory `%s`", dir);
 
-  dfd = openat (rundir_dfd, id, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+  dfd = openat (parent_dfd, id, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
   if (UNLIKELY (dfd < 0))
     return crun_make_error (err, errno, "cannot open directory `%s/%s`", dir, id);
 
@@ -548,7 +837,7 @@ libcrun_container_delete_status (const char *state_root, const char *id, libcrun
   if (UNLIKELY (ret < 0))
     return ret;
 
-  ret = unlinkat (rundir_dfd, id, AT_REMOVEDIR);
+  ret = unlinkat (parent_dfd, id, AT_REMOVEDIR);
   if (UNLIKELY (ret < 0))
     return crun_make_error (err, errno, "cannot rm state directory `%s/%s`", dir, id);
 
@@ -570,15 +859,14 @@ libcrun_free_container_status (libcrun_container_status_t *status)
   free (status->owner);
 }
 
-int
-libcrun_get_containers_list (libcrun_container_list_t **ret, const char *state_root, libcrun_error_t *err)
+/* Add the containers found in the directory PATH to LIST.  If VERBOSE is
+   set, warn about directories without a status file.  */
+static int
+read_containers_list (libcrun_container_list_t **list, const char *path, bool verbose, libcrun_error_t *err)
 {
   struct dirent *next;
-  cleanup_container_list libcrun_container_list_t *tmp = NULL;
-  cleanup_free char *path = get_run_directory (state_root);
   cleanup_dir DIR *dir = NULL;
 
-  *ret = NULL;
   dir = opendir (path);
   if (UNLIKELY (dir == NULL))
     return crun_make_error (err, errno, "cannot opendir `%s`", path);
@@ -605,15 +893,133 @@ libcrun_get_containers_list (libcrun_container_list_t **ret, const char *state_r
 
       if (! exists)
         {
-          libcrun_error (errno, "error opening file `%s`", status_file);
+          if (verbose)
+            libcrun_error (errno, "error opening file `%s`", status_file);
           continue;
         }
 
       next_container = xmalloc (sizeof (libcrun_container_list_t));
       next_container->name = xstrdup (next->d_name);
-      next_container->next = tmp;
-      tmp = next_container;
+      next_container->next = *list;
+      *list = next_container;
     }
+  return 0;
+}
+
+struct shards_reader_s
+{
+  const char *root;
+  unsigned int next_shard;
+};
+
+struct shards_worker_s
+{
+  struct shards_reader_s *reader;
+  libcrun_container_list_t *list;
+  libcrun_error_t err;
+  int ret;
+};
+
+static void *
+shards_worker (void *arg)
+{
+  struct shards_worker_s *worker = arg;
+  unsigned int shard;
+
+  while ((shard = __atomic_fetch_add (&worker->reader->next_shard, 1, __ATOMIC_RELAXED)) < STATE_SHARDS)
+    {
+      cleanup_free char *path = NULL;
+
+      xasprintf (&path, "%s/" STATE_SHARDS_DIR "/%02x", worker->reader->root, shard);
+
+      /* Do not log from the workers, a directory without a status file
+         is a container being created.  */
+      worker->ret = read_containers_list (&worker->list, path, false, &worker->err);
+      if (UNLIKELY (worker->ret < 0))
+        break;
+    }
+  return NULL;
+}
+
+/* Read all the shards, using up to STATE_SHARDS_MAX_THREADS threads.  */
+static int
+read_sharded_containers_list (libcrun_container_list_t **list, const char *root, libcrun_error_t *err)
+{
+  struct shards_worker_s workers[STATE_SHARDS_MAX_THREADS];
+  pthread_t threads[STATE_SHARDS_MAX_THREADS];
+  struct shards_reader_s reader = { root, 0 };
+  size_t n_threads, i, started = 0;
+  long cpus;
+  int ret = 0;
+
+  cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  n_threads = cpus > 0 && cpus < STATE_SHARDS_MAX_THREADS ? (size_t) cpus : STATE_SHARDS_MAX_THREADS;
+
+  memset (workers, 0, sizeof (workers));
+  for (i = 0; i < n_threads; i++)
+    workers[i].reader = &reader;
+
+  /* The calling thread is one of the workers.  */
+  for (i = 1; i < n_threads; i++)
+    {
+      if (pthread_create (&threads[started], NULL, shards_worker, &workers[i]) != 0)
+        break;
+      started++;
+    }
+
+  shards_worker (&workers[0]);
+
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+
+  for (i = 0; i < started + 1; i++)
+    {
+      while (workers[i].list)
+        {
+          libcrun_container_list_t *next = workers[i].list->next;
+
+          workers[i].list->next = *list;
+          *list = workers[i].list;
+          workers[i].list = next;
+        }
+
+      if (workers[i].ret < 0)
+        {
+          if (ret == 0)
+            {
+              ret = workers[i].ret;
+              *err = workers[i].err;
+            }
+          else
+            crun_error_release (&workers[i].err);
+        }
+    }
+
+  return ret;
+}
+
+int
+libcrun_get_containers_list (libcrun_container_list_t **ret, const char *state_root, libcrun_error_t *err)
+{
+  cleanup_container_list libcrun_container_list_t *tmp = NULL;
+  cleanup_free char *path = get_run_directory (state_root);
+  int r;
+
+  *ret = NULL;
+
+  /* With the sharded layout, the run directory has only the containers
+     that were not migrated.  */
+  r = read_containers_list (&tmp, path, true, err);
+  if (UNLIKELY (r < 0))
+    return r;
+
+  if (is_sharded_layout (path))
+    {
+      r = read_sharded_containers_list (&tmp, path, err);
+      if (UNLIKELY (r < 0))
+        return r;
+    }
+
   *ret = tmp;
   tmp = NULL;
   return 0;
@@ -59,8 +59,10 @@ LIBCRUN_PUBLIC char *libcrun_get_state_directory (const char *state_root, const
 LIBCRUN_PUBLIC int libcrun_container_delete_status (const char *state_root, const char *id, libcrun_error_t *err);
 LIBCRUN_PUBLIC int libcrun_get_containers_list (libcrun_container_list_t **ret, const char *state_root,
                                                 libcrun_error_t *err);
+LIBCRUN_PUBLIC int libcrun_status_enable_sharded_layout (const char *state_root, libcrun_error_t *err);
 
 int libcrun_status_check_directories (const char *state_root, const char *id, libcrun_error_t *err);
+int libcrun_status_lock_container (const char *state_root, const char *id, libcrun_error_t *err);
 int libcrun_status_create_exec_fifo (const char *state_root, const char *id, libcrun_error_t *err);
 int libcrun_status_write_exec_fifo (const char *state_root, const char *id, libcrun_error_t *err);
 int libcrun_status_has_read_exec_fifo (const char *state_root, const char *id, libcrun_error_t *err);
@@ -0,0 +1,349 @@
+/*
+ * crun - OCI runtime written in C
+ *
+ * Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+ * crun is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * crun is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crun.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <config.h>
+#include "utils.h"
+#include "status.h"
+#include "userns-cache.h"
+#include "blake3/blake3.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sched.h>
+
+/* The user namespaces used for idmapped mounts are pinned with a bind
+   mount of their nsfs file in this directory, one file for each set of
+   mappings, named after the hash of the mappings.  */
+#define USERNS_CACHE_DIR ".cache/userns"
+
+/* Hits and misses counters.  */
+#define USERNS_CACHE_STATS ".stats"
+
+#ifndef NS_GET_NSTYPE
+#  define NS_GET_NSTYPE _IO (0xb7, 0x3)
+#endif
+
+void
+libcrun_userns_cache_key (const char *uid_map, size_t uid_map_len, const char *gid_map, size_t gid_map_len,
+                          userns_cache_key_t key)
+{
+  blake3_hasher hasher;
+  unsigned char hash[32];
+  size_t i;
+
+  blake3_hasher_init (&hasher);
+  blake3_hasher_update (&hasher, "uid", 4);
+  if (uid_map)
+    blake3_hasher_update (&hasher, uid_map, uid_map_len);
+  blake3_hasher_update (&hasher, "gid", 4);
+  if (gid_map)
+    blake3_hasher_update (&hasher, gid_map, gid_map_len);
+  blake3_hasher_finalize (&hasher, hash, sizeof (hash));
+
+  for (i = 0; i < sizeof (hash); i++)
+    sprintf (&key[i * 2], "%02x", hash[i]);
+  key[USERNS_CACHE_KEY_SIZE - 1] = '\0';
+}
+
+static int
+open_userns_cache_dir (const char *state_root, bool create, char **path, libcrun_error_t *err)
+{
+  cleanup_free char *state_dir = NULL;
+  cleanup_free char *dir = NULL;
+  int ret, dirfd;
+
+  state_dir = libcrun_get_state_directory (state_root, NULL);
+  if (UNLIKELY (state_dir == NULL))
+    return crun_make_error (err, 0, "cannot get state directory");
+
+  ret = append_paths (&dir, err, state_dir, USERNS_CACHE_DIR, NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  if (create)
+    {
+      ret = crun_ensure_directory (dir, 0700, false, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+    }
+
+  dirfd = TEMP_FAILURE_RETRY (open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (UNLIKELY (dirfd < 0))
+    {
+      if (! create && errno == ENOENT)
+        return 0;
+      return crun_make_error (err, errno, "open `%s`", dir);
+    }
+
+  if (path)
+    {
+      *path = dir;
+      dir = NULL;
+    }
+
+  return dirfd;
+}
+
+int
+libcrun_userns_cache_lookup (const char *state_root, const char *key, int *out, libcrun_error_t *err)
+{
+  cleanup_close int dirfd = -1;
+  cleanup_close int fd = -1;
+  int ret;
+
+  *out = -1;
+
+  dirfd = open_userns_cache_dir (state_root, false, NULL, err);
+  if (dirfd <= 0)
+    return dirfd;
+
+  fd = openat (dirfd, key, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+        return 0;
+      return crun_make_error (err, errno, "open `%s/%s`", USERNS_CACHE_DIR, key);
+    }
+
+  /* A file left behind without the bind mount, e.g. while it is being
+     stored by another process, is not a user namespace.  */
+  ret = ioctl (fd, NS_GET_NSTYPE);
+  if (ret != CLONE_NEWUSER)
+    return 0;
+
+  /* The mtime is used to evict the least recently used entries.  */
+  ret = utimensat (dirfd, key, NULL, AT_SYMLINK_NOFOLLOW);
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "utimensat `%s/%s`", USERNS_CACHE_DIR, key);
+
+  *out = fd;
+  fd = -1;
+  return 1;
+}
+
+struct userns_cache_entry_s
+{
+  char *name;
+  struct timespec mtime;
+};
+
+static int
+compare_entries_by_mtime (const void *a, const void *b)
+{
+  const struct userns_cache_entry_s *entry_a = a;
+  const struct userns_cache_entry_s *entry_b = b;
+
+  if (entry_a->mtime.tv_sec != entry_b->mtime.tv_sec)
+    return entry_a->mtime.tv_sec < entry_b->mtime.tv_sec ? -1 : 1;
+  if (entry_a->mtime.tv_nsec != entry_b->mtime.tv_nsec)
+    return entry_a->mtime.tv_nsec < entry_b->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+static void
+remove_entry (const char *dir, int dirfd, const char *name)
+{
+  cleanup_free char *path = NULL;
+  libcrun_error_t tmp_err = NULL;
+  int ret;
+
+  ret = append_paths (&path, &tmp_err, dir, name, NULL);
+  if (UNLIKELY (ret < 0))
+    {
+      crun_error_release (&tmp_err);
+      return;
+    }
+
+  /* The namespace stays alive as long as it is used.  */
+  umount2 (path, MNT_DETACH);
+  unlinkat (dirfd, name, 0);
+}
+
+/* Drop the least recently used entries so that at most MAX_ENTRIES are
+   left.  It must be called with the lock held.  */
+static void
+evict_userns_cache (const char *dir, int dirfd, size_t max_entries)
+{
+  cleanup_free struct userns_cache_entry_s *entries = NULL;
+  size_t i, n_entries = 0, allocated = 0;
+  cleanup_dir DIR *d = NULL;
+  struct dirent *de;
+  int dfd;
+
+  dfd = dup (dirfd);
+  if (UNLIKELY (dfd < 0))
+    return;
+
+  d = fdopendir (dfd);
+  if (UNLIKELY (d == NULL))
+    {
+      TEMP_FAILURE_RETRY (close (dfd));
+      return;
+    }
+
+  while ((de = readdir (d)))
+    {
+      struct stat st;
+
+      if (de->d_name[0] == '.')
+        continue;
+
+      if (TEMP_FAILURE_RETRY (fstatat (dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) < 0)
+        continue;
+
+      if (n_entries == allocated)
+        {
+          allocated = allocated ? allocated * 2 : 16;
+          entries = xrealloc (entries, sizeof (*entries) * allocated);
+        }
+      entries[n_entries].name = xstrdup (de->d_name);
+      entries[n_entries].mtime = st.st_mtim;
+      n_entries++;
+    }
+
+  if (n_entries > max_entries)
+    {
+      qsort (entries, n_entries, sizeof (*entries), compare_entries_by_mtime);
+      for (i = 0; i < n_entries - max_entries; i++)
+        remove_entry (dir, dirfd, entries[i].name);
+    }
+
+  for (i = 0; i < n_entries; i++)
+    free (entries[i].name);
+}
+
+int
+libcrun_userns_cache_store (const char *state_root, const char *key, pid_t pid, size_t max_entries,
+                            libcrun_error_t *err)
+{
+  cleanup_free char *dir = NULL;
+  cleanup_close int dirfd = -1;
+  cleanup_close int fd = -1;
+  proc_fd_path_t target;
+  char source[64];
+  int ret;
+
+  dirfd = open_userns_cache_dir (state_root, true, &dir, err);
+  if (UNLIKELY (dirfd < 0))
+    return dirfd;
+
+  /* Serialize the updates to the cache.  */
+  ret = TEMP_FAILURE_RETRY (flock (dirfd, LOCK_EX));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "flock `%s`", dir);
+
+  fd = openat (dirfd, key, O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      /* Stored by another container in the meanwhile.  */
+      if (errno == EEXIST)
+        return 0;
+      return crun_make_error (err, errno, "create `%s/%s`", dir, key);
+    }
+
+  sprintf (source, "/proc/%d/ns/user", pid);
+  get_proc_self_fd_path (target, fd);
+
+  ret = mount (source, target, NULL, MS_BIND, NULL);
+  if (UNLIKELY (ret < 0))
+    {
+      ret = crun_make_error (err, errno, "bind mount `%s` to `%s/%s`", source, dir, key);
+      unlinkat (dirfd, key, 0);
+      return ret;
+    }
+
+  evict_userns_cache (dir, dirfd, max_entries);
+
+  return 0;
+}
+
+int
+libcrun_userns_cache_purge (const char *state_root, libcrun_error_t *err)
+{
+  cleanup_free char *dir = NULL;
+  cleanup_close int dirfd = -1;
+  int ret;
+
+  dirfd = open_userns_cache_dir (state_root, false, &dir, err);
+  if (dirfd <= 0)
+    return dirfd;
+
+  ret = TEMP_FAILURE_RETRY (flock (dirfd, LOCK_EX));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "flock `%s`", dir);
+
+  /* The namespaces still used by a container stay alive.  */
+  evict_userns_cache (dir, dirfd, 0);
+  unlinkat (dirfd, USERNS_CACHE_STATS, 0);
+
+  ret = rmdir (dir);
+  if (UNLIKELY (ret < 0 && errno != ENOENT && errno != ENOTEMPTY))
+    return crun_make_error (err, errno, "rmdir `%s`", dir);
+
+  return 0;
+}
+
+int
+libcrun_userns_cache_update_stats (const char *state_root, size_t hits, size_t misses, libcrun_error_t *err)
+{
+  cleanup_free char *content = NULL;
+  cleanup_free char *dir = NULL;
+  cleanup_close int dirfd = -1;
+  cleanup_close int fd = -1;
+  unsigned long long total_hits = 0, total_misses = 0;
+  char buffer[128];
+  int ret, len;
+
+  dirfd = open_userns_cache_dir (state_root, true, &dir, err);
+  if (UNLIKELY (dirfd < 0))
+    return dirfd;
+
+  ret = TEMP_FAILURE_RETRY (flock (dirfd, LOCK_EX));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "flock `%s`", dir);
+
+  fd = openat (dirfd, USERNS_CACHE_STATS, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (UNLIKELY (fd < 0))
+    return crun_make_error (err, errno, "open `%s/%s`", dir, USERNS_CACHE_STATS);
+
+  ret = read_all_fd (fd, USERNS_CACHE_STATS, &content, NULL, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  if (content)
+    sscanf (content, "hits %llu\nmisses %llu", &total_hits, &total_misses);
+
+  len = snprintf (buffer, sizeof (buffer), "hits %llu\nmisses %llu\n", total_hits + hits, total_misses + misses);
+
+  ret = ftruncate (fd, 0);
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "truncate `%s/%s`", dir, USERNS_CACHE_STATS);
+
+  ret = TEMP_FAILURE_RETRY (pwrite (fd, buffer, len, 0));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "write `%s/%s`", dir, USERNS_CACHE_STATS);
+
+  return 0;
+}
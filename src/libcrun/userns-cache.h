@@ -0,0 +1,43 @@
+/*
+ * crun - OCI runtime written in C
+ *
+ * Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+ * crun is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * crun is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crun.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef USERNS_CACHE_H
+#define USERNS_CACHE_H
+
+#include <config.h>
+#include "error.h"
+#include "container.h"
+#include "status.h"
+
+/* Size of the key used for a set of mappings, as an hex string.  */
+#define USERNS_CACHE_KEY_SIZE 65
+
+typedef char userns_cache_key_t[USERNS_CACHE_KEY_SIZE];
+
+void libcrun_userns_cache_key (const char *uid_map, size_t uid_map_len, const char *gid_map, size_t gid_map_len,
+                               userns_cache_key_t key);
+
+int libcrun_userns_cache_lookup (const char *state_root, const char *key, int *fd, libcrun_error_t *err);
+
+int libcrun_userns_cache_store (const char *state_root, const char *key, pid_t pid, size_t max_entries,
+                                libcrun_error_t *err);
+
+int libcrun_userns_cache_purge (const char *state_root, libcrun_error_t *err);
+
+int libcrun_userns_cache_update_stats (const char *state_root, size_t hits, size_t misses, libcrun_error_t *err);
+
+#endif
@@ -41,6 +41,7 @@
 #include <linux/magic.h>
 #include <limits.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
 #ifdef HAVE_LINUX_OPENAT2_H
 #  include <linux/openat2.h>
 #endif
@@ -53,6 +54,15 @@
 #ifndef CLOSE_RANGE_CLOEXEC
 #  define CLOSE_RANGE_CLOEXEC (1U << 2)
 #endif
+#ifndef RESOLVE_NO_MAGICLINKS
+#  define RESOLVE_NO_MAGICLINKS 0x02
+#endif
+#ifndef RESOLVE_NO_SYMLINKS
+#  define RESOLVE_NO_SYMLINKS 0x04
+#endif
+#ifndef RESOLVE_BENEATH
+#  define RESOLVE_BENEATH 0x08
+#endif
 #ifndef RESOLVE_IN_ROOT
 #  define RESOLVE_IN_ROOT 0x10
 #endif
@@ -356,6 +366,276 @@ close_and_replace (int *oldfd, int newfd)
 /* Defined in chroot_realpath.c  */
 char *chroot_realpath (const char *chroot, const char *path, char resolved_path[]);
 
+/* Cache of O_PATH descriptors for directories already resolved under
+   the rootfs, so that mounts sharing a prefix don't need to walk it
+   again.  Only paths without symlinks, "." and ".." are stored, so
+   that the lexical path is also the resolved one.  The cache is active
+   only between safe_openat_cache_begin () and safe_openat_cache_end ()
+   and only for lookups from the rootfs descriptor.  */
+#define SAFE_OPENAT_CACHE_SIZE 32
+
+struct safe_openat_cache_entry_s
+{
+  char *path;
+  size_t path_len;
+  int fd;
+};
+
+static struct safe_openat_cache_s
+{
+  int dirfd;
+  char *root;
+  size_t root_len;
+  size_t next;
+  struct safe_openat_cache_entry_s entries[SAFE_OPENAT_CACHE_SIZE];
+} safe_openat_cache = {
+  .dirfd = -1,
+};
+
+static struct
+{
+  size_t openat2;
+  size_t hits;
+  size_t misses;
+  size_t escapes;
+  size_t fallbacks;
+} safe_openat_stats;
+
+static void
+safe_openat_cache_drop (struct safe_openat_cache_entry_s *entry)
+{
+  if (entry->path == NULL)
+    return;
+
+  TEMP_FAILURE_RETRY (close (entry->fd));
+  free (entry->path);
+  entry->path = NULL;
+  entry->fd = -1;
+}
+
+static struct safe_openat_cache_entry_s *
+safe_openat_cache_lookup (const char *path, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < SAFE_OPENAT_CACHE_SIZE; i++)
+    {
+      struct safe_openat_cache_entry_s *entry = &safe_openat_cache.entries[i];
+
+      if (entry->path && entry->path_len == len && memcmp (entry->path, path, len) == 0)
+        return entry;
+    }
+  return NULL;
+}
+
+static struct safe_openat_cache_entry_s *
+safe_openat_cache_add (const char *path, size_t len, int fd)
+{
+  struct safe_openat_cache_entry_s *entry;
+
+  entry = &safe_openat_cache.entries[safe_openat_cache.next];
+  safe_openat_cache.next = (safe_openat_cache.next + 1) % SAFE_OPENAT_CACHE_SIZE;
+
+  safe_openat_cache_drop (entry);
+
+  entry->path = xmalloc (len + 1);
+  memcpy (entry->path, path, len);
+  entry->path[len] = '\0';
+  entry->path_len = len;
+  entry->fd = fd;
+  return entry;
+}
+
+/* Whether PATH can be used as a cache key: no empty, "." or ".." components.  */
+static bool
+is_simple_path (const char *path, size_t len)
+{
+  const char *it = path;
+  const char *end = path + len;
+
+  while (it < end)
+    {
+      const char *sep = memchr (it, '/', end - it);
+      size_t comp_len = (sep ? sep : end) - it;
+
+      if (comp_len == 0
+          || (comp_len == 1 && it[0] == '.')
+          || (comp_len == 2 && it[0] == '.' && it[1] == '.'))
+        return false;
+
+      if (sep == NULL)
+        break;
+      it = sep + 1;
+    }
+  return true;
+}
+
+void
+safe_openat_cache_begin (int dirfd)
+{
+  libcrun_error_t tmp_err = NULL;
+  proc_fd_path_t fd_path;
+  char *root = NULL;
+  ssize_t len;
+
+  safe_openat_cache_end ();
+
+  get_proc_self_fd_path (fd_path, dirfd);
+  len = safe_readlinkat (AT_FDCWD, fd_path, &root, 0, &tmp_err);
+  if (UNLIKELY (len < 0))
+    {
+      crun_error_release (&tmp_err);
+      return;
+    }
+
+  memset (&safe_openat_stats, 0, sizeof (safe_openat_stats));
+
+  safe_openat_cache.dirfd = dirfd;
+  safe_openat_cache.root = root;
+  /* For a rootfs on "/", every path is under it.  */
+  safe_openat_cache.root_len = strcmp (root, "/") == 0 ? 0 : (size_t) len;
+}
+
+void
+safe_openat_cache_end (void)
+{
+  size_t i;
+
+  if (safe_openat_cache.dirfd < 0)
+    return;
+
+  for (i = 0; i < SAFE_OPENAT_CACHE_SIZE; i++)
+    safe_openat_cache_drop (&safe_openat_cache.entries[i]);
+
+  free (safe_openat_cache.root);
+  safe_openat_cache.root = NULL;
+  safe_openat_cache.dirfd = -1;
+  safe_openat_cache.next = 0;
+
+  libcrun_debug ("path resolution: %zu openat2 lookups, %zu cached prefix hits, %zu prefixes cached, "
+                 "%zu lookups escaping a prefix, %zu user space fallbacks",
+                 safe_openat_stats.openat2, safe_openat_stats.hits, safe_openat_stats.misses,
+                 safe_openat_stats.escapes, safe_openat_stats.fallbacks);
+}
+
+void
+safe_openat_cache_invalidate (int targetfd)
+{
+  libcrun_error_t tmp_err = NULL;
+  cleanup_free char *target = NULL;
+  proc_fd_path_t fd_path;
+  const char *rel;
+  size_t rel_len;
+  ssize_t len;
+  size_t i;
+
+  if (safe_openat_cache.dirfd < 0)
+    return;
+
+  if (targetfd < 0)
+    goto drop_all;
+
+  get_proc_self_fd_path (fd_path, targetfd);
+  len = safe_readlinkat (AT_FDCWD, fd_path, &target, 0, &tmp_err);
+  if (UNLIKELY (len < 0))
+    {
+      crun_error_release (&tmp_err);
+      goto drop_all;
+    }
+
+  if ((size_t) len < safe_openat_cache.root_len
+      || memcmp (target, safe_openat_cache.root, safe_openat_cache.root_len) != 0
+      || (target[safe_openat_cache.root_len] != '/' && target[safe_openat_cache.root_len] != '\0'))
+    goto drop_all;
+
+  rel = consume_slashes (target + safe_openat_cache.root_len);
+  rel_len = strlen (rel);
+  if (rel_len == 0)
+    goto drop_all;
+
+  /* A new mount hides the directory itself and everything under it.  */
+  for (i = 0; i < SAFE_OPENAT_CACHE_SIZE; i++)
+    {
+      struct safe_openat_cache_entry_s *entry = &safe_openat_cache.entries[i];
+
+      if (entry->path && entry->path_len >= rel_len && memcmp (entry->path, rel, rel_len) == 0
+          && (entry->path[rel_len] == '\0' || entry->path[rel_len] == '/'))
+        safe_openat_cache_drop (entry);
+    }
+  return;
+
+drop_all:
+  for (i = 0; i < SAFE_OPENAT_CACHE_SIZE; i++)
+    safe_openat_cache_drop (&safe_openat_cache.entries[i]);
+}
+
+/* Resolve PATH starting from the cached descriptor for its parent
+   directory, caching the parent if needed.  Returns -1 if the lookup
+   cannot be served from the cache, and the caller must do a full
+   resolution.  */
+static int
+safe_openat_cached (const char *path, int flags, int mode)
+{
+  struct safe_openat_cache_entry_s *entry;
+  const char *name;
+  size_t parent_len;
+  int ret;
+
+  path = consume_slashes (path);
+  name = strrchr (path, '/');
+  if (name == NULL)
+    return -1;
+
+  parent_len = name - path;
+  name++;
+  if (parent_len >= PATH_MAX || ! is_simple_path (path, parent_len) || ! is_simple_path (name, strlen (name)))
+    return -1;
+
+  entry = safe_openat_cache_lookup (path, parent_len);
+  if (entry)
+    safe_openat_stats.hits++;
+  else
+    {
+      struct safe_openat_cache_entry_s *ancestor = NULL;
+      char parent[PATH_MAX];
+      size_t prefix_len;
+      int startfd;
+
+      /* Find the longest cached ancestor to start the lookup from.  */
+      for (prefix_len = parent_len; prefix_len > 0 && ancestor == NULL;)
+        {
+          const char *sep = memrchr (path, '/', prefix_len);
+
+          prefix_len = sep ? (size_t) (sep - path) : 0;
+          if (prefix_len > 0)
+            ancestor = safe_openat_cache_lookup (path, prefix_len);
+        }
+
+      startfd = ancestor ? ancestor->fd : safe_openat_cache.dirfd;
+      if (ancestor)
+        prefix_len++;
+      memcpy (parent, path + prefix_len, parent_len - prefix_len);
+      parent[parent_len - prefix_len] = '\0';
+
+      safe_openat_stats.openat2++;
+      ret = syscall_openat2 (startfd, parent, O_PATH | O_DIRECTORY | O_CLOEXEC, 0,
+                             (ancestor ? RESOLVE_BENEATH : RESOLVE_IN_ROOT) | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS);
+      if (ret < 0)
+        return -1;
+
+      safe_openat_stats.misses++;
+      entry = safe_openat_cache_add (path, parent_len, ret);
+    }
+
+  /* The parent is fully resolved, so the last component can be looked
+     up from there unless it is a symlink escaping the parent.  */
+  safe_openat_stats.openat2++;
+  ret = syscall_openat2 (entry->fd, name, flags, mode, RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS);
+  if (ret < 0 && errno == EXDEV)
+    safe_openat_stats.escapes++;
+  return ret;
+}
+
 static int
 safe_openat_fallback (int dirfd, const char *rootfs, size_t rootfs_len, const char *path,
                       int flags, int mode, libcrun_error_t *err)
@@ -365,6 +645,8 @@ safe_openat_fallback (int dirfd, const char *rootfs, size_t rootfs_len, const ch
   char buffer[PATH_MAX];
   int ret;
 
+  safe_openat_stats.fallbacks++;
+
   path_in_chroot = chroot_realpath (rootfs, path, buffer);
   if (path_in_chroot == NULL)
     return crun_make_error (err, errno, "cannot resolve `%s` under rootfs", path);
@@ -405,8 +687,19 @@ safe_openat (int dirfd, const char *rootfs, size_t rootfs_len, const char *path,
 
   if (openat2_supported)
     {
+      if (dirfd >= 0 && dirfd == safe_openat_cache.dirfd)
+        {
+          ret = safe_openat_cached (path, flags, mode);
+          if (ret >= 0)
+            return ret;
+        }
+
+      /* Magic links, such as /proc/self/fd/N, are refused with ELOOP and
+         are not retried with safe_openat_fallback: they could point
+         anywhere on the host.  */
     repeat:
-      ret = syscall_openat2 (dirfd, path, flags, mode, RESOLVE_IN_ROOT);
+      safe_openat_stats.openat2++;
+      ret = syscall_openat2 (dirfd, path, flags, mode, RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS);
       if (UNLIKELY (ret < 0))
         {
           if (errno == EINTR || errno == EAGAIN)
@@ -478,6 +771,18 @@ crun_safe_ensure_at (bool do_open, bool dir, int dirfd, const char *dirpath,
   if (*path == '\0')
     return 0;
 
+  /* Skip the walk if the directory already exists.  */
+  if (dir && ! do_open)
+    {
+      ret = safe_openat (dirfd, dirpath, dirpath_len, path, O_PATH | O_DIRECTORY | O_CLOEXEC, 0, err);
+      if (ret >= 0)
+        {
+          TEMP_FAILURE_RETRY (close (ret));
+          return 0;
+        }
+      crun_error_release (err);
+    }
+
   npath = xstrdup (path);
 
   cwd = dirfd;
@@ -1215,6 +1520,100 @@ receive_fd_from_socket_with_payload (int from, char *payload, size_t payload_len
   return ret;
 }
 
+int
+send_fds_to_socket_with_payload (int server, const int *fds, size_t n_fds, const char *payload, size_t payload_len,
+                                 libcrun_error_t *err)
+{
+  cleanup_free char *ctrl_buf = NULL;
+  struct cmsghdr *cmsg = NULL;
+  struct msghdr msg = {};
+  struct iovec iov[1];
+  char data[1];
+  int ret;
+
+  data[0] = ' ';
+  iov[0].iov_base = data;
+  iov[0].iov_len = sizeof (data);
+
+  if (payload_len > 0)
+    {
+      iov[0].iov_base = (void *) payload;
+      iov[0].iov_len = payload_len;
+    }
+
+  ctrl_buf = xmalloc0 (CMSG_SPACE (sizeof (int) * n_fds));
+
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  msg.msg_controllen = CMSG_SPACE (sizeof (int) * n_fds);
+  msg.msg_control = ctrl_buf;
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int) * n_fds);
+
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * n_fds);
+
+  ret = TEMP_FAILURE_RETRY (sendmsg (server, &msg, 0));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "sendmsg");
+  return 0;
+}
+
+int
+receive_fds_from_socket_with_payload (int from, int *fds, size_t n_fds, char *payload, size_t payload_len,
+                                      libcrun_error_t *err)
+{
+  cleanup_free char *ctrl_buf = NULL;
+  struct cmsghdr *cmsg;
+  struct msghdr msg = {};
+  struct iovec iov[1];
+  size_t received = 0;
+  char data[1];
+  size_t i;
+  int ret;
+
+  data[0] = ' ';
+  iov[0].iov_base = data;
+  iov[0].iov_len = sizeof (data);
+
+  if (payload_len > 0)
+    {
+      iov[0].iov_base = (void *) payload;
+      iov[0].iov_len = payload_len;
+    }
+
+  ctrl_buf = xmalloc0 (CMSG_SPACE (sizeof (int) * n_fds));
+
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  msg.msg_controllen = CMSG_SPACE (sizeof (int) * n_fds);
+  msg.msg_control = ctrl_buf;
+
+  ret = TEMP_FAILURE_RETRY (recvmsg (from, &msg, MSG_CMSG_CLOEXEC));
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "recvmsg");
+  if (UNLIKELY (ret == 0))
+    return crun_make_error (err, 0, "read FDs: connection closed");
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      received = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+      memcpy (fds, CMSG_DATA (cmsg), sizeof (int) * received);
+    }
+
+  if (UNLIKELY (received != n_fds || (msg.msg_flags & MSG_CTRUNC) || (payload_len > 0 && (size_t) ret != payload_len)))
+    {
+      for (i = 0; i < received; i++)
+        TEMP_FAILURE_RETRY (close (fds[i]));
+      return crun_make_error (err, 0, "received %zu FDs, expected %zu", received, n_fds);
+    }
+
+  return 0;
+}
+
 int
 receive_fd_from_socket (int from, libcrun_error_t *err)
 {
@@ -1940,78 +2339,119 @@ find_executable (const char *executable_path, const char *cwd)
   return NULL;
 }
 
-#ifdef HAVE_FGETXATTR
+/* Size of the buffer used to copy the file data when neither FICLONE
+   nor copy_file_range can be used.  */
+#define COPY_BUFFER_SIZE (128 * 1024)
 
-static ssize_t
-safe_read_xattr (char **ret, int sfd, const char *srcname, const char *name, size_t initial_size, libcrun_error_t *err)
+/* Initial size of the buffers used for the xattrs.  Most files have
+   only a few short xattrs, so they are read with a single syscall.  */
+#define COPY_XATTR_BUFFER_SIZE 1024
+
+/* A directory is copied by a worker when it likely has enough content
+   to make up for the cost of forking: it has sub-directories or its
+   size shows it has many entries.  */
+#define COPY_FANOUT_DIR_SIZE (16 * 1024)
+
+#ifndef FICLONE
+#  define FICLONE _IOW (0x94, 9, int)
+#endif
+
+/* Shared with the workers through a MAP_SHARED mapping.  */
+struct copy_shared_s
 {
-  cleanup_free char *buffer = NULL;
-  ssize_t current_size;
-  ssize_t s;
+  uint64_t files;
+  uint64_t bytes;
+  int error_set;
+  int error_status;
+  char error_msg[512];
+};
 
-  current_size = (ssize_t) initial_size;
-  buffer = xmalloc (current_size + 1);
+struct copy_ctx_s
+{
+  struct copy_shared_s *shared;
 
-  while (1)
-    {
-      s = fgetxattr (sfd, name, buffer, current_size);
-      if (UNLIKELY (s < 0))
-        return crun_make_error (err, errno, "get xattr `%s` from `%s`", name, srcname);
+  char *buffer;
+  char *xattr_list;
+  size_t xattr_list_size;
+  char *xattr_value;
+  size_t xattr_value_size;
 
-      if (s < current_size)
-        break;
+  pid_t *workers;
+  size_t n_workers;
+  size_t max_workers;
+  bool is_worker;
+  bool worker_failed;
+};
 
-      current_size *= 2;
-      buffer = xrealloc (buffer, current_size + 1);
-    }
+#ifdef HAVE_FGETXATTR
+static ssize_t
+copy_list_xattr (struct copy_ctx_s *ctx, int sfd, const char *srcname, libcrun_error_t *err)
+{
+  for (;;)
+    {
+      ssize_t len;
 
-  if (s <= 0)
-    return s;
+      len = flistxattr (sfd, ctx->xattr_list, ctx->xattr_list_size);
+      if (len >= 0)
+        return len;
 
-  buffer[s] = '\0';
+      if (errno == ENOTSUP)
+        return 0;
+      if (UNLIKELY (errno != ERANGE))
+        return crun_make_error (err, errno, "get xattr list for `%s`", srcname);
 
-  /* Change owner.  */
-  *ret = buffer;
-  buffer = NULL;
+      /* The buffer is too small, ask for the size.  */
+      len = flistxattr (sfd, NULL, 0);
+      if (UNLIKELY (len < 0))
+        return crun_make_error (err, errno, "get xattr list for `%s`", srcname);
 
-  return s;
+      ctx->xattr_list_size = len + 1;
+      ctx->xattr_list = xrealloc (ctx->xattr_list, ctx->xattr_list_size);
+    }
 }
 
 static ssize_t
-copy_xattr (int sfd, int dfd, const char *srcname, const char *destname, libcrun_error_t *err)
+copy_get_xattr (struct copy_ctx_s *ctx, int sfd, const char *srcname, const char *name, libcrun_error_t *err)
 {
-  cleanup_free char *buf = NULL;
-  ssize_t xattr_len;
-  char *it;
-
-  xattr_len = flistxattr (sfd, NULL, 0);
-  if (UNLIKELY (xattr_len < 0))
+  for (;;)
     {
-      if (errno == ENOTSUP)
-        return 0;
+      ssize_t len;
 
-      return crun_make_error (err, errno, "get xattr list for `%s`", srcname);
-    }
+      len = fgetxattr (sfd, name, ctx->xattr_value, ctx->xattr_value_size);
+      if (len >= 0)
+        return len;
 
-  if (xattr_len == 0)
-    return 0;
+      if (UNLIKELY (errno != ERANGE))
+        return crun_make_error (err, errno, "get xattr `%s` from `%s`", name, srcname);
+
+      len = fgetxattr (sfd, name, NULL, 0);
+      if (UNLIKELY (len < 0))
+        return crun_make_error (err, errno, "get xattr `%s` from `%s`", name, srcname);
+
+      ctx->xattr_value_size = len + 1;
+      ctx->xattr_value = xrealloc (ctx->xattr_value, ctx->xattr_value_size);
+    }
+}
 
-  buf = xmalloc (xattr_len + 1);
+static ssize_t
+copy_xattr (struct copy_ctx_s *ctx, int sfd, int dfd, const char *srcname, const char *destname, libcrun_error_t *err)
+{
+  ssize_t xattr_len;
+  char *it;
 
-  xattr_len = flistxattr (sfd, buf, xattr_len + 1);
-  if (UNLIKELY (xattr_len < 0))
-    return crun_make_error (err, errno, "get xattr list for `%s`", srcname);
+  xattr_len = copy_list_xattr (ctx, sfd, srcname, err);
+  if (UNLIKELY (xattr_len <= 0))
+    return xattr_len;
 
-  for (it = buf; it - buf < xattr_len; it += strlen (it) + 1)
+  for (it = ctx->xattr_list; it - ctx->xattr_list < xattr_len; it += strlen (it) + 1)
     {
-      cleanup_free char *v = NULL;
       ssize_t s;
 
-      s = safe_read_xattr (&v, sfd, srcname, it, 256, err);
+      s = copy_get_xattr (ctx, sfd, srcname, it, err);
       if (UNLIKELY (s < 0))
         return s;
 
-      s = fsetxattr (dfd, it, v, s, 0);
+      s = fsetxattr (dfd, it, ctx->xattr_value, s, 0);
       if (UNLIKELY (s < 0))
         {
           if (errno == EINVAL || errno == EOPNOTSUPP)
@@ -2026,8 +2466,18 @@ copy_xattr (int sfd, int dfd, const char *srcname, const char *destname, libcrun
 
 #endif
 
+struct copy_stat_s
+{
+  mode_t mode;
+  off_t size;
+  dev_t rdev;
+  uid_t uid;
+  gid_t gid;
+  nlink_t nlink;
+};
+
 static int
-copy_rec_stat_file_at (int dfd, const char *path, mode_t *mode, off_t *size, dev_t *rdev, uid_t *uid, gid_t *gid)
+copy_rec_stat_file_at (int dfd, const char *path, struct copy_stat_s *cst)
 {
   struct stat st;
   int ret;
@@ -2038,7 +2488,7 @@ copy_rec_stat_file_at (int dfd, const char *path, mode_t *mode, off_t *size, dev
   };
 
   ret = statx (dfd, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
-               STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_UID | STATX_GID, &stx);
+               STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_UID | STATX_GID | STATX_NLINK, &stx);
   if (UNLIKELY (ret < 0))
     {
       if (errno == ENOSYS || errno == EINVAL)
@@ -2047,11 +2497,12 @@ copy_rec_stat_file_at (int dfd, const char *path, mode_t *mode, off_t *size, dev
       return ret;
     }
 
-  *mode = stx.stx_mode;
-  *size = stx.stx_size;
-  *rdev = makedev (stx.stx_rdev_major, stx.stx_rdev_minor);
-  *uid = stx.stx_uid;
-  *gid = stx.stx_gid;
+  cst->mode = stx.stx_mode;
+  cst->size = stx.stx_size;
+  cst->rdev = makedev (stx.stx_rdev_major, stx.stx_rdev_minor);
+  cst->uid = stx.stx_uid;
+  cst->gid = stx.stx_gid;
+  cst->nlink = stx.stx_nlink;
 
   return ret;
 
@@ -2059,17 +2510,219 @@ fallback:
 #endif
   ret = fstatat (dfd, path, &st, AT_SYMLINK_NOFOLLOW);
 
-  *mode = st.st_mode;
-  *size = st.st_size;
-  *rdev = st.st_rdev;
-  *uid = st.st_uid;
-  *gid = st.st_gid;
+  cst->mode = st.st_mode;
+  cst->size = st.st_size;
+  cst->rdev = st.st_rdev;
+  cst->uid = st.st_uid;
+  cst->gid = st.st_gid;
+  cst->nlink = st.st_nlink;
 
   return ret;
 }
 
-int
-copy_recursive_fd_to_fd (int srcdirfd, int dfd, const char *srcname, const char *destname, libcrun_error_t *err)
+/* Copy the whole content of SRCFD to DESTFD.  Try first to share the
+   extents with FICLONE, then to copy them in the kernel with
+   copy_file_range and as last resort with read/write.  */
+static int
+copy_file_data (struct copy_ctx_s *ctx, int srcfd, int destfd, off_t size, const char *name, libcrun_error_t *err)
+{
+  uint64_t copied = 0;
+  ssize_t nread;
+
+  if (size == 0)
+    return 0;
+
+  if (ioctl (destfd, FICLONE, srcfd) == 0)
+    {
+      __atomic_add_fetch (&ctx->shared->bytes, size, __ATOMIC_RELAXED);
+      return 0;
+    }
+
+#ifdef HAVE_COPY_FILE_RANGE
+  for (;;)
+    {
+      nread = copy_file_range (srcfd, NULL, destfd, NULL, SSIZE_MAX, 0);
+      if (nread < 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP))
+        break;
+      if (UNLIKELY (nread < 0))
+        return crun_make_error (err, errno, "copy_file_range `%s`", name);
+      if (nread == 0)
+        goto done;
+      copied += nread;
+    }
+#endif
+
+  /* Continue from the current offset, copy_file_range might have
+     copied some data before failing.  */
+  if (ctx->buffer == NULL)
+    ctx->buffer = xmalloc (COPY_BUFFER_SIZE);
+
+  for (;;)
+    {
+      ssize_t remaining;
+
+      nread = TEMP_FAILURE_RETRY (read (srcfd, ctx->buffer, COPY_BUFFER_SIZE));
+      if (UNLIKELY (nread < 0))
+        return crun_make_error (err, errno, "read `%s`", name);
+      if (nread == 0)
+        break;
+
+      for (remaining = nread; remaining;)
+        {
+          ssize_t w = TEMP_FAILURE_RETRY (write (destfd, ctx->buffer + nread - remaining, remaining));
+          if (UNLIKELY (w < 0))
+            return crun_make_error (err, errno, "write `%s`", name);
+          remaining -= w;
+        }
+      copied += nread;
+    }
+
+#ifdef HAVE_COPY_FILE_RANGE
+done:
+#endif
+  __atomic_add_fetch (&ctx->shared->bytes, copied, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static int
+copy_set_owner_and_mode (int destdirfd, const char *name, const char *destname, const struct copy_stat_s *cst,
+                         libcrun_error_t *err)
+{
+  int ret;
+
+  ret = fchownat (destdirfd, name, cst->uid, cst->gid, AT_SYMLINK_NOFOLLOW);
+  if (UNLIKELY (ret < 0))
+    return crun_make_error (err, errno, "chown `%s/%s`", destname, name);
+
+    /*
+     * ALLPERMS is not defined by POSIX
+     */
+#ifndef ALLPERMS
+#  define ALLPERMS (S_ISUID | S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO)
+#endif
+
+  ret = fchmodat (destdirfd, name, cst->mode & ALLPERMS, AT_SYMLINK_NOFOLLOW);
+  if (UNLIKELY (ret < 0))
+    {
+      /* If the operation fails with ENOTSUP we are dealing with a symlink, so ignore it.  */
+      if (errno == ENOTSUP)
+        return 0;
+
+      return crun_make_error (err, errno, "chmod `%s/%s`", destname, name);
+    }
+
+  return 0;
+}
+
+static int copy_directory (struct copy_ctx_s *ctx, int srcdirfd, int dfd, const char *srcname, const char *destname,
+                           libcrun_error_t *err);
+
+/* Copy the directory NAME, that was already created in DESTDIRFD.  */
+static int
+copy_directory_entry (struct copy_ctx_s *ctx, int srcdirfd, int destdirfd, const char *name, const char *srcname,
+                      const char *destname, const struct copy_stat_s *cst, libcrun_error_t *err)
+{
+  cleanup_close int srcfd = -1;
+  cleanup_close int destfd = -1;
+  int ret;
+
+  srcfd = openat (srcdirfd, name, O_DIRECTORY | O_CLOEXEC);
+  if (UNLIKELY (srcfd < 0))
+    return crun_make_error (err, errno, "open directory `%s/%s`", srcname, name);
+
+  destfd = openat (destdirfd, name, O_DIRECTORY | O_CLOEXEC);
+  if (UNLIKELY (destfd < 0))
+    return crun_make_error (err, errno, "open directory `%s/%s`", destname, name);
+
+#ifdef HAVE_FGETXATTR
+  ret = (int) copy_xattr (ctx, srcfd, destfd, name, name, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+#endif
+
+  ret = copy_directory (ctx, srcfd, destfd, name, name, err);
+  srcfd = destfd = -1;
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  return copy_set_owner_and_mode (destdirfd, name, destname, cst, err);
+}
+
+static void
+copy_reap_workers (struct copy_ctx_s *ctx, bool block)
+{
+  size_t i = 0;
+
+  while (i < ctx->n_workers)
+    {
+      int status = 0;
+      pid_t ret;
+
+      ret = TEMP_FAILURE_RETRY (waitpid (ctx->workers[i], &status, block ? 0 : WNOHANG));
+      if (ret == 0)
+        {
+          i++;
+          continue;
+        }
+
+      if (ret < 0 || ! WIFEXITED (status) || WEXITSTATUS (status) != 0)
+        ctx->worker_failed = true;
+
+      ctx->workers[i] = ctx->workers[--ctx->n_workers];
+    }
+}
+
+/* Try to copy the directory NAME in a worker process.  Returns 1 if a
+   worker took care of it, 0 if the caller must copy it.  */
+static int
+copy_directory_in_worker (struct copy_ctx_s *ctx, int srcdirfd, int destdirfd, const char *name, const char *srcname,
+                          const char *destname, const struct copy_stat_s *cst)
+{
+  libcrun_error_t tmp_err = NULL;
+  pid_t pid;
+  int ret;
+
+  if (ctx->is_worker || ctx->max_workers <= 1)
+    return 0;
+
+  if (cst->nlink <= 2 && cst->size < COPY_FANOUT_DIR_SIZE)
+    return 0;
+
+  if (ctx->n_workers == ctx->max_workers)
+    {
+      copy_reap_workers (ctx, false);
+      if (ctx->n_workers == ctx->max_workers)
+        return 0;
+    }
+
+  pid = fork ();
+  if (pid < 0)
+    return 0;
+
+  if (pid)
+    {
+      ctx->workers[ctx->n_workers++] = pid;
+      return 1;
+    }
+
+  ctx->is_worker = true;
+  ret = copy_directory_entry (ctx, srcdirfd, destdirfd, name, srcname, destname, cst, &tmp_err);
+  if (UNLIKELY (ret < 0))
+    {
+      /* Only the first error is reported.  */
+      if (__atomic_exchange_n (&ctx->shared->error_set, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+          ctx->shared->error_status = tmp_err->status;
+          snprintf (ctx->shared->error_msg, sizeof (ctx->shared->error_msg), "%s", tmp_err->msg);
+        }
+      _exit (EXIT_FAILURE);
+    }
+  _exit (EXIT_SUCCESS);
+}
+
+static int
+copy_directory (struct copy_ctx_s *ctx, int srcdirfd, int dfd, const char *srcname, const char *destname,
+                libcrun_error_t *err)
 {
   cleanup_close int destdirfd = dfd;
   cleanup_dir DIR *dsrcfd = NULL;
@@ -2087,21 +2740,17 @@ copy_recursive_fd_to_fd (int srcdirfd, int dfd, const char *srcname, const char
       cleanup_close int srcfd = -1;
       cleanup_close int destfd = -1;
       cleanup_free char *target_buf = NULL;
+      struct copy_stat_s cst;
       int ret;
-      mode_t mode;
-      off_t st_size;
-      dev_t rdev;
-      uid_t uid;
-      gid_t gid;
 
       if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
         continue;
 
-      ret = copy_rec_stat_file_at (dirfd (dsrcfd), de->d_name, &mode, &st_size, &rdev, &uid, &gid);
+      ret = copy_rec_stat_file_at (dirfd (dsrcfd), de->d_name, &cst);
       if (UNLIKELY (ret < 0))
         return crun_make_error (err, errno, "stat `%s/%s`", srcname, de->d_name);
 
-      switch (mode & S_IFMT)
+      switch (cst.mode & S_IFMT)
         {
         case S_IFREG:
           srcfd = openat (dirfd (dsrcfd), de->d_name, O_NONBLOCK | O_RDONLY | O_CLOEXEC);
@@ -2112,12 +2761,12 @@ copy_recursive_fd_to_fd (int srcdirfd, int dfd, const char *srcname, const char
           if (UNLIKELY (destfd < 0))
             return crun_make_error (err, errno, "open `%s/%s`", destname, de->d_name);
 
-          ret = copy_from_fd_to_fd (srcfd, destfd, 1, err);
+          ret = copy_file_data (ctx, srcfd, destfd, cst.size, de->d_name, err);
           if (UNLIKELY (ret < 0))
             return ret;
 
 #ifdef HAVE_FGETXATTR
-          ret = (int) copy_xattr (srcfd, destfd, de->d_name, de->d_name, err);
+          ret = (int) copy_xattr (ctx, srcfd, destfd, de->d_name, de->d_name, err);
           if (UNLIKELY (ret < 0))
             return ret;
 #endif
@@ -2127,32 +2776,23 @@ copy_recursive_fd_to_fd (int srcdirfd, int dfd, const char *srcname, const char
           break;
 
         case S_IFDIR:
-          ret = mkdirat (destdirfd, de->d_name, mode);
+          ret = mkdirat (destdirfd, de->d_name, cst.mode);
           if (UNLIKELY (ret < 0))
             return crun_make_error (err, errno, "mkdir `%s/%s`", destname, de->d_name);
 
-          srcfd = openat (dirfd (dsrcfd), de->d_name, O_DIRECTORY | O_CLOEXEC);
-          if (UNLIKELY (srcfd < 0))
-            return crun_make_error (err, errno, "open directory `%s/%s`", srcname, de->d_name);
-
-          destfd = openat (destdirfd, de->d_name, O_DIRECTORY | O_CLOEXEC);
-          if (UNLIKELY (destfd < 0))
-            return crun_make_error (err, errno, "open directory `%s/%s`", srcname, de->d_name);
-
-#ifdef HAVE_FGETXATTR
-          ret = (int) copy_xattr (srcfd, destfd, de->d_name, de->d_name, err);
+          /* The owner and the mode are set once the directory is copied,
+             either by the worker or by copy_directory_entry.  */
+          ret = copy_directory_in_worker (ctx, dirfd (dsrcfd), destdirfd, de->d_name, srcname, destname, &cst);
+          if (ret == 0)
+            ret = copy_directory_entry (ctx, dirfd (dsrcfd), destdirfd, de->d_name, srcname, destname, &cst, err);
           if (UNLIKELY (ret < 0))
             return ret;
-#endif
 
-          ret = copy_recursive_fd_to_fd (srcfd, destfd, de->d_name, de->d_name, err);
-          srcfd = destfd = -1;
-          if (UNLIKELY (ret < 0))
-            return ret;
-          break;
+          __atomic_add_fetch (&ctx->shared->files, 1, __ATOMIC_RELAXED);
+          continue;
 
         case S_IFLNK:
-          ret = safe_readlinkat (dirfd (dsrcfd), de->d_name, &target_buf, st_size, err);
+          ret = safe_readlinkat (dirfd (dsrcfd), de->d_name, &target_buf, cst.size, err);
           if (UNLIKELY (ret < 0))
             return ret;
 
@@ -2165,35 +2805,73 @@ copy_recursive_fd_to_fd (int srcdirfd, int dfd, const char *srcname, const char
         case S_IFCHR:
         case S_IFIFO:
         case S_IFSOCK:
-          ret = mknodat (destdirfd, de->d_name, mode, rdev);
+          ret = mknodat (destdirfd, de->d_name, cst.mode, cst.rdev);
           if (UNLIKELY (ret < 0))
             return crun_make_error (err, errno, "create special file `%s/%s`", destname, de->d_name);
           break;
         }
 
-      ret = fchownat (destdirfd, de->d_name, uid, gid, AT_SYMLINK_NOFOLLOW);
+      ret = copy_set_owner_and_mode (destdirfd, de->d_name, destname, &cst, err);
       if (UNLIKELY (ret < 0))
-        return crun_make_error (err, errno, "chown `%s/%s`", destname, de->d_name);
+        return ret;
 
-        /*
-         * ALLPERMS is not defined by POSIX
-         */
-#ifndef ALLPERMS
-#  define ALLPERMS (S_ISUID | S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO)
-#endif
+      __atomic_add_fetch (&ctx->shared->files, 1, __ATOMIC_RELAXED);
+    }
 
-      ret = fchmodat (destdirfd, de->d_name, mode & ALLPERMS, AT_SYMLINK_NOFOLLOW);
-      if (UNLIKELY (ret < 0))
-        {
-          /* If the operation fails with ENOTSUP we are dealing with a symlink, so ignore it.  */
-          if (errno == ENOTSUP)
-            continue;
+  return 0;
+}
 
-          return crun_make_error (err, errno, "chmod `%s/%s`", destname, de->d_name);
-        }
+int
+copy_recursive_fd_to_fd (int srcdirfd, int dfd, const char *srcname, const char *destname, unsigned int workers,
+                         struct copy_recursive_stats_s *stats, libcrun_error_t *err)
+{
+  struct copy_ctx_s ctx = {
+    0,
+  };
+  int ret;
+
+  ctx.shared = mmap (NULL, sizeof (struct copy_shared_s), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (UNLIKELY (ctx.shared == MAP_FAILED))
+    {
+      TEMP_FAILURE_RETRY (close (srcdirfd));
+      TEMP_FAILURE_RETRY (close (dfd));
+      return crun_make_error (err, errno, "mmap");
     }
 
-  return 0;
+  ctx.max_workers = workers;
+  if (workers > 1)
+    ctx.workers = xmalloc (sizeof (pid_t) * workers);
+  ctx.xattr_list_size = COPY_XATTR_BUFFER_SIZE;
+  ctx.xattr_list = xmalloc (ctx.xattr_list_size);
+  ctx.xattr_value_size = COPY_XATTR_BUFFER_SIZE;
+  ctx.xattr_value = xmalloc (ctx.xattr_value_size);
+
+  ret = copy_directory (&ctx, srcdirfd, dfd, srcname, destname, err);
+
+  /* Always wait for the workers, even if the copy failed.  */
+  copy_reap_workers (&ctx, true);
+
+  if (ret >= 0 && ctx.worker_failed)
+    {
+      if (ctx.shared->error_set)
+        ret = crun_make_error (err, ctx.shared->error_status, "%s", ctx.shared->error_msg);
+      else
+        ret = crun_make_error (err, 0, "copy of `%s` failed", srcname);
+    }
+
+  if (stats)
+    {
+      stats->files += ctx.shared->files;
+      stats->bytes += ctx.shared->bytes;
+    }
+
+  munmap (ctx.shared, sizeof (struct copy_shared_s));
+  free (ctx.workers);
+  free (ctx.buffer);
+  free (ctx.xattr_list);
+  free (ctx.xattr_value);
+
+  return ret;
 }
 
 const char *
@@ -321,6 +321,12 @@ int receive_fd_from_socket (int from, libcrun_error_t *err);
 
 int receive_fd_from_socket_with_payload (int from, char *payload, size_t payload_len, libcrun_error_t *err);
 
+int send_fds_to_socket_with_payload (int server, const int *fds, size_t n_fds, const char *payload, size_t payload_len,
+                                     libcrun_error_t *err);
+
+int receive_fds_from_socket_with_payload (int from, int *fds, size_t n_fds, char *payload, size_t payload_len,
+                                          libcrun_error_t *err);
+
 int create_signalfd (sigset_t *mask, libcrun_error_t *err);
 
 int epoll_helper (int *fds, int *levelfds, libcrun_error_t *err);
@@ -351,7 +357,18 @@ has_prefix (const char *str, const char *prefix)
 
 char *find_executable (const char *executable_path, const char *cwd);
 
-int copy_recursive_fd_to_fd (int srcfd, int destfd, const char *srcname, const char *destname, libcrun_error_t *err);
+struct copy_recursive_stats_s
+{
+  uint64_t files;
+  uint64_t bytes;
+};
+
+/* Copy the content of the directory SRCFD to DESTFD, taking ownership
+   of both fds.  Sub-directories are copied in parallel by up to WORKERS
+   processes.  If STATS is not NULL, the number of files and bytes
+   copied are added to it.  */
+int copy_recursive_fd_to_fd (int srcfd, int destfd, const char *srcname, const char *destname, unsigned int workers,
+                             struct copy_recursive_stats_s *stats, libcrun_error_t *err);
 
 int set_home_env (uid_t uid);
 
@@ -373,6 +390,22 @@ char *get_user_name (uid_t uid);
 int safe_openat (int dirfd, const char *rootfs, size_t rootfs_len, const char *path, int flags, int mode,
                  libcrun_error_t *err);
 
+void safe_openat_cache_begin (int dirfd);
+
+void safe_openat_cache_end (void);
+
+void safe_openat_cache_invalidate (int targetfd);
+
+static inline void
+cleanup_safe_openat_cachep (void *p)
+{
+  bool *active = (bool *) p;
+  if (*active)
+    safe_openat_cache_end ();
+}
+
+#define cleanup_safe_openat_cache __attribute__ ((cleanup (cleanup_safe_openat_cachep)))
+
 ssize_t safe_write (int fd, const void *buf, ssize_t count);
 
 int append_paths (char **out, libcrun_error_t *err, ...) __attribute__ ((sentinel));
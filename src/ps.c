@@ -23,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include "crun.h"
 #include "libcrun/container.h"
@@ -37,12 +38,14 @@ enum
   OPTION_PID_FILE,
   OPTION_NO_SUBREAPER,
   OPTION_NO_NEW_KEYRING,
-  OPTION_PRESERVE_FDS
+  OPTION_PRESERVE_FDS,
+  OPTION_STAT,
 };
 
 struct ps_options_s
 {
   int format;
+  bool stat;
 };
 
 enum
@@ -54,6 +57,7 @@ enum
 static struct ps_options_s ps_options;
 
 static struct argp_option options[] = { { "format", 'f', "FORMAT", 0, "select the output format", 0 },
+                                        { "stat", OPTION_STAT, 0, 0, "include the stat of each process", 0 },
                                         {
                                             0,
                                         } };
@@ -74,6 +78,10 @@ parse_opt (int key, char *arg, struct argp_state *state arg_unused)
         error (EXIT_FAILURE, 0, "invalid format `%s`", arg);
       break;
 
+    case OPTION_STAT:
+      ps_options.stat = true;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -83,6 +91,72 @@ parse_opt (int key, char *arg, struct argp_state *state arg_unused)
 
 static struct argp run_argp = { options, parse_opt, args_doc, doc, NULL, NULL, NULL };
 
+static void
+print_json_string (const char *str)
+{
+  const unsigned char *it;
+
+  putchar ('"');
+  for (it = (const unsigned char *) str; *it; it++)
+    {
+      if (*it == '"' || *it == '\\')
+        printf ("\\%c", *it);
+      else if (*it < 0x20)
+        printf ("\\u%04x", *it);
+      else
+        putchar (*it);
+    }
+  putchar ('"');
+}
+
+/* Print the stat of each process as it is read, the processes that
+   exited in the meanwhile are skipped.  */
+static int
+print_pids_stat (pid_t *pids, libcrun_error_t *err)
+{
+  char buffer[4096];
+  bool first = true;
+  size_t i;
+  int ret;
+
+  if (ps_options.format == PS_JSON)
+    printf ("[");
+  else
+    printf ("%-8s %-8s %-5s %-7s %-10s %-10s %-10s %s\n", "PID", "PPID", "STATE", "THREADS", "UTIME", "STIME",
+            "RSS", "COMMAND");
+
+  for (i = 0; pids && pids[i]; i++)
+    {
+      libcrun_process_stat_t st;
+
+      ret = libcrun_read_process_stat (pids[i], buffer, sizeof (buffer), &st, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+      if (ret == 0)
+        continue;
+
+      if (ps_options.format == PS_JSON)
+        {
+          printf ("%s\n  {\"pid\": %d, \"ppid\": %d, \"state\": \"%c\", \"comm\": ", first ? "" : ",", st.pid,
+                  st.ppid, st.state);
+          print_json_string (st.comm);
+          printf (", \"utime\": %" PRIu64 ", \"stime\": %" PRIu64 ", \"num_threads\": %" PRIu64
+                  ", \"starttime\": %" PRIu64 ", \"vsize\": %" PRIu64 ", \"rss\": %" PRIu64 "}",
+                  st.utime, st.stime, st.num_threads, st.starttime, st.vsize, st.rss);
+        }
+      else
+        printf ("%-8d %-8d %-5c %-7" PRIu64 " %-10" PRIu64 " %-10" PRIu64 " %-10" PRIu64 " %s\n", st.pid, st.ppid,
+                st.state, st.num_threads, st.utime, st.stime, st.rss, st.comm);
+
+      first = false;
+    }
+
+  if (ps_options.format == PS_JSON)
+    printf ("\n]\n");
+
+  return 0;
+}
+
 int
 crun_command_ps (struct crun_global_arguments *global_args, int argc, char **argv, libcrun_error_t *err)
 {
@@ -110,6 +184,9 @@ crun_command_ps (struct crun_global_arguments *global_args, int argc, char **arg
       return ret;
     }
 
+  if (ps_options.stat)
+    return print_pids_stat (pids, err);
+
   switch (ps_options.format)
     {
     case PS_JSON:
@@ -0,0 +1,215 @@
+/*
+ * crun - OCI runtime written in C
+ *
+ * Copyright (C) 2017, 2018, 2019 Giuseppe Scrivano <giuseppe@scrivano.org>
+ * crun is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * crun is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with crun.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <argp.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "crun.h"
+#include "libcrun/container.h"
+#include "libcrun/utils.h"
+
+static char doc[] = "OCI runtime";
+
+enum
+{
+  OPTION_INTERVAL = 1000,
+  OPTION_NO_STREAM,
+  OPTION_ALL,
+  OPTION_FORMAT,
+  OPTION_THREADS,
+};
+
+struct stats_options_s
+{
+  unsigned long interval;
+  bool no_stream;
+  bool all;
+  int format;
+  unsigned int threads;
+};
+
+static struct stats_options_s stats_options;
+
+static struct argp_option options[]
+    = { { "interval", OPTION_INTERVAL, "MS", 0, "interval between two samples in milliseconds (default 1000)", 0 },
+        { "no-stream", OPTION_NO_STREAM, 0, 0, "print a single sample and exit", 0 },
+        { "all", OPTION_ALL, 0, 0, "print the stats of all the containers", 0 },
+        { "format", OPTION_FORMAT, "FORMAT", 0, "output format for --all: json or prometheus (default json)", 0 },
+        { "threads", OPTION_THREADS, "N", 0, "number of threads used by --all to read the stats (default 4)", 0 },
+        {
+            0,
+        } };
+
+static char args_doc[] = "stats [CONTAINER]";
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
+    {
+    case ARGP_KEY_NO_ARGS:
+      if (! stats_options.all)
+        libcrun_fail_with_error (0, "please specify a ID for the container");
+      break;
+
+    case OPTION_INTERVAL:
+      stats_options.interval = strtoul (argp_mandatory_argument (arg, state), NULL, 10);
+      if (stats_options.interval == 0)
+        libcrun_fail_with_error (0, "invalid interval `%s`", arg);
+      break;
+
+    case OPTION_NO_STREAM:
+      stats_options.no_stream = true;
+      break;
+
+    case OPTION_ALL:
+      stats_options.all = true;
+      break;
+
+    case OPTION_FORMAT:
+      if (strcmp (arg, "json") == 0)
+        stats_options.format = LIBCRUN_STATS_FORMAT_JSON;
+      else if (strcmp (arg, "prometheus") == 0)
+        stats_options.format = LIBCRUN_STATS_FORMAT_PROMETHEUS;
+      else
+        libcrun_fail_with_error (0, "invalid format `%s`", arg);
+      break;
+
+    case OPTION_THREADS:
+      stats_options.threads = strtoul (argp_mandatory_argument (arg, state), NULL, 10);
+      if (stats_options.threads == 0)
+        libcrun_fail_with_error (0, "invalid number of threads `%s`", arg);
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+
+  return 0;
+}
+
+static struct argp run_argp = { options, parse_opt, args_doc, doc, NULL, NULL, NULL };
+
+static int
+stats_all (libcrun_context_t *crun_context, struct timespec *interval, libcrun_error_t *err)
+{
+  libcrun_stats_table_t *table = NULL;
+  int ret;
+
+  ret = libcrun_stats_table_new (crun_context, stats_options.threads, &table, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  for (;;)
+    {
+      const char *out;
+      size_t len;
+
+      ret = libcrun_stats_table_scrape (table, stats_options.format, &out, &len, err);
+      if (UNLIKELY (ret < 0))
+        break;
+
+      fwrite (out, 1, len, stdout);
+      fflush (stdout);
+
+      if (stats_options.no_stream)
+        break;
+
+      nanosleep (interval, NULL);
+    }
+
+  libcrun_stats_table_free (table);
+  return ret;
+}
+
+int
+crun_command_stats (struct crun_global_arguments *global_args, int argc, char **argv, libcrun_error_t *err)
+{
+  libcrun_stats_reader_t *reader = NULL;
+  libcrun_container_stats_t stats;
+  struct timespec interval;
+  int first_arg;
+  int ret;
+
+  libcrun_context_t crun_context = {
+    0,
+  };
+
+  stats_options.interval = 1000;
+  stats_options.threads = 4;
+
+  argp_parse (&run_argp, argc, argv, ARGP_IN_ORDER, &first_arg, &stats_options);
+  if (stats_options.all)
+    crun_assert_n_args (argc - first_arg, 0, 0);
+  else
+    crun_assert_n_args (argc - first_arg, 1, 1);
+
+  ret = init_libcrun_context (&crun_context, argv[first_arg], global_args, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  interval.tv_sec = stats_options.interval / 1000;
+  interval.tv_nsec = (stats_options.interval % 1000) * 1000000;
+
+  if (stats_options.all)
+    return stats_all (&crun_context, &interval, err);
+
+  ret = libcrun_container_stats_open (&crun_context, argv[first_arg], &reader, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  for (;;)
+    {
+      const char *json;
+      size_t len;
+
+      ret = libcrun_stats_reader_read (reader, &stats, err);
+      if (UNLIKELY (ret < 0))
+        {
+          /* The container exited and its cgroup was removed.  */
+          if ((*err)->status == ENODEV)
+            {
+              libcrun_error_release (err);
+              ret = 0;
+            }
+          break;
+        }
+
+      ret = libcrun_stats_reader_format_json (reader, &stats, &json, &len, err);
+      if (UNLIKELY (ret < 0))
+        break;
+
+      fwrite (json, 1, len, stdout);
+      fputc ('\n', stdout);
+      fflush (stdout);
+
+      if (stats_options.no_stream)
+        break;
+
+      nanosleep (&interval, NULL);
+    }
+
+  libcrun_stats_reader_free (reader);
+  return ret;
+}
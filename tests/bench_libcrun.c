@@ -0,0 +1,463 @@
+/*
+ * crun - OCI runtime written in C
+ *
+ * Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+ * crun is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * crun is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crun.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks for the libcrun hot paths.  Each benchmark prints a
+   JSON object on its own line:
+
+   {"name": "append_paths", "iterations": 1048576, "ns_per_op": 45.1}
+
+   Benchmarks that cannot run in the current environment print
+   "skipped" with the reason instead.  The benchmarks to run can be
+   selected by passing their names on the command line.  */
+
+#define _GNU_SOURCE
+
+#include <config.h>
+#include <libcrun/error.h>
+#include <libcrun/cgroup.h>
+#include <libcrun/cgroup-internal.h>
+#include <libcrun/utils.h>
+#include <libcrun/status.h>
+#include <libcrun/seccomp.h>
+#include <libcrun/ebpf.h>
+#include <libcrun/mount_flags.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct signal_s;
+extern const struct signal_s *libcrun_signal_in_word_set (const char *str, size_t len);
+
+/* Run each benchmark for at least this long.  */
+#define BENCH_MIN_TIME_NS 200000000ULL
+
+struct bench_state_s
+{
+  char *state_root;
+  libcrun_context_t context;
+  libcrun_container_t *seccomp_container;
+  char *cgroup_path;
+};
+
+typedef int (*bench_fn) (struct bench_state_s *state, size_t iterations, libcrun_error_t *err);
+
+static uint64_t
+now_ns ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+bench_append_paths (struct bench_state_s *state arg_unused, size_t iterations, libcrun_error_t *err)
+{
+  size_t i;
+  int ret;
+
+  for (i = 0; i < iterations; i++)
+    {
+      cleanup_free char *path = NULL;
+
+      ret = append_paths (&path, err, "/run/crun/", "/container-id//", "rootfs/dev/null", NULL);
+      if (UNLIKELY (ret < 0))
+        return ret;
+    }
+  return 0;
+}
+
+static int
+bench_mount_flags (struct bench_state_s *state arg_unused, size_t iterations, libcrun_error_t *err arg_unused)
+{
+  const char *options[] = { "rbind", "nosuid", "noexec", "nodev", "ro", "rprivate", "idmap", "mode=755" };
+  size_t found = 0;
+  size_t i;
+
+  for (i = 0; i < iterations; i++)
+    if (libcrun_str2mount_flags (options[i % (sizeof (options) / sizeof (options[0]))]))
+      found++;
+
+  return found > 0 ? 0 : -1;
+}
+
+static int
+bench_signal_lookup (struct bench_state_s *state arg_unused, size_t iterations, libcrun_error_t *err arg_unused)
+{
+  const char *signals[] = { "TERM", "KILL", "HUP", "USR1", "WINCH", "RTMIN+3", "NOTASIGNAL" };
+  size_t found = 0;
+  size_t i;
+
+  for (i = 0; i < iterations; i++)
+    {
+      const char *name = signals[i % (sizeof (signals) / sizeof (signals[0]))];
+
+      if (libcrun_signal_in_word_set (name, strlen (name)))
+        found++;
+    }
+
+  return found > 0 ? 0 : -1;
+}
+
+static int
+bench_ebpf_dev_program (struct bench_state_s *state arg_unused, size_t iterations, libcrun_error_t *err)
+{
+  size_t i;
+  int j;
+
+  for (i = 0; i < iterations; i++)
+    {
+      struct bpf_program *program = bpf_program_new (2048);
+
+      program = bpf_program_init_dev (program, err);
+      for (j = 0; j < 16; j++)
+        program = bpf_program_append_dev (program, "rwm", 'c', 1, j, true, err);
+      program = bpf_program_append_dev (program, "rwm", 'b', -1, -1, false, err);
+      program = bpf_program_complete_dev (program, err);
+      free (program);
+    }
+  return 0;
+}
+
+static int
+bench_seccomp (struct bench_state_s *state, size_t iterations, unsigned int options, libcrun_error_t *err)
+{
+  cleanup_free char *bpf_path = NULL;
+  size_t i;
+  int ret;
+
+  ret = append_paths (&bpf_path, err, state->state_root, state->context.id, "seccomp.bpf", NULL);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  for (i = 0; i < iterations; i++)
+    {
+      struct libcrun_seccomp_gen_ctx_s ctx;
+      cleanup_close int fd = -1;
+
+      libcrun_seccomp_gen_ctx_init (&ctx, state->seccomp_container, true, options);
+
+      ret = libcrun_open_seccomp_bpf (&ctx, &fd, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      ret = libcrun_generate_seccomp (&ctx, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+
+      unlink (bpf_path);
+    }
+  return 0;
+}
+
+static int
+bench_seccomp_cold (struct bench_state_s *state, size_t iterations, libcrun_error_t *err)
+{
+  return bench_seccomp (state, iterations, LIBCRUN_SECCOMP_SKIP_CACHE, err);
+}
+
+/* The first iteration fills the cache, the checksum is computed on every
+   iteration.  */
+static int
+bench_seccomp_cached (struct bench_state_s *state, size_t iterations, libcrun_error_t *err)
+{
+  return bench_seccomp (state, iterations, 0, err);
+}
+
+static int
+bench_read_pids_cgroup (struct bench_state_s *state, size_t iterations, libcrun_error_t *err)
+{
+  size_t i;
+  int ret;
+
+  for (i = 0; i < iterations; i++)
+    {
+      cleanup_free pid_t *pids = NULL;
+
+      ret = libcrun_cgroup_read_pids_from_path (state->cgroup_path, false, &pids, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+    }
+  return 0;
+}
+
+static void
+fill_status (libcrun_container_status_t *status)
+{
+  memset (status, 0, sizeof (*status));
+  status->pid = getpid ();
+  status->bundle = "/var/lib/containers/bundle";
+  status->rootfs = "/var/lib/containers/bundle/rootfs";
+  status->cgroup_path = "/machine.slice/libpod-bench.scope";
+  status->scope = "libpod-bench.scope";
+  status->created = "2023-01-01T00:00:00.000000000Z";
+  status->owner = "root";
+}
+
+static int
+bench_status_write (struct bench_state_s *state, size_t iterations, libcrun_error_t *err)
+{
+  libcrun_container_status_t status;
+  size_t i;
+  int ret;
+
+  fill_status (&status);
+
+  for (i = 0; i < iterations; i++)
+    {
+      ret = libcrun_write_container_status (state->state_root, state->context.id, &status, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+    }
+  return 0;
+}
+
+static int
+bench_status_read (struct bench_state_s *state, size_t iterations, libcrun_error_t *err)
+{
+  libcrun_container_status_t status;
+  size_t i;
+  int ret;
+
+  fill_status (&status);
+  ret = libcrun_write_container_status (state->state_root, state->context.id, &status, err);
+  if (UNLIKELY (ret < 0))
+    return ret;
+
+  for (i = 0; i < iterations; i++)
+    {
+      libcrun_container_status_t read_status;
+
+      ret = libcrun_read_container_status (&read_status, state->state_root, state->context.id, err);
+      if (UNLIKELY (ret < 0))
+        return ret;
+      libcrun_free_container_status (&read_status);
+    }
+  return 0;
+}
+
+static const char *seccomp_syscalls[] = {
+  "read", "write", "open", "openat", "close", "stat", "fstat", "lstat", "poll", "lseek", "mmap", "mprotect",
+  "munmap", "brk", "rt_sigaction", "rt_sigprocmask", "ioctl", "pread64", "pwrite64", "readv", "writev",
+  "access", "pipe", "select", "sched_yield", "mremap", "msync", "mincore", "madvise", "dup", "dup2",
+  "nanosleep", "getpid", "socket", "connect", "accept", "sendto", "recvfrom", "clone", "fork", "execve",
+  "exit", "wait4", "kill", "uname", "fcntl", "flock", "fsync", "getdents64", "getcwd", "chdir", "rename",
+  "mkdir", "rmdir", "unlink", "readlink", "chmod", "chown", "umask", "getuid", "getgid", "setuid", "setgid",
+  "exit_group", "epoll_wait", "epoll_ctl", "futex", "set_tid_address", "prlimit64", "getrandom",
+};
+
+static int
+make_seccomp_container (struct bench_state_s *state, libcrun_error_t *err)
+{
+  cleanup_free char *json = NULL;
+  cleanup_free char *names = NULL;
+  size_t names_len = 0;
+  size_t i;
+
+  for (i = 0; i < sizeof (seccomp_syscalls) / sizeof (seccomp_syscalls[0]); i++)
+    {
+      size_t len = strlen (seccomp_syscalls[i]);
+
+      names = xrealloc (names, names_len + len + 4);
+      names_len += sprintf (names + names_len, "%s\"%s\"", i ? "," : "", seccomp_syscalls[i]);
+    }
+
+  xasprintf (&json,
+             "{\"ociVersion\": \"1.0.0\", \"root\": {\"path\": \"rootfs\"}, \"process\": {\"args\": [\"/bin/true\"], \"cwd\": \"/\"},"
+             "\"linux\": {\"seccomp\": {\"defaultAction\": \"SCMP_ACT_ERRNO\", \"architectures\": [\"SCMP_ARCH_X86_64\", \"SCMP_ARCH_AARCH64\"],"
+             "\"syscalls\": [{\"names\": [%s], \"action\": \"SCMP_ACT_ALLOW\"},"
+             "{\"names\": [\"personality\"], \"action\": \"SCMP_ACT_ALLOW\", \"args\": [{\"index\": 0, \"value\": 0, \"op\": \"SCMP_CMP_EQ\"}]}]}}}",
+             names);
+
+  state->seccomp_container = libcrun_container_load_from_memory (json, err);
+  if (state->seccomp_container == NULL)
+    return -1;
+
+  state->seccomp_container->context = &state->context;
+  return 0;
+}
+
+/* Find the cgroup of the current process on the unified hierarchy.  */
+static char *
+get_own_cgroup ()
+{
+  cleanup_free char *content = NULL;
+  libcrun_error_t err = NULL;
+  char *line, *saveptr = NULL;
+  size_t len;
+  int ret;
+
+  ret = read_all_file ("/proc/self/cgroup", &content, &len, &err);
+  if (UNLIKELY (ret < 0))
+    {
+      crun_error_release (&err);
+      return NULL;
+    }
+
+  for (line = strtok_r (content, "\n", &saveptr); line; line = strtok_r (NULL, "\n", &saveptr))
+    if (has_prefix (line, "0::"))
+      return xstrdup (line + 3);
+
+  return NULL;
+}
+
+struct bench_s
+{
+  const char *name;
+  bench_fn fn;
+};
+
+static struct bench_s benchmarks[] = {
+  { "append_paths", bench_append_paths },
+  { "mount_flags_lookup", bench_mount_flags },
+  { "signal_lookup", bench_signal_lookup },
+  { "ebpf_dev_program", bench_ebpf_dev_program },
+  { "seccomp_generate_cold", bench_seccomp_cold },
+  { "seccomp_generate_cached", bench_seccomp_cached },
+  { "read_pids_cgroup", bench_read_pids_cgroup },
+  { "status_write", bench_status_write },
+  { "status_read", bench_status_read },
+  { NULL, NULL },
+};
+
+static void
+print_skipped (const char *name, const char *reason)
+{
+  printf ("{\"name\": \"%s\", \"skipped\": \"%s\"}\n", name, reason);
+}
+
+static void
+run_benchmark (struct bench_state_s *state, struct bench_s *bench)
+{
+  libcrun_error_t err = NULL;
+  size_t iterations = 1;
+  uint64_t elapsed;
+  int ret;
+
+  if (bench->fn == bench_read_pids_cgroup && state->cgroup_path == NULL)
+    {
+      print_skipped (bench->name, "cgroup v2 not available");
+      return;
+    }
+  if ((bench->fn == bench_seccomp_cold || bench->fn == bench_seccomp_cached) && state->seccomp_container == NULL)
+    {
+      print_skipped (bench->name, "cannot load the seccomp configuration");
+      return;
+    }
+
+  /* Warm up.  */
+  ret = bench->fn (state, 1, &err);
+  if (UNLIKELY (ret < 0))
+    goto fail;
+
+  while (1)
+    {
+      uint64_t start = now_ns ();
+
+      ret = bench->fn (state, iterations, &err);
+      if (UNLIKELY (ret < 0))
+        goto fail;
+
+      elapsed = now_ns () - start;
+      if (elapsed >= BENCH_MIN_TIME_NS)
+        break;
+
+      iterations *= 2;
+    }
+
+  printf ("{\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f}\n", bench->name, iterations,
+          (double) elapsed / iterations);
+  return;
+
+fail:
+  print_skipped (bench->name, err ? err->msg : "failed");
+  crun_error_release (&err);
+}
+
+static int
+remove_entry (const char *path, const struct stat *st arg_unused, int type arg_unused, struct FTW *ftw arg_unused)
+{
+  return remove (path);
+}
+
+static bool
+is_selected (const char *name, int argc, char **argv)
+{
+  int i;
+
+  if (argc < 2)
+    return true;
+
+  for (i = 1; i < argc; i++)
+    if (strcmp (argv[i], name) == 0)
+      return true;
+
+  return false;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct bench_state_s state = {};
+  libcrun_error_t err = NULL;
+  cleanup_free char *container_dir = NULL;
+  char state_root[] = "/tmp/crun-bench.XXXXXX";
+  struct bench_s *it;
+  int ret;
+
+  if (mkdtemp (state_root) == NULL)
+    {
+      fprintf (stderr, "cannot create the state directory\n");
+      return 1;
+    }
+
+  state.state_root = state_root;
+  state.context.state_root = state_root;
+  state.context.id = "bench";
+  state.context.fifo_exec_wait_fd = -1;
+
+  ret = append_paths (&container_dir, &err, state_root, state.context.id, NULL);
+  if (UNLIKELY (ret < 0) || mkdir (container_dir, 0700) < 0)
+    {
+      fprintf (stderr, "cannot create the container directory\n");
+      return 1;
+    }
+
+  ret = make_seccomp_container (&state, &err);
+  if (UNLIKELY (ret < 0))
+    crun_error_release (&err);
+
+  state.cgroup_path = get_own_cgroup ();
+
+  for (it = benchmarks; it->name; it++)
+    if (is_selected (it->name, argc, argv))
+      run_benchmark (&state, it);
+
+  ret = nftw (state_root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  if (UNLIKELY (ret < 0))
+    fprintf (stderr, "cannot remove `%s`\n", state_root);
+
+  if (state.seccomp_container)
+    libcrun_container_free (state.seccomp_container);
+  free (state.cgroup_path);
+  return 0;
+}
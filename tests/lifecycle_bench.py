@@ -0,0 +1,250 @@
+#!/bin/env python3
+# crun - OCI runtime written in C
+#
+# Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+# crun is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# crun is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with crun.  If not, see <http://www.gnu.org/licenses/>.
+
+# Measure the throughput of the container lifecycle.  See
+# docs/lifecycle-benchmark.md for the details.
+
+import argparse
+import concurrent.futures
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from tests_utils import get_crun_path, get_init_path, running_on_systemd
+
+PHASES = ["create", "start", "exec", "kill", "delete"]
+
+# Denied syscalls for the seccomp variants.  The container does not use
+# them, they are only there to give the filter a realistic size.
+SECCOMP_DENIED = [
+    "acct", "add_key", "bpf", "clock_adjtime", "clock_settime", "create_module", "delete_module",
+    "finit_module", "get_kernel_syms", "get_mempolicy", "init_module", "ioperm", "iopl", "kcmp",
+    "kexec_file_load", "kexec_load", "keyctl", "lookup_dcookie", "mbind", "migrate_pages", "move_pages",
+    "nfsservctl", "open_by_handle_at", "perf_event_open", "pivot_root", "process_vm_readv",
+    "process_vm_writev", "ptrace", "query_module", "quotactl", "reboot", "request_key", "set_mempolicy",
+    "setns", "settimeofday", "swapoff", "swapon", "sysfs", "_sysctl", "umount2", "unshare", "uselib",
+    "userfaultfd", "ustat", "vm86", "vm86old",
+]
+
+def percentile(values, p):
+    if len(values) == 0:
+        return 0.0
+    values = sorted(values)
+    k = (len(values) - 1) * p / 100.0
+    f = int(k)
+    c = min(f + 1, len(values) - 1)
+    return values[f] + (values[c] - values[f]) * (k - f)
+
+def make_rootfs(path):
+    for i in ["proc", "sys", "dev", "tmp", "etc"]:
+        os.makedirs(os.path.join(path, i))
+    shutil.copy2(get_init_path(), os.path.join(path, "init"))
+
+def make_config(rootfs, variant):
+    with tempfile.TemporaryDirectory() as d:
+        cmd = [get_crun_path(), "spec"]
+        if variant.get("userns") or os.getuid() != 0:
+            cmd.append("--rootless")
+        subprocess.check_call(cmd, cwd=d)
+        with open(os.path.join(d, "config.json")) as f:
+            conf = json.load(f)
+
+    conf['root'] = {'path': rootfs, 'readonly': True}
+    conf['process']['args'] = ['/init', 'pause']
+    conf['process']['terminal'] = False
+    if variant.get("seccomp"):
+        conf['linux']['seccomp'] = {
+            'defaultAction': 'SCMP_ACT_ALLOW',
+            'syscalls': [{'names': SECCOMP_DENIED, 'action': 'SCMP_ACT_ERRNO'}],
+        }
+    return conf
+
+def run_crun(variant, state_root, args):
+    cmd = [get_crun_path(), "--root", state_root, "--cgroup-manager", variant.get("cgroup_manager", "cgroupfs")] + args
+    subprocess.check_call(cmd, stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+def create_prefork(variant, state_root, bundle, cid):
+    # The Python bindings create the container with
+    # LIBCRUN_CREATE_OPTIONS_PREFORK.
+    import python_crun
+    ctx = python_crun.make_context(cid, bundle=bundle, state_root=state_root,
+                                   systemd_cgroup=variant.get("cgroup_manager") == "systemd",
+                                   force_no_cgroup=variant.get("cgroup_manager") == "disabled")
+    ctr = python_crun.load_from_file(os.path.join(bundle, "config.json"))
+    python_crun.create(ctx, ctr)
+
+def run_cycle(variant, state_root, bundle, cid):
+    timings = {}
+
+    start = time.monotonic()
+    if variant.get("prefork"):
+        create_prefork(variant, state_root, bundle, cid)
+    else:
+        run_crun(variant, state_root, ["create", "--bundle", bundle, cid])
+    timings["create"] = time.monotonic() - start
+
+    steps = [
+        ("start", ["start", cid]),
+        ("exec", ["exec", cid, "/init", "true"]),
+        ("kill", ["kill", cid, "KILL"]),
+        ("delete", ["delete", "--force", cid]),
+    ]
+    for phase, args in steps:
+        start = time.monotonic()
+        run_crun(variant, state_root, args)
+        timings[phase] = time.monotonic() - start
+
+    return timings
+
+def run_variant(name, variant, opts):
+    workdir = tempfile.mkdtemp(prefix="crun-lifecycle-")
+    try:
+        state_root = os.path.join(workdir, "state")
+        rootfs = os.path.join(workdir, "rootfs")
+        make_rootfs(rootfs)
+        conf = make_config(rootfs, variant)
+
+        bundles = []
+        for i in range(opts.containers):
+            bundle = os.path.join(workdir, "bundle-%d" % i)
+            os.makedirs(bundle)
+            with open(os.path.join(bundle, "config.json"), "w") as f:
+                json.dump(conf, f)
+            # With a cold cache every cycle gets its own state root, and
+            # so its own empty cache, since the cycles run in parallel.
+            cycle_state_root = state_root
+            if variant.get("seccomp_cache") == "cold":
+                cycle_state_root = os.path.join(workdir, "state-%d" % i)
+            bundles.append((bundle, "bench-%d-%d" % (os.getpid(), i), cycle_state_root))
+
+        # Populate the caches, e.g. the seccomp filter cache, before the
+        # measured cycles.
+        for i in range(opts.warmup):
+            run_cycle(variant, state_root, bundles[0][0], "bench-warmup-%d-%d" % (os.getpid(), i))
+
+        results = []
+        failures = 0
+        start = time.monotonic()
+        with concurrent.futures.ProcessPoolExecutor(max_workers=opts.parallel) as executor:
+            futures = [executor.submit(run_cycle, variant, cycle_state_root, bundle, cid)
+                       for bundle, cid, cycle_state_root in bundles]
+            for f in concurrent.futures.as_completed(futures):
+                try:
+                    results.append(f.result())
+                except Exception as e:
+                    failures += 1
+                    sys.stderr.write("%s: cycle failed: %s\n" % (name, e))
+        elapsed = time.monotonic() - start
+
+        phases = {}
+        for phase in PHASES:
+            values = [r[phase] * 1000 for r in results]
+            phases[phase] = {
+                "p50_ms": percentile(values, 50),
+                "p90_ms": percentile(values, 90),
+                "p99_ms": percentile(values, 99),
+                "max_ms": max(values) if values else 0.0,
+            }
+
+        return {
+            "variant": name,
+            "options": variant,
+            "containers": opts.containers,
+            "parallel": opts.parallel,
+            "failures": failures,
+            "elapsed_s": elapsed,
+            "containers_per_s": len(results) / elapsed if elapsed > 0 else 0.0,
+            "phases": phases,
+        }
+    finally:
+        for d in os.listdir(workdir):
+            if d == "state" or d.startswith("state-"):
+                subprocess.call([get_crun_path(), "--root", os.path.join(workdir, d), "delete", "--all", "--force"],
+                                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        shutil.rmtree(workdir, ignore_errors=True)
+
+def have_python_bindings():
+    try:
+        import python_crun
+        return True
+    except ImportError:
+        return False
+
+def get_variants(opts):
+    base = {"cgroup_manager": opts.cgroup_manager}
+    if not opts.matrix:
+        variant = dict(base)
+        if opts.userns:
+            variant["userns"] = True
+        if opts.seccomp_cache:
+            variant["seccomp"] = True
+            variant["seccomp_cache"] = opts.seccomp_cache
+        if opts.prefork:
+            variant["prefork"] = True
+        return {"custom": variant}
+
+    variants = {
+        "cgroupfs": {"cgroup_manager": "cgroupfs"},
+        "seccomp-cold": {"cgroup_manager": "cgroupfs", "seccomp": True, "seccomp_cache": "cold"},
+        "seccomp-warm": {"cgroup_manager": "cgroupfs", "seccomp": True, "seccomp_cache": "warm"},
+        "userns": {"cgroup_manager": "cgroupfs", "userns": True},
+    }
+    if running_on_systemd():
+        variants["systemd"] = {"cgroup_manager": "systemd"}
+    if have_python_bindings():
+        variants["prefork"] = {"cgroup_manager": "cgroupfs", "prefork": True}
+    return variants
+
+def print_results(results):
+    print("%-14s %8s %8s  %s" % ("variant", "ctr/s", "fail", "  ".join("%-16s" % ("%s p50/p99" % p) for p in PHASES)))
+    for r in results:
+        cols = ["%6.1f/%-7.1f" % (r["phases"][p]["p50_ms"], r["phases"][p]["p99_ms"]) for p in PHASES]
+        print("%-14s %8.2f %8d  %s" % (r["variant"], r["containers_per_s"], r["failures"], "  ".join("%-16s" % c for c in cols)))
+
+def main():
+    parser = argparse.ArgumentParser(description="crun lifecycle throughput benchmark")
+    parser.add_argument("-n", "--containers", type=int, default=100, help="containers to run for each variant")
+    parser.add_argument("-j", "--parallel", type=int, default=os.cpu_count(), help="lifecycles to run in parallel")
+    parser.add_argument("--warmup", type=int, default=2, help="lifecycles to run before measuring")
+    parser.add_argument("--cgroup-manager", default="cgroupfs", choices=["cgroupfs", "systemd", "disabled"])
+    parser.add_argument("--userns", action="store_true", help="run the containers in a user namespace")
+    parser.add_argument("--seccomp-cache", choices=["cold", "warm"], help="add a seccomp profile, with a cold or warm cache")
+    parser.add_argument("--prefork", action="store_true", help="create the containers with LIBCRUN_CREATE_OPTIONS_PREFORK (needs the Python bindings)")
+    parser.add_argument("--matrix", action="store_true", help="compare all the variants supported on this host")
+    parser.add_argument("--json", help="write the results to this file")
+    opts = parser.parse_args()
+
+    if opts.prefork and not have_python_bindings():
+        sys.stderr.write("--prefork needs the python_crun module\n")
+        return 1
+
+    results = []
+    for name, variant in get_variants(opts).items():
+        results.append(run_variant(name, variant, opts))
+
+    print_results(results)
+    if opts.json:
+        with open(opts.json, "w") as f:
+            json.dump(results, f, indent=2)
+
+    return 1 if any(r["failures"] for r in results) else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -19,6 +19,7 @@ import time
 import json
 import os
 import subprocess
+import tempfile
 from tests_utils import *
 
 criu_version = 0
@@ -82,9 +83,16 @@ def _get_cmdline(cid, tests_root):
     return ""
 
 
-def run_cr_test(conf):
+def _new_cr_dir():
+    # Every test gets its own images directory, not created yet so that
+    # crun creates it, and that is not shared with previous tests.
+    return os.path.join(tempfile.mkdtemp(dir=get_tests_root()), 'checkpoint')
+
+
+def run_cr_test(conf, checkpoint_args=None, restore_args=None, cr_dir=None):
     cid = None
-    cr_dir = os.path.join(get_tests_root(), 'checkpoint')
+    if cr_dir is None:
+        cr_dir = _new_cr_dir()
     try:
         _, cid = run_and_get_output(
             conf,
@@ -97,7 +105,8 @@ def run_cr_test(conf):
         if first_cmdline == "":
             return -1
 
-        run_crun_command(["checkpoint", "--image-path=%s" % cr_dir, cid])
+        run_crun_command(["checkpoint", "--image-path=%s" % cr_dir]
+                         + (checkpoint_args or []) + [cid])
 
         bundle = os.path.join(
             get_tests_root(),
@@ -107,10 +116,9 @@ def run_cr_test(conf):
         run_crun_command([
             "restore",
             "-d",
-            "--image-path=%s" % cr_dir,
             "--bundle=%s" % bundle,
-            cid
-        ])
+            "--image-path=%s" % cr_dir,
+        ] + (restore_args or []) + [cid])
 
         second_cmdline = _get_cmdline(cid, get_tests_root())
         if first_cmdline != second_cmdline:
@@ -153,7 +161,8 @@ def test_cr_pre_dump():
     add_all_namespaces(conf)
 
     cid = None
-    cr_dir = os.path.join(get_tests_root(), 'pre-dump')
+    base_dir = tempfile.mkdtemp(dir=get_tests_root())
+    cr_dir = os.path.join(base_dir, 'pre-dump')
     try:
         _, cid = run_and_get_output(
             conf,
@@ -178,7 +187,7 @@ def test_cr_pre_dump():
         pre_dump_size = _get_pre_dump_size(cr_dir)
 
         # Do the final dump. This dump should be much smaller.
-        cr_dir = os.path.join(get_tests_root(), 'checkpoint')
+        cr_dir = os.path.join(base_dir, 'checkpoint')
         run_crun_command([
             "checkpoint",
             "--parent-path=../pre-dump",
@@ -252,10 +261,78 @@ def test_cr_with_ext_ns():
     return run_cr_test(conf)
 
 
+def test_cr_iterative():
+    if is_rootless() or 'CRIU' not in get_crun_feature_string():
+        return 77
+
+    if _get_criu_version() < 31700:
+        return 77
+
+    if "iterative" not in run_crun_command(["checkpoint", "--help"]):
+        return 77
+
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'pause']
+    add_all_namespaces(conf)
+    cr_dir = _new_cr_dir()
+    ret = run_cr_test(conf, checkpoint_args=["--iterative", "--max-iterations=3"], cr_dir=cr_dir)
+    if ret != 0:
+        return ret
+
+    # At least one pre-dump must have been done before the final dump.
+    if not os.path.isdir(os.path.join(cr_dir, 'pre-dump-1')):
+        return -1
+    return 0
+
+
+def test_cr_iterative_invalid_values():
+    if 'CRIU' not in get_crun_feature_string():
+        return 77
+
+    if "iterative" not in run_crun_command(["checkpoint", "--help"]):
+        return 77
+
+    # The values are checked before the container is looked up.
+    for arg in ["--max-iterations=0", "--max-iterations=abc", "--max-iterations=-1",
+                "--converge-pages=0", "--converge-pages=10x", "--converge-pages="]:
+        try:
+            run_crun_command_raw(["checkpoint", "--iterative", arg, "does-not-exist"])
+        except subprocess.CalledProcessError as e:
+            if b"invalid value" not in e.output:
+                sys.stderr.write("# unexpected error for %s: %s\n" % (arg, e.output))
+                return -1
+            continue
+        sys.stderr.write("# %s was accepted\n" % arg)
+        return -1
+    return 0
+
+
+def test_cr_lazy_pages():
+    if is_rootless() or 'CRIU' not in get_crun_feature_string():
+        return 77
+
+    if "lazy-pages" not in run_crun_command(["restore", "--help"]):
+        return 77
+
+    # Lazy restore needs userfaultfd support for non-cooperative processes.
+    if subprocess.call(["criu", "check", "--feature", "uffd-noncoop"],
+                       stdout=subprocess.DEVNULL,
+                       stderr=subprocess.DEVNULL) != 0:
+        return 77
+
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'pause']
+    add_all_namespaces(conf)
+    return run_cr_test(conf, restore_args=["--lazy-pages"])
+
+
 all_tests = {
     "checkpoint-restore": test_cr,
     "checkpoint-restore-ext-ns": test_cr_with_ext_ns,
     "checkpoint-restore-pre-dump": test_cr_pre_dump,
+    "checkpoint-restore-iterative": test_cr_iterative,
+    "checkpoint-restore-iterative-invalid-values": test_cr_iterative_invalid_values,
+    "checkpoint-restore-lazy-pages": test_cr_lazy_pages,
 }
 
 if __name__ == "__main__":
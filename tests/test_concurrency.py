@@ -0,0 +1,105 @@
+#!/bin/env python3
+# crun - OCI runtime written in C
+#
+# Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+# crun is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# crun is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with crun.  If not, see <http://www.gnu.org/licenses/>.
+
+# Stress the state directory with many crun processes running at the
+# same time.  See docs/concurrency.md.
+
+import concurrent.futures
+import os
+import subprocess
+from tests_utils import *
+
+# Number of containers, it can be raised with CRUN_STRESS_CONTAINERS.
+CONTAINERS = int(os.getenv("CRUN_STRESS_CONTAINERS", "100"))
+
+def pause_config():
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'pause']
+    add_all_namespaces(conf)
+    return conf
+
+def create(conf, cid):
+    proc, _ = run_and_get_output(conf, command='create', use_popen=True, all_dev_null=True, id_container=cid)
+    return proc.wait()
+
+def crun_returncode(args):
+    cmd = [get_crun_path(), "--root", get_tests_root_status()] + args
+    return subprocess.call(cmd, stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+def list_containers():
+    return set(run_crun_command(["list", "-q"]).split())
+
+def run_parallel(fn, args):
+    with concurrent.futures.ThreadPoolExecutor(max_workers=min(64, len(args))) as executor:
+        return list(executor.map(lambda a: fn(*a), args))
+
+def test_concurrent_create_same_id():
+    """Only one of many concurrent `crun create` with the same id succeeds"""
+    conf = pause_config()
+    cid = "test-concurrent-same-id"
+    try:
+        results = run_parallel(create, [(conf, cid)] * 32)
+        succeeded = len([r for r in results if r == 0])
+        if succeeded != 1:
+            print("%d creates succeeded" % succeeded)
+            return -1
+    finally:
+        crun_returncode(["delete", "-f", cid])
+    return 0
+
+def test_concurrent_lifecycle():
+    """Create, list and delete many containers concurrently, checking that none is lost"""
+    conf = pause_config()
+    ids = ["test-concurrent-%d" % i for i in range(CONTAINERS)]
+    try:
+        results = run_parallel(create, [(conf, cid) for cid in ids])
+        failed = [cid for cid, r in zip(ids, results) if r != 0]
+        if failed:
+            print("create failed for %s" % failed)
+            return -1
+
+        missing = set(ids) - list_containers()
+        if missing:
+            print("containers missing from the list: %s" % missing)
+            return -1
+
+        # Two deletes for each container, racing with `list` and `state`.
+        args = []
+        for cid in ids:
+            args += [(["delete", "-f", cid],), (["delete", "-f", cid],), (["state", cid],), (["list", "-q"],)]
+        results = run_parallel(crun_returncode, args)
+        for a, r in zip(args, results):
+            if r != 0 and a[0][0] != "state":
+                print("`%s` failed with %d" % (" ".join(a[0]), r))
+                return -1
+
+        left = set(ids) & list_containers()
+        if left:
+            print("containers not deleted: %s" % left)
+            return -1
+    finally:
+        for cid in ids:
+            crun_returncode(["delete", "-f", cid])
+    return 0
+
+all_tests = {
+    "concurrent-create-same-id" : test_concurrent_create_same_id,
+    "concurrent-lifecycle" : test_concurrent_lifecycle,
+}
+
+if __name__ == "__main__":
+    tests_main(all_tests)
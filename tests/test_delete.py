@@ -18,6 +18,8 @@
 import json
 import subprocess
 import os
+import shutil
+import tempfile
 from tests_utils import *
 
 def test_simple_delete():
@@ -96,10 +98,91 @@ def test_multiple_containers_delete():
             return -1
     return 0
 
+def test_delete_sharded_state():
+    """Migrate a container to the sharded state layout and delete it"""
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'pause']
+    add_all_namespaces(conf)
+
+    # The migration changes the layout of the whole state root, keep it
+    # away from the other tests.
+    root = tempfile.mkdtemp(dir=get_tests_root())
+    try:
+        out, container_id = run_and_get_output(conf, detach=True, hide_stderr=True, root=root)
+        if out != "":
+            return -1
+        try:
+            output = run_crun_command(["--state-layout=sharded", "list", "-q"], root=root)
+            if container_id not in output.split():
+                print("container not listed after the migration: %s" % output)
+                return -1
+            if os.path.exists(os.path.join(root, container_id)):
+                print("state directory not migrated")
+                return -1
+            shards = os.path.join(root, ".shards")
+            if len(os.listdir(shards)) != 256:
+                return -1
+            state = json.loads(run_crun_command(["state", container_id], root=root))
+            if state['id'] != container_id:
+                return -1
+        finally:
+            run_crun_command(["delete", "-f", container_id], root=root)
+
+        for shard in os.listdir(shards):
+            if container_id in os.listdir(os.path.join(shards, shard)):
+                print("state directory not deleted")
+                return -1
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+    return 0
+
+def test_delete_config_summary():
+    """Delete uses the configuration summary only while it matches config.json"""
+    root = tempfile.mkdtemp(dir=get_tests_root())
+    try:
+        marker = os.path.join(root, "poststop")
+        conf = base_config()
+        conf['process']['args'] = ['/init', 'pause']
+        conf['hooks'] = {"poststop" : [{"path" : "/bin/sh", "args" : ["sh", "-c", "echo hook >> %s" % marker]}]}
+        add_all_namespaces(conf)
+
+        out, container_id = run_and_get_output(conf, detach=True, hide_stderr=True, root=root)
+        if out != "":
+            return -1
+        if not os.path.exists(os.path.join(root, container_id, "config.summary")):
+            print("config.summary not written")
+            return -1
+        run_crun_command(["delete", "-f", container_id], root=root)
+        if not os.path.exists(marker):
+            print("poststop hook not run")
+            return -1
+        os.unlink(marker)
+
+        # A container without hooks whose config.json is changed after
+        # create: the summary is stale and config.json is used.
+        del conf['hooks']
+        out, container_id = run_and_get_output(conf, detach=True, hide_stderr=True, root=root)
+        if out != "":
+            return -1
+        config_path = os.path.join(root, container_id, "config.json")
+        with open(config_path) as f:
+            config = json.load(f)
+        config['hooks'] = {"poststop" : [{"path" : "/bin/sh", "args" : ["sh", "-c", "echo hook >> %s" % marker]}]}
+        with open(config_path, "w") as f:
+            json.dump(config, f)
+        run_crun_command(["delete", "-f", container_id], root=root)
+        if not os.path.exists(marker):
+            print("poststop hook added after create not run")
+            return -1
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+    return 0
 
 all_tests = {
     "test_simple_delete" : test_simple_delete,
     "test_multiple_containers_delete" : test_multiple_containers_delete,
+    "test_delete_sharded_state" : test_delete_sharded_state,
+    "test_delete_config_summary" : test_delete_config_summary,
 }
 
 if __name__ == "__main__":
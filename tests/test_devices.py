@@ -215,6 +215,51 @@ def test_mknod_device():
     return 0
 
 
+def test_devices_template():
+    if is_rootless():
+        return 77
+
+    template_dir = os.path.join(get_tests_root_status(), ".cache", "devs")
+    if os.path.exists(template_dir):
+        run_crun_command(["delete", "--all", "--force"])
+
+    conf = base_config()
+    add_all_namespaces(conf, userns=True)
+    fullMapping = [
+        {
+            "containerID": 0,
+            "hostID": 0,
+            "size": 4294967295
+        }
+    ]
+    conf['linux']['uidMappings'] = fullMapping
+    conf['linux']['gidMappings'] = fullMapping
+    conf['annotations'] = {"run.oci.devices_template": "1"}
+    conf['process']['args'] = ['/init', 'owner', '/dev/foo']
+    conf['linux']['devices'] = [{"path": "/dev/foo", "type": "c", "major": 1, "minor": 3, "uid": 10, "gid": 11},]
+
+    # The second container reuses the node created by the first one.
+    for i in range(2):
+        try:
+            out = run_and_get_output(conf)
+        except Exception as e:
+            sys.stderr.write("# %s\n" % e)
+            return -1
+        if "10:11" not in out[0]:
+            sys.stderr.write("# wrong file owner, found %s\n" % out[0])
+            return -1
+        nodes = os.listdir(template_dir)
+        if len(nodes) != 1 or not nodes[0].startswith("c-1-3-"):
+            sys.stderr.write("# unexpected template content %s\n" % nodes)
+            return -1
+
+    run_crun_command(["delete", "--all"])
+    if os.path.exists(template_dir):
+        sys.stderr.write("# the devices template was not removed\n")
+        return -1
+    return 0
+
+
 all_tests = {
     "owner-device" : test_owner_device,
     "deny-devices" : test_deny_devices,
@@ -223,6 +268,7 @@ all_tests = {
     "mknod-device" : test_mknod_device,
     "mode-device"  : test_mode_device,
     "create-or-bind-mount-device" : test_create_or_bind_mount_device,
+    "devices-template" : test_devices_template,
 }
 
 if __name__ == "__main__":
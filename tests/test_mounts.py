@@ -228,6 +228,75 @@ def test_copy_symlink():
         return 0
     return -1
 
+def test_mount_nested_destinations():
+    # The mount targets share the /a prefix, and each mount must hide
+    # the directories resolved before it.
+    bind_dir = os.path.join(get_tests_root(), "bind-mount-nested")
+    os.makedirs(bind_dir)
+    with open(os.path.join(bind_dir, "content"), "w+") as f:
+        f.write("hello")
+
+    def prepare_rootfs(rootfs):
+        os.makedirs(os.path.join(rootfs, "a", "b"))
+        os.symlink("/a", os.path.join(rootfs, "link"))
+
+    conf = base_config()
+    add_all_namespaces(conf)
+    conf['mounts'].append({"destination": "/a", "type": "tmpfs", "source": "tmpfs", "options": []})
+    conf['mounts'].append({"destination": "/a/b", "type": "bind", "source": bind_dir, "options": ["bind", "ro"]})
+    conf['mounts'].append({"destination": "/link/c", "type": "tmpfs", "source": "tmpfs", "options": []})
+    try:
+        conf['process']['args'] = ['/init', 'cat', '/a/b/content']
+        out, _ = run_and_get_output(conf, hide_stderr=True, callback_prepare_rootfs=prepare_rootfs)
+        if out != "hello":
+            sys.stderr.write("# unexpected content %s\n" % out)
+            return -1
+
+        conf['process']['args'] = ['/init', 'cat', '/proc/self/mountinfo']
+        out, _ = run_and_get_output(conf, hide_stderr=True, callback_prepare_rootfs=prepare_rootfs)
+        targets = [i.split()[4] for i in out.split("\n") if len(i.split()) > 4]
+        for i in ["/a", "/a/b", "/a/c"]:
+            if i not in targets:
+                sys.stderr.write("# %s is not a mount point: %s\n" % (i, targets))
+                return -1
+        if "/link/c" in targets:
+            sys.stderr.write("# the symlink was not resolved in the rootfs\n")
+            return -1
+    finally:
+        shutil.rmtree(bind_dir)
+    return 0
+
+def test_mount_tmpcopyup():
+    def prepare_rootfs(rootfs):
+        tree = os.path.join(rootfs, "var", "tree")
+        # Enough sub-directories to have them copied in parallel.
+        for i in range(16):
+            path = os.path.join(tree, "dir%d" % i, "nested")
+            os.makedirs(path)
+            with open(os.path.join(path, "file"), "w") as f:
+                f.write("content-%d" % i)
+        os.chmod(os.path.join(tree, "dir7"), 0o712)
+        with open(os.path.join(tree, "big"), "wb") as f:
+            f.write(b"x" * (4 * 1024 * 1024))
+
+    conf = base_config()
+    add_all_namespaces(conf)
+    mount_opt = {"destination": "/var/tree", "type": "tmpfs", "source": "tmpfs", "options": ["tmpcopyup"]}
+    conf['mounts'].append(mount_opt)
+
+    conf['process']['args'] = ['/init', 'cat', '/var/tree/dir15/nested/file']
+    out, _ = run_and_get_output(conf, hide_stderr=True, callback_prepare_rootfs=prepare_rootfs)
+    if "content-15" not in out:
+        sys.stderr.write("# unexpected content %s\n" % out)
+        return -1
+
+    conf['process']['args'] = ['/init', 'mode', '/var/tree/dir7']
+    out, _ = run_and_get_output(conf, hide_stderr=True, callback_prepare_rootfs=prepare_rootfs)
+    if "712" not in out:
+        sys.stderr.write("# unexpected mode %s\n" % out)
+        return -1
+    return 0
+
 def test_mount_path_with_multiple_slashes():
     conf = base_config()
     conf['process']['args'] = ['/init', 'cat', '/proc/self/mountinfo']
@@ -548,6 +617,74 @@ def test_idmapped_mounts():
 
     return 0
 
+def test_userns_cache():
+    if is_rootless():
+        return 77
+    source_dir = os.path.join(get_tests_root(), "test-userns-cache")
+    cache_dir = os.path.join(get_tests_root_status(), ".cache", "userns")
+    try:
+        os.makedirs(source_dir)
+        with open(os.path.join(source_dir, "file"), "w+") as f:
+            f.write("")
+
+        idmapped_mounts_status = subprocess.call([get_init_path(), "check-feature", "idmapped-mounts", source_dir])
+        if idmapped_mounts_status != 0:
+            return 77
+
+        if os.path.exists(cache_dir):
+            run_crun_command(["delete", "--all", "--force"])
+
+        def run(hostID):
+            conf = base_config()
+            add_all_namespaces(conf, userns=True)
+            fullMapping = [{"containerID": 0, "hostID": 1, "size": 10}]
+            conf['linux']['uidMappings'] = fullMapping
+            conf['linux']['gidMappings'] = fullMapping
+            conf['process']['args'] = ['/init', 'true']
+            conf['annotations'] = {
+                "run.oci.userns_cache": "1",
+                "run.oci.userns_cache.max_entries": "2",
+            }
+            mountMappings = [{"containerID": 0, "hostID": hostID, "size": 10}]
+            conf['mounts'].append({"destination": "/foo", "type": "bind", "source": source_dir,
+                                   "options": ["bind", "ro", "idmap"],
+                                   "uidMappings": mountMappings, "gidMappings": mountMappings})
+            run_and_get_output(conf, chown_rootfs_to=1)
+
+        def entries():
+            return set(i for i in os.listdir(cache_dir) if not i.startswith("."))
+
+        run(2)
+        a = entries()
+        run(3)
+        b = entries() - a
+        if len(a) != 1 or len(b) != 1:
+            sys.stderr.write("# expected one new cache entry for each mapping\n")
+            return -1
+
+        # A hit refreshes the entry, so B is the least recently used one.
+        run(2)
+        run(4)
+        found = entries()
+        if len(found) != 2 or not a.issubset(found) or b.issubset(found):
+            sys.stderr.write("# wrong entries after the eviction: %s\n" % found)
+            return -1
+
+        with open(os.path.join(cache_dir, ".stats")) as f:
+            stats = f.read().split()
+        if stats != ["hits", "1", "misses", "3"]:
+            sys.stderr.write("# wrong cache stats: %s\n" % stats)
+            return -1
+
+        run_crun_command(["delete", "--all"])
+        if os.path.exists(cache_dir):
+            sys.stderr.write("# the cache was not purged\n")
+            return -1
+    finally:
+        shutil.rmtree(source_dir)
+
+    return 0
+
 def test_cgroup_mount_without_netns():
     for cgroupns in [True, False]:
         conf = base_config()
@@ -617,8 +754,10 @@ all_tests = {
     "mount-dev" : test_mount_dev,
     "mount-nodev" : test_mount_nodev,
     "mount-path-with-multiple-slashes" : test_mount_path_with_multiple_slashes,
+    "mount-nested-destinations" : test_mount_nested_destinations,
     "mount-userns-bind-mount" : test_userns_bind_mount,
     "mount-idmapped-mounts" : test_idmapped_mounts,
+    "mount-userns-cache" : test_userns_cache,
     "mount-idmapped-mounts-symlink" : test_userns_bind_mount_symlink,
     "mount-linux-readonly-should-inherit-flags": test_mount_readonly_should_inherit_options_from_parent,
     "proc-linux-readonly-should-inherit-flags": test_proc_readonly_should_inherit_options_from_parent,
@@ -626,6 +765,7 @@ all_tests = {
     "mount-cgroup-without-netns": test_cgroup_mount_without_netns,
     "mount-copy-symlink": test_copy_symlink,
     "mount-tmpfs-permissions": test_mount_tmpfs_permissions,
+    "mount-tmpcopyup": test_mount_tmpcopyup,
 }
 
 if __name__ == "__main__":
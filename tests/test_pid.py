@@ -15,6 +15,8 @@
 # You should have received a copy of the GNU General Public License
 # along with crun.  If not, see <http://www.gnu.org/licenses/>.
 
+import json
+import sys
 from tests_utils import *
 
 def test_pid():
@@ -39,9 +41,36 @@ def test_pid_user():
         return 0
     return -1
 
+def test_ps_stat():
+    if is_rootless():
+        return 77
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'pause']
+    add_all_namespaces(conf)
+    cid = None
+    try:
+        _, cid = run_and_get_output(conf, command='run', detach=True)
+        pids = json.loads(run_crun_command(["ps", "--format=json", cid]))
+        if len(pids) != 1:
+            sys.stderr.write("# unexpected pids %s\n" % pids)
+            return -1
+        out = run_crun_command(["ps", "--format=json", "--stat", cid])
+        procs = json.loads(out)
+        if len(procs) != 1 or procs[0]['pid'] != pids[0]:
+            sys.stderr.write("# unexpected stat %s\n" % out)
+            return -1
+        if procs[0]['comm'] != 'init' or procs[0]['num_threads'] < 1:
+            sys.stderr.write("# unexpected stat %s\n" % out)
+            return -1
+    finally:
+        if cid is not None:
+            run_crun_command(["delete", "-f", cid])
+    return 0
+
 all_tests = {
     "pid" : test_pid,
     "pid-user" : test_pid_user,
+    "ps-stat" : test_ps_stat,
 }
 
 if __name__ == "__main__":
@@ -0,0 +1,333 @@
+#!/bin/env python3
+# crun - OCI runtime written in C
+#
+# Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+# crun is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# crun is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with crun.  If not, see <http://www.gnu.org/licenses/>.
+
+# Drive libcrun through the python_crun module, as a long-lived process
+# would do.  The tests are skipped when crun was not configured with
+# --with-python-bindings.
+
+import asyncio
+import json
+import os
+import select
+import shutil
+import sys
+import tempfile
+import threading
+import time
+from tests_utils import *
+
+def import_python_crun():
+    sys.path.insert(0, os.path.join(os.getcwd(), ".libs"))
+    sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "python"))
+    try:
+        import python_crun
+    except ImportError:
+        return None
+    return python_crun
+
+def make_bundle(conf):
+    bundle = tempfile.mkdtemp(dir=get_tests_root())
+    rootfs = os.path.join(bundle, "rootfs")
+    for i in ["proc", "sys", "dev"]:
+        os.makedirs(os.path.join(rootfs, i))
+    shutil.copy2(get_init_path(), os.path.join(rootfs, "init"))
+    conf['root']['path'] = rootfs
+    return bundle, json.dumps(conf)
+
+def pause_config():
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'pause']
+    add_all_namespaces(conf)
+    return conf
+
+def create_and_delete(python_crun, systemd_cgroup):
+    bundle, conf = make_bundle(pause_config())
+    cid = 'test-%s' % os.path.basename(bundle)
+    ctx = python_crun.make_context(cid, bundle=bundle, state_root=get_tests_root_status(),
+                                   systemd_cgroup=systemd_cgroup, detach=True)
+    python_crun.create(ctx, python_crun.load_from_memory(conf))
+    python_crun.delete(ctx, cid, True)
+
+def test_systemd_after_fork():
+    if is_rootless() or not running_on_systemd():
+        return 77
+    python_crun = import_python_crun()
+    if python_crun is None:
+        return 77
+
+    # Open the connection to systemd in the parent process.
+    create_and_delete(python_crun, True)
+
+    # The child must not use, nor flush, the connection it inherited.
+    pid = os.fork()
+    if pid == 0:
+        try:
+            create_and_delete(python_crun, True)
+            os._exit(0)
+        except Exception as e:
+            sys.stderr.write("%s\n" % e)
+            os._exit(1)
+
+    _, status = os.waitpid(pid, 0)
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+        sys.stderr.write("# the forked child failed to use systemd\n")
+        return -1
+
+    # The connection of the parent is still usable.
+    create_and_delete(python_crun, True)
+    return 0
+
+def make_container(python_crun, detach=True):
+    bundle, conf = make_bundle(pause_config())
+    cid = 'test-%s' % os.path.basename(bundle)
+    ctx = python_crun.make_context(cid, bundle=bundle, state_root=get_tests_root_status(), detach=detach)
+    return ctx, cid, python_crun.load_from_memory(conf)
+
+def get_status(python_crun, ctx, cid):
+    for i in python_crun.containers_status(ctx):
+        if i[0] == cid:
+            return i
+    return None
+
+def test_containers_status():
+    if is_rootless():
+        return 77
+    python_crun = import_python_crun()
+    if python_crun is None:
+        return 77
+
+    ctx, cid, ctr = make_container(python_crun)
+    ctx2, cid2, ctr2 = make_container(python_crun)
+    try:
+        python_crun.create(ctx, ctr)
+        python_crun.create(ctx2, ctr2)
+        python_crun.start(ctx, cid)
+
+        found = get_status(python_crun, ctx, cid)
+        if found is None or found[2] != "running" or found[1] <= 0:
+            sys.stderr.write("# unexpected status of the started container: %s\n" % (found,))
+            return -1
+        found = get_status(python_crun, ctx2, cid2)
+        if found is None or found[2] != "created":
+            sys.stderr.write("# unexpected status of the created container: %s\n" % (found,))
+            return -1
+    finally:
+        python_crun.delete(ctx, cid, True)
+        python_crun.delete(ctx2, cid2, True)
+
+    if get_status(python_crun, ctx, cid) is not None:
+        sys.stderr.write("# a deleted container is still reported\n")
+        return -1
+    return 0
+
+def test_pidfd():
+    if is_rootless():
+        return 77
+    python_crun = import_python_crun()
+    if python_crun is None:
+        return 77
+
+    ctx, cid, ctr = make_container(python_crun)
+    try:
+        python_crun.create(ctx, ctr)
+        python_crun.start(ctx, cid)
+        try:
+            fd = python_crun.pidfd(ctx, cid)
+        except RuntimeError as e:
+            if "Function not implemented" in str(e):
+                return 77
+            raise
+        try:
+            if select.select([fd], [], [], 0)[0]:
+                sys.stderr.write("# the pidfd is readable while the container runs\n")
+                return -1
+            python_crun.kill(ctx, cid, "KILL")
+            if not select.select([fd], [], [], 10)[0]:
+                sys.stderr.write("# the pidfd is not readable after the container exited\n")
+                return -1
+        finally:
+            os.close(fd)
+
+        # No pidfd for a container that is not running.
+        try:
+            os.close(python_crun.pidfd(ctx, cid))
+            return -1
+        except RuntimeError:
+            pass
+    finally:
+        python_crun.delete(ctx, cid, True)
+    return 0
+
+def test_run_foreground():
+    if is_rootless():
+        return 77
+    python_crun = import_python_crun()
+    if python_crun is None:
+        return 77
+
+    # A foreground run must not block the other calls while it waits for
+    # the container.
+    ctx, cid, ctr = make_container(python_crun, detach=False)
+    result = {}
+
+    def run():
+        try:
+            result["ret"] = python_crun.run(ctx, ctr)
+        except Exception as e:
+            result["error"] = e
+
+    runner = threading.Thread(target=run)
+    runner.start()
+    try:
+        for _ in range(100):
+            found = get_status(python_crun, ctx, cid)
+            if found is not None and found[2] == "running":
+                break
+            time.sleep(0.1)
+        else:
+            sys.stderr.write("# the container is not running\n")
+            return -1
+        python_crun.kill(ctx, cid, "KILL")
+        runner.join(30)
+        if runner.is_alive():
+            sys.stderr.write("# the foreground run did not return\n")
+            return -1
+        if "error" in result:
+            sys.stderr.write("# the foreground run failed: %s\n" % result["error"])
+            return -1
+    finally:
+        try:
+            python_crun.delete(ctx, cid, True)
+        except RuntimeError:
+            pass
+        runner.join(30)
+    return 0
+
+def test_crun_async():
+    if is_rootless():
+        return 77
+    python_crun = import_python_crun()
+    if python_crun is None:
+        return 77
+    import crun_async
+
+    async def lifecycle():
+        ctxs = [make_container(python_crun) for _ in range(2)]
+        try:
+            await asyncio.gather(*[crun_async.create(ctx, ctr) for ctx, _, ctr in ctxs])
+            await asyncio.gather(*[crun_async.start(ctx, cid) for ctx, cid, _ in ctxs])
+
+            states = {i[0]: i[2] for i in await crun_async.containers_status(ctxs[0][0])}
+            for _, cid, _ in ctxs:
+                if states.get(cid) != "running":
+                    sys.stderr.write("# %s is not running: %s\n" % (cid, states))
+                    return -1
+
+            # wait() returns once the container is killed.
+            ctx, cid, _ = ctxs[0]
+            waiter = asyncio.ensure_future(crun_async.wait(ctx, cid))
+            await asyncio.sleep(0.5)
+            if waiter.done():
+                sys.stderr.write("# wait() returned while the container runs\n")
+                return -1
+            await crun_async.kill(ctx, cid, "KILL")
+            await asyncio.wait_for(waiter, 10)
+        finally:
+            for ctx, cid, _ in ctxs:
+                await crun_async.delete(ctx, cid, True)
+
+        ctx, _, ctr = make_container(python_crun, detach=False)
+        try:
+            await crun_async.run(ctx, ctr)
+            sys.stderr.write("# a foreground run was accepted\n")
+            return -1
+        except ValueError:
+            pass
+        return 0
+
+    return asyncio.run(lifecycle())
+
+def test_lazy_config_getters():
+    python_crun = import_python_crun()
+    if python_crun is None:
+        return 77
+
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'true']
+    conf['process']['terminal'] = False
+    conf['linux']['resources'] = {'pids': {'limit': 100}}
+    conf['mounts'] = [{'destination': '/tmp', 'type': 'tmpfs', 'source': 'tmpfs', 'options': ['nosuid']}]
+    config = python_crun.load_lazy_from_memory(json.dumps(conf))
+
+    process = python_crun.lazy_process(config)
+    if process['args'] != ['/init', 'true'] or process['terminal']:
+        sys.stderr.write("# unexpected process: %s\n" % process)
+        return -1
+    if python_crun.lazy_resources(config).get('pids_limit') != 100:
+        sys.stderr.write("# unexpected resources: %s\n" % python_crun.lazy_resources(config))
+        return -1
+    mounts = python_crun.lazy_mounts(config)
+    if len(mounts) != 1 or mounts[0]['destination'] != '/tmp' or mounts[0]['options'] != ['nosuid']:
+        sys.stderr.write("# unexpected mounts: %s\n" % mounts)
+        return -1
+
+    # A missing section is not an error.
+    del conf['mounts']
+    del conf['linux']['resources']
+    config = python_crun.load_lazy_from_memory(json.dumps(conf))
+    if python_crun.lazy_mounts(config) is not None or python_crun.lazy_resources(config) is not None:
+        sys.stderr.write("# a missing section was reported\n")
+        return -1
+
+    # A malformed section fails only when it is parsed.
+    conf['process']['terminal'] = 'yes'
+    config = python_crun.load_lazy_from_memory(json.dumps(conf))
+    try:
+        python_crun.lazy_process(config)
+        sys.stderr.write("# a malformed process was accepted\n")
+        return -1
+    except RuntimeError:
+        pass
+
+    # The mounts parsed before a malformed one are released, and the
+    # error is reported again on the next call.
+    conf['process']['terminal'] = False
+    conf['mounts'] = [{'destination': '/tmp', 'type': 'tmpfs', 'source': 'tmpfs'}, {'type': 'tmpfs'}]
+    config = python_crun.load_lazy_from_memory(json.dumps(conf))
+    for _ in range(2):
+        try:
+            python_crun.lazy_mounts(config)
+            sys.stderr.write("# a malformed mount was accepted\n")
+            return -1
+        except RuntimeError:
+            pass
+    if python_crun.lazy_process(config)['args'] != ['/init', 'true']:
+        sys.stderr.write("# the process cannot be parsed after a mounts error\n")
+        return -1
+    return 0
+
+all_tests = {
+    "systemd-after-fork": test_systemd_after_fork,
+    "containers-status": test_containers_status,
+    "pidfd": test_pidfd,
+    "run-foreground": test_run_foreground,
+    "crun-async": test_crun_async,
+    "lazy-config-getters": test_lazy_config_getters,
+}
+
+if __name__ == "__main__":
+    tests_main(all_tests)
@@ -15,8 +15,12 @@
 # You should have received a copy of the GNU General Public License
 # along with crun.  If not, see <http://www.gnu.org/licenses/>.
 
+import json
+import socket
 import subprocess
 import sys
+import tempfile
+import threading
 import time
 from tests_utils import *
 
@@ -333,6 +337,83 @@ def test_resources_exec_cgroup():
             run_crun_command(["delete", "-f", cid])
     return 0
 
+def oom_config(receiver):
+    conf = base_config()
+    add_all_namespaces(conf, cgroupns=True)
+    # No swap, so that the allocation hits memory.max and the OOM killer.
+    conf['process']['args'] = ['/init', 'memhog', '128']
+    conf['linux']['resources'] = {
+        "memory": {
+            "limit": 32 * 1024 * 1024,
+            "swap": 32 * 1024 * 1024
+        }
+    }
+    conf['annotations'] = {"run.oci.cgroup_events": receiver}
+    return conf
+
+def test_resources_cgroup_events_log():
+    if not is_cgroup_v2_unified() or is_rootless():
+        return 77
+
+    try:
+        out, _ = run_and_get_output(oom_config("log"), command='run')
+    except subprocess.CalledProcessError as e:
+        out = e.output.decode()
+    if "cgroup event `oom_kill`" not in out:
+        sys.stderr.write("# no oom_kill event in the log: %s\n" % out)
+        return -1
+    return 0
+
+def test_resources_cgroup_events_socket():
+    if not is_cgroup_v2_unified() or is_rootless():
+        return 77
+
+    # Keep the socket path short, it must fit in sun_path.
+    socket_dir = tempfile.mkdtemp()
+    socket_path = os.path.join(socket_dir, "events.sock")
+    received = []
+
+    server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    server.bind(socket_path)
+    server.listen(1)
+    server.settimeout(60)
+
+    def receive():
+        try:
+            conn, _ = server.accept()
+        except socket.timeout:
+            return
+        with conn:
+            data = b""
+            while True:
+                chunk = conn.recv(4096)
+                if not chunk:
+                    break
+                data += chunk
+            received.extend(data.decode().splitlines())
+
+    receiver = threading.Thread(target=receive)
+    receiver.start()
+    try:
+        try:
+            run_and_get_output(oom_config(socket_path), command='run')
+        except subprocess.CalledProcessError:
+            # The container is OOM killed.
+            pass
+        receiver.join(60)
+    finally:
+        server.close()
+        shutil.rmtree(socket_dir)
+
+    events = [json.loads(i) for i in received]
+    if not any(i['event'] == 'oom_kill' and i['value'] >= 1 for i in events):
+        sys.stderr.write("# no oom_kill event received: %s\n" % received)
+        return -1
+    if not any(i['event'] == 'max' for i in events):
+        sys.stderr.write("# no max event received: %s\n" % received)
+        return -1
+    return 0
+
 
 all_tests = {
     "resources-v2-swap-disabled": test_resources_cgroupv2_swap_0,
@@ -346,6 +427,8 @@ all_tests = {
     "resources-cpu-weight" : test_resources_cpu_weight,
     "resources-cpu-weight-systemd" : test_resources_cpu_weight_systemd,
     "resources-cpu-quota-minus-one" : test_resources_cpu_quota_minus_one,
+    "resources-cgroup-events-log" : test_resources_cgroup_events_log,
+    "resources-cgroup-events-socket" : test_resources_cgroup_events_socket,
 }
 
 if __name__ == "__main__":
@@ -0,0 +1,187 @@
+#!/bin/env python3
+# crun - OCI runtime written in C
+#
+# Copyright (C) 2017, 2018, 2019 Giuseppe Scrivano <giuseppe@scrivano.org>
+# crun is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# crun is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with crun.  If not, see <http://www.gnu.org/licenses/>.
+
+
+import json
+import sys
+import subprocess
+from tests_utils import *
+
+
+def is_cgroup_v2_unified():
+    return subprocess.check_output("stat -c%T -f /sys/fs/cgroup".split()).decode("utf-8").strip() == "cgroup2fs"
+
+def test_stats():
+    if is_rootless():
+        return 77
+    if not is_cgroup_v2_unified():
+        return 77
+
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'pause']
+    add_all_namespaces(conf)
+
+    cid = None
+    try:
+        _, cid = run_and_get_output(conf, command='run', detach=True)
+        out = run_crun_command(["stats", "--no-stream", cid])
+        lines = out.strip().split('\n')
+        if len(lines) != 1:
+            sys.stderr.write("# expected a single sample, got %s\n" % out)
+            return -1
+        stats = json.loads(lines[0])
+        if stats['id'] != cid:
+            return -1
+        if 'pids' in stats and stats['pids']['current'] < 1:
+            sys.stderr.write("# invalid pids.current %s\n" % stats['pids'])
+            return -1
+    finally:
+        if cid is not None:
+            run_crun_command(["delete", "-f", cid])
+    return 0
+
+def test_stats_exits_with_container():
+    if is_rootless():
+        return 77
+    if not is_cgroup_v2_unified():
+        return 77
+
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'pause']
+    add_all_namespaces(conf)
+
+    cid = None
+    try:
+        _, cid = run_and_get_output(conf, command='run', detach=True)
+        proc = subprocess.Popen([get_crun_path(), "--root", get_tests_root_status(), "stats", "--interval=100", cid],
+                                stdout=subprocess.PIPE, close_fds=False)
+        # Wait for the first sample before killing the container.
+        proc.stdout.readline()
+        run_crun_command(["delete", "-f", cid])
+        cid = None
+        proc.wait(timeout=10)
+        if proc.returncode != 0:
+            return -1
+    finally:
+        if cid is not None:
+            run_crun_command(["delete", "-f", cid])
+    return 0
+
+def test_stats_all():
+    if is_rootless():
+        return 77
+    if not is_cgroup_v2_unified():
+        return 77
+
+    cids = []
+    try:
+        for i in range(3):
+            conf = base_config()
+            conf['process']['args'] = ['/init', 'pause']
+            add_all_namespaces(conf)
+            _, cid = run_and_get_output(conf, command='run', detach=True)
+            cids.append(cid)
+
+        out = run_crun_command(["stats", "--all", "--no-stream"])
+        batch = json.loads(out)
+        ids = [c['id'] for c in batch['containers']]
+        for cid in cids:
+            if cid not in ids:
+                sys.stderr.write("# container %s missing from %s\n" % (cid, out))
+                return -1
+
+        out = run_crun_command(["stats", "--all", "--no-stream", "--format=prometheus", "--threads=2"])
+        for cid in cids:
+            if 'id="%s"' % cid not in out:
+                sys.stderr.write("# container %s missing from %s\n" % (cid, out))
+                return -1
+        if "# TYPE crun_container_cpu_usage_usec counter" not in out:
+            sys.stderr.write("# invalid prometheus output %s\n" % out)
+            return -1
+    finally:
+        for cid in cids:
+            run_crun_command(["delete", "-f", cid])
+    return 0
+
+def test_stats_all_replaced_container():
+    if is_rootless():
+        return 77
+    if not is_cgroup_v2_unified():
+        return 77
+
+    # Deleting a container and creating another one between two scrapes
+    # keeps the number of entries, the new one must still be found by
+    # the next scrapes.
+    def run(cid):
+        conf = base_config()
+        conf['process']['args'] = ['/init', 'pause']
+        add_all_namespaces(conf)
+        run_and_get_output(conf, command='run', detach=True, id_container=cid)
+
+    prefix = "stats-replaced-%d-" % os.getpid()
+    running = []
+    proc = None
+    try:
+        for i in ["b", "c"]:
+            run(prefix + i)
+            running.append(prefix + i)
+
+        proc = subprocess.Popen([get_crun_path(), "--root", get_tests_root_status(), "stats", "--all", "--interval=100"],
+                                stdout=subprocess.PIPE, close_fds=False)
+
+        def scrape():
+            batch = json.loads(proc.stdout.readline())
+            return [c['id'] for c in batch['containers'] if c['id'].startswith(prefix)]
+
+        if sorted(scrape()) != [prefix + "b", prefix + "c"]:
+            return -1
+
+        run_crun_command(["delete", "-f", prefix + "b"])
+        running.remove(prefix + "b")
+        run(prefix + "a")
+        running.append(prefix + "a")
+
+        expected = [prefix + "a", prefix + "c"]
+        for _ in range(50):
+            if sorted(scrape()) == expected:
+                break
+        else:
+            sys.stderr.write("# the new container was not found\n")
+            return -1
+
+        for _ in range(3):
+            ids = scrape()
+            if sorted(ids) != expected:
+                sys.stderr.write("# unexpected containers %s\n" % ids)
+                return -1
+    finally:
+        if proc is not None:
+            proc.kill()
+            proc.wait()
+        for cid in running:
+            run_crun_command(["delete", "-f", cid])
+    return 0
+
+all_tests = {
+    "stats" : test_stats,
+    "stats-exits-with-container" : test_stats_exits_with_container,
+    "stats-all" : test_stats_all,
+    "stats-all-replaced-container" : test_stats_all_replaced_container,
+}
+
+if __name__ == "__main__":
+    tests_main(all_tests)
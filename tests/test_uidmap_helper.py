@@ -0,0 +1,289 @@
+#!/bin/env python3
+# crun - OCI runtime written in C
+#
+# Copyright (C) 2023 Giuseppe Scrivano <giuseppe@scrivano.org>
+# crun is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# crun is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with crun.  If not, see <http://www.gnu.org/licenses/>.
+
+# Test contrib/uidmap-helper and the fallback to newuidmap/newgidmap
+# when RUN_OCI_UIDMAP_HELPER does not answer.
+
+import errno
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from tests_utils import *
+
+def get_helper_path():
+    return os.path.abspath(os.getenv("UIDMAP_HELPER") or "contrib/uidmap-helper/uidmap-helper")
+
+def start_helper(socket_path):
+    helper = subprocess.Popen([get_helper_path(), socket_path])
+    for _ in range(50):
+        if os.path.exists(socket_path):
+            return helper
+        time.sleep(0.1)
+    helper.kill()
+    helper.wait()
+    return None
+
+def connect(socket_path):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.settimeout(30)
+    s.connect(socket_path)
+    return s
+
+def request(s, kind, pid, mapping):
+    s.sendall(("%s %d %d\n" % (kind, pid, len(mapping))).encode() + mapping.encode())
+    reply = b""
+    while not reply.endswith(b"\n"):
+        chunk = s.recv(256)
+        if not chunk:
+            break
+        reply += chunk
+    return reply.decode()
+
+def test_uidmap_helper_protocol():
+    if is_rootless() or not os.path.exists(get_helper_path()):
+        return 77
+    if shutil.which("unshare") is None:
+        return 77
+
+    # Keep the socket path short, it must fit in sun_path.
+    socket_dir = tempfile.mkdtemp()
+    socket_path = os.path.join(socket_dir, "helper.sock")
+    helper = start_helper(socket_path)
+    if helper is None:
+        return -1
+
+    target = subprocess.Popen(["unshare", "--user", "sleep", "60"])
+    # Another target that no request touches, to check that a failed
+    # request does not write anything.
+    untouched = subprocess.Popen(["unshare", "--user", "sleep", "60"])
+    idle = None
+    try:
+        time.sleep(0.5)
+
+        # A client that does not send anything must not stop the others.
+        idle = connect(socket_path)
+
+        s = connect(socket_path)
+        reply = request(s, "uid", target.pid, "0 0 1\n")
+        if reply != "0\n":
+            sys.stderr.write("# uid request failed: %s\n" % reply)
+            return -1
+        reply = request(s, "gid", target.pid, "0 0 1\n")
+        if reply != "0\n":
+            sys.stderr.write("# gid request failed: %s\n" % reply)
+            return -1
+        s.close()
+
+        with open("/proc/%d/uid_map" % target.pid) as f:
+            if f.read().split() != ["0", "0", "1"]:
+                return -1
+        with open("/proc/%d/setgroups" % target.pid) as f:
+            if f.read().strip() != "deny":
+                return -1
+
+        # Not the caller id and not in /etc/subuid.
+        s = connect(socket_path)
+        reply = request(s, "uid", untouched.pid, "0 4000000000 1\n")
+        if reply.split(" ")[0] != str(errno.EPERM):
+            sys.stderr.write("# unexpected reply to a forbidden mapping: %s\n" % reply)
+            return -1
+        reply = request(s, "uid", untouched.pid, "0 0 0\n")
+        if reply.split(" ")[0] != str(errno.EINVAL):
+            sys.stderr.write("# unexpected reply to an invalid mapping: %s\n" % reply)
+            return -1
+        s.close()
+
+        with open("/proc/%d/uid_map" % untouched.pid) as f:
+            if f.read().strip() != "":
+                return -1
+
+        # The idle client is disconnected once the request deadline expires.
+        idle.settimeout(15)
+        if idle.recv(1) != b"":
+            return -1
+    finally:
+        if idle is not None:
+            idle.close()
+        for p in [target, untouched, helper]:
+            p.kill()
+            p.wait()
+        shutil.rmtree(socket_dir)
+    return 0
+
+def test_uidmap_helper_limits():
+    if is_rootless() or not os.path.exists(get_helper_path()):
+        return 77
+
+    socket_dir = tempfile.mkdtemp()
+    socket_path = os.path.join(socket_dir, "helper.sock")
+    helper = start_helper(socket_path)
+    if helper is None:
+        return -1
+
+    idle = []
+    try:
+        # Keep the maximum number of connections per user busy.
+        for _ in range(4):
+            idle.append(connect(socket_path))
+        time.sleep(0.5)
+
+        s = connect(socket_path)
+        reply = request(s, "uid", os.getpid(), "0 0 1\n")
+        s.close()
+        if reply.split(" ")[0] != str(errno.EAGAIN):
+            sys.stderr.write("# unexpected reply above the limit: %s\n" % reply)
+            return -1
+
+        # Once the processes serving the idle connections are reaped, new
+        # connections are served again.
+        for c in idle:
+            c.close()
+        idle = []
+        for _ in range(50):
+            s = connect(socket_path)
+            reply = request(s, "uid", os.getpid(), "0 0 0\n")
+            s.close()
+            if reply.split(" ")[0] == str(errno.EINVAL):
+                break
+            time.sleep(0.1)
+        else:
+            sys.stderr.write("# the helper does not serve new connections: %s\n" % reply)
+            return -1
+    finally:
+        for c in idle:
+            c.close()
+        helper.kill()
+        helper.wait()
+        shutil.rmtree(socket_dir)
+    return 0
+
+def test_uidmap_helper_pid_namespace():
+    if is_rootless() or not os.path.exists(get_helper_path()):
+        return 77
+    if shutil.which("unshare") is None:
+        return 77
+
+    socket_dir = tempfile.mkdtemp()
+    socket_path = os.path.join(socket_dir, "helper.sock")
+    helper = start_helper(socket_path)
+    if helper is None:
+        return -1
+
+    # The client runs in a new pid namespace and sends the pid of the
+    # target as it sees it.
+    client = """
+import socket, subprocess, sys, time
+target = subprocess.Popen(["unshare", "--user", "sleep", "60"])
+time.sleep(0.5)
+s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+s.settimeout(30)
+s.connect(sys.argv[1])
+mapping = b"0 0 1\\n"
+s.sendall(b"uid %d %d\\n" % (target.pid, len(mapping)) + mapping)
+reply = s.recv(256).decode()
+with open("/proc/%d/uid_map" % target.pid) as f:
+    uid_map = f.read().split()
+target.kill()
+print(reply.strip(), " ".join(uid_map))
+"""
+    try:
+        out = subprocess.check_output(["unshare", "--pid", "--fork", "--mount-proc",
+                                       sys.executable, "-c", client, socket_path],
+                                      timeout=60).decode().strip()
+    except Exception as e:
+        sys.stderr.write("# cannot run the client in a pid namespace: %s\n" % e)
+        return 77
+    finally:
+        helper.kill()
+        helper.wait()
+        shutil.rmtree(socket_dir)
+
+    if out != "0 0 0 1":
+        sys.stderr.write("# unexpected result from a pid namespace: %s\n" % out)
+        return -1
+    return 0
+
+def test_uidmap_helper_fallback():
+    # The helper is used only for rootless containers.
+    if not is_rootless() or os.getuid() == 0 or shutil.which("newuidmap") is None:
+        return 77
+
+    socket_dir = tempfile.mkdtemp()
+    socket_path = os.path.join(socket_dir, "helper.sock")
+
+    # A helper that accepts the connection and never answers.
+    server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    server.bind(socket_path)
+    server.listen(1)
+    server.settimeout(30)
+    connections = []
+
+    def accept():
+        try:
+            conn, _ = server.accept()
+            connections.append(conn)
+        except socket.timeout:
+            pass
+
+    acceptor = threading.Thread(target=accept)
+    acceptor.start()
+
+    conf = base_config()
+    conf['process']['args'] = ['/init', 'true']
+    add_all_namespaces(conf, userns=True)
+    conf['linux']['uidMappings'] = [{"containerID": 0, "hostID": os.getuid(), "size": 1}]
+    conf['linux']['gidMappings'] = [{"containerID": 0, "hostID": os.getgid(), "size": 1}]
+
+    env = dict(os.environ)
+    env["RUN_OCI_UIDMAP_HELPER"] = socket_path
+    try:
+        start = time.time()
+        run_and_get_output(conf, env=env)
+        elapsed = time.time() - start
+        acceptor.join(30)
+    except Exception as e:
+        sys.stderr.write("# container failed with an unresponsive helper: %s\n" % e)
+        return -1
+    finally:
+        server.close()
+        for c in connections:
+            c.close()
+        shutil.rmtree(socket_dir)
+
+    if not connections:
+        sys.stderr.write("# the helper was not used\n")
+        return -1
+    # A single timeout, then newuidmap and newgidmap are used directly.
+    if elapsed > 15:
+        sys.stderr.write("# the fallback took %f seconds\n" % elapsed)
+        return -1
+    return 0
+
+all_tests = {
+    "uidmap-helper-protocol" : test_uidmap_helper_protocol,
+    "uidmap-helper-limits" : test_uidmap_helper_limits,
+    "uidmap-helper-pid-namespace" : test_uidmap_helper_pid_namespace,
+    "uidmap-helper-fallback" : test_uidmap_helper_fallback,
+}
+
+if __name__ == "__main__":
+    tests_main(all_tests)
@@ -211,7 +211,7 @@ def run_and_get_output(config, detach=False, preserve_fds=None, pid_file=None,
                        keep=False,
                        command='run', env=None, use_popen=False, hide_stderr=False, cgroup_manager='cgroupfs',
                        all_dev_null=False, id_container=None, relative_config_path="config.json",
-                       chown_rootfs_to=None, callback_prepare_rootfs=None):
+                       chown_rootfs_to=None, callback_prepare_rootfs=None, root=None):
 
     # Some tests require that the container user, which might not be the
     # same user as the person running the tests, is able to resolve the full path
@@ -272,7 +272,8 @@ def run_and_get_output(config, detach=False, preserve_fds=None, pid_file=None,
     pid_file_arg = ['--pid-file', pid_file] if pid_file else []
     relative_config_path = ['--config', relative_config_path] if relative_config_path else []
 
-    root = get_tests_root_status()
+    if root is None:
+        root = get_tests_root_status()
     args = [crun, "--cgroup-manager", cgroup_manager, "--root", root, command] + relative_config_path + preserve_fds_arg + detach_arg + keep_arg + pid_file_arg + [id_container]
 
     stderr = subprocess.STDOUT
@@ -297,8 +298,9 @@ def run_and_get_output(config, detach=False, preserve_fds=None, pid_file=None,
     else:
         return subprocess.check_output(args, cwd=temp_dir, stderr=stderr, env=env, close_fds=False, umask=default_umask).decode(), id_container
 
-def run_crun_command(args):
-    root = get_tests_root_status()
+def run_crun_command(args, root=None):
+    if root is None:
+        root = get_tests_root_status()
     crun = get_crun_path()
     args = [crun, "--root", root] + args
     return subprocess.check_output(args, close_fds=False).decode()